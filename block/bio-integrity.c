@@ -160,6 +160,10 @@ static int bdev_integrity_enabled(struct block_device *bdev, int rw)
 	if (bi == NULL)
 		return 0;
 
+	/* the device expects a metadata buffer with every IO */
+	if (bi->flags & INTEGRITY_FLAG_META)
+		return 1;
+
 	if (rw == READ && bi->verify_fn != NULL &&
 	    (bi->flags & INTEGRITY_FLAG_READ))
 		return 1;
@@ -374,40 +378,34 @@ static inline unsigned short blk_integrity_tuple_size(struct blk_integrity *bi)
 }
 
 /**
- * bio_integrity_prep - Prepare bio for integrity I/O
- * @bio:	bio to prepare
+ * bio_integrity_map - Allocate and attach an integrity buffer
+ * @bio:	bio to attach the buffer to
+ * @bi:		blk_integrity profile of the target device
+ * @gfp_mask:	memory allocation mask
  *
- * Description: Allocates a buffer for integrity metadata, maps the
- * pages and attaches them to a bio.  The bio must have data
- * direction, target device and start sector set priot to calling.  In
- * the WRITE case, integrity metadata will be generated using the
- * block device's integrity function.  In the READ case, the buffer
- * will be prepared for DMA and a suitable end_io handler set up.
+ * Description: Allocates a buffer large enough for the integrity
+ * metadata of all sectors in @bio and attaches it.  The buffer is
+ * owned by the bip and freed along with the bio.  Returns the buffer
+ * or %NULL on allocation failure.
  */
-int bio_integrity_prep(struct bio *bio)
+static void *bio_integrity_map(struct bio *bio, struct blk_integrity *bi,
+			       gfp_t gfp_mask)
 {
 	struct bio_integrity_payload *bip;
-	struct blk_integrity *bi;
-	struct request_queue *q;
-	void *buf;
+	void *buf, *meta;
 	unsigned long start, end;
 	unsigned int len, nr_pages;
 	unsigned int bytes, offset, i;
 	unsigned int sectors;
 
-	bi = bdev_get_integrity(bio->bi_bdev);
-	q = bdev_get_queue(bio->bi_bdev);
-	BUG_ON(bi == NULL);
-	BUG_ON(bio_integrity(bio));
-
 	sectors = bio_integrity_hw_sectors(bi, bio_sectors(bio));
 
 	/* Allocate kernel buffer for protection data */
 	len = sectors * blk_integrity_tuple_size(bi);
-	buf = kmalloc(len, GFP_NOIO | q->bounce_gfp);
+	buf = kmalloc(len, gfp_mask);
 	if (unlikely(buf == NULL)) {
 		printk(KERN_ERR "could not allocate integrity buffer\n");
-		return -ENOMEM;
+		return NULL;
 	}
 
 	end = (((unsigned long) buf) + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
@@ -415,17 +413,18 @@ int bio_integrity_prep(struct bio *bio)
 	nr_pages = end - start;
 
 	/* Allocate bio integrity payload and integrity vectors */
-	bip = bio_integrity_alloc(bio, GFP_NOIO, nr_pages);
+	bip = bio_integrity_alloc(bio, gfp_mask & ~__GFP_ZERO, nr_pages);
 	if (unlikely(bip == NULL)) {
 		printk(KERN_ERR "could not allocate data integrity bioset\n");
 		kfree(buf);
-		return -EIO;
+		return NULL;
 	}
 
 	bip->bip_owns_buf = 1;
 	bip->bip_buf = buf;
 	bip->bip_iter.bi_size = len;
 	bip->bip_iter.bi_sector = bio->bi_iter.bi_sector;
+	meta = buf;
 
 	/* Map it */
 	offset = offset_in_page(buf);
@@ -443,7 +442,7 @@ int bio_integrity_prep(struct bio *bio)
 					     bytes, offset);
 
 		if (ret == 0)
-			return 0;
+			break;
 
 		if (ret < bytes)
 			break;
@@ -453,20 +452,77 @@ int bio_integrity_prep(struct bio *bio)
 		offset = 0;
 	}
 
+	return meta;
+}
+
+/**
+ * bio_integrity_prep - Prepare bio for integrity I/O
+ * @bio:	bio to prepare
+ *
+ * Description: Allocates a buffer for integrity metadata, maps the
+ * pages and attaches them to a bio.  The bio must have data
+ * direction, target device and start sector set priot to calling.  In
+ * the WRITE case, integrity metadata will be generated using the
+ * block device's integrity function.  In the READ case, the buffer
+ * will be prepared for DMA and a suitable end_io handler set up.
+ */
+int bio_integrity_prep(struct bio *bio)
+{
+	struct blk_integrity *bi;
+	struct request_queue *q;
+	gfp_t gfp_mask;
+
+	bi = bdev_get_integrity(bio->bi_bdev);
+	q = bdev_get_queue(bio->bi_bdev);
+	BUG_ON(bi == NULL);
+	BUG_ON(bio_integrity(bio));
+
+	/* nobody filled in opaque metadata, don't hand stale memory out */
+	gfp_mask = GFP_NOIO | q->bounce_gfp;
+	if (bi->flags & INTEGRITY_FLAG_META)
+		gfp_mask |= __GFP_ZERO;
+
+	if (!bio_integrity_map(bio, bi, gfp_mask))
+		return -ENOMEM;
+
 	/* Install custom I/O completion handler if read verify is enabled */
-	if (bio_data_dir(bio) == READ) {
-		bip->bip_end_io = bio->bi_end_io;
+	if (bio_data_dir(bio) == READ && bi->verify_fn) {
+		bio->bi_integrity->bip_end_io = bio->bi_end_io;
 		bio->bi_end_io = bio_integrity_endio;
 	}
 
 	/* Auto-generate integrity metadata if this is a write */
-	if (bio_data_dir(bio) == WRITE)
+	if (bio_data_dir(bio) == WRITE && bi->generate_fn)
 		bio_integrity_generate(bio);
 
 	return 0;
 }
 EXPORT_SYMBOL(bio_integrity_prep);
 
+/**
+ * bio_integrity_meta_alloc - Attach an opaque metadata buffer to a bio
+ * @bio:	bio to attach the buffer to
+ * @gfp_mask:	memory allocation mask
+ *
+ * Description: For devices registered with %INTEGRITY_FLAG_META, which
+ * store per-sector metadata the block layer doesn't interpret.  Returns
+ * a zeroed buffer of tuple_size bytes per hardware sector of @bio, to
+ * be filled in before a write is submitted or read after a read has
+ * completed.  The bio must have its target device and size set.  The
+ * buffer is freed with the bio.  Returns %NULL if the device doesn't
+ * take metadata, @bio already carries some or on allocation failure.
+ */
+void *bio_integrity_meta_alloc(struct bio *bio, gfp_t gfp_mask)
+{
+	struct blk_integrity *bi = bdev_get_integrity(bio->bi_bdev);
+
+	if (!bi || !(bi->flags & INTEGRITY_FLAG_META) || bio_integrity(bio))
+		return NULL;
+
+	return bio_integrity_map(bio, bi, gfp_mask | __GFP_ZERO);
+}
+EXPORT_SYMBOL(bio_integrity_meta_alloc);
+
 /**
  * bio_integrity_verify - Verify integrity metadata for a bio
  * @bio:	bio to verify
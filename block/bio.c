@@ -28,6 +28,7 @@
 #include <linux/mempool.h>
 #include <linux/workqueue.h>
 #include <linux/cgroup.h>
+#include <linux/cpu.h>
 #include <scsi/sg.h>		/* for struct sg_iovec */
 
 #include <trace/events/block.h>
@@ -38,6 +39,20 @@
  */
 #define BIO_INLINE_VECS		4
 
+/*
+ * Max number of freed bios each cpu keeps around for bio_alloc_cached().
+ */
+#define BIO_CACHE_MAX		64
+
+struct bio_alloc_cache {
+	struct bio_list		free_list;
+	unsigned int		nr;
+};
+
+/* bio_sets with per-cpu caches, drained when a cpu goes away */
+static LIST_HEAD(bio_cache_list);
+static DEFINE_MUTEX(bio_cache_lock);
+
 /*
  * if you change this list, also change bvec_alloc or things will
  * break badly! cannot be bigger than what you can fit into an
@@ -242,6 +257,32 @@ static void __bio_free(struct bio *bio)
 		bio_integrity_free(bio);
 }
 
+/*
+ * Park a bio from bio_alloc_cached() on the local cpu's cache.  Returns
+ * %false if the cache is full or the mempool is short of its reserve,
+ * in which case the bio should be freed normally: GFP_NOIO allocations
+ * under memory pressure rely on the reserve to make progress.
+ */
+static bool bio_cache_put(struct bio_set *bs, struct bio *bio)
+{
+	struct bio_alloc_cache *cache;
+	unsigned long flags;
+	bool ret = false;
+
+	if (bs->bio_pool->curr_nr < bs->bio_pool->min_nr)
+		return false;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(bs->cache);
+	if (cache->nr < BIO_CACHE_MAX) {
+		bio_list_add_head(&cache->free_list, bio);
+		cache->nr++;
+		ret = true;
+	}
+	local_irq_restore(flags);
+	return ret;
+}
+
 static void bio_free(struct bio *bio)
 {
 	struct bio_set *bs = bio->bi_pool;
@@ -252,6 +293,9 @@ static void bio_free(struct bio *bio)
 	if (bs) {
 		if (bio_flagged(bio, BIO_OWNS_VEC))
 			bvec_free(bs->bvec_pool, bio->bi_io_vec, BIO_POOL_IDX(bio));
+		else if (bio_flagged(bio, BIO_PERCPU_CACHE) &&
+			 bio_cache_put(bs, bio))
+			return;
 
 		/*
 		 * If we have front padding, adjust the bio pointer before freeing
@@ -496,6 +540,56 @@ err_free:
 }
 EXPORT_SYMBOL(bio_alloc_bioset);
 
+/**
+ * bio_alloc_cached - allocate a small bio from the per-cpu cache
+ * @gfp_mask:   the GFP_ mask given to the slab allocator
+ * @nr_iovecs:	number of iovecs to pre-allocate
+ * @bs:		the bio_set to allocate from
+ *
+ * Description:
+ *   Like bio_alloc_bioset(), but bios with no more than %BIO_INLINE_VECS
+ *   vecs are served from a per-cpu list of previously freed bios if @bs
+ *   has one, see bioset_enable_cache().  That saves a trip through the
+ *   mempool and slab for each bio, which shows for small IOs issued at
+ *   a high rate.  Freeing such a bio puts it back on the cache of the
+ *   cpu doing the freeing, unless the mempool needs it to refill its
+ *   reserve.
+ *
+ *   The same mempool rules as for bio_alloc_bioset() apply.
+ */
+struct bio *bio_alloc_cached(gfp_t gfp_mask, int nr_iovecs, struct bio_set *bs)
+{
+	struct bio_alloc_cache *cache;
+	unsigned long flags;
+	struct bio *bio;
+
+	if (!bs->cache || nr_iovecs > BIO_INLINE_VECS)
+		return bio_alloc_bioset(gfp_mask, nr_iovecs, bs);
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(bs->cache);
+	bio = bio_list_pop(&cache->free_list);
+	if (bio)
+		cache->nr--;
+	local_irq_restore(flags);
+
+	if (!bio) {
+		bio = bio_alloc_bioset(gfp_mask, nr_iovecs, bs);
+		if (bio)
+			bio->bi_flags |= 1 << BIO_PERCPU_CACHE;
+		return bio;
+	}
+
+	bio_init(bio);
+	bio->bi_pool = bs;
+	bio->bi_flags |= BIO_POOL_NONE << BIO_POOL_OFFSET |
+			 1 << BIO_PERCPU_CACHE;
+	bio->bi_max_vecs = nr_iovecs;
+	bio->bi_io_vec = nr_iovecs ? bio->bi_inline_vecs : NULL;
+	return bio;
+}
+EXPORT_SYMBOL(bio_alloc_cached);
+
 void zero_fill_bio(struct bio *bio)
 {
 	unsigned long flags;
@@ -1873,11 +1967,65 @@ mempool_t *biovec_create_pool(int pool_entries)
 	return mempool_create_slab_pool(pool_entries, bp->slab);
 }
 
+/* Give the bios cached by @cpu back to the mempool */
+static void bio_cache_drain(struct bio_set *bs, int cpu)
+{
+	struct bio_alloc_cache *cache = per_cpu_ptr(bs->cache, cpu);
+	struct bio *bio;
+
+	while ((bio = bio_list_pop(&cache->free_list)))
+		mempool_free((void *)bio - bs->front_pad, bs->bio_pool);
+	cache->nr = 0;
+}
+
+static void bioset_free_cache(struct bio_set *bs)
+{
+	int cpu;
+
+	if (!bs->cache)
+		return;
+
+	mutex_lock(&bio_cache_lock);
+	list_del(&bs->cache_node);
+	mutex_unlock(&bio_cache_lock);
+
+	for_each_possible_cpu(cpu)
+		bio_cache_drain(bs, cpu);
+
+	free_percpu(bs->cache);
+}
+
+static int bio_cpu_notify(struct notifier_block *self, unsigned long action,
+			  void *hcpu)
+{
+	/*
+	 * Nobody allocates from a dead cpu's caches, don't let them sit on
+	 * bios the mempools may need.
+	 */
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
+		int cpu = (unsigned long) hcpu;
+		struct bio_set *bs;
+
+		mutex_lock(&bio_cache_lock);
+		list_for_each_entry(bs, &bio_cache_list, cache_node)
+			bio_cache_drain(bs, cpu);
+		mutex_unlock(&bio_cache_lock);
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block bio_cpu_notifier = {
+	.notifier_call	= bio_cpu_notify,
+};
+
 void bioset_free(struct bio_set *bs)
 {
 	if (bs->rescue_workqueue)
 		destroy_workqueue(bs->rescue_workqueue);
 
+	bioset_free_cache(bs);
+
 	if (bs->bio_pool)
 		mempool_destroy(bs->bio_pool);
 
@@ -1944,6 +2092,27 @@ bad:
 }
 EXPORT_SYMBOL(bioset_create);
 
+/**
+ * bioset_enable_cache - let bio_alloc_cached() use per-cpu bio caches
+ * @bs:		bio_set to enable the caches for
+ *
+ * Description:
+ *    Each cpu keeps up to %BIO_CACHE_MAX freed small bios of @bs for
+ *    reuse.  Must be called before any allocations from @bs.
+ */
+int bioset_enable_cache(struct bio_set *bs)
+{
+	bs->cache = alloc_percpu(struct bio_alloc_cache);
+	if (!bs->cache)
+		return -ENOMEM;
+
+	mutex_lock(&bio_cache_lock);
+	list_add(&bs->cache_node, &bio_cache_list);
+	mutex_unlock(&bio_cache_lock);
+	return 0;
+}
+EXPORT_SYMBOL(bioset_enable_cache);
+
 #ifdef CONFIG_BLK_CGROUP
 /**
  * bio_associate_current - associate a bio with %current
@@ -2039,6 +2208,10 @@ static int __init init_bio(void)
 	if (bioset_integrity_create(fs_bio_set, BIO_POOL_SIZE))
 		panic("bio: can't create integrity pool\n");
 
+	if (bioset_enable_cache(fs_bio_set))
+		panic("bio: can't create bio caches\n");
+	register_hotcpu_notifier(&bio_cpu_notifier);
+
 	return 0;
 }
 subsys_initcall(init_bio);
@@ -27,6 +27,11 @@
 #define CFQ_WEIGHT_MAX		1000
 #define CFQ_WEIGHT_DEFAULT	500
 
+/* blk-iocost specific, out here for blkcg->iocost_weight */
+#define IOC_WEIGHT_MIN		1
+#define IOC_WEIGHT_MAX		1000
+#define IOC_WEIGHT_DEFAULT	100
+
 #ifdef CONFIG_BLK_CGROUP
 
 enum blkg_rwstat_type {
@@ -55,6 +60,7 @@ struct blkcg {
 	/* TODO: per-policy storage in blkcg */
 	unsigned int			cfq_weight;	/* belongs to cfq */
 	unsigned int			cfq_leaf_weight;
+	unsigned int			iocost_weight;	/* belongs to iocost */
 };
 
 struct blkg_stat {
@@ -397,7 +397,8 @@ static void __blk_drain_queue(struct request_queue *q, bool drain_all)
 			for (i = 0; i < 2; i++) {
 				drain |= q->nr_rqs[i];
 				drain |= q->in_flight[i];
-				drain |= !list_empty(&q->flush_queue[i]);
+				if (q->fq)
+					drain |= !list_empty(&q->fq->flush_queue[i]);
 			}
 		}
 
@@ -600,9 +601,8 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 #ifdef CONFIG_BLK_CGROUP
 	INIT_LIST_HEAD(&q->blkg_list);
 #endif
-	INIT_LIST_HEAD(&q->flush_queue[0]);
-	INIT_LIST_HEAD(&q->flush_queue[1]);
-	INIT_LIST_HEAD(&q->flush_data_in_flight);
+	/* nothing is known about the device cache until the first flush */
+	set_bit(BLK_FLUSH_DIRTY, &q->flush_state);
 	INIT_DELAYED_WORK(&q->delay_work, blk_delay_work);
 
 	kobject_init(&q->kobj, &blk_queue_ktype);
@@ -705,8 +705,8 @@ blk_init_allocated_queue(struct request_queue *q, request_fn_proc *rfn,
 	if (!q)
 		return NULL;
 
-	q->flush_rq = kzalloc(sizeof(struct request), GFP_KERNEL);
-	if (!q->flush_rq)
+	q->fq = blk_alloc_flush_queue(q, q->node, 0);
+	if (!q->fq)
 		return NULL;
 
 	if (blk_init_rl(&q->root_rl, q, GFP_KERNEL))
@@ -742,7 +742,8 @@ blk_init_allocated_queue(struct request_queue *q, request_fn_proc *rfn,
 	return q;
 
 fail:
-	kfree(q->flush_rq);
+	blk_free_flush_queue(q->fq);
+	q->fq = NULL;
 	return NULL;
 }
 EXPORT_SYMBOL(blk_init_allocated_queue);
@@ -1284,46 +1285,58 @@ static void add_acct_request(struct request_queue *q, struct request *rq,
 	__elv_add_request(q, rq, where);
 }
 
-static void part_round_stats_single(int cpu, struct hd_struct *part,
-				    unsigned long now)
+static void update_io_ticks_single(int cpu, struct hd_struct *part,
+				   unsigned long now, bool end)
 {
-	int inflight;
+	unsigned long stamp = ACCESS_ONCE(part->stamp);
 
-	if (now == part->stamp)
+	if (likely(stamp == now))
 		return;
 
-	inflight = part_in_flight(part);
-	if (inflight) {
-		__part_stat_add(cpu, part, time_in_queue,
-				inflight * (now - part->stamp));
-		__part_stat_add(cpu, part, io_ticks, (now - part->stamp));
-	}
-	part->stamp = now;
+	/* only the winner of the race accounts the interval */
+	if (cmpxchg(&part->stamp, stamp, now) == stamp)
+		__part_stat_add(cpu, part, io_ticks, end ? now - stamp : 1);
 }
 
 /**
- * part_round_stats() - Round off the performance stats on a struct disk_stats.
+ * part_update_io_ticks() - Account device busy time from the I/O path.
  * @cpu: cpu number for stats access
  * @part: target partition
+ * @end: an I/O is completing rather than starting
  *
- * The average IO queue length and utilisation statistics are maintained
- * by observing the current state of the queue length and the amount of
- * time it has been in this state for.
- *
- * Normally, that accounting is done on IO completion, but that can result
- * in more than a second's worth of IO being accounted for within any one
- * second, leading to >100% utilisation.  To deal with that, we call this
- * function to do a round-off before returning the results when reading
- * /proc/diskstats.  This accounts immediately for all queue usage up to
- * the current jiffies and restarts the counters again.
+ * Called on every I/O start and completion.  The partition's stamp is only
+ * written once per jiffy, so on a busy device this is a read of a shared
+ * cacheline.  A completing I/O was in flight since the last stamp, so the
+ * whole interval is busy time; a starting one only claims the current
+ * jiffy.  The time spent in queue is accounted per request on completion.
  */
-void part_round_stats(int cpu, struct hd_struct *part)
+void part_update_io_ticks(int cpu, struct hd_struct *part, bool end)
 {
 	unsigned long now = jiffies;
 
 	if (part->partno)
-		part_round_stats_single(cpu, &part_to_disk(part)->part0, now);
-	part_round_stats_single(cpu, part, now);
+		update_io_ticks_single(cpu, &part_to_disk(part)->part0,
+				       now, end);
+	update_io_ticks_single(cpu, part, now, end);
+}
+EXPORT_SYMBOL_GPL(part_update_io_ticks);
+
+/**
+ * part_round_stats() - Round off the performance stats on a struct disk_stats.
+ * @cpu: cpu number for stats access
+ * @part: target partition
+ *
+ * Busy time is otherwise only accounted when I/O starts or completes,
+ * which would hide a long running request.  To deal with that, we call
+ * this function before returning the results when reading /proc/diskstats
+ * so that the time up to the current jiffy is accounted if anything is
+ * in flight.  It sums the per-cpu in-flight counters, so it must not be
+ * used from the I/O path; use part_update_io_ticks() there.
+ */
+void part_round_stats(int cpu, struct hd_struct *part)
+{
+	if (part_in_flight(part))
+		part_update_io_ticks(cpu, part, true);
 }
 EXPORT_SYMBOL_GPL(part_round_stats);
 
@@ -1840,6 +1853,9 @@ generic_make_request_checks(struct bio *bio)
 	if (blk_throtl_bio(q, bio))
 		return false;	/* throttled, will be resubmitted later */
 
+	if (blk_iocost_bio(q, bio))
+		return false;	/* over its share, will be resubmitted later */
+
 	trace_block_bio_queue(q, bio);
 	return true;
 
@@ -2046,6 +2062,7 @@ int blk_insert_cloned_request(struct request_queue *q, struct request *rq)
 	 */
 	BUG_ON(blk_queued_rq(rq));
 
+	rq->cmd_flags |= REQ_CLONE;
 	if (rq->cmd_flags & (REQ_FLUSH|REQ_FUA))
 		where = ELEVATOR_INSERT_FLUSH;
 
@@ -2134,7 +2151,8 @@ void blk_account_io_done(struct request *req)
 
 		part_stat_inc(cpu, part, ios[rw]);
 		part_stat_add(cpu, part, ticks[rw], duration);
-		part_round_stats(cpu, part);
+		part_stat_add(cpu, part, time_in_queue, duration);
+		part_update_io_ticks(cpu, part, true);
 		part_dec_in_flight(part, rw);
 
 		hd_struct_put(part);
@@ -2192,7 +2210,7 @@ void blk_account_io_start(struct request *rq, bool new_io)
 			part = &rq->rq_disk->part0;
 			hd_struct_get(part);
 		}
-		part_round_stats(cpu, part);
+		part_update_io_ticks(cpu, part, false);
 		part_inc_in_flight(part, rw);
 		rq->part = part;
 	}
@@ -2413,6 +2431,10 @@ bool blk_update_request(struct request *req, int error, unsigned int nr_bytes)
 
 	trace_block_rq_complete(req->q, req, nr_bytes);
 
+	/* completed write data may sit in a write-back cache */
+	if (nr_bytes && rq_data_dir(req) == WRITE)
+		blk_flush_mark_dirty(req->q);
+
 	/*
 	 * For fs requests, rq is just carrier of independent bio's
 	 * and each partial completion should be handled separately.
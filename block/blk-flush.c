@@ -28,12 +28,23 @@
  *
  * The actual execution of flush is double buffered.  Whenever a request
  * needs to execute PRE or POSTFLUSH, it queues at
- * q->flush_queue[q->flush_pending_idx].  Once certain criteria are met, a
+ * fq->flush_queue[fq->flush_pending_idx].  Once certain criteria are met, a
  * flush is issued and the pending_idx is toggled.  When the flush
  * completes, all the requests which were pending are proceeded to the next
  * step.  This allows arbitrary merging of different types of FLUSH/FUA
  * requests.
  *
+ * Legacy queues have a single flush queue.  blk-mq keeps one per hardware
+ * context, so flushes from cpus mapped to different contexts don't contend
+ * on a common lock while concurrent flushes on one context still coalesce.
+ *
+ * A flush is only useful if write data completed since the last one was
+ * issued.  Completion of write data sets BLK_FLUSH_DIRTY in q->flush_state
+ * and issuing a flush clears it.  If the bit is clear and no flush is in
+ * flight on any flush queue when a flush would be issued, the device cache
+ * holds nothing a flush could write out and the pending requests proceed
+ * to their next step right away.
+ *
  * Currently, the following conditions are used to determine when to issue
  * flush.
  *
@@ -91,7 +102,8 @@ enum {
 	FLUSH_PENDING_TIMEOUT	= 5 * HZ,
 };
 
-static bool blk_kick_flush(struct request_queue *q);
+static bool blk_kick_flush(struct request_queue *q,
+			   struct blk_flush_queue *fq);
 
 static unsigned int blk_flush_policy(unsigned int fflags, struct request *rq)
 {
@@ -150,6 +162,7 @@ static bool blk_flush_queue_rq(struct request *rq, bool add_front)
 /**
  * blk_flush_complete_seq - complete flush sequence
  * @rq: FLUSH/FUA request being sequenced
+ * @fq: flush queue
  * @seq: sequences to complete (mask of %REQ_FSEQ_*, can be zero)
  * @error: whether an error occurred
  *
@@ -157,16 +170,17 @@ static bool blk_flush_queue_rq(struct request *rq, bool add_front)
  * completion and trigger the next step.
  *
  * CONTEXT:
- * spin_lock_irq(q->queue_lock or q->mq_flush_lock)
+ * spin_lock_irq(q->queue_lock or fq->mq_flush_lock)
  *
  * RETURNS:
  * %true if requests were added to the dispatch queue, %false otherwise.
  */
-static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
-				   int error)
+static bool blk_flush_complete_seq(struct request *rq,
+				   struct blk_flush_queue *fq,
+				   unsigned int seq, int error)
 {
 	struct request_queue *q = rq->q;
-	struct list_head *pending = &q->flush_queue[q->flush_pending_idx];
+	struct list_head *pending = &fq->flush_queue[fq->flush_pending_idx];
 	bool queued = false, kicked;
 
 	BUG_ON(rq->flush.seq & seq);
@@ -182,12 +196,12 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 	case REQ_FSEQ_POSTFLUSH:
 		/* queue for flush */
 		if (list_empty(pending))
-			q->flush_pending_since = jiffies;
+			fq->flush_pending_since = jiffies;
 		list_move_tail(&rq->flush.list, pending);
 		break;
 
 	case REQ_FSEQ_DATA:
-		list_move_tail(&rq->flush.list, &q->flush_data_in_flight);
+		list_move_tail(&rq->flush.list, &fq->flush_data_in_flight);
 		queued = blk_flush_queue_rq(rq, true);
 		break;
 
@@ -211,39 +225,60 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 		BUG();
 	}
 
-	kicked = blk_kick_flush(q);
+	kicked = blk_kick_flush(q, fq);
 	return kicked | queued;
 }
 
+/* push the requests waiting on @list for a flush to their next stage */
+static bool blk_flush_complete_list(struct blk_flush_queue *fq,
+				    struct list_head *list, int error)
+{
+	struct request *rq, *n;
+	bool queued = false;
+
+	list_for_each_entry_safe(rq, n, list, flush.list) {
+		unsigned int seq = blk_flush_cur_seq(rq);
+
+		BUG_ON(seq != REQ_FSEQ_PREFLUSH && seq != REQ_FSEQ_POSTFLUSH);
+		queued |= blk_flush_complete_seq(rq, fq, seq, error);
+	}
+	return queued;
+}
+
 static void flush_end_io(struct request *flush_rq, int error)
 {
 	struct request_queue *q = flush_rq->q;
+	struct blk_flush_queue *fq = blk_get_flush_queue(q, flush_rq->mq_ctx);
 	struct list_head *running;
 	bool queued = false;
-	struct request *rq, *n;
 	unsigned long flags = 0;
 
 	if (q->mq_ops) {
-		spin_lock_irqsave(&q->mq_flush_lock, flags);
-		q->flush_rq->tag = -1;
+		spin_lock_irqsave(&fq->mq_flush_lock, flags);
+		flush_rq->tag = -1;
 	}
 
-	running = &q->flush_queue[q->flush_running_idx];
-	BUG_ON(q->flush_pending_idx == q->flush_running_idx);
+	running = &fq->flush_queue[fq->flush_running_idx];
+	BUG_ON(fq->flush_pending_idx == fq->flush_running_idx);
 
 	/* account completion of the flush request */
-	q->flush_running_idx ^= 1;
+	fq->flush_running_idx ^= 1;
+
+	/*
+	 * A failed flush may have left data in the cache.  Mark the cache
+	 * dirty before dropping the in-flight count so that nobody skips a
+	 * flush on the strength of this one.
+	 */
+	if (error)
+		set_bit(BLK_FLUSH_DIRTY, &q->flush_state);
+	smp_mb__before_atomic_dec();
+	atomic_dec(&q->flush_inflight);
 
 	if (!q->mq_ops)
 		elv_completed_request(q, flush_rq);
 
 	/* and push the waiting requests to the next stage */
-	list_for_each_entry_safe(rq, n, running, flush.list) {
-		unsigned int seq = blk_flush_cur_seq(rq);
-
-		BUG_ON(seq != REQ_FSEQ_PREFLUSH && seq != REQ_FSEQ_POSTFLUSH);
-		queued |= blk_flush_complete_seq(rq, seq, error);
-	}
+	queued = blk_flush_complete_list(fq, running, error);
 
 	/*
 	 * Kick the queue to avoid stall for two cases:
@@ -256,60 +291,94 @@ static void flush_end_io(struct request *flush_rq, int error)
 	 * directly into request_fn may confuse the driver.  Always use
 	 * kblockd.
 	 */
-	if (queued || q->flush_queue_delayed) {
+	if (queued || fq->flush_queue_delayed) {
 		WARN_ON(q->mq_ops);
 		blk_run_queue_async(q);
 	}
-	q->flush_queue_delayed = 0;
+	fq->flush_queue_delayed = 0;
 	if (q->mq_ops)
-		spin_unlock_irqrestore(&q->mq_flush_lock, flags);
+		spin_unlock_irqrestore(&fq->mq_flush_lock, flags);
+}
+
+/*
+ * Nothing to flush if no write data completed since the last flush was
+ * issued and every flush issued so far has completed successfully.
+ * blk_insert_flush() marks the cache dirty for flushes covering writes
+ * this queue may not have seen.  The dirty bit is read before the
+ * in-flight count, the reverse of the order in which blk_kick_flush()
+ * updates them.
+ */
+static bool blk_flush_skip(struct request_queue *q)
+{
+	if (test_bit(BLK_FLUSH_DIRTY, &q->flush_state))
+		return false;
+	smp_rmb();
+	return !atomic_read(&q->flush_inflight);
 }
 
 /**
  * blk_kick_flush - consider issuing flush request
  * @q: request_queue being kicked
+ * @fq: flush queue
  *
- * Flush related states of @q have changed, consider issuing flush request.
+ * Flush related states of @fq have changed, consider issuing flush request.
  * Please read the comment at the top of this file for more info.
  *
  * CONTEXT:
- * spin_lock_irq(q->queue_lock or q->mq_flush_lock)
+ * spin_lock_irq(q->queue_lock or fq->mq_flush_lock)
  *
  * RETURNS:
- * %true if flush was issued, %false otherwise.
+ * %true if requests were added to the dispatch queue, %false otherwise.
  */
-static bool blk_kick_flush(struct request_queue *q)
+static bool blk_kick_flush(struct request_queue *q, struct blk_flush_queue *fq)
 {
-	struct list_head *pending = &q->flush_queue[q->flush_pending_idx];
+	struct list_head *pending = &fq->flush_queue[fq->flush_pending_idx];
 	struct request *first_rq =
 		list_first_entry(pending, struct request, flush.list);
+	struct request *flush_rq = fq->flush_rq;
 
 	/* C1 described at the top of this file */
-	if (q->flush_pending_idx != q->flush_running_idx || list_empty(pending))
+	if (fq->flush_pending_idx != fq->flush_running_idx || list_empty(pending))
 		return false;
 
 	/* C2 and C3 */
-	if (!list_empty(&q->flush_data_in_flight) &&
+	if (!list_empty(&fq->flush_data_in_flight) &&
 	    time_before(jiffies,
-			q->flush_pending_since + FLUSH_PENDING_TIMEOUT))
+			fq->flush_pending_since + FLUSH_PENDING_TIMEOUT))
 		return false;
 
+	/*
+	 * The cache is clean, complete the flush step without bothering
+	 * the device.  Take the requests off the pending list first, as
+	 * advancing them kicks us again.
+	 */
+	if (blk_flush_skip(q)) {
+		LIST_HEAD(skipped);
+
+		list_splice_init(pending, &skipped);
+		return blk_flush_complete_list(fq, &skipped, 0);
+	}
+
 	/*
 	 * Issue flush and toggle pending_idx.  This makes pending_idx
 	 * different from running_idx, which means flush is in flight.
 	 */
-	q->flush_pending_idx ^= 1;
+	fq->flush_pending_idx ^= 1;
 
-	blk_rq_init(q, q->flush_rq);
+	atomic_inc(&q->flush_inflight);
+	smp_mb__after_atomic_inc();
+	clear_bit(BLK_FLUSH_DIRTY, &q->flush_state);
+
+	blk_rq_init(q, flush_rq);
 	if (q->mq_ops)
-		blk_mq_clone_flush_request(q->flush_rq, first_rq);
+		blk_mq_clone_flush_request(flush_rq, first_rq);
 
-	q->flush_rq->cmd_type = REQ_TYPE_FS;
-	q->flush_rq->cmd_flags = WRITE_FLUSH | REQ_FLUSH_SEQ;
-	q->flush_rq->rq_disk = first_rq->rq_disk;
-	q->flush_rq->end_io = flush_end_io;
+	flush_rq->cmd_type = REQ_TYPE_FS;
+	flush_rq->cmd_flags = WRITE_FLUSH | REQ_FLUSH_SEQ;
+	flush_rq->rq_disk = first_rq->rq_disk;
+	flush_rq->end_io = flush_end_io;
 
-	return blk_flush_queue_rq(q->flush_rq, false);
+	return blk_flush_queue_rq(flush_rq, false);
 }
 
 static void flush_data_end_io(struct request *rq, int error)
@@ -320,7 +389,7 @@ static void flush_data_end_io(struct request *rq, int error)
 	 * After populating an empty queue, kick it to avoid stall.  Read
 	 * the comment in flush_end_io().
 	 */
-	if (blk_flush_complete_seq(rq, REQ_FSEQ_DATA, error))
+	if (blk_flush_complete_seq(rq, q->fq, REQ_FSEQ_DATA, error))
 		blk_run_queue_async(q);
 }
 
@@ -338,10 +407,10 @@ static void mq_flush_data_end_io(struct request *rq, int error)
 	 * After populating an empty queue, kick it to avoid stall.  Read
 	 * the comment in flush_end_io().
 	 */
-	spin_lock_irqsave(&q->mq_flush_lock, flags);
-	if (blk_flush_complete_seq(rq, REQ_FSEQ_DATA, error))
+	spin_lock_irqsave(&hctx->fq->mq_flush_lock, flags);
+	if (blk_flush_complete_seq(rq, hctx->fq, REQ_FSEQ_DATA, error))
 		blk_mq_run_hw_queue(hctx, true);
-	spin_unlock_irqrestore(&q->mq_flush_lock, flags);
+	spin_unlock_irqrestore(&hctx->fq->mq_flush_lock, flags);
 }
 
 /**
@@ -400,6 +469,15 @@ void blk_insert_flush(struct request *rq)
 		return;
 	}
 
+	/*
+	 * The writes a cloned or passthrough flush covers may not have gone
+	 * through this queue, e.g. they went down another path of a
+	 * multipath device.  Don't let blk_kick_flush() skip the flush on
+	 * the strength of this queue's cache state.
+	 */
+	if ((rq->cmd_flags & REQ_CLONE) || rq->cmd_type != REQ_TYPE_FS)
+		blk_flush_mark_dirty(q);
+
 	/*
 	 * @rq should go through flush machinery.  Mark it part of flush
 	 * sequence and submit for further processing.
@@ -409,16 +487,18 @@ void blk_insert_flush(struct request *rq)
 	rq->cmd_flags |= REQ_FLUSH_SEQ;
 	rq->flush.saved_end_io = rq->end_io; /* Usually NULL */
 	if (q->mq_ops) {
+		struct blk_flush_queue *fq = blk_get_flush_queue(q, rq->mq_ctx);
+
 		rq->end_io = mq_flush_data_end_io;
 
-		spin_lock_irq(&q->mq_flush_lock);
-		blk_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
-		spin_unlock_irq(&q->mq_flush_lock);
+		spin_lock_irq(&fq->mq_flush_lock);
+		blk_flush_complete_seq(rq, fq, REQ_FSEQ_ACTIONS & ~policy, 0);
+		spin_unlock_irq(&fq->mq_flush_lock);
 		return;
 	}
 	rq->end_io = flush_data_end_io;
 
-	blk_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
+	blk_flush_complete_seq(rq, q->fq, REQ_FSEQ_ACTIONS & ~policy, 0);
 }
 
 /**
@@ -433,6 +513,7 @@ void blk_insert_flush(struct request *rq)
  */
 void blk_abort_flushes(struct request_queue *q)
 {
+	struct blk_flush_queue *fq = q->fq;
 	struct request *rq, *n;
 	int i;
 
@@ -440,7 +521,7 @@ void blk_abort_flushes(struct request_queue *q)
 	 * Requests in flight for data are already owned by the dispatch
 	 * queue or the device driver.  Just restore for normal completion.
 	 */
-	list_for_each_entry_safe(rq, n, &q->flush_data_in_flight, flush.list) {
+	list_for_each_entry_safe(rq, n, &fq->flush_data_in_flight, flush.list) {
 		list_del_init(&rq->flush.list);
 		blk_flush_restore_request(rq);
 	}
@@ -449,8 +530,8 @@ void blk_abort_flushes(struct request_queue *q)
 	 * We need to give away requests on flush queues.  Restore for
 	 * normal completion and put them on the dispatch queue.
 	 */
-	for (i = 0; i < ARRAY_SIZE(q->flush_queue); i++) {
-		list_for_each_entry_safe(rq, n, &q->flush_queue[i],
+	for (i = 0; i < ARRAY_SIZE(fq->flush_queue); i++) {
+		list_for_each_entry_safe(rq, n, &fq->flush_queue[i],
 					 flush.list) {
 			list_del_init(&rq->flush.list);
 			blk_flush_restore_request(rq);
@@ -512,7 +593,43 @@ int blkdev_issue_flush(struct block_device *bdev, gfp_t gfp_mask,
 }
 EXPORT_SYMBOL(blkdev_issue_flush);
 
-void blk_mq_init_flush(struct request_queue *q)
+struct blk_flush_queue *blk_alloc_flush_queue(struct request_queue *q,
+		int node, int cmd_size)
 {
-	spin_lock_init(&q->mq_flush_lock);
+	struct blk_flush_queue *fq;
+	int rq_sz = sizeof(struct request);
+
+	fq = kzalloc_node(sizeof(*fq), GFP_KERNEL, node);
+	if (!fq)
+		goto fail;
+
+	if (q->mq_ops) {
+		spin_lock_init(&fq->mq_flush_lock);
+		rq_sz = round_up(rq_sz + cmd_size, cache_line_size());
+	}
+
+	fq->flush_rq = kzalloc_node(rq_sz, GFP_KERNEL, node);
+	if (!fq->flush_rq)
+		goto fail_rq;
+
+	INIT_LIST_HEAD(&fq->flush_queue[0]);
+	INIT_LIST_HEAD(&fq->flush_queue[1]);
+	INIT_LIST_HEAD(&fq->flush_data_in_flight);
+
+	return fq;
+
+fail_rq:
+	kfree(fq);
+fail:
+	return NULL;
+}
+
+void blk_free_flush_queue(struct blk_flush_queue *fq)
+{
+	/* bio based request queue hasn't flush queue */
+	if (!fq)
+		return;
+
+	kfree(fq->flush_rq);
+	kfree(fq);
 }
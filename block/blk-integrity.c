@@ -421,6 +421,8 @@ int blk_integrity_register(struct gendisk *disk, struct blk_integrity *template)
 		bi->set_tag_fn = template->set_tag_fn;
 		bi->get_tag_fn = template->get_tag_fn;
 		bi->tag_size = template->tag_size;
+		bi->flags &= ~INTEGRITY_FLAG_META;
+		bi->flags |= template->flags & INTEGRITY_FLAG_META;
 	} else
 		bi->name = bi_unsupported_name;
 
@@ -0,0 +1,981 @@
+/*
+ * Proportional share IO control for blk-mq request queues
+ *
+ * cfq implements blkio.weight by time slicing a single dispatch queue,
+ * which isn't available on blk-mq.  Instead, each bio is charged the
+ * device time it is expected to occupy according to a per-device cost
+ * model and every group runs its own virtual clock which advances by the
+ * charged cost divided by the group's share of the device.  The device
+ * has a virtual clock too, which runs at vrate times wall clock time; a
+ * group whose clock runs ahead of the device by more than a small margin
+ * has consumed more than its share and its bios are held back until the
+ * device catches up.
+ *
+ * Holding back bios only makes sense when groups are actually competing
+ * for a device which can't keep up.  Saturation is judged from the
+ * device itself: groups are throttled only while a good part of the
+ * requests completed in a period took longer than the latency target.
+ * The cost model is just a starting point for vrate, which is lowered
+ * while the device keeps missing its target and raised while bios are
+ * held back although it doesn't, so the model doesn't cap throughput.
+ *
+ * The root cgroup is never charged and a group which has the device to
+ * itself isn't held back, so a system without configured cgroups issues
+ * as if the policy wasn't there.  Charging only takes the group's lock;
+ * the device wide lock is left to activation, held back bios and the
+ * period timer.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/blktrace_api.h>
+#include "blk-cgroup.h"
+#include "blk.h"
+
+/* Usage, weights and vrate are re-evaluated every period */
+static unsigned long ioc_period = HZ/20;	/* 50 ms */
+
+/* A group may run this far ahead of the device before being held back */
+static u64 ioc_margin_ns = 10 * NSEC_PER_MSEC;
+
+/* Completion latency targets, picked by whether the queue is rotational */
+static u64 ioc_lat_target_rot_ns = 50 * NSEC_PER_MSEC;
+static u64 ioc_lat_target_nonrot_ns = 5 * NSEC_PER_MSEC;
+
+/*
+ * The device is considered saturated once ioc_busy_pct of the requests
+ * completed in a period missed the latency target and stays so until
+ * that drops below ioc_idle_pct with nothing held back.  The gap keeps
+ * throttling itself from flipping the state.
+ */
+static int ioc_busy_pct = 10;
+static int ioc_idle_pct = 5;
+
+/* fixed point one for hierarchical weights */
+#define IOC_HWEIGHT_ONE		(1U << 16)
+
+/* fixed point vrate, device nsecs per wall clock nsec */
+#define IOC_VRATE_SHIFT		16
+#define IOC_VRATE_ONE		(1U << IOC_VRATE_SHIFT)
+#define IOC_VRATE_MIN		(IOC_VRATE_ONE / 16)
+#define IOC_VRATE_MAX		(IOC_VRATE_ONE * 128)
+
+static struct blkcg_policy blkcg_policy_iocost;
+
+/*
+ * Cost in nsecs of device time.  An IO costs seq_cost or rand_cost
+ * depending on whether it continues where the group's previous IO ended,
+ * plus page_cost for each page transferred.
+ */
+struct ioc_model {
+	u64			seq_cost[2];
+	u64			rand_cost[2];
+	u64			page_cost[2];
+};
+
+/* ~100MB/s with 8ms seeks */
+static const struct ioc_model ioc_model_rotational = {
+	.seq_cost	= { 100 * NSEC_PER_USEC, 100 * NSEC_PER_USEC },
+	.rand_cost	= { 8 * NSEC_PER_MSEC, 8 * NSEC_PER_MSEC },
+	.page_cost	= { 40 * NSEC_PER_USEC, 40 * NSEC_PER_USEC },
+};
+
+/* ~1GB/s read, ~500MB/s write, no seek penalty */
+static const struct ioc_model ioc_model_nonrot = {
+	.seq_cost	= { 20 * NSEC_PER_USEC, 20 * NSEC_PER_USEC },
+	.rand_cost	= { 20 * NSEC_PER_USEC, 20 * NSEC_PER_USEC },
+	.page_cost	= { 4 * NSEC_PER_USEC, 8 * NSEC_PER_USEC },
+};
+
+/* completions seen by each cpu, summed up at the end of a period */
+struct ioc_lat_stat {
+	u64			nr_done;
+	u64			nr_missed;
+};
+
+struct ioc_grp {
+	/* must be the first member */
+	struct blkg_policy_data pd;
+
+	/* ioc_data this group belongs to */
+	struct ioc_data *iocd;
+
+	/* parent in the weight tree, %NULL if directly below iocd */
+	struct ioc_grp *parent;
+
+	/* per-device weight, 0 if following blkcg->iocost_weight */
+	unsigned int dev_weight;
+
+	/* sum of the weights of the active children, see ioc_refresh_hweights() */
+	unsigned int child_active_sum;
+	unsigned int active_gen;
+
+	/* share of the whole device in IOC_HWEIGHT_ONE units */
+	unsigned int hweight;
+
+	/* protects the fields below, nests inside iocd->lock */
+	spinlock_t lock;
+
+	/* virtual time in device nsecs */
+	u64 vtime;
+
+	/* end sector of the last bio, to detect sequential IO */
+	sector_t cursor;
+
+	/* cost dispatched in the current period and in total */
+	u64 period_usage;
+	struct blkg_stat usage;
+
+	/* bios held back for exceeding the share, also under iocd->lock */
+	struct bio_list queued;
+	unsigned int nr_queued;
+
+	/* on ioc_data->active_list, changed under iocd->lock */
+	struct list_head active_node;
+	bool active;
+
+	/* set once offline, no more bios may be queued */
+	bool dead;
+};
+
+struct ioc_data {
+	struct request_queue *queue;
+
+	/* protects everything below and the active lists */
+	spinlock_t lock;
+
+	/* set through blk_iocost_set_model(), otherwise picked by nonrot */
+	struct ioc_model model;
+	bool has_model;
+
+	/* groups which issued IO recently or have bios queued */
+	struct list_head active_list;
+	unsigned int nr_active;
+	unsigned int child_active_sum;
+	unsigned int active_gen;
+
+	/* device virtual clock, read locklessly through vnow_seq */
+	seqcount_t vnow_seq;
+	u64 vnow_base;
+	u64 vnow_start;
+	u32 vrate;
+
+	/* completion latencies, totals as of the last period */
+	struct ioc_lat_stat __percpu *lat_stat;
+	struct ioc_lat_stat lat_last;
+
+	u64 period_start;
+	bool saturated;
+
+	/* bios released from the groups, issued from dispatch_work */
+	struct bio_list dispatch_list;
+	unsigned int nr_queued;
+
+	struct timer_list period_timer;
+	struct timer_list dispatch_timer;
+	struct work_struct dispatch_work;
+};
+
+static inline struct ioc_grp *pd_to_iocg(struct blkg_policy_data *pd)
+{
+	return pd ? container_of(pd, struct ioc_grp, pd) : NULL;
+}
+
+static inline struct ioc_grp *blkg_to_iocg(struct blkcg_gq *blkg)
+{
+	return pd_to_iocg(blkg_to_pd(blkg, &blkcg_policy_iocost));
+}
+
+static inline struct blkcg_gq *iocg_to_blkg(struct ioc_grp *iocg)
+{
+	return pd_to_blkg(&iocg->pd);
+}
+
+#define ioc_log(iocd, fmt, args...)					\
+	blk_add_trace_msg((iocd)->queue, "iocost " fmt, ##args)
+
+static inline u64 ioc_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* the device's virtual time at wall clock time @now */
+static u64 ioc_vnow(struct ioc_data *iocd, u64 now)
+{
+	unsigned int seq;
+	u64 vnow;
+
+	do {
+		seq = read_seqcount_begin(&iocd->vnow_seq);
+		vnow = iocd->vnow_base;
+		if (now > iocd->vnow_start)
+			vnow += ((now - iocd->vnow_start) * iocd->vrate) >>
+				IOC_VRATE_SHIFT;
+	} while (read_seqcount_retry(&iocd->vnow_seq, seq));
+
+	return vnow;
+}
+
+/*
+ * Restart the device clock from @now, e.g. before changing vrate.
+ *
+ * CONTEXT: iocd->lock held.
+ */
+static void ioc_rebase_vnow(struct ioc_data *iocd, u64 now, u32 vrate)
+{
+	u64 vnow = ioc_vnow(iocd, now);
+
+	write_seqcount_begin(&iocd->vnow_seq);
+	iocd->vnow_base = vnow;
+	iocd->vnow_start = now;
+	iocd->vrate = vrate;
+	write_seqcount_end(&iocd->vnow_seq);
+}
+
+static unsigned int iocg_weight(struct ioc_grp *iocg)
+{
+	return iocg->dev_weight ?: iocg_to_blkg(iocg)->blkcg->iocost_weight;
+}
+
+/* nobody's held back unless groups compete for a saturated device */
+static inline bool ioc_unthrottled(struct ioc_data *iocd)
+{
+	return !ACCESS_ONCE(iocd->saturated) ||
+		ACCESS_ONCE(iocd->nr_active) <= 1;
+}
+
+static void ioc_pd_init(struct blkcg_gq *blkg)
+{
+	struct ioc_grp *iocg = blkg_to_iocg(blkg);
+	struct ioc_data *iocd = blkg->q->iocd;
+
+	iocg->iocd = iocd;
+
+	/*
+	 * Same as blk-throttle, only sane_hierarchy nests the weights.
+	 * Otherwise all groups compete directly with each other.
+	 */
+	if (cgroup_sane_behavior(blkg->blkcg->css.cgroup) && blkg->parent)
+		iocg->parent = blkg_to_iocg(blkg->parent);
+
+	iocg->hweight = IOC_HWEIGHT_ONE;
+	spin_lock_init(&iocg->lock);
+	blkg_stat_init(&iocg->usage);
+	bio_list_init(&iocg->queued);
+	INIT_LIST_HEAD(&iocg->active_node);
+}
+
+/* CONTEXT: iocd->lock held. */
+static void ioc_deactivate(struct ioc_grp *iocg)
+{
+	list_del_init(&iocg->active_node);
+	iocg->active = false;
+	iocg->iocd->nr_active--;
+}
+
+static void ioc_pd_offline(struct blkcg_gq *blkg)
+{
+	struct ioc_grp *iocg = blkg_to_iocg(blkg);
+	struct ioc_data *iocd = iocg->iocd;
+	unsigned long flags;
+
+	/*
+	 * The blkg may go away once we return.  Let whatever is still held
+	 * back go, the weights are recomputed at the end of the period.
+	 */
+	spin_lock_irqsave(&iocd->lock, flags);
+	spin_lock(&iocg->lock);
+	iocg->dead = true;
+	if (iocg->nr_queued) {
+		bio_list_merge(&iocd->dispatch_list, &iocg->queued);
+		bio_list_init(&iocg->queued);
+		iocd->nr_queued -= iocg->nr_queued;
+		iocg->nr_queued = 0;
+		kblockd_schedule_work(&iocd->dispatch_work);
+	}
+	spin_unlock(&iocg->lock);
+	if (iocg->active)
+		ioc_deactivate(iocg);
+	spin_unlock_irqrestore(&iocd->lock, flags);
+}
+
+static void ioc_pd_reset_stats(struct blkcg_gq *blkg)
+{
+	blkg_stat_reset(&blkg_to_iocg(blkg)->usage);
+}
+
+static struct ioc_grp *ioc_lookup_iocg(struct ioc_data *iocd,
+				       struct blkcg *blkcg)
+{
+	return blkg_to_iocg(blkg_lookup(blkcg, iocd->queue));
+}
+
+static struct ioc_grp *ioc_lookup_create_iocg(struct ioc_data *iocd,
+					      struct blkcg *blkcg)
+{
+	struct blkcg_gq *blkg = blkg_lookup_create(blkcg, iocd->queue);
+
+	/* on failure the bio just isn't charged */
+	if (IS_ERR(blkg))
+		return NULL;
+	return blkg_to_iocg(blkg);
+}
+
+/*
+ * Recompute the hierarchical weights of the active groups.  A group's
+ * hweight is its weight relative to its active siblings, multiplied all
+ * the way up.
+ *
+ * CONTEXT: iocd->lock held.
+ */
+static void ioc_refresh_hweights(struct ioc_data *iocd)
+{
+	struct ioc_grp *iocg, *pos;
+	unsigned int gen = ++iocd->active_gen;
+
+	iocd->child_active_sum = 0;
+
+	/* sum up the active weights at each level, counting each group once */
+	list_for_each_entry(iocg, &iocd->active_list, active_node) {
+		for (pos = iocg; pos; pos = pos->parent) {
+			if (pos->active_gen == gen)
+				break;
+			pos->active_gen = gen;
+			pos->child_active_sum = 0;
+		}
+	}
+
+	gen = ++iocd->active_gen;
+
+	list_for_each_entry(iocg, &iocd->active_list, active_node) {
+		for (pos = iocg; pos; pos = pos->parent) {
+			if (pos->active_gen == gen)
+				break;
+			pos->active_gen = gen;
+			if (pos->parent)
+				pos->parent->child_active_sum += iocg_weight(pos);
+			else
+				iocd->child_active_sum += iocg_weight(pos);
+		}
+	}
+
+	list_for_each_entry(iocg, &iocd->active_list, active_node) {
+		u64 hw = IOC_HWEIGHT_ONE;
+
+		for (pos = iocg; pos; pos = pos->parent) {
+			unsigned int sum = pos->parent ?
+				pos->parent->child_active_sum :
+				iocd->child_active_sum;
+
+			hw = hw * iocg_weight(pos);
+			do_div(hw, max(sum, 1U));
+		}
+		ACCESS_ONCE(iocg->hweight) = max_t(u64, hw, 1);
+	}
+}
+
+/*
+ * Percentage of the requests completed since the last call which missed
+ * the latency target, -1 if there were none.
+ *
+ * CONTEXT: iocd->lock held.
+ */
+static int ioc_lat_missed_pct(struct ioc_data *iocd)
+{
+	struct ioc_lat_stat sum = { };
+	u64 done, missed;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ioc_lat_stat *stat = per_cpu_ptr(iocd->lat_stat, cpu);
+
+		sum.nr_done += ACCESS_ONCE(stat->nr_done);
+		sum.nr_missed += ACCESS_ONCE(stat->nr_missed);
+	}
+
+	done = sum.nr_done - iocd->lat_last.nr_done;
+	missed = sum.nr_missed - iocd->lat_last.nr_missed;
+	iocd->lat_last = sum;
+
+	if (!done)
+		return -1;
+	return div64_u64(min(missed, done) * 100, done);
+}
+
+/* CONTEXT: iocd->lock held. */
+static void ioc_activate(struct ioc_grp *iocg, u64 now)
+{
+	struct ioc_data *iocd = iocg->iocd;
+	u64 vnow;
+
+	/* the first group in a while, latencies start from scratch */
+	if (!timer_pending(&iocd->period_timer)) {
+		ioc_rebase_vnow(iocd, now, iocd->vrate);
+		ioc_lat_missed_pct(iocd);
+		iocd->saturated = false;
+		iocd->period_start = now;
+		mod_timer(&iocd->period_timer, jiffies + ioc_period);
+	}
+
+	/* an idle group doesn't get to bank more than the margin */
+	vnow = ioc_vnow(iocd, now);
+	spin_lock(&iocg->lock);
+	if (time_before64(iocg->vtime, vnow - ioc_margin_ns))
+		iocg->vtime = vnow - ioc_margin_ns;
+	spin_unlock(&iocg->lock);
+
+	iocg->active = true;
+	iocd->nr_active++;
+	list_add_tail(&iocg->active_node, &iocd->active_list);
+	ioc_refresh_hweights(iocd);
+}
+
+static u64 ioc_bio_cost(struct ioc_data *iocd, struct ioc_grp *iocg,
+			struct bio *bio)
+{
+	const struct ioc_model *m = &iocd->model;
+	bool rw = bio_data_dir(bio);
+	u64 cost;
+
+	if (!iocd->has_model)
+		m = blk_queue_nonrot(iocd->queue) ? &ioc_model_nonrot :
+						    &ioc_model_rotational;
+
+	if (bio->bi_iter.bi_sector == iocg->cursor)
+		cost = m->seq_cost[rw];
+	else
+		cost = m->rand_cost[rw];
+
+	if (!(bio->bi_rw & (REQ_DISCARD | REQ_WRITE_SAME)))
+		cost += m->page_cost[rw] *
+			DIV_ROUND_UP(bio->bi_iter.bi_size, PAGE_SIZE);
+
+	iocg->cursor = bio_end_sector(bio);
+	return cost;
+}
+
+/*
+ * Charge @cost to @iocg.  While nobody is being held back, don't let a
+ * group build up debt beyond the margin - once groups start competing,
+ * it shouldn't be punished for having used capacity nobody else wanted.
+ *
+ * CONTEXT: iocg->lock held.
+ */
+static void ioc_charge(struct ioc_grp *iocg, u64 cost, u64 vnow)
+{
+	iocg->vtime += div_u64(cost * IOC_HWEIGHT_ONE,
+			       ACCESS_ONCE(iocg->hweight));
+	if (ioc_unthrottled(iocg->iocd) &&
+	    time_after64(iocg->vtime, vnow + ioc_margin_ns))
+		iocg->vtime = vnow + ioc_margin_ns;
+
+	iocg->period_usage += cost;
+	blkg_stat_add(&iocg->usage, cost);
+}
+
+/* CONTEXT: iocg->lock held. */
+static bool ioc_may_dispatch(struct ioc_grp *iocg, u64 vnow)
+{
+	return ioc_unthrottled(iocg->iocd) ||
+		!time_after64(iocg->vtime, vnow + ioc_margin_ns);
+}
+
+/*
+ * Release the bios of the groups which are back within their share and
+ * arm dispatch_timer for the first of the remaining ones.
+ *
+ * CONTEXT: iocd->lock held.
+ */
+static void ioc_release_queued(struct ioc_data *iocd)
+{
+	struct ioc_grp *iocg;
+	u64 now = ioc_now(), vnow = ioc_vnow(iocd, now), next = 0;
+	bool released = false;
+
+	list_for_each_entry(iocg, &iocd->active_list, active_node) {
+		struct bio *bio;
+
+		spin_lock(&iocg->lock);
+		while ((bio = bio_list_peek(&iocg->queued))) {
+			if (!ioc_may_dispatch(iocg, vnow)) {
+				u64 wait = iocg->vtime - ioc_margin_ns - vnow;
+
+				if (!next || wait < next)
+					next = wait;
+				break;
+			}
+
+			bio_list_pop(&iocg->queued);
+			iocg->nr_queued--;
+			iocd->nr_queued--;
+			ioc_charge(iocg, ioc_bio_cost(iocd, iocg, bio), vnow);
+			bio_list_add(&iocd->dispatch_list, bio);
+			released = true;
+		}
+		spin_unlock(&iocg->lock);
+	}
+
+	if (released)
+		kblockd_schedule_work(&iocd->dispatch_work);
+
+	/* @next is in device time, the timer runs on the wall clock */
+	if (next) {
+		next = div_u64(next << IOC_VRATE_SHIFT, iocd->vrate);
+		mod_timer(&iocd->dispatch_timer, jiffies +
+			  max(nsecs_to_jiffies(next), 1UL));
+	}
+}
+
+static void ioc_dispatch_timer_fn(unsigned long data)
+{
+	struct ioc_data *iocd = (struct ioc_data *)data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&iocd->lock, flags);
+	ioc_release_queued(iocd);
+	spin_unlock_irqrestore(&iocd->lock, flags);
+}
+
+/*
+ * End of a period.  Update the saturation state from the completion
+ * latencies seen during it, adjust vrate, retire the groups which went
+ * idle and refresh the weights.
+ */
+static void ioc_period_timer_fn(unsigned long data)
+{
+	struct ioc_data *iocd = (struct ioc_data *)data;
+	struct ioc_grp *iocg, *tmp;
+	u64 now = ioc_now(), usage = 0;
+	unsigned long flags;
+	bool was_saturated;
+	int missed;
+	u32 vrate;
+
+	spin_lock_irqsave(&iocd->lock, flags);
+
+	vrate = iocd->vrate;
+	missed = ioc_lat_missed_pct(iocd);
+	was_saturated = iocd->saturated;
+
+	if (!iocd->saturated)
+		iocd->saturated = missed >= ioc_busy_pct;
+	else
+		iocd->saturated = iocd->nr_queued || missed >= ioc_idle_pct;
+
+	/*
+	 * While groups compete for a saturated device, slow its virtual
+	 * clock down if it keeps missing the target and speed it up if it
+	 * keeps up but bios are held back anyway.
+	 */
+	if (iocd->saturated && iocd->nr_active > 1) {
+		if (missed >= ioc_busy_pct)
+			vrate = max_t(u32, vrate - vrate / 8, IOC_VRATE_MIN);
+		else if (iocd->nr_queued)
+			vrate = min_t(u32, vrate + vrate / 8, IOC_VRATE_MAX);
+	}
+
+	list_for_each_entry_safe(iocg, tmp, &iocd->active_list, active_node) {
+		bool idle;
+
+		spin_lock(&iocg->lock);
+		usage += iocg->period_usage;
+		idle = !iocg->period_usage && !iocg->nr_queued;
+		iocg->period_usage = 0;
+		spin_unlock(&iocg->lock);
+
+		if (idle)
+			ioc_deactivate(iocg);
+	}
+	ioc_refresh_hweights(iocd);
+
+	if (iocd->saturated != was_saturated)
+		ioc_log(iocd, "%s missed=%d%% usage=%llu vrate=%u queued=%u",
+			iocd->saturated ? "saturated" : "idle", missed,
+			usage, vrate, iocd->nr_queued);
+
+	ioc_rebase_vnow(iocd, now, vrate);
+	iocd->period_start = now;
+
+	if (iocd->nr_queued)
+		ioc_release_queued(iocd);
+
+	if (!list_empty(&iocd->active_list))
+		mod_timer(&iocd->period_timer, jiffies + ioc_period);
+
+	spin_unlock_irqrestore(&iocd->lock, flags);
+}
+
+/* Issue bios released by ioc_release_queued() or ioc_pd_offline(). */
+static void ioc_dispatch_work_fn(struct work_struct *work)
+{
+	struct ioc_data *iocd = container_of(work, struct ioc_data,
+					     dispatch_work);
+	struct bio_list bio_list_on_stack;
+	struct blk_plug plug;
+	struct bio *bio;
+
+	spin_lock_irq(&iocd->lock);
+	bio_list_on_stack = iocd->dispatch_list;
+	bio_list_init(&iocd->dispatch_list);
+	spin_unlock_irq(&iocd->lock);
+
+	if (bio_list_empty(&bio_list_on_stack))
+		return;
+
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(&bio_list_on_stack))) {
+		/* charged here and already went through blk-throttle */
+		bio->bi_rw |= REQ_IOCOST | REQ_THROTTLED;
+		generic_make_request(bio);
+	}
+	blk_finish_plug(&plug);
+}
+
+/**
+ * blk_iocost_bio - charge @bio to its group and hold it back if needed
+ * @q: request_queue @bio is being issued to
+ * @bio: bio being issued
+ *
+ * Returns %true if @bio was held back and will be issued later.  Only
+ * applies to blk-mq queues; legacy queues have cfq for this.
+ */
+bool blk_iocost_bio(struct request_queue *q, struct bio *bio)
+{
+	struct ioc_data *iocd = q->iocd;
+	struct blkcg *blkcg;
+	struct ioc_grp *iocg;
+	bool queued = false;
+	u64 now, vnow;
+
+	/* released by ioc_dispatch_work_fn(), already charged */
+	if (bio->bi_rw & REQ_IOCOST) {
+		bio->bi_rw &= ~REQ_IOCOST;
+		return false;
+	}
+
+	if (!q->mq_ops || !iocd)
+		return false;
+
+	rcu_read_lock();
+	blkcg = bio_blkcg(bio);
+	if (blkcg == &blkcg_root)
+		goto out_unlock_rcu;
+
+	iocg = ioc_lookup_iocg(iocd, blkcg);
+	if (unlikely(!iocg)) {
+		spin_lock_irq(q->queue_lock);
+		iocg = ioc_lookup_create_iocg(iocd, blkcg);
+		spin_unlock_irq(q->queue_lock);
+		if (unlikely(!iocg))
+			goto out_unlock_rcu;
+	}
+
+	now = ioc_now();
+	if (unlikely(!ACCESS_ONCE(iocg->active))) {
+		spin_lock_irq(&iocd->lock);
+		if (!iocg->active && !iocg->dead)
+			ioc_activate(iocg, now);
+		spin_unlock_irq(&iocd->lock);
+	}
+
+	/* keep FIFO order behind the bios which are already held back */
+	vnow = ioc_vnow(iocd, now);
+	spin_lock_irq(&iocg->lock);
+	if (!iocg->nr_queued && ioc_may_dispatch(iocg, vnow)) {
+		ioc_charge(iocg, ioc_bio_cost(iocd, iocg, bio), vnow);
+		spin_unlock_irq(&iocg->lock);
+		goto out_unlock_rcu;
+	}
+	spin_unlock_irq(&iocg->lock);
+
+	/* over its share, recheck with everything locked and hold it back */
+	spin_lock_irq(&iocd->lock);
+	if (unlikely(iocg->dead))
+		goto out_unlock;
+	if (!iocg->active)
+		ioc_activate(iocg, now);
+
+	spin_lock(&iocg->lock);
+	vnow = ioc_vnow(iocd, ioc_now());
+	if (!iocg->nr_queued && ioc_may_dispatch(iocg, vnow)) {
+		ioc_charge(iocg, ioc_bio_cost(iocd, iocg, bio), vnow);
+		spin_unlock(&iocg->lock);
+		goto out_unlock;
+	}
+
+	bio_associate_current(bio);
+	bio_list_add(&iocg->queued, bio);
+	iocg->nr_queued++;
+	iocd->nr_queued++;
+	queued = true;
+	spin_unlock(&iocg->lock);
+
+	if (iocg->nr_queued == 1)
+		ioc_release_queued(iocd);
+
+out_unlock:
+	spin_unlock_irq(&iocd->lock);
+out_unlock_rcu:
+	rcu_read_unlock();
+	return queued;
+}
+
+/**
+ * blk_iocost_done - account the completion latency of @rq
+ * @rq: blk-mq request being completed
+ *
+ * Feeds the saturation state; only done while groups are active.
+ */
+void blk_iocost_done(struct request *rq)
+{
+	struct ioc_data *iocd = rq->q->iocd;
+	u64 target;
+
+	if (!iocd || !ACCESS_ONCE(iocd->nr_active) ||
+	    rq->cmd_type != REQ_TYPE_FS || (rq->cmd_flags & REQ_FLUSH))
+		return;
+
+	target = blk_queue_nonrot(rq->q) ? ioc_lat_target_nonrot_ns :
+					   ioc_lat_target_rot_ns;
+
+	this_cpu_inc(iocd->lat_stat->nr_done);
+	if (sched_clock() - rq_start_time_ns(rq) > target)
+		this_cpu_inc(iocd->lat_stat->nr_missed);
+}
+
+/**
+ * blk_iocost_set_model - set the cost model of a request_queue
+ * @q: request_queue of interest
+ * @rw: READ or WRITE
+ * @seq_cost: device time in nsecs of an IO continuing the previous one
+ * @rand_cost: device time in nsecs of any other IO
+ * @page_cost: device time in nsecs per page transferred
+ *
+ * Drivers which know how long their device is busy with an IO can use
+ * this to replace the defaults, which are picked by whether @q is
+ * rotational.  Costs of the direction not set yet are left at the
+ * defaults.
+ */
+void blk_iocost_set_model(struct request_queue *q, int rw, u64 seq_cost,
+			  u64 rand_cost, u64 page_cost)
+{
+	struct ioc_data *iocd = q->iocd;
+
+	if (!iocd)
+		return;
+
+	spin_lock_irq(&iocd->lock);
+	if (!iocd->has_model) {
+		iocd->model = blk_queue_nonrot(q) ? ioc_model_nonrot :
+						     ioc_model_rotational;
+		iocd->has_model = true;
+	}
+	iocd->model.seq_cost[rw] = seq_cost;
+	iocd->model.rand_cost[rw] = rand_cost;
+	iocd->model.page_cost[rw] = page_cost;
+	spin_unlock_irq(&iocd->lock);
+}
+EXPORT_SYMBOL_GPL(blk_iocost_set_model);
+
+static int ioc_print_weight(struct seq_file *sf, void *v)
+{
+	seq_printf(sf, "%u\n", css_to_blkcg(seq_css(sf))->iocost_weight);
+	return 0;
+}
+
+static int ioc_set_weight(struct cgroup_subsys_state *css, struct cftype *cft,
+			  u64 val)
+{
+	struct blkcg *blkcg = css_to_blkcg(css);
+
+	if (val < IOC_WEIGHT_MIN || val > IOC_WEIGHT_MAX)
+		return -EINVAL;
+
+	/* picked up by the groups at the end of the current period */
+	spin_lock_irq(&blkcg->lock);
+	blkcg->iocost_weight = val;
+	spin_unlock_irq(&blkcg->lock);
+	return 0;
+}
+
+static u64 iocg_prfill_weight_device(struct seq_file *sf,
+				     struct blkg_policy_data *pd, int off)
+{
+	struct ioc_grp *iocg = pd_to_iocg(pd);
+
+	if (!iocg->dev_weight)
+		return 0;
+	return __blkg_prfill_u64(sf, pd, iocg->dev_weight);
+}
+
+static int iocg_print_weight_device(struct seq_file *sf, void *v)
+{
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)),
+			  iocg_prfill_weight_device, &blkcg_policy_iocost, 0,
+			  false);
+	return 0;
+}
+
+static int iocg_set_weight_device(struct cgroup_subsys_state *css,
+				  struct cftype *cft, char *buf)
+{
+	struct blkcg *blkcg = css_to_blkcg(css);
+	struct blkg_conf_ctx ctx;
+	struct ioc_grp *iocg;
+	int ret;
+
+	ret = blkg_conf_prep(blkcg, &blkcg_policy_iocost, buf, &ctx);
+	if (ret)
+		return ret;
+
+	ret = -EINVAL;
+	iocg = blkg_to_iocg(ctx.blkg);
+	if (!ctx.v || (ctx.v >= IOC_WEIGHT_MIN && ctx.v <= IOC_WEIGHT_MAX)) {
+		spin_lock(&iocg->iocd->lock);
+		iocg->dev_weight = ctx.v;
+		ioc_refresh_hweights(iocg->iocd);
+		spin_unlock(&iocg->iocd->lock);
+		ret = 0;
+	}
+
+	blkg_conf_finish(&ctx);
+	return ret;
+}
+
+static int iocg_print_stat(struct seq_file *sf, void *v)
+{
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)), blkg_prfill_stat,
+			  &blkcg_policy_iocost, seq_cft(sf)->private, false);
+	return 0;
+}
+
+static struct cftype ioc_files[] = {
+	{
+		.name = "cost.weight_device",
+		.seq_show = iocg_print_weight_device,
+		.write_string = iocg_set_weight_device,
+	},
+	{
+		.name = "cost.weight",
+		.seq_show = ioc_print_weight,
+		.write_u64 = ioc_set_weight,
+	},
+	{
+		.name = "cost.usage",
+		.private = offsetof(struct ioc_grp, usage),
+		.seq_show = iocg_print_stat,
+	},
+	{ }	/* terminate */
+};
+
+static struct blkcg_policy blkcg_policy_iocost = {
+	.pd_size		= sizeof(struct ioc_grp),
+	.cftypes		= ioc_files,
+
+	.pd_init_fn		= ioc_pd_init,
+	.pd_offline_fn		= ioc_pd_offline,
+	.pd_reset_stats_fn	= ioc_pd_reset_stats,
+};
+
+/**
+ * blk_iocost_drain - issue all held back bios
+ * @q: request_queue to drain
+ */
+void blk_iocost_drain(struct request_queue *q)
+	__releases(q->queue_lock) __acquires(q->queue_lock)
+{
+	struct ioc_data *iocd = q->iocd;
+	struct bio_list bio_list_on_stack;
+	struct ioc_grp *iocg;
+	struct bio *bio;
+
+	queue_lockdep_assert_held(q);
+
+	spin_lock(&iocd->lock);
+	list_for_each_entry(iocg, &iocd->active_list, active_node) {
+		spin_lock(&iocg->lock);
+		bio_list_merge(&iocd->dispatch_list, &iocg->queued);
+		bio_list_init(&iocg->queued);
+		iocg->nr_queued = 0;
+		spin_unlock(&iocg->lock);
+	}
+	iocd->nr_queued = 0;
+	bio_list_on_stack = iocd->dispatch_list;
+	bio_list_init(&iocd->dispatch_list);
+	spin_unlock(&iocd->lock);
+
+	spin_unlock_irq(q->queue_lock);
+
+	while ((bio = bio_list_pop(&bio_list_on_stack))) {
+		bio->bi_rw |= REQ_IOCOST | REQ_THROTTLED;
+		generic_make_request(bio);
+	}
+
+	spin_lock_irq(q->queue_lock);
+}
+
+int blk_iocost_init(struct request_queue *q)
+{
+	struct ioc_data *iocd;
+	int ret;
+
+	iocd = kzalloc_node(sizeof(*iocd), GFP_KERNEL, q->node);
+	if (!iocd)
+		return -ENOMEM;
+
+	iocd->lat_stat = alloc_percpu(struct ioc_lat_stat);
+	if (!iocd->lat_stat) {
+		kfree(iocd);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&iocd->lock);
+	INIT_LIST_HEAD(&iocd->active_list);
+	seqcount_init(&iocd->vnow_seq);
+	iocd->vrate = IOC_VRATE_ONE;
+	bio_list_init(&iocd->dispatch_list);
+	setup_timer(&iocd->period_timer, ioc_period_timer_fn,
+		    (unsigned long)iocd);
+	setup_timer(&iocd->dispatch_timer, ioc_dispatch_timer_fn,
+		    (unsigned long)iocd);
+	INIT_WORK(&iocd->dispatch_work, ioc_dispatch_work_fn);
+
+	q->iocd = iocd;
+	iocd->queue = q;
+
+	/* activate policy */
+	ret = blkcg_activate_policy(q, &blkcg_policy_iocost);
+	if (ret) {
+		q->iocd = NULL;
+		free_percpu(iocd->lat_stat);
+		kfree(iocd);
+	}
+	return ret;
+}
+
+void blk_iocost_exit(struct request_queue *q)
+{
+	struct ioc_data *iocd = q->iocd;
+
+	BUG_ON(!iocd);
+	del_timer_sync(&iocd->period_timer);
+	del_timer_sync(&iocd->dispatch_timer);
+	blkcg_deactivate_policy(q, &blkcg_policy_iocost);
+	/* deactivation may have released the last held back bios */
+	flush_work(&iocd->dispatch_work);
+	q->iocd = NULL;
+	free_percpu(iocd->lat_stat);
+	kfree(iocd);
+}
+
+static int __init ioc_init(void)
+{
+	return blkcg_policy_register(&blkcg_policy_iocost);
+}
+
+module_init(ioc_init);
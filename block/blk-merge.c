@@ -452,7 +452,6 @@ static void blk_account_io_merge(struct request *req)
 		cpu = part_stat_lock();
 		part = req->part;
 
-		part_round_stats(cpu, part);
 		part_dec_in_flight(part, rq_data_dir(req));
 
 		hd_struct_put(part);
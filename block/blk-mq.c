@@ -21,6 +21,8 @@
 #include <linux/sched/sysctl.h>
 #include <linux/delay.h>
 
+#include <net/busy_poll.h>
+
 #include <trace/events/block.h>
 
 #include <linux/blk-mq.h>
@@ -129,7 +131,7 @@ static void __blk_mq_drain_queue(struct request_queue *q)
  * Guarantee no request is in use, so we can change any data structure of
  * the queue afterward.
  */
-static void blk_mq_freeze_queue(struct request_queue *q)
+void blk_mq_freeze_queue(struct request_queue *q)
 {
 	bool drain;
 
@@ -141,13 +143,14 @@ static void blk_mq_freeze_queue(struct request_queue *q)
 	if (drain)
 		__blk_mq_drain_queue(q);
 }
+EXPORT_SYMBOL_GPL(blk_mq_freeze_queue);
 
 void blk_mq_drain_queue(struct request_queue *q)
 {
 	__blk_mq_drain_queue(q);
 }
 
-static void blk_mq_unfreeze_queue(struct request_queue *q)
+void blk_mq_unfreeze_queue(struct request_queue *q)
 {
 	bool wake = false;
 
@@ -161,6 +164,7 @@ static void blk_mq_unfreeze_queue(struct request_queue *q)
 	if (wake)
 		wake_up_all(&q->mq_freeze_wq);
 }
+EXPORT_SYMBOL_GPL(blk_mq_unfreeze_queue);
 
 bool blk_mq_can_queue(struct blk_mq_hw_ctx *hctx)
 {
@@ -319,6 +323,7 @@ void blk_mq_clone_flush_request(struct request *flush_rq,
 
 inline void __blk_mq_end_io(struct request *rq, int error)
 {
+	blk_iocost_done(rq);
 	blk_account_io_done(rq);
 
 	if (rq->end_io) {
@@ -525,20 +530,20 @@ void blk_mq_kick_requeue_list(struct request_queue *q)
 }
 EXPORT_SYMBOL(blk_mq_kick_requeue_list);
 
-static inline bool is_flush_request(struct request *rq, unsigned int tag)
-{
-	return ((rq->cmd_flags & REQ_FLUSH_SEQ) &&
-			rq->q->flush_rq->tag == tag);
-}
-
 struct request *blk_mq_tag_to_rq(struct blk_mq_tags *tags, unsigned int tag)
 {
 	struct request *rq = tags->rqs[tag];
+	struct blk_flush_queue *fq;
+
+	if (!(rq->cmd_flags & REQ_FLUSH_SEQ))
+		return rq;
 
-	if (!is_flush_request(rq, tag))
+	/* the flush request borrows the tag of a request parked on its queue */
+	fq = blk_get_flush_queue(rq->q, rq->mq_ctx);
+	if (fq->flush_rq->tag != tag)
 		return rq;
 
-	return rq->q->flush_rq;
+	return fq->flush_rq;
 }
 EXPORT_SYMBOL(blk_mq_tag_to_rq);
 
@@ -1323,6 +1328,75 @@ struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
 }
 EXPORT_SYMBOL(blk_mq_map_queue);
 
+static int __blk_mq_poll(struct blk_mq_hw_ctx *hctx)
+{
+	int found;
+
+	atomic_long_inc(&hctx->poll_invoked);
+	found = hctx->queue->mq_ops->poll(hctx);
+	if (found > 0) {
+		atomic_long_inc(&hctx->poll_success);
+		return found;
+	}
+	return 0;
+}
+
+/**
+ * blk_mq_poll - reap completions without waiting for the interrupt
+ * @q:		the queue
+ *
+ * Description:
+ *	Polls the hardware queue that the current CPU maps to once and
+ *	returns the number of requests completed.  Does nothing unless
+ *	busy polling was enabled for @q through its io_poll attribute.
+ **/
+int blk_mq_poll(struct request_queue *q)
+{
+	int found;
+
+	if (!q->mq_ops || !ACCESS_ONCE(q->poll_usec) || blk_queue_dying(q))
+		return 0;
+
+	found = __blk_mq_poll(q->mq_ops->map_queue(q, get_cpu()));
+	put_cpu();
+	return found;
+}
+EXPORT_SYMBOL_GPL(blk_mq_poll);
+
+/**
+ * blk_busy_wait - busy poll until a block IO wait condition is met
+ * @q:		queue the IO was submitted to
+ * @done:	the wait condition
+ * @arg:	argument to @done
+ *
+ * Description:
+ *	Spins for up to @q's io_poll budget polling @q and, so that one
+ *	budget covers both, the network device last busy polled on this
+ *	CPU.  Returns the final value of @done; when that is false the
+ *	caller goes to sleep as it would have without polling.
+ **/
+bool blk_busy_wait(struct request_queue *q, bool (*done)(void *), void *arg)
+{
+	unsigned int usec = ACCESS_ONCE(q->poll_usec);
+	u64 end_time;
+
+	if (!q->mq_ops || !usec)
+		return done(arg);
+
+	end_time = local_clock() + (u64)usec * NSEC_PER_USEC;
+	while (!done(arg)) {
+		blk_mq_poll(q);
+		napi_busy_poll_cpu();
+
+		if (need_resched() || signal_pending(current) ||
+		    local_clock() > end_time)
+			return done(arg);
+		cpu_relax();
+	}
+	return true;
+}
+EXPORT_SYMBOL_GPL(blk_busy_wait);
+
 static void blk_mq_free_rq_map(struct blk_mq_tag_set *set,
 		struct blk_mq_tags *tags, unsigned int hctx_idx)
 {
@@ -1551,6 +1625,7 @@ static void blk_mq_exit_hw_queues(struct request_queue *q,
 			set->ops->exit_hctx(hctx, i);
 
 		blk_mq_unregister_cpu_notifier(&hctx->cpu_notifier);
+		blk_free_flush_queue(hctx->fq);
 		kfree(hctx->ctxs);
 		blk_mq_free_bitmap(&hctx->ctx_map);
 	}
@@ -1612,6 +1687,10 @@ static int blk_mq_init_hw_queues(struct request_queue *q,
 		if (blk_mq_alloc_bitmap(&hctx->ctx_map, node))
 			break;
 
+		hctx->fq = blk_alloc_flush_queue(q, node, set->cmd_size);
+		if (!hctx->fq)
+			break;
+
 		hctx->nr_ctx = 0;
 
 		if (set->ops->init_hctx &&
@@ -1845,17 +1924,10 @@ struct request_queue *blk_mq_init_queue(struct blk_mq_tag_set *set)
 	if (set->ops->complete)
 		blk_queue_softirq_done(q, set->ops->complete);
 
-	blk_mq_init_flush(q);
 	blk_mq_init_cpu_queues(q, set->nr_hw_queues);
 
-	q->flush_rq = kzalloc(round_up(sizeof(struct request) +
-				set->cmd_size, cache_line_size()),
-				GFP_KERNEL);
-	if (!q->flush_rq)
-		goto err_hw;
-
 	if (blk_mq_init_hw_queues(q, set))
-		goto err_flush_rq;
+		goto err_hw;
 
 	mutex_lock(&all_q_mutex);
 	list_add_tail(&q->all_q_node, &all_q_list);
@@ -1867,8 +1939,6 @@ struct request_queue *blk_mq_init_queue(struct blk_mq_tag_set *set)
 
 	return q;
 
-err_flush_rq:
-	kfree(q->flush_rq);
 err_hw:
 	blk_cleanup_queue(q);
 err_hctxs:
@@ -27,13 +27,25 @@ struct blk_mq_ctx {
 
 void __blk_mq_complete_request(struct request *rq);
 void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async);
-void blk_mq_init_flush(struct request_queue *q);
 void blk_mq_drain_queue(struct request_queue *q);
 void blk_mq_free_queue(struct request_queue *q);
 void blk_mq_clone_flush_request(struct request *flush_rq,
 		struct request *orig_rq);
 int blk_mq_update_nr_requests(struct request_queue *q, unsigned int nr);
 
+/*
+ * Flush requests are sequenced per hardware context, legacy queues have a
+ * single flush queue hanging off the request_queue.
+ */
+static inline struct blk_flush_queue *blk_get_flush_queue(
+		struct request_queue *q, struct blk_mq_ctx *ctx)
+{
+	if (!q->mq_ops)
+		return q->fq;
+
+	return q->mq_ops->map_queue(q, ctx->cpu)->fq;
+}
+
 /*
  * CPU hotplug helpers
  */
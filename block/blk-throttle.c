@@ -21,6 +21,12 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/*
+ * A cpu is granted dispatch budget for 1/8th of a slice worth of the IO
+ * it has been issuing, or of the limit if it has no history yet.
+ */
+static int throtl_budget_share = 8;
+
 static struct blkcg_policy blkcg_policy_throtl;
 
 /* A workqueue to queue throttle related work */
@@ -83,12 +89,29 @@ enum tg_state_flags {
 
 #define rb_entry_tg(node)	rb_entry((node), struct throtl_grp, rb_node)
 
-/* Per-cpu group stats */
+/* Per-cpu group stats and dispatch budget */
 struct tg_stats_cpu {
 	/* total bytes transferred */
 	struct blkg_rwstat		service_bytes;
 	/* total IOs serviced, post merge */
 	struct blkg_rwstat		serviced;
+
+	/*
+	 * Budget reserved at the group and its ancestors which this cpu
+	 * may dispatch without queue_lock until it expires, see
+	 * throtl_grant_budget().  Only what was spent is charged once the
+	 * budget is settled, the rest goes back.
+	 */
+	spinlock_t			budget_lock;
+	uint64_t			budget_bytes[2];	/* left */
+	unsigned int			budget_ios[2];
+	uint64_t			granted_bytes[2];
+	unsigned int			granted_ios[2];
+	unsigned long			granted_at[2];
+
+	/* what the last settled budget was spent at, per budget window */
+	uint64_t			rate_bytes[2];
+	unsigned int			rate_ios[2];
 };
 
 struct throtl_grp {
@@ -138,6 +161,10 @@ struct throtl_grp {
 	/* Number of bio's dispatched in current slice */
 	unsigned int io_disp[2];
 
+	/* Bytes and bios reserved by outstanding per cpu budgets */
+	uint64_t bytes_rsv[2];
+	unsigned int io_rsv[2];
+
 	/* When did we start a new slice */
 	unsigned long slice_start[2];
 	unsigned long slice_end[2];
@@ -145,6 +172,12 @@ struct throtl_grp {
 	/* Per cpu stats pointer */
 	struct tg_stats_cpu __percpu *stats_cpu;
 
+	/* cpus holding a budget of this group, on td->budget_list if any */
+	unsigned int nr_budget_cpus[2];
+	struct list_head budget_node;
+	/* last time budgets were reclaimed for a throttled bio */
+	unsigned long budget_reclaimed[2];
+
 	/* List of tgs waiting for per cpu stats memory to be allocated */
 	struct list_head stats_alloc_node;
 };
@@ -166,6 +199,9 @@ struct throtl_data
 
 	/* Work for dispatching throttled bios */
 	struct work_struct dispatch_work;
+
+	/* groups with outstanding per cpu budgets */
+	struct list_head budget_list;
 };
 
 /* list and work item to allocate percpu group stats */
@@ -176,6 +212,8 @@ static void tg_stats_alloc_fn(struct work_struct *);
 static DECLARE_DELAYED_WORK(tg_stats_alloc_work, tg_stats_alloc_fn);
 
 static void throtl_pending_timer_fn(unsigned long arg);
+static bool throtl_settle_budget(struct throtl_grp *tg, int cpu, bool rw,
+				 bool force);
 
 static inline struct throtl_grp *pd_to_tg(struct blkg_policy_data *pd)
 {
@@ -260,6 +298,7 @@ static void tg_stats_init(struct tg_stats_cpu *tg_stats)
 {
 	blkg_rwstat_init(&tg_stats->service_bytes);
 	blkg_rwstat_init(&tg_stats->serviced);
+	spin_lock_init(&tg_stats->budget_lock);
 }
 
 /*
@@ -434,9 +473,11 @@ static void throtl_pd_init(struct blkcg_gq *blkg)
 	for (rw = READ; rw <= WRITE; rw++) {
 		throtl_qnode_init(&tg->qnode_on_self[rw], tg);
 		throtl_qnode_init(&tg->qnode_on_parent[rw], tg);
+		tg->budget_reclaimed[rw] = jiffies - throtl_slice;
 	}
 
 	RB_CLEAR_NODE(&tg->rb_node);
+	INIT_LIST_HEAD(&tg->budget_node);
 	tg->td = td;
 
 	tg->bps[READ] = -1;
@@ -479,6 +520,18 @@ static void throtl_pd_online(struct blkcg_gq *blkg)
 	tg_update_has_rules(blkg_to_tg(blkg));
 }
 
+static void throtl_pd_offline(struct blkcg_gq *blkg)
+{
+	struct throtl_grp *tg = blkg_to_tg(blkg);
+	int cpu, rw;
+
+	/* charge the ancestors for what was spent and let go of the rest */
+	if (tg->stats_cpu)
+		for_each_possible_cpu(cpu)
+			for (rw = READ; rw <= WRITE; rw++)
+				throtl_settle_budget(tg, cpu, rw, true);
+}
+
 static void throtl_pd_exit(struct blkcg_gq *blkg)
 {
 	struct throtl_grp *tg = blkg_to_tg(blkg);
@@ -808,10 +861,9 @@ static inline void throtl_trim_slice(struct throtl_grp *tg, bool rw)
 		   tg->slice_start[rw], tg->slice_end[rw], jiffies);
 }
 
-static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
-				  unsigned long *wait)
+static bool __tg_with_in_iops_limit(struct throtl_grp *tg, bool rw,
+				    unsigned int nr_ios, unsigned long *wait)
 {
-	bool rw = bio_data_dir(bio);
 	unsigned int io_allowed;
 	unsigned long jiffy_elapsed, jiffy_wait, jiffy_elapsed_rnd;
 	u64 tmp;
@@ -839,14 +891,17 @@ static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
 	else
 		io_allowed = tmp;
 
-	if (tg->io_disp[rw] + 1 <= io_allowed) {
+	/* budgets handed to cpus may be spent any time, count them as used */
+	nr_ios += tg->io_rsv[rw];
+
+	if (tg->io_disp[rw] + nr_ios <= io_allowed) {
 		if (wait)
 			*wait = 0;
 		return true;
 	}
 
 	/* Calc approx time to dispatch */
-	jiffy_wait = ((tg->io_disp[rw] + 1) * HZ)/tg->iops[rw] + 1;
+	jiffy_wait = ((tg->io_disp[rw] + nr_ios) * HZ)/tg->iops[rw] + 1;
 
 	if (jiffy_wait > jiffy_elapsed)
 		jiffy_wait = jiffy_wait - jiffy_elapsed;
@@ -858,10 +913,15 @@ static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
 	return 0;
 }
 
-static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
-				 unsigned long *wait)
+static bool tg_with_in_iops_limit(struct throtl_grp *tg, struct bio *bio,
+				  unsigned long *wait)
+{
+	return __tg_with_in_iops_limit(tg, bio_data_dir(bio), 1, wait);
+}
+
+static bool __tg_with_in_bps_limit(struct throtl_grp *tg, bool rw,
+				   u64 bytes, unsigned long *wait)
 {
-	bool rw = bio_data_dir(bio);
 	u64 bytes_allowed, extra_bytes, tmp;
 	unsigned long jiffy_elapsed, jiffy_wait, jiffy_elapsed_rnd;
 
@@ -877,14 +937,17 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 	do_div(tmp, HZ);
 	bytes_allowed = tmp;
 
-	if (tg->bytes_disp[rw] + bio->bi_iter.bi_size <= bytes_allowed) {
+	/* budgets handed to cpus may be spent any time, count them as used */
+	bytes += tg->bytes_rsv[rw];
+
+	if (tg->bytes_disp[rw] + bytes <= bytes_allowed) {
 		if (wait)
 			*wait = 0;
 		return true;
 	}
 
 	/* Calc approx time to dispatch */
-	extra_bytes = tg->bytes_disp[rw] + bio->bi_iter.bi_size - bytes_allowed;
+	extra_bytes = tg->bytes_disp[rw] + bytes - bytes_allowed;
 	jiffy_wait = div64_u64(extra_bytes * HZ, tg->bps[rw]);
 
 	if (!jiffy_wait)
@@ -900,6 +963,13 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 	return 0;
 }
 
+static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
+				 unsigned long *wait)
+{
+	return __tg_with_in_bps_limit(tg, bio_data_dir(bio),
+				      bio->bi_iter.bi_size, wait);
+}
+
 /*
  * Returns whether one can dispatch a bio or not. Also returns approx number
  * of jiffies to wait before this bio is with-in IO rate and can be dispatched
@@ -1008,6 +1078,289 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	}
 }
 
+/*
+ * Can @tg dispatch @bytes and @nr_ios more in direction @rw right now?
+ * Like tg_may_dispatch() but for a budget rather than a bio, and a refusal
+ * doesn't extend the slice as nothing is going to wait for it.
+ */
+static bool tg_may_grant(struct throtl_grp *tg, bool rw, u64 bytes,
+			 unsigned int nr_ios)
+{
+	if (tg->bps[rw] == -1 && tg->iops[rw] == -1)
+		return true;
+
+	/* throtl is FIFO - don't let budget overtake queued bios */
+	if (tg->service_queue.nr_queued[rw])
+		return false;
+
+	if (throtl_slice_used(tg, rw))
+		throtl_start_new_slice(tg, rw);
+	else if (time_before(tg->slice_end[rw], jiffies + throtl_slice))
+		throtl_extend_slice(tg, rw, jiffies + throtl_slice);
+
+	if (tg->bps[rw] != -1 && !__tg_with_in_bps_limit(tg, rw, bytes, NULL))
+		return false;
+	if (tg->iops[rw] != -1 && !__tg_with_in_iops_limit(tg, rw, nr_ios, NULL))
+		return false;
+	return true;
+}
+
+/*
+ * Settle the budget @tg granted to @cpu in direction @rw: charge what was
+ * spent of it and hand the rest back.  Unless @force, only done once the
+ * budget expired.  Returns %true if there was a budget to settle.
+ *
+ * CONTEXT: queue_lock held with irqs disabled.
+ */
+static bool throtl_settle_budget(struct throtl_grp *tg, int cpu, bool rw,
+				 bool force)
+{
+	struct tg_stats_cpu *stats_cpu = per_cpu_ptr(tg->stats_cpu, cpu);
+	unsigned long window = max(throtl_slice / throtl_budget_share, 1UL);
+	unsigned long elapsed;
+	u64 granted_bytes, bytes;
+	unsigned int granted_ios, nr_ios;
+	struct throtl_grp *pos;
+
+	spin_lock(&stats_cpu->budget_lock);
+	granted_ios = stats_cpu->granted_ios[rw];
+	if (!granted_ios || (!force &&
+	    time_before(jiffies, stats_cpu->granted_at[rw] + throtl_slice))) {
+		spin_unlock(&stats_cpu->budget_lock);
+		return false;
+	}
+	granted_bytes = stats_cpu->granted_bytes[rw];
+	bytes = granted_bytes - stats_cpu->budget_bytes[rw];
+	nr_ios = granted_ios - stats_cpu->budget_ios[rw];
+	elapsed = max(jiffies - stats_cpu->granted_at[rw], 1UL);
+
+	stats_cpu->budget_bytes[rw] = 0;
+	stats_cpu->budget_ios[rw] = 0;
+	stats_cpu->granted_bytes[rw] = 0;
+	stats_cpu->granted_ios[rw] = 0;
+	stats_cpu->rate_bytes[rw] = div64_u64(bytes * window, elapsed);
+	stats_cpu->rate_ios[rw] = div64_u64((u64)nr_ios * window, elapsed);
+	spin_unlock(&stats_cpu->budget_lock);
+
+	/* the limits can't have changed, see throtl_reclaim_budgets() */
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq)) {
+		if (pos->bps[rw] != -1) {
+			pos->bytes_rsv[rw] -= granted_bytes;
+			pos->bytes_disp[rw] += bytes;
+		}
+		if (pos->iops[rw] != -1) {
+			pos->io_rsv[rw] -= granted_ios;
+			pos->io_disp[rw] += nr_ios;
+		}
+	}
+
+	if (!--tg->nr_budget_cpus[rw] && !tg->nr_budget_cpus[!rw])
+		list_del_init(&tg->budget_node);
+
+	throtl_log(&tg->service_queue, "[%c] settle cpu=%d bytes=%llu/%llu ios=%u/%u",
+		   rw == READ ? 'R' : 'W', cpu, bytes, granted_bytes,
+		   nr_ios, granted_ios);
+	return true;
+}
+
+/* settle the budgets of @tg in direction @rw which have expired */
+static void throtl_settle_expired(struct throtl_grp *tg, bool rw)
+{
+	int cpu;
+
+	if (!tg->nr_budget_cpus[rw])
+		return;
+
+	for_each_possible_cpu(cpu)
+		throtl_settle_budget(tg, cpu, rw, false);
+}
+
+/**
+ * throtl_reclaim_path - settle the budgets in the way of a throttled bio
+ * @tg: the group the bio was issued from
+ * @rw: direction of the bio
+ *
+ * Before a bio of @tg is queued, settle the budgets @tg and its ancestors
+ * handed out, expired or not, as unspent ones may be all that's over the
+ * limit.  Done at most once a slice per group so that a throttled queue
+ * doesn't keep walking the cpus.  Returns %true if anything was reclaimed.
+ *
+ * CONTEXT: queue_lock held with irqs disabled.
+ */
+static bool throtl_reclaim_path(struct throtl_grp *tg, bool rw)
+{
+	bool reclaimed = false;
+	int cpu;
+
+	for (; tg; tg = sq_to_tg(tg->service_queue.parent_sq)) {
+		if (!tg->nr_budget_cpus[rw] ||
+		    time_before(jiffies, tg->budget_reclaimed[rw] + throtl_slice))
+			continue;
+
+		tg->budget_reclaimed[rw] = jiffies;
+		for_each_possible_cpu(cpu)
+			if (throtl_settle_budget(tg, cpu, rw, true))
+				reclaimed = true;
+	}
+
+	return reclaimed;
+}
+
+/**
+ * throtl_reclaim_budgets - settle the per cpu budgets of @td's groups
+ * @td: throtl_data of interest
+ * @force: settle budgets which haven't expired yet too
+ *
+ * Budget reserved by cpus which stopped issuing IO holds back everybody
+ * else until it is settled.  Expired budgets are reclaimed from the
+ * dispatch timer, all of them before the limits change.  Returns %true
+ * if anything was reclaimed.
+ *
+ * CONTEXT: queue_lock held with irqs disabled.
+ */
+static bool throtl_reclaim_budgets(struct throtl_data *td, bool force)
+{
+	struct throtl_grp *tg, *tmp;
+	bool reclaimed = false;
+	int cpu, rw;
+
+	list_for_each_entry_safe(tg, tmp, &td->budget_list, budget_node)
+		for_each_possible_cpu(cpu)
+			for (rw = READ; rw <= WRITE; rw++)
+				if (throtl_settle_budget(tg, cpu, rw, force))
+					reclaimed = true;
+
+	return reclaimed;
+}
+
+/**
+ * throtl_grant_budget - hand dispatch budget of @tg to the local cpu
+ * @tg: the throtl_grp @bio was just dispatched from without queueing
+ * @bio: the bio
+ *
+ * Reserve budget at @tg and its ancestors and let the local cpu spend it
+ * from blk_throtl_bio() without queue_lock.  The budget is sized by the
+ * rate the cpu spent its previous one at, at least one more bio like
+ * @bio, and capped at each level's slice limit shared among the cpus
+ * holding a budget.  Nothing is granted unless every level can afford
+ * it now.  Only the part which is actually spent gets charged.
+ *
+ * CONTEXT: queue_lock held with irqs disabled.
+ */
+static void throtl_grant_budget(struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+	int cpu = smp_processor_id();
+	struct tg_stats_cpu *stats_cpu;
+	struct throtl_grp *pos;
+	u64 bytes = -1, tmp;
+	unsigned int nr_ios = -1, nr_cpus;
+
+	if (tg->stats_cpu == NULL)
+		return;
+	stats_cpu = per_cpu_ptr(tg->stats_cpu, cpu);
+
+	/* whatever is left of the previous budget of this cpu goes back */
+	throtl_settle_budget(tg, cpu, rw, true);
+	nr_cpus = tg->nr_budget_cpus[rw] + 1;
+
+	/* without history, start from a share of the slice limit */
+	if (stats_cpu->rate_ios[rw]) {
+		bytes = max_t(u64, stats_cpu->rate_bytes[rw],
+			      bio->bi_iter.bi_size);
+		nr_ios = stats_cpu->rate_ios[rw];
+	} else {
+		nr_cpus = max_t(unsigned int, nr_cpus, throtl_budget_share);
+	}
+
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq)) {
+		if (pos->bps[rw] != -1) {
+			tmp = pos->bps[rw] * throtl_slice;
+			do_div(tmp, HZ * nr_cpus);
+			bytes = min(bytes, tmp);
+		}
+		if (pos->iops[rw] != -1) {
+			tmp = (u64)pos->iops[rw] * throtl_slice;
+			do_div(tmp, HZ * nr_cpus);
+			nr_ios = min_t(u64, nr_ios, tmp);
+		}
+	}
+
+	/* limits too low to be worth sharing out */
+	if (bytes < bio->bi_iter.bi_size || !nr_ios)
+		return;
+
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq))
+		if (!tg_may_grant(pos, rw, bytes, nr_ios))
+			return;
+
+	for (pos = tg; pos; pos = sq_to_tg(pos->service_queue.parent_sq)) {
+		if (pos->bps[rw] != -1)
+			pos->bytes_rsv[rw] += bytes;
+		if (pos->iops[rw] != -1)
+			pos->io_rsv[rw] += nr_ios;
+	}
+
+	if (!tg->nr_budget_cpus[READ] && !tg->nr_budget_cpus[WRITE])
+		list_add(&tg->budget_node, &tg->td->budget_list);
+	tg->nr_budget_cpus[rw]++;
+
+	spin_lock(&stats_cpu->budget_lock);
+	stats_cpu->budget_bytes[rw] = bytes;
+	stats_cpu->budget_ios[rw] = nr_ios;
+	stats_cpu->granted_bytes[rw] = bytes;
+	stats_cpu->granted_ios[rw] = nr_ios;
+	stats_cpu->granted_at[rw] = jiffies;
+	spin_unlock(&stats_cpu->budget_lock);
+
+	throtl_log(&tg->service_queue, "[%c] grant cpu=%d bytes=%llu ios=%u",
+		   rw == READ ? 'R' : 'W', cpu, bytes, nr_ios);
+}
+
+/*
+ * Dispatch @bio from the budget @tg granted to the local cpu, if there's
+ * enough of it left.  Called under rcu without queue_lock; the budget
+ * lock is only ever contended by throtl_settle_budget().
+ */
+static bool tg_budget_consume(struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+	unsigned int size = bio->bi_iter.bi_size;
+	struct throtl_service_queue *sq;
+	struct tg_stats_cpu *stats_cpu;
+	unsigned long flags;
+	bool ret = false;
+
+	if (tg->stats_cpu == NULL)
+		return false;
+
+	/* throtl is FIFO - don't overtake bios queued at any level */
+	for (sq = &tg->service_queue; sq; sq = sq->parent_sq)
+		if (sq->nr_queued[rw])
+			return false;
+
+	local_irq_save(flags);
+	stats_cpu = this_cpu_ptr(tg->stats_cpu);
+
+	spin_lock(&stats_cpu->budget_lock);
+	if (stats_cpu->budget_ios[rw] &&
+	    stats_cpu->budget_bytes[rw] >= size &&
+	    time_before(jiffies, stats_cpu->granted_at[rw] + throtl_slice)) {
+		stats_cpu->budget_ios[rw]--;
+		stats_cpu->budget_bytes[rw] -= size;
+		ret = true;
+	}
+	spin_unlock(&stats_cpu->budget_lock);
+
+	if (ret) {
+		blkg_rwstat_add(&stats_cpu->serviced, bio->bi_rw, 1);
+		blkg_rwstat_add(&stats_cpu->service_bytes, bio->bi_rw, size);
+	}
+
+	local_irq_restore(flags);
+	return ret;
+}
+
 /**
  * throtl_add_bio_tg - add a bio to the specified throtl_grp
  * @bio: bio to add
@@ -1204,6 +1557,9 @@ static void throtl_pending_timer_fn(unsigned long arg)
 	int ret;
 
 	spin_lock_irq(q->queue_lock);
+
+	/* expired budgets may be what the queued bios are waiting for */
+	throtl_reclaim_budgets(td, false);
 again:
 	parent_sq = sq->parent_sq;
 	dispatched = false;
@@ -1367,6 +1723,9 @@ static int tg_set_conf(struct cgroup_subsys_state *css, struct cftype *cft,
 	if (!ctx.v)
 		ctx.v = -1;
 
+	/* budgets were reserved against the old limits, settle them first */
+	throtl_reclaim_budgets(tg->td, true);
+
 	if (is_u64)
 		*(u64 *)((void *)tg + cft->private) = ctx.v;
 	else
@@ -1470,6 +1829,7 @@ static struct blkcg_policy blkcg_policy_throtl = {
 
 	.pd_init_fn		= throtl_pd_init,
 	.pd_online_fn		= throtl_pd_online,
+	.pd_offline_fn		= throtl_pd_offline,
 	.pd_exit_fn		= throtl_pd_exit,
 	.pd_reset_stats_fn	= throtl_pd_reset_stats,
 };
@@ -1478,7 +1838,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 {
 	struct throtl_data *td = q->td;
 	struct throtl_qnode *qn = NULL;
-	struct throtl_grp *tg;
+	struct throtl_grp *tg, *leaf_tg;
 	struct throtl_service_queue *sq;
 	bool rw = bio_data_dir(bio);
 	struct blkcg *blkcg;
@@ -1502,6 +1862,10 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 					bio->bi_iter.bi_size, bio->bi_rw);
 			goto out_unlock_rcu;
 		}
+
+		/* within the budget this cpu was granted earlier */
+		if (tg_budget_consume(tg, bio))
+			goto out_unlock_rcu;
 	}
 
 	/*
@@ -1513,6 +1877,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 	if (unlikely(!tg))
 		goto out_unlock;
 
+	leaf_tg = tg;
 	sq = &tg->service_queue;
 
 	while (true) {
@@ -1520,8 +1885,13 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 		if (sq->nr_queued[rw])
 			break;
 
-		/* if above limits, break to queue */
-		if (!tg_may_dispatch(tg, bio, NULL))
+		/*
+		 * If above limits, break to queue.  Budget still reserved by
+		 * other cpus may be what's in the way, settle it first.
+		 */
+		if (!tg_may_dispatch(tg, bio, NULL) &&
+		    (!throtl_reclaim_path(leaf_tg, rw) ||
+		     !tg_may_dispatch(tg, bio, NULL)))
 			break;
 
 		/* within limits, let's charge and dispatch directly */
@@ -1539,6 +1909,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 		 * So keep on trimming slice even if bio is not queued.
 		 */
 		throtl_trim_slice(tg, rw);
+		throtl_settle_expired(tg, rw);
 
 		/*
 		 * @bio passed through this layer without being throttled.
@@ -1548,8 +1919,14 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 		qn = &tg->qnode_on_parent[rw];
 		sq = sq->parent_sq;
 		tg = sq_to_tg(sq);
-		if (!tg)
+		if (!tg) {
+			/*
+			 * Passed every level without waiting, let the
+			 * following bios from this cpu skip queue_lock.
+			 */
+			throtl_grant_budget(leaf_tg, bio);
 			goto out_unlock;
+		}
 	}
 
 	/* out-of-limit, queue to @tg */
@@ -1665,6 +2042,7 @@ int blk_throtl_init(struct request_queue *q)
 
 	INIT_WORK(&td->dispatch_work, blk_throtl_dispatch_work_fn);
 	throtl_service_queue_init(&td->service_queue, NULL);
+	INIT_LIST_HEAD(&td->budget_list);
 
 	q->td = td;
 	td->queue = q;
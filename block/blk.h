@@ -83,8 +83,37 @@ static inline void blk_clear_rq_complete(struct request *rq)
  */
 #define ELV_ON_HASH(rq) ((rq)->cmd_flags & REQ_HASHED)
 
+struct blk_flush_queue {
+	unsigned int		flush_queue_delayed:1;
+	unsigned int		flush_pending_idx:1;
+	unsigned int		flush_running_idx:1;
+	unsigned long		flush_pending_since;
+	struct list_head	flush_queue[2];
+	struct list_head	flush_data_in_flight;
+	struct request		*flush_rq;
+	spinlock_t		mq_flush_lock;
+};
+
+/* q->flush_state bits */
+enum {
+	BLK_FLUSH_DIRTY		= 0,	/* writes completed since last flush */
+};
+
 void blk_insert_flush(struct request *rq);
 void blk_abort_flushes(struct request_queue *q);
+struct blk_flush_queue *blk_alloc_flush_queue(struct request_queue *q,
+		int node, int cmd_size);
+void blk_free_flush_queue(struct blk_flush_queue *fq);
+
+/*
+ * Called for every completed chunk of write data.  The bit is tested
+ * first so that a busy device doesn't bounce the cacheline around.
+ */
+static inline void blk_flush_mark_dirty(struct request_queue *q)
+{
+	if (!test_bit(BLK_FLUSH_DIRTY, &q->flush_state))
+		set_bit(BLK_FLUSH_DIRTY, &q->flush_state);
+}
 
 static inline struct request *__elv_next_request(struct request_queue *q)
 {
@@ -111,9 +140,9 @@ static inline struct request *__elv_next_request(struct request_queue *q)
 		 * should be restarted later. Please see flush_end_io() for
 		 * details.
 		 */
-		if (q->flush_pending_idx != q->flush_running_idx &&
+		if (q->fq->flush_pending_idx != q->fq->flush_running_idx &&
 				!queue_flush_queueable(q)) {
-			q->flush_queue_delayed = 1;
+			q->fq->flush_queue_delayed = 1;
 			return NULL;
 		}
 		if (unlikely(blk_queue_bypass(q)) ||
@@ -253,4 +282,24 @@ static inline int blk_throtl_init(struct request_queue *q) { return 0; }
 static inline void blk_throtl_exit(struct request_queue *q) { }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+/*
+ * Internal proportional share interface
+ */
+#ifdef CONFIG_BLK_CGROUP_IOCOST
+extern bool blk_iocost_bio(struct request_queue *q, struct bio *bio);
+extern void blk_iocost_done(struct request *rq);
+extern void blk_iocost_drain(struct request_queue *q);
+extern int blk_iocost_init(struct request_queue *q);
+extern void blk_iocost_exit(struct request_queue *q);
+#else /* CONFIG_BLK_CGROUP_IOCOST */
+static inline bool blk_iocost_bio(struct request_queue *q, struct bio *bio)
+{
+	return false;
+}
+static inline void blk_iocost_done(struct request *rq) { }
+static inline void blk_iocost_drain(struct request_queue *q) { }
+static inline int blk_iocost_init(struct request_queue *q) { return 0; }
+static inline void blk_iocost_exit(struct request_queue *q) { }
+#endif /* CONFIG_BLK_CGROUP_IOCOST */
+
 #endif /* BLK_INTERNAL_H */
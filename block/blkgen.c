@@ -0,0 +1,899 @@
+/*
+ * blkgen - in-kernel block IO generator
+ *
+ * Submits bios straight to a block device from per-cpu kernel threads, in
+ * the spirit of pktgen, so that drivers and FTLs can be measured without
+ * the syscall, page pinning and scheduling costs a userspace benchmark
+ * adds on top of every IO.
+ *
+ * Interface, all under /proc/blkgen:
+ *
+ *   ctrl           "start", "stop" or "reset" all configured threads;
+ *                  reading it lists the state of every thread.
+ *   kblkgend_<cpu> one workload per thread.  Configure it by writing
+ *                  "<key> <value>" lines, read it for the configuration,
+ *                  the results of the last run and a latency histogram.
+ *
+ *   dev <path>       block device, an empty value clears the workload
+ *   rw <mode>        read, write, randread, randwrite, rw, randrw
+ *   rwmix <pct>      percentage of reads for rw and randrw (default 50)
+ *   bs <bytes>       IO size, multiple of the logical block size
+ *   qd <n>           IOs kept in flight (default 1)
+ *   rate <n>         IOs per second, 0 for as fast as possible
+ *   count <n>        stop after n IOs, 0 for no limit
+ *   runtime <ms>     stop after this long, 0 for no limit
+ *   offset <bytes>   start of the area IO is issued to
+ *   span <bytes>     size of that area, 0 for up to the end of the device
+ *
+ * Sizes accept the usual k/m/g suffixes.  A thread with neither count nor
+ * runtime runs until stopped.  Writes destroy the data on the device.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/cpu.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#define BLKGEN_PROC_DIR		"blkgen"
+#define BLKGEN_MAX_QD		4096
+
+/*
+ * Latency histogram: values below 2^BLKGEN_LAT_SUB_BITS nsecs get a bucket
+ * each, above that every power of two is split into 2^BLKGEN_LAT_SUB_BITS
+ * linear buckets, which keeps the relative error under 12.5%.
+ */
+#define BLKGEN_LAT_SUB_BITS	3
+#define BLKGEN_LAT_SUB		(1 << BLKGEN_LAT_SUB_BITS)
+#define BLKGEN_LAT_BUCKETS	((64 - BLKGEN_LAT_SUB_BITS + 1) * BLKGEN_LAT_SUB)
+
+enum blkgen_state {
+	BLKGEN_IDLE,
+	BLKGEN_RUNNING,
+	BLKGEN_STOPPING,
+};
+
+enum blkgen_rw {
+	BLKGEN_READ,
+	BLKGEN_WRITE,
+	BLKGEN_RANDREAD,
+	BLKGEN_RANDWRITE,
+	BLKGEN_RW,
+	BLKGEN_RANDRW,
+};
+
+static const char * const blkgen_rw_names[] = {
+	[BLKGEN_READ]		= "read",
+	[BLKGEN_WRITE]		= "write",
+	[BLKGEN_RANDREAD]	= "randread",
+	[BLKGEN_RANDWRITE]	= "randwrite",
+	[BLKGEN_RW]		= "rw",
+	[BLKGEN_RANDRW]		= "randrw",
+};
+
+struct blkgen_stats {
+	u64			ios[2];		/* indexed by READ/WRITE */
+	u64			bytes[2];
+	u64			errors;
+	u64			lat_min;
+	u64			lat_max;
+	u64			lat_sum;
+	u64			lat[BLKGEN_LAT_BUCKETS];
+};
+
+struct blkgen_thread {
+	struct list_head	list;
+	struct task_struct	*task;
+	int			cpu;
+	enum blkgen_state	state;
+
+	/* workload, only changed while the thread is idle */
+	char			path[64];
+	enum blkgen_rw		rw;
+	unsigned int		rwmix;
+	unsigned int		bs;
+	unsigned int		qd;
+	u64			rate;
+	u64			count;
+	u64			runtime_ms;
+	u64			offset;
+	u64			span;
+
+	/* run state */
+	struct block_device	*bdev;
+	struct page		**pages;
+	unsigned int		nr_pages;
+	u64			nr_blocks;
+	u64			seq_block;
+	u64			issued;
+	atomic_t		inflight;
+	ktime_t			started;
+	ktime_t			stopped;
+	int			result;
+
+	/* updated from bio completion */
+	spinlock_t		lock;
+	struct blkgen_stats	stats;
+};
+
+/* wraps every bio we submit, see the front_pad of blkgen_bio_set */
+struct blkgen_io {
+	struct blkgen_thread	*t;
+	ktime_t			start;
+	struct bio		bio;
+};
+
+static LIST_HEAD(blkgen_threads);
+static DEFINE_MUTEX(blkgen_mutex);
+static struct proc_dir_entry *blkgen_proc_dir;
+static struct bio_set *blkgen_bio_set;
+
+static unsigned int blkgen_lat_bucket(u64 ns)
+{
+	unsigned int msb;
+
+	if (ns < BLKGEN_LAT_SUB)
+		return ns;
+
+	msb = fls64(ns) - 1;
+	return (msb - BLKGEN_LAT_SUB_BITS + 1) * BLKGEN_LAT_SUB +
+		((ns >> (msb - BLKGEN_LAT_SUB_BITS)) & (BLKGEN_LAT_SUB - 1));
+}
+
+/* lowest latency, in nsecs, accounted to bucket @idx */
+static u64 blkgen_lat_bucket_base(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < BLKGEN_LAT_SUB)
+		return idx;
+
+	shift = idx / BLKGEN_LAT_SUB - 1;
+	return (u64)(BLKGEN_LAT_SUB + idx % BLKGEN_LAT_SUB) << shift;
+}
+
+static bool blkgen_is_random(struct blkgen_thread *t)
+{
+	return t->rw == BLKGEN_RANDREAD || t->rw == BLKGEN_RANDWRITE ||
+		t->rw == BLKGEN_RANDRW;
+}
+
+static int blkgen_pick_dir(struct blkgen_thread *t)
+{
+	switch (t->rw) {
+	case BLKGEN_READ:
+	case BLKGEN_RANDREAD:
+		return READ;
+	case BLKGEN_WRITE:
+	case BLKGEN_RANDWRITE:
+		return WRITE;
+	default:
+		return prandom_u32() % 100 < t->rwmix ? READ : WRITE;
+	}
+}
+
+static bool blkgen_has_writes(struct blkgen_thread *t)
+{
+	switch (t->rw) {
+	case BLKGEN_READ:
+	case BLKGEN_RANDREAD:
+		return false;
+	case BLKGEN_RW:
+	case BLKGEN_RANDRW:
+		return t->rwmix < 100;
+	default:
+		return true;
+	}
+}
+
+static sector_t blkgen_next_sector(struct blkgen_thread *t)
+{
+	u64 block;
+
+	if (blkgen_is_random(t)) {
+		u64 r = ((u64)prandom_u32() << 32) | prandom_u32();
+
+		block = r - div64_u64(r, t->nr_blocks) * t->nr_blocks;
+	} else {
+		block = t->seq_block++;
+		if (t->seq_block == t->nr_blocks)
+			t->seq_block = 0;
+	}
+
+	return (t->offset + block * t->bs) >> 9;
+}
+
+static void blkgen_end_io(struct bio *bio, int error)
+{
+	struct blkgen_io *io = container_of(bio, struct blkgen_io, bio);
+	struct blkgen_thread *t = io->t;
+	u64 lat = ktime_to_ns(ktime_sub(ktime_get(), io->start));
+	int dir = bio_data_dir(bio);
+	unsigned long flags;
+
+	bio_put(bio);
+
+	spin_lock_irqsave(&t->lock, flags);
+	if (error) {
+		t->stats.errors++;
+	} else {
+		t->stats.ios[dir]++;
+		t->stats.bytes[dir] += t->bs;
+		t->stats.lat_sum += lat;
+		t->stats.lat[blkgen_lat_bucket(lat)]++;
+		if (lat < t->stats.lat_min)
+			t->stats.lat_min = lat;
+		if (lat > t->stats.lat_max)
+			t->stats.lat_max = lat;
+	}
+	/* under t->lock so that blkgen_run() can wait for us to let go of t */
+	atomic_dec(&t->inflight);
+	wake_up_process(t->task);
+	spin_unlock_irqrestore(&t->lock, flags);
+}
+
+static int blkgen_submit(struct blkgen_thread *t)
+{
+	unsigned int i, left = t->bs;
+	struct blkgen_io *io;
+	struct bio *bio;
+
+	bio = bio_alloc_bioset(GFP_NOIO, t->nr_pages, blkgen_bio_set);
+	bio->bi_bdev = t->bdev;
+	bio->bi_iter.bi_sector = blkgen_next_sector(t);
+	bio->bi_end_io = blkgen_end_io;
+
+	/*
+	 * All IOs of a thread share one buffer: the contents don't matter,
+	 * only that there is memory to DMA to and from.
+	 */
+	for (i = 0; i < t->nr_pages; i++) {
+		unsigned int len = min_t(unsigned int, left, PAGE_SIZE);
+
+		/* the queue limits were checked in blkgen_prepare() */
+		if (bio_add_page(bio, t->pages[i], len, 0) < len) {
+			bio_put(bio);
+			return -EINVAL;
+		}
+		left -= len;
+	}
+
+	io = container_of(bio, struct blkgen_io, bio);
+	io->t = t;
+	atomic_inc(&t->inflight);
+	t->issued++;
+	io->start = ktime_get();
+	submit_bio(blkgen_pick_dir(t), bio);
+	return 0;
+}
+
+/* Sleep until an IO completes, @until passes or we are told to stop. */
+static void blkgen_wait(struct blkgen_thread *t, ktime_t *until)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (ACCESS_ONCE(t->state) == BLKGEN_RUNNING && !kthread_should_stop()) {
+		if (until)
+			schedule_hrtimeout(until, HRTIMER_MODE_ABS);
+		else if (atomic_read(&t->inflight) >= t->qd)
+			schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static void blkgen_run(struct blkgen_thread *t)
+{
+	ktime_t end = ktime_set(KTIME_SEC_MAX, 0);
+	struct blk_plug plug;
+	int ret;
+
+	t->started = ktime_get();
+	if (t->runtime_ms)
+		end = ktime_add_ms(t->started, t->runtime_ms);
+
+	while (ACCESS_ONCE(t->state) == BLKGEN_RUNNING &&
+	       !kthread_should_stop()) {
+		ktime_t now = ktime_get();
+
+		if (ktime_compare(now, end) >= 0 ||
+		    (t->count && t->issued >= t->count))
+			break;
+
+		if (atomic_read(&t->inflight) >= t->qd) {
+			blkgen_wait(t, NULL);
+			continue;
+		}
+
+		if (t->rate) {
+			ktime_t next = ktime_add_ns(t->started,
+				div64_u64(t->issued * NSEC_PER_SEC, t->rate));
+
+			if (ktime_compare(next, now) > 0) {
+				blkgen_wait(t, &next);
+				continue;
+			}
+		}
+
+		/* fill the queue up in one go, the device sees a batch */
+		blk_start_plug(&plug);
+		do {
+			ret = blkgen_submit(t);
+		} while (!ret && !t->rate && atomic_read(&t->inflight) < t->qd &&
+			 (!t->count || t->issued < t->count));
+		blk_finish_plug(&plug);
+
+		/* a short IO would skew the results, give up on the run */
+		if (ret) {
+			t->result = ret;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	while (atomic_read(&t->inflight)) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		if (atomic_read(&t->inflight))
+			io_schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	/* the last completion may still be waking us up */
+	spin_lock_irq(&t->lock);
+	spin_unlock_irq(&t->lock);
+
+	t->stopped = ktime_get();
+}
+
+static void blkgen_put_resources(struct blkgen_thread *t)
+{
+	unsigned int i;
+
+	if (t->pages) {
+		for (i = 0; i < t->nr_pages; i++)
+			if (t->pages[i])
+				__free_page(t->pages[i]);
+		kfree(t->pages);
+		t->pages = NULL;
+	}
+	if (t->bdev) {
+		blkdev_put(t->bdev, FMODE_READ |
+			   (blkgen_has_writes(t) ? FMODE_WRITE : 0));
+		t->bdev = NULL;
+	}
+}
+
+static int blkgen_thread_fn(void *data)
+{
+	struct blkgen_thread *t = data;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (ACCESS_ONCE(t->state) != BLKGEN_RUNNING) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		blkgen_run(t);
+
+		mutex_lock(&blkgen_mutex);
+		blkgen_put_resources(t);
+		t->state = BLKGEN_IDLE;
+		mutex_unlock(&blkgen_mutex);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* Open the device and allocate buffers for a run.  Called idle. */
+static int blkgen_prepare(struct blkgen_thread *t)
+{
+	fmode_t mode = FMODE_READ | (blkgen_has_writes(t) ? FMODE_WRITE : 0);
+	struct request_queue *q;
+	u64 size;
+	unsigned int i;
+
+	t->bdev = blkdev_get_by_path(t->path, mode, NULL);
+	if (IS_ERR(t->bdev)) {
+		int ret = PTR_ERR(t->bdev);
+
+		t->bdev = NULL;
+		return ret;
+	}
+
+	/* every IO is a single bio of one segment per page */
+	q = bdev_get_queue(t->bdev);
+	t->nr_pages = DIV_ROUND_UP(t->bs, PAGE_SIZE);
+	if (t->bs % bdev_logical_block_size(t->bdev) ||
+	    t->bs > queue_max_sectors(q) << 9 ||
+	    t->nr_pages > min_t(unsigned int, queue_max_segments(q),
+				BIO_MAX_PAGES) ||
+	    t->offset % bdev_logical_block_size(t->bdev))
+		goto invalid;
+
+	size = i_size_read(t->bdev->bd_inode);
+	if (t->offset >= size)
+		goto invalid;
+	t->nr_blocks = div_u64(t->span ? : size - t->offset, t->bs);
+	if (!t->nr_blocks || t->offset + t->nr_blocks * t->bs > size)
+		goto invalid;
+
+	t->pages = kcalloc(t->nr_pages, sizeof(*t->pages), GFP_KERNEL);
+	if (!t->pages)
+		goto nomem;
+	for (i = 0; i < t->nr_pages; i++) {
+		t->pages[i] = alloc_pages_node(cpu_to_node(t->cpu),
+					       GFP_KERNEL | __GFP_ZERO, 0);
+		if (!t->pages[i])
+			goto nomem;
+	}
+
+	t->seq_block = 0;
+	t->issued = 0;
+	t->result = 0;
+	memset(&t->stats, 0, sizeof(t->stats));
+	t->stats.lat_min = U64_MAX;
+	return 0;
+
+invalid:
+	blkgen_put_resources(t);
+	return -EINVAL;
+nomem:
+	blkgen_put_resources(t);
+	return -ENOMEM;
+}
+
+static void blkgen_start_all(void)
+{
+	struct blkgen_thread *t;
+
+	mutex_lock(&blkgen_mutex);
+	list_for_each_entry(t, &blkgen_threads, list) {
+		if (!t->path[0] || t->state != BLKGEN_IDLE)
+			continue;
+
+		t->result = blkgen_prepare(t);
+		if (t->result) {
+			pr_warn("%s: cannot start on %s: %d\n",
+				t->task->comm, t->path, t->result);
+			continue;
+		}
+		t->state = BLKGEN_RUNNING;
+		wake_up_process(t->task);
+	}
+	mutex_unlock(&blkgen_mutex);
+}
+
+static void blkgen_stop_all(void)
+{
+	struct blkgen_thread *t;
+
+	mutex_lock(&blkgen_mutex);
+	list_for_each_entry(t, &blkgen_threads, list) {
+		if (t->state == BLKGEN_RUNNING) {
+			t->state = BLKGEN_STOPPING;
+			wake_up_process(t->task);
+		}
+	}
+	mutex_unlock(&blkgen_mutex);
+}
+
+static void blkgen_reset_thread(struct blkgen_thread *t)
+{
+	blkgen_put_resources(t);
+	t->path[0] = '\0';
+	t->rw = BLKGEN_RANDREAD;
+	t->rwmix = 50;
+	t->bs = 4096;
+	t->qd = 1;
+	t->rate = 0;
+	t->count = 0;
+	t->runtime_ms = 0;
+	t->offset = 0;
+	t->span = 0;
+	t->result = 0;
+	t->started = t->stopped = ktime_set(0, 0);
+	memset(&t->stats, 0, sizeof(t->stats));
+}
+
+/* Returns false if some thread was busy and has been left alone. */
+static bool blkgen_reset_all(void)
+{
+	struct blkgen_thread *t;
+	bool ok = true;
+
+	mutex_lock(&blkgen_mutex);
+	list_for_each_entry(t, &blkgen_threads, list) {
+		if (t->state != BLKGEN_IDLE) {
+			ok = false;
+			continue;
+		}
+		blkgen_reset_thread(t);
+	}
+	mutex_unlock(&blkgen_mutex);
+
+	return ok;
+}
+
+static const char *blkgen_state_name(struct blkgen_thread *t)
+{
+	switch (t->state) {
+	case BLKGEN_RUNNING:
+		return "running";
+	case BLKGEN_STOPPING:
+		return "stopping";
+	default:
+		return "idle";
+	}
+}
+
+static int blkgen_ctrl_show(struct seq_file *seq, void *v)
+{
+	struct blkgen_thread *t;
+
+	mutex_lock(&blkgen_mutex);
+	list_for_each_entry(t, &blkgen_threads, list)
+		seq_printf(seq, "%s: %s %s\n", t->task->comm,
+			   blkgen_state_name(t), t->path[0] ? t->path : "-");
+	mutex_unlock(&blkgen_mutex);
+
+	return 0;
+}
+
+static ssize_t blkgen_ctrl_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	char data[16], *cmd;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (count == 0 || count >= sizeof(data))
+		return -EINVAL;
+	if (copy_from_user(data, buf, count))
+		return -EFAULT;
+	data[count] = '\0';
+	cmd = strim(data);
+
+	if (!strcmp(cmd, "start"))
+		blkgen_start_all();
+	else if (!strcmp(cmd, "stop"))
+		blkgen_stop_all();
+	else if (!strcmp(cmd, "reset")) {
+		if (!blkgen_reset_all())
+			return -EBUSY;
+	} else
+		return -EINVAL;
+
+	return count;
+}
+
+static int blkgen_ctrl_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, blkgen_ctrl_show, NULL);
+}
+
+static const struct file_operations blkgen_ctrl_fops = {
+	.owner		= THIS_MODULE,
+	.open		= blkgen_ctrl_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= blkgen_ctrl_write,
+	.release	= single_release,
+};
+
+/* latency, in nsecs, below which @pct permille of the IOs completed */
+static u64 blkgen_lat_percentile(struct blkgen_stats *st, u64 total,
+				 unsigned int permille)
+{
+	u64 want = div_u64(total * permille + 999, 1000), seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < BLKGEN_LAT_BUCKETS; i++) {
+		seen += st->lat[i];
+		if (seen >= want)
+			return blkgen_lat_bucket_base(i + 1);
+	}
+	return st->lat_max;
+}
+
+static int blkgen_thread_show(struct seq_file *seq, void *v)
+{
+	struct blkgen_thread *t = seq->private;
+	struct blkgen_stats *st;
+	u64 total, elapsed_us, usecs;
+	unsigned long flags;
+	unsigned int i;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+
+	mutex_lock(&blkgen_mutex);
+	seq_printf(seq, "Config: dev %s rw %s rwmix %u bs %u qd %u rate %llu count %llu runtime %llu offset %llu span %llu\n",
+		   t->path[0] ? t->path : "-", blkgen_rw_names[t->rw],
+		   t->rwmix, t->bs, t->qd, t->rate, t->count, t->runtime_ms,
+		   t->offset, t->span);
+	seq_printf(seq, "State: %s", blkgen_state_name(t));
+	if (t->result)
+		seq_printf(seq, " (error %d)", t->result);
+	seq_puts(seq, "\n");
+
+	spin_lock_irqsave(&t->lock, flags);
+	*st = t->stats;
+	spin_unlock_irqrestore(&t->lock, flags);
+
+	if (t->state == BLKGEN_IDLE)
+		elapsed_us = ktime_us_delta(t->stopped, t->started);
+	else
+		elapsed_us = ktime_us_delta(ktime_get(), t->started);
+	mutex_unlock(&blkgen_mutex);
+
+	total = st->ios[READ] + st->ios[WRITE];
+	usecs = max_t(u64, elapsed_us, 1);
+	seq_printf(seq, "Result: reads %llu writes %llu errors %llu elapsed_us %llu\n",
+		   st->ios[READ], st->ios[WRITE], st->errors, elapsed_us);
+	seq_printf(seq, "  iops %llu read_kBps %llu write_kBps %llu\n",
+		   div64_u64(total * USEC_PER_SEC, usecs),
+		   div64_u64(st->bytes[READ] * USEC_PER_SEC, usecs * 1024),
+		   div64_u64(st->bytes[WRITE] * USEC_PER_SEC, usecs * 1024));
+
+	if (total) {
+		seq_printf(seq, "Latency(ns): min %llu avg %llu max %llu p50 %llu p90 %llu p99 %llu p99.9 %llu\n",
+			   st->lat_min, div64_u64(st->lat_sum, total),
+			   st->lat_max,
+			   blkgen_lat_percentile(st, total, 500),
+			   blkgen_lat_percentile(st, total, 900),
+			   blkgen_lat_percentile(st, total, 990),
+			   blkgen_lat_percentile(st, total, 999));
+		seq_puts(seq, "Histogram(ns):\n");
+		for (i = 0; i < BLKGEN_LAT_BUCKETS; i++) {
+			if (!st->lat[i])
+				continue;
+			seq_printf(seq, "  %12llu - %12llu: %llu\n",
+				   blkgen_lat_bucket_base(i),
+				   blkgen_lat_bucket_base(i + 1) - 1,
+				   st->lat[i]);
+		}
+	}
+
+	kfree(st);
+	return 0;
+}
+
+static int blkgen_set_size(const char *val, u64 *res)
+{
+	char *end;
+
+	*res = memparse(val, &end);
+	return *end ? -EINVAL : 0;
+}
+
+/* Apply one "<key> <value>" line.  Called with blkgen_mutex held. */
+static int blkgen_set(struct blkgen_thread *t, const char *key,
+		      const char *val)
+{
+	unsigned int i, uval;
+	u64 v;
+	int ret;
+
+	if (!strcmp(key, "dev")) {
+		if (strlen(val) >= sizeof(t->path))
+			return -ENAMETOOLONG;
+		strcpy(t->path, val);
+		return 0;
+	}
+	if (!strcmp(key, "rw")) {
+		for (i = 0; i < ARRAY_SIZE(blkgen_rw_names); i++) {
+			if (!strcmp(val, blkgen_rw_names[i])) {
+				t->rw = i;
+				return 0;
+			}
+		}
+		return -EINVAL;
+	}
+	if (!strcmp(key, "rwmix")) {
+		ret = kstrtouint(val, 0, &uval);
+		if (ret)
+			return ret;
+		if (uval > 100)
+			return -EINVAL;
+		t->rwmix = uval;
+		return 0;
+	}
+	if (!strcmp(key, "qd")) {
+		ret = kstrtouint(val, 0, &uval);
+		if (ret)
+			return ret;
+		if (!uval || uval > BLKGEN_MAX_QD)
+			return -EINVAL;
+		t->qd = uval;
+		return 0;
+	}
+	if (!strcmp(key, "rate"))
+		return kstrtou64(val, 0, &t->rate);
+	if (!strcmp(key, "count"))
+		return kstrtou64(val, 0, &t->count);
+	if (!strcmp(key, "runtime"))
+		return kstrtou64(val, 0, &t->runtime_ms);
+	if (!strcmp(key, "offset"))
+		return blkgen_set_size(val, &t->offset);
+	if (!strcmp(key, "span"))
+		return blkgen_set_size(val, &t->span);
+	if (!strcmp(key, "bs")) {
+		ret = blkgen_set_size(val, &v);
+		if (ret)
+			return ret;
+		if (!v || v & 511 || v > BIO_MAX_PAGES * PAGE_SIZE)
+			return -EINVAL;
+		t->bs = v;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t blkgen_thread_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct blkgen_thread *t = ((struct seq_file *)file->private_data)->private;
+	char data[128], *key, *val;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (count == 0 || count >= sizeof(data))
+		return -EINVAL;
+	if (copy_from_user(data, buf, count))
+		return -EFAULT;
+	data[count] = '\0';
+
+	val = strim(data);
+	key = strsep(&val, " \t");
+	val = val ? skip_spaces(val) : "";
+
+	mutex_lock(&blkgen_mutex);
+	if (t->state != BLKGEN_IDLE)
+		ret = -EBUSY;
+	else
+		ret = blkgen_set(t, key, val);
+	mutex_unlock(&blkgen_mutex);
+
+	return ret ? ret : count;
+}
+
+static int blkgen_thread_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, blkgen_thread_show, PDE_DATA(inode));
+}
+
+static const struct file_operations blkgen_thread_fops = {
+	.owner		= THIS_MODULE,
+	.open		= blkgen_thread_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.write		= blkgen_thread_write,
+	.release	= single_release,
+};
+
+static int __init blkgen_create_thread(int cpu)
+{
+	struct blkgen_thread *t;
+	struct task_struct *p;
+
+	t = kzalloc_node(sizeof(*t), GFP_KERNEL, cpu_to_node(cpu));
+	if (!t)
+		return -ENOMEM;
+
+	t->cpu = cpu;
+	spin_lock_init(&t->lock);
+	atomic_set(&t->inflight, 0);
+	blkgen_reset_thread(t);
+
+	p = kthread_create_on_node(blkgen_thread_fn, t, cpu_to_node(cpu),
+				   "kblkgend_%d", cpu);
+	if (IS_ERR(p)) {
+		kfree(t);
+		return PTR_ERR(p);
+	}
+	kthread_bind(p, cpu);
+	t->task = p;
+
+	if (!proc_create_data(p->comm, 0600, blkgen_proc_dir,
+			      &blkgen_thread_fops, t)) {
+		kthread_stop(p);
+		kfree(t);
+		return -ENOMEM;
+	}
+
+	list_add_tail(&t->list, &blkgen_threads);
+	wake_up_process(p);
+	return 0;
+}
+
+static void blkgen_destroy_threads(void)
+{
+	struct blkgen_thread *t, *next;
+
+	blkgen_stop_all();
+
+	list_for_each_entry_safe(t, next, &blkgen_threads, list) {
+		remove_proc_entry(t->task->comm, blkgen_proc_dir);
+		kthread_stop(t->task);
+		blkgen_put_resources(t);
+		list_del(&t->list);
+		kfree(t);
+	}
+}
+
+static int __init blkgen_init(void)
+{
+	int cpu, ret = -ENOMEM;
+
+	blkgen_bio_set = bioset_create(BIO_POOL_SIZE,
+				       offsetof(struct blkgen_io, bio));
+	if (!blkgen_bio_set)
+		return -ENOMEM;
+
+	blkgen_proc_dir = proc_mkdir(BLKGEN_PROC_DIR, NULL);
+	if (!blkgen_proc_dir)
+		goto free_bioset;
+
+	if (!proc_create("ctrl", 0600, blkgen_proc_dir, &blkgen_ctrl_fops))
+		goto remove_dir;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		ret = blkgen_create_thread(cpu);
+		if (ret) {
+			pr_warn("cannot create thread for cpu %d: %d\n",
+				cpu, ret);
+			break;
+		}
+	}
+	put_online_cpus();
+
+	if (list_empty(&blkgen_threads)) {
+		ret = ret ? : -ENODEV;
+		goto remove_ctrl;
+	}
+
+	pr_info("%d threads, see /proc/%s\n", num_online_cpus(),
+		BLKGEN_PROC_DIR);
+	return 0;
+
+remove_ctrl:
+	remove_proc_entry("ctrl", blkgen_proc_dir);
+remove_dir:
+	remove_proc_entry(BLKGEN_PROC_DIR, NULL);
+free_bioset:
+	bioset_free(blkgen_bio_set);
+	return ret;
+}
+
+static void __exit blkgen_exit(void)
+{
+	blkgen_destroy_threads();
+	remove_proc_entry("ctrl", blkgen_proc_dir);
+	remove_proc_entry(BLKGEN_PROC_DIR, NULL);
+	bioset_free(blkgen_bio_set);
+}
+
+module_init(blkgen_init);
+module_exit(blkgen_exit);
+
+MODULE_DESCRIPTION("In-kernel block IO generator");
+MODULE_LICENSE("GPL");
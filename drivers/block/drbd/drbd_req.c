@@ -39,7 +39,7 @@ static void _drbd_start_io_acct(struct drbd_device *device, struct drbd_request
 	const int rw = bio_data_dir(req->master_bio);
 	int cpu;
 	cpu = part_stat_lock();
-	part_round_stats(cpu, &device->vdisk->part0);
+	part_update_io_ticks(cpu, &device->vdisk->part0, false);
 	part_stat_inc(cpu, &device->vdisk->part0, ios[rw]);
 	part_stat_add(cpu, &device->vdisk->part0, sectors[rw], req->i.size >> 9);
 	(void) cpu; /* The macro invocations above want the cpu argument, I do not like
@@ -56,7 +56,8 @@ static void _drbd_end_io_acct(struct drbd_device *device, struct drbd_request *r
 	int cpu;
 	cpu = part_stat_lock();
 	part_stat_add(cpu, &device->vdisk->part0, ticks[rw], duration);
-	part_round_stats(cpu, &device->vdisk->part0);
+	part_stat_add(cpu, &device->vdisk->part0, time_in_queue, duration);
+	part_update_io_ticks(cpu, &device->vdisk->part0, true);
 	part_dec_in_flight(&device->vdisk->part0, rw);
 	part_stat_unlock();
 }
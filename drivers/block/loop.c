@@ -70,7 +70,6 @@
 #include <linux/writeback.h>
 #include <linux/completion.h>
 #include <linux/highmem.h>
-#include <linux/kthread.h>
 #include <linux/splice.h>
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
@@ -411,222 +410,330 @@ lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 	return 0;
 }
 
-static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
+static int lo_req_flush(struct loop_device *lo)
 {
-	loff_t pos;
+	struct file *file = lo->lo_backing_file;
+	int ret = vfs_fsync(file, 0);
+
+	if (unlikely(ret && ret != -EINVAL))
+		ret = -EIO;
+
+	return ret;
+}
+
+static int lo_discard(struct loop_device *lo, struct request *rq, loff_t pos)
+{
+	/*
+	 * We use punch hole to reclaim the free space used by the
+	 * image a.k.a. discard. However we do not support discard if
+	 * encryption is enabled, because it may give an attacker
+	 * useful information.
+	 */
+	struct file *file = lo->lo_backing_file;
+	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
 	int ret;
 
-	pos = ((loff_t) bio->bi_iter.bi_sector << 9) + lo->lo_offset;
+	if ((!file->f_op->fallocate) || lo->lo_encrypt_key_size)
+		return -EOPNOTSUPP;
 
-	if (bio_rw(bio) == WRITE) {
-		struct file *file = lo->lo_backing_file;
+	ret = file->f_op->fallocate(file, mode, pos, blk_rq_bytes(rq));
+	if (unlikely(ret && ret != -EINVAL && ret != -EOPNOTSUPP))
+		ret = -EIO;
 
-		if (bio->bi_rw & REQ_FLUSH) {
-			ret = vfs_fsync(file, 0);
-			if (unlikely(ret && ret != -EINVAL)) {
-				ret = -EIO;
-				goto out;
-			}
-		}
+	return ret;
+}
 
-		/*
-		 * We use punch hole to reclaim the free space used by the
-		 * image a.k.a. discard. However we do not support discard if
-		 * encryption is enabled, because it may give an attacker
-		 * useful information.
-		 */
-		if (bio->bi_rw & REQ_DISCARD) {
-			struct file *file = lo->lo_backing_file;
-			int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
-
-			if ((!file->f_op->fallocate) ||
-			    lo->lo_encrypt_key_size) {
-				ret = -EOPNOTSUPP;
-				goto out;
-			}
-			ret = file->f_op->fallocate(file, mode, pos,
-						    bio->bi_iter.bi_size);
-			if (unlikely(ret && ret != -EINVAL &&
-				     ret != -EOPNOTSUPP))
-				ret = -EIO;
-			goto out;
-		}
+static int do_req_filebacked(struct loop_device *lo, struct request *rq)
+{
+	struct bio *bio;
+	loff_t pos;
+	int ret = 0;
+
+	pos = ((loff_t) blk_rq_pos(rq) << 9) + lo->lo_offset;
+
+	if (rq->cmd_flags & REQ_WRITE) {
+		if (rq->cmd_flags & REQ_FLUSH)
+			return lo_req_flush(lo);
 
-		ret = lo_send(lo, bio, pos);
+		if (rq->cmd_flags & REQ_DISCARD)
+			return lo_discard(lo, rq, pos);
 
-		if ((bio->bi_rw & REQ_FUA) && !ret) {
-			ret = vfs_fsync(file, 0);
-			if (unlikely(ret && ret != -EINVAL))
-				ret = -EIO;
+		__rq_for_each_bio(bio, rq) {
+			ret = lo_send(lo, bio, pos);
+			if (ret < 0)
+				break;
+			pos += bio->bi_iter.bi_size;
 		}
-	} else
-		ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
+	} else {
+		__rq_for_each_bio(bio, rq) {
+			ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
+			if (ret < 0)
+				break;
+			pos += bio->bi_iter.bi_size;
+		}
+	}
 
-out:
 	return ret;
 }
 
-/*
- * Add bio to back of pending list
- */
-static void loop_add_bio(struct loop_device *lo, struct bio *bio)
+static void lo_rw_dio_endio(struct bio *bio, int error)
 {
-	lo->lo_bio_count++;
-	bio_list_add(&lo->lo_bio_list, bio);
+	struct loop_cmd *cmd = bio->bi_private;
+
+	if (error)
+		cmd->ret = error;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&cmd->ref))
+		blk_mq_complete_request(cmd->rq);
 }
 
 /*
- * Grab first pending buffer
+ * Direct I/O to a block device backing store. Every bio of the request is
+ * cloned, remapped by the loop offset and submitted to the backing device,
+ * so the data pages are handed down without a copy and without going
+ * through the page cache of the backing device. The request is completed
+ * once the last clone has completed.
  */
-static struct bio *loop_get_bio(struct loop_device *lo)
-{
-	lo->lo_bio_count--;
-	return bio_list_pop(&lo->lo_bio_list);
+static void lo_rw_dio(struct loop_device *lo, struct loop_cmd *cmd)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+	sector_t offset = lo->lo_offset >> 9;
+	struct request *rq = cmd->rq;
+	struct blk_plug plug;
+	struct bio *bio, *clone;
+
+	cmd->ret = 0;
+	atomic_set(&cmd->ref, 1);
+
+	blk_start_plug(&plug);
+	__rq_for_each_bio(bio, rq) {
+		clone = bio_clone_fast(bio, GFP_NOIO, lo->lo_bio_set);
+		if (unlikely(!clone)) {
+			cmd->ret = -ENOMEM;
+			break;
+		}
+
+		/* the loop queue runs its own flush sequence */
+		clone->bi_rw &= ~(REQ_FLUSH | REQ_FUA);
+		clone->bi_bdev = inode->i_bdev;
+		clone->bi_iter.bi_sector += offset;
+		clone->bi_end_io = lo_rw_dio_endio;
+		clone->bi_private = cmd;
+
+		atomic_inc(&cmd->ref);
+		submit_bio(clone->bi_rw, clone);
+	}
+	blk_finish_plug(&plug);
+
+	if (atomic_dec_and_test(&cmd->ref))
+		blk_mq_complete_request(rq);
 }
 
-static void loop_make_request(struct request_queue *q, struct bio *old_bio)
+static void loop_handle_cmd(struct loop_cmd *cmd)
 {
-	struct loop_device *lo = q->queuedata;
-	int rw = bio_rw(old_bio);
+	struct request *rq = cmd->rq;
+	struct loop_device *lo = rq->q->queuedata;
+	int ret = -EIO;
 
-	if (rw == READA)
-		rw = READ;
+	if ((rq->cmd_flags & REQ_WRITE) && (lo->lo_flags & LO_FLAGS_READ_ONLY))
+		goto failed;
 
-	BUG_ON(!lo || (rw != READ && rw != WRITE));
+	if (lo->use_dio && !(rq->cmd_flags & (REQ_FLUSH | REQ_DISCARD))) {
+		lo_rw_dio(lo, cmd);
+		return;
+	}
+
+	ret = do_req_filebacked(lo, rq);
+failed:
+	cmd->ret = ret;
+	blk_mq_complete_request(rq);
+}
+
+/*
+ * Buffered writes to the backing file are issued in order from a single
+ * work item, as concurrent writers would only serialise on the backing
+ * inode anyway. Reads and direct I/O run from per-command work items, up
+ * to the queue depth at once.
+ */
+static void loop_queue_write_work(struct work_struct *work)
+{
+	struct loop_device *lo =
+		container_of(work, struct loop_device, write_work);
+	LIST_HEAD(cmd_list);
 
 	spin_lock_irq(&lo->lo_lock);
-	if (lo->lo_state != Lo_bound)
-		goto out;
-	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
-		goto out;
-	if (lo->lo_bio_count >= q->nr_congestion_on)
-		wait_event_lock_irq(lo->lo_req_wait,
-				    lo->lo_bio_count < q->nr_congestion_off,
-				    lo->lo_lock);
-	loop_add_bio(lo, old_bio);
-	wake_up(&lo->lo_event);
+repeat:
+	list_splice_init(&lo->write_cmd_head, &cmd_list);
 	spin_unlock_irq(&lo->lo_lock);
-	return;
 
-out:
-	spin_unlock_irq(&lo->lo_lock);
-	bio_io_error(old_bio);
-}
+	while (!list_empty(&cmd_list)) {
+		struct loop_cmd *cmd = list_first_entry(&cmd_list,
+				struct loop_cmd, list);
 
-struct switch_request {
-	struct file *file;
-	struct completion wait;
-};
+		list_del_init(&cmd->list);
+		loop_handle_cmd(cmd);
+	}
 
-static void do_loop_switch(struct loop_device *, struct switch_request *);
+	spin_lock_irq(&lo->lo_lock);
+	if (!list_empty(&lo->write_cmd_head))
+		goto repeat;
+	lo->write_started = false;
+	spin_unlock_irq(&lo->lo_lock);
+}
 
-static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
+static void loop_queue_read_work(struct work_struct *work)
 {
-	if (unlikely(!bio->bi_bdev)) {
-		do_loop_switch(lo, bio->bi_private);
-		bio_put(bio);
-	} else {
-		int ret = do_bio_filebacked(lo, bio);
-		bio_endio(bio, ret);
-	}
+	struct loop_cmd *cmd =
+		container_of(work, struct loop_cmd, read_work);
+
+	loop_handle_cmd(cmd);
 }
 
-/*
- * worker thread that handles reads/writes to file backed loop devices,
- * to avoid blocking in our make_request_fn. it also does loop decrypting
- * on reads for block backed loop, as that is too heavy to do from
- * b_end_io context where irqs may be disabled.
- *
- * Loop explanation:  loop_clr_fd() sets lo_state to Lo_rundown before
- * calling kthread_stop().  Therefore once kthread_should_stop() is
- * true, make_request will not place any more requests.  Therefore
- * once kthread_should_stop() is true and lo_bio is NULL, we are
- * done with the loop.
- */
-static int loop_thread(void *data)
+static int loop_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
 {
-	struct loop_device *lo = data;
-	struct bio *bio;
+	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct loop_device *lo = rq->q->queuedata;
+	bool need_sched = true;
 
-	set_user_nice(current, MIN_NICE);
+	if (lo->lo_state != Lo_bound)
+		return BLK_MQ_RQ_QUEUE_ERROR;
 
-	while (!kthread_should_stop() || !bio_list_empty(&lo->lo_bio_list)) {
+	if (!(rq->cmd_flags & REQ_WRITE) || lo->use_dio) {
+		queue_work(lo->wq, &cmd->read_work);
+		return BLK_MQ_RQ_QUEUE_OK;
+	}
 
-		wait_event_interruptible(lo->lo_event,
-				!bio_list_empty(&lo->lo_bio_list) ||
-				kthread_should_stop());
+	spin_lock_irq(&lo->lo_lock);
+	if (lo->write_started)
+		need_sched = false;
+	else
+		lo->write_started = true;
+	list_add_tail(&cmd->list, &lo->write_cmd_head);
+	spin_unlock_irq(&lo->lo_lock);
 
-		if (bio_list_empty(&lo->lo_bio_list))
-			continue;
-		spin_lock_irq(&lo->lo_lock);
-		bio = loop_get_bio(lo);
-		if (lo->lo_bio_count < lo->lo_queue->nr_congestion_off)
-			wake_up(&lo->lo_req_wait);
-		spin_unlock_irq(&lo->lo_lock);
+	if (need_sched)
+		queue_work(lo->wq, &lo->write_work);
 
-		BUG_ON(!bio);
-		loop_handle_bio(lo, bio);
-	}
+	return BLK_MQ_RQ_QUEUE_OK;
+}
 
-	return 0;
+static void loop_softirq_done_fn(struct request *rq)
+{
+	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	blk_mq_end_io(rq, cmd->ret);
 }
 
-/*
- * loop_switch performs the hard work of switching a backing store.
- * First it needs to flush existing IO, it does this by sending a magic
- * BIO down the pipe. The completion of this BIO does the actual switch.
- */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int loop_init_request(void *data, struct request *rq,
+		unsigned int hctx_idx, unsigned int request_idx,
+		unsigned int numa_node)
 {
-	struct switch_request w;
-	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
-	if (!bio)
-		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
-	bio->bi_bdev = NULL;
-	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
+	struct loop_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->rq = rq;
+	INIT_LIST_HEAD(&cmd->list);
+	INIT_WORK(&cmd->read_work, loop_queue_read_work);
+
 	return 0;
 }
 
+static struct blk_mq_ops loop_mq_ops = {
+	.queue_rq	= loop_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.init_request	= loop_init_request,
+	.complete	= loop_softirq_done_fn,
+};
+
 /*
- * Helper to flush the IOs in loop, but keeping loop thread running
+ * Direct I/O is done by remapping bios onto a block device backing store,
+ * so it needs an untransformed data path and a loop offset aligned to the
+ * backing device's logical block size. Otherwise we stay with buffered
+ * I/O. Once on, the loop queue takes on the backing device's limits, so
+ * the remapped bios are nothing the backing device can't take as is.
  */
-static int loop_flush(struct loop_device *lo)
+static void __loop_update_dio(struct loop_device *lo, bool dio)
 {
-	/* loop not yet configured, no running thread, nothing to flush */
-	if (!lo->lo_thread)
-		return 0;
+	struct file *file = lo->lo_backing_file;
+	struct inode *inode = file->f_mapping->host;
+	unsigned short bsize = 0;
+	bool use_dio;
+
+	if (S_ISBLK(inode->i_mode))
+		bsize = bdev_logical_block_size(inode->i_bdev);
+
+	use_dio = dio && bsize && lo->transfer == transfer_none &&
+		!(lo->lo_offset & (bsize - 1));
+
+	if (lo->use_dio == use_dio)
+		return;
 
-	return loop_switch(lo, NULL);
+	/* write back dirty pages before switching between the two paths */
+	vfs_fsync(file, 0);
+
+	blk_mq_freeze_queue(lo->lo_queue);
+	lo->use_dio = use_dio;
+	if (use_dio) {
+		blk_queue_stack_limits(lo->lo_queue,
+				       bdev_get_queue(inode->i_bdev));
+		blk_queue_logical_block_size(lo->lo_queue, bsize);
+		invalidate_mapping_pages(file->f_mapping, 0, -1);
+		lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	} else {
+		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	}
+	blk_mq_unfreeze_queue(lo->lo_queue);
+}
+
+static void loop_update_dio(struct loop_device *lo)
+{
+	__loop_update_dio(lo, (lo->lo_backing_file->f_flags & O_DIRECT) ||
+			lo->use_dio);
 }
 
 /*
- * Do the actual switch; called from the BIO completion routine
+ * loop_switch performs the hard work of switching a backing store.
+ * The queue is frozen first, so no request is in flight against the
+ * old backing file while it is replaced.  Direct I/O is turned off
+ * along with it and then re-evaluated for the new backing file.
  */
-static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
+static int loop_switch(struct loop_device *lo, struct file *file)
 {
-	struct file *file = p->file;
 	struct file *old_file = lo->lo_backing_file;
-	struct address_space *mapping;
+	struct address_space *mapping = file->f_mapping;
+	bool dio = lo->use_dio;
 
-	/* if no new file, only flush of queued bios requested */
-	if (!file)
-		goto out;
+	blk_mq_freeze_queue(lo->lo_queue);
 
-	mapping = file->f_mapping;
 	mapping_set_gfp_mask(old_file->f_mapping, lo->old_gfp_mask);
 	lo->lo_backing_file = file;
 	lo->lo_blocksize = S_ISBLK(mapping->host->i_mode) ?
 		mapping->host->i_bdev->bd_block_size : PAGE_SIZE;
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
-out:
-	complete(&p->wait);
+	lo->use_dio = false;
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+
+	blk_mq_unfreeze_queue(lo->lo_queue);
+
+	__loop_update_dio(lo, dio || (file->f_flags & O_DIRECT));
+
+	return 0;
 }
 
+/*
+ * Helper to flush the IOs in loop, but keeping the device configured
+ */
+static int loop_flush(struct loop_device *lo)
+{
+	/* loop not yet configured, nothing to flush */
+	if (lo->lo_state != Lo_bound)
+		return 0;
+
+	blk_mq_freeze_queue(lo->lo_queue);
+	blk_mq_unfreeze_queue(lo->lo_queue);
+	return 0;
+}
 
 /*
  * loop_change_fd switched the backing store of a loopback device to
@@ -759,11 +866,19 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -771,6 +886,7 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -889,11 +1005,13 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	lo->transfer = transfer_none;
 	lo->ioctl = NULL;
 	lo->lo_sizelimit = 0;
-	lo->lo_bio_count = 0;
+	lo->use_dio = false;
+	lo->write_started = false;
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask & ~(__GFP_IO|__GFP_FS));
 
-	bio_list_init(&lo->lo_bio_list);
+	INIT_LIST_HEAD(&lo->write_cmd_head);
+	INIT_WORK(&lo->write_work, loop_queue_write_work);
 
 	if (!(lo_flags & LO_FLAGS_READ_ONLY) && file->f_op->fsync)
 		blk_queue_flush(lo->lo_queue, REQ_FLUSH);
@@ -906,14 +1024,15 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 
 	set_blocksize(bdev, lo_blocksize);
 
-	lo->lo_thread = kthread_create(loop_thread, lo, "loop%d",
-						lo->lo_number);
-	if (IS_ERR(lo->lo_thread)) {
-		error = PTR_ERR(lo->lo_thread);
+	lo->wq = alloc_workqueue("kloopd%d",
+			WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_UNBOUND,
+			lo->tag_set.queue_depth, lo->lo_number);
+	if (!lo->wq) {
+		error = -ENOMEM;
 		goto out_clr;
 	}
 	lo->lo_state = Lo_bound;
-	wake_up_process(lo->lo_thread);
+	loop_update_dio(lo);
 	if (part_shift)
 		lo->lo_flags |= LO_FLAGS_PARTSCAN;
 	if (lo->lo_flags & LO_FLAGS_PARTSCAN)
@@ -927,7 +1046,6 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 
 out_clr:
 	loop_sysfs_exit(lo);
-	lo->lo_thread = NULL;
 	lo->lo_device = NULL;
 	lo->lo_backing_file = NULL;
 	lo->lo_flags = 0;
@@ -1010,16 +1128,21 @@ static int loop_clr_fd(struct loop_device *lo)
 	if (filp == NULL)
 		return -EINVAL;
 
-	spin_lock_irq(&lo->lo_lock);
-	lo->lo_state = Lo_rundown;
-	spin_unlock_irq(&lo->lo_lock);
-
-	kthread_stop(lo->lo_thread);
+	/*
+	 * Freezing the queue waits for all in-flight requests to finish
+	 * against the backing file; new ones are failed once we are in
+	 * rundown.
+	 */
+	blk_mq_freeze_queue(lo->lo_queue);
 
 	spin_lock_irq(&lo->lo_lock);
+	lo->lo_state = Lo_rundown;
 	lo->lo_backing_file = NULL;
 	spin_unlock_irq(&lo->lo_lock);
 
+	destroy_workqueue(lo->wq);
+	lo->wq = NULL;
+
 	loop_release_xfer(lo);
 	lo->transfer = NULL;
 	lo->ioctl = NULL;
@@ -1028,7 +1151,10 @@ static int loop_clr_fd(struct loop_device *lo)
 	lo->lo_offset = 0;
 	lo->lo_sizelimit = 0;
 	lo->lo_encrypt_key_size = 0;
-	lo->lo_thread = NULL;
+	lo->use_dio = false;
+	/* direct I/O may have raised them to the backing device's */
+	blk_queue_logical_block_size(lo->lo_queue, 512);
+	blk_queue_physical_block_size(lo->lo_queue, 512);
 	memset(lo->lo_encrypt_key, 0, LO_KEY_SIZE);
 	memset(lo->lo_crypt_name, 0, LO_NAME_SIZE);
 	memset(lo->lo_file_name, 0, LO_NAME_SIZE);
@@ -1045,6 +1171,7 @@ static int loop_clr_fd(struct loop_device *lo)
 	}
 	mapping_set_gfp_mask(filp->f_mapping, gfp);
 	lo->lo_state = Lo_unbound;
+	blk_mq_unfreeze_queue(lo->lo_queue);
 	/* This is safe: open() is still holding a reference. */
 	module_put(THIS_MODULE);
 	if (lo->lo_flags & LO_FLAGS_PARTSCAN && bdev)
@@ -1079,6 +1206,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
 
+	/* transforming transfer functions need the buffered path */
+	if (info->lo_encrypt_type)
+		__loop_update_dio(lo, false);
+
 	err = loop_release_xfer(lo);
 	if (err)
 		return err;
@@ -1135,6 +1266,9 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		lo->lo_key_owner = uid;
 	}	
 
+	/* update dio if lo_offset or transfer is changed */
+	loop_update_dio(lo);
+
 	return 0;
 }
 
@@ -1285,6 +1419,21 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	return figure_loop_size(lo, lo->lo_offset, lo->lo_sizelimit);
 }
 
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	int error = -ENXIO;
+
+	if (lo->lo_state != Lo_bound)
+		goto out;
+
+	__loop_update_dio(lo, !!arg);
+	if (lo->use_dio == !!arg)
+		return 0;
+	error = -EINVAL;
+ out:
+	return error;
+}
+
 static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	unsigned int cmd, unsigned long arg)
 {
@@ -1328,6 +1477,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1482,6 +1636,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1560,6 +1715,14 @@ module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+
+static int submit_queues = 1;
+module_param(submit_queues, int, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of hardware queues per loop device. Default: 1, 0 for one per CPU");
+
+static int hw_queue_depth = 128;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue. Default: 128");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1627,16 +1790,30 @@ static int loop_add(struct loop_device **l, int i)
 	i = err;
 
 	err = -ENOMEM;
-	lo->lo_queue = blk_alloc_queue(GFP_KERNEL);
-	if (!lo->lo_queue)
+	lo->lo_bio_set = bioset_create(BIO_POOL_SIZE, 0);
+	if (!lo->lo_bio_set)
 		goto out_free_idr;
 
-	/*
-	 * set queue make_request_fn
-	 */
-	blk_queue_make_request(lo->lo_queue, loop_make_request);
+	lo->tag_set.ops = &loop_mq_ops;
+	lo->tag_set.nr_hw_queues = submit_queues;
+	lo->tag_set.queue_depth = hw_queue_depth;
+	lo->tag_set.numa_node = NUMA_NO_NODE;
+	lo->tag_set.cmd_size = sizeof(struct loop_cmd);
+	lo->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_SG_MERGE;
+	lo->tag_set.driver_data = lo;
+
+	err = blk_mq_alloc_tag_set(&lo->tag_set);
+	if (err)
+		goto out_free_bioset;
+
+	lo->lo_queue = blk_mq_init_queue(&lo->tag_set);
+	if (IS_ERR(lo->lo_queue)) {
+		err = PTR_ERR(lo->lo_queue);
+		goto out_cleanup_tags;
+	}
 	lo->lo_queue->queuedata = lo;
 
+	err = -ENOMEM;
 	disk = lo->lo_disk = alloc_disk(1 << part_shift);
 	if (!disk)
 		goto out_free_queue;
@@ -1664,9 +1841,6 @@ static int loop_add(struct loop_device **l, int i)
 	disk->flags |= GENHD_FL_EXT_DEVT;
 	mutex_init(&lo->lo_ctl_mutex);
 	lo->lo_number		= i;
-	lo->lo_thread		= NULL;
-	init_waitqueue_head(&lo->lo_event);
-	init_waitqueue_head(&lo->lo_req_wait);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1680,6 +1854,10 @@ static int loop_add(struct loop_device **l, int i)
 
 out_free_queue:
 	blk_cleanup_queue(lo->lo_queue);
+out_cleanup_tags:
+	blk_mq_free_tag_set(&lo->tag_set);
+out_free_bioset:
+	bioset_free(lo->lo_bio_set);
 out_free_idr:
 	idr_remove(&loop_index_idr, i);
 out_free_dev:
@@ -1692,6 +1870,8 @@ static void loop_remove(struct loop_device *lo)
 {
 	del_gendisk(lo->lo_disk);
 	blk_cleanup_queue(lo->lo_queue);
+	blk_mq_free_tag_set(&lo->tag_set);
+	bioset_free(lo->lo_bio_set);
 	put_disk(lo->lo_disk);
 	kfree(lo);
 }
@@ -1854,6 +2034,15 @@ static int __init loop_init(void)
 		goto misc_out;
 	}
 
+	if (submit_queues <= 0 || submit_queues > nr_cpu_ids)
+		submit_queues = nr_cpu_ids;
+
+	if (hw_queue_depth < 1 || hw_queue_depth > BLK_MQ_MAX_DEPTH) {
+		pr_warn("loop: invalid hw_queue_depth %d, using 128\n",
+							hw_queue_depth);
+		hw_queue_depth = 128;
+	}
+
 	/*
 	 * If max_loop is specified, create that many devices upfront.
 	 * This also becomes a hard limit. If max_loop is not specified,
@@ -30,8 +30,10 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <net/sock.h>
+#include <net/tcp.h>
 #include <linux/net.h>
 #include <linux/kthread.h>
+#include <linux/workqueue.h>
 
 #include <asm/uaccess.h>
 #include <asm/types.h>
@@ -58,18 +60,27 @@ static unsigned int debugflags;
 static unsigned int nbds_max = 16;
 static struct nbd_device *nbd_dev;
 static int max_part;
+static unsigned int max_connections = 4;
+static unsigned int tx_coalesce_us;
+static struct workqueue_struct *nbd_wq;
 
 /*
- * Use just one lock (or at most 1 per NIC). Two arguments for this:
- * 1. Each NIC is essentially a synchronization point for all servers
- *    accessed through that NIC so there's no need to have more locks
- *    than NICs anyway.
- * 2. More locks lead to more "Dirty cache line bouncing" which will slow
- *    down each lock to the point where they're actually slower than just
- *    a single lock.
- * Thanks go to Jens Axboe and Al Viro for their LKML emails explaining this!
+ * Per request driver data.  The reply handle is the blk-mq tag plus the
+ * hardware queue index, so a reply maps straight back to its request.
  */
-static DEFINE_SPINLOCK(nbd_lock);
+struct nbd_cmd {
+	struct nbd_device *nbd;
+	struct work_struct work;
+	int index;		/* hardware queue */
+	int type;		/* NBD_CMD_* */
+	unsigned long flags;
+};
+
+/* nbd_cmd->flags */
+#define NBD_CMDF_INFLIGHT	0	/* sent, waiting for the reply */
+
+#define NBD_HANDLE_QUEUE_SHIFT	16
+#define NBD_HANDLE_TAG_MASK	((1U << NBD_HANDLE_QUEUE_SHIFT) - 1)
 
 #ifndef NDEBUG
 static const char *ioctl_cmd_to_ascii(int cmd)
@@ -107,53 +118,47 @@ static const char *nbdcmd_to_ascii(int cmd)
 
 static void nbd_end_request(struct request *req)
 {
-	int error = req->errors ? -EIO : 0;
-	struct request_queue *q = req->q;
-	unsigned long flags;
-
 	dprintk(DBG_BLKDEV, "%s: request %p: %s\n", req->rq_disk->disk_name,
-			req, error ? "failed" : "done");
+			req, req->errors ? "failed" : "done");
 
-	spin_lock_irqsave(q->queue_lock, flags);
-	__blk_end_request_all(req, error);
-	spin_unlock_irqrestore(q->queue_lock, flags);
+	blk_mq_complete_request(req);
 }
 
-static void sock_shutdown(struct nbd_device *nbd, int lock)
+static void nbd_complete_rq(struct request *req)
 {
-	/* Forcibly shutdown the socket causing all listeners
-	 * to error
-	 *
-	 * FIXME: This code is duplicated from sys_shutdown, but
-	 * there should be a more generic interface rather than
-	 * calling socket ops directly here */
-	if (lock)
-		mutex_lock(&nbd->tx_lock);
-	if (nbd->sock) {
-		dev_warn(disk_to_dev(nbd->disk), "shutting down socket\n");
-		kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
-		nbd->sock = NULL;
-	}
-	if (lock)
-		mutex_unlock(&nbd->tx_lock);
+	blk_mq_end_io(req, req->errors ? -EIO : 0);
 }
 
-static void nbd_xmit_timeout(unsigned long arg)
+/*
+ * Forcibly shutdown all sockets causing all listeners to error.  The
+ * sockets stay referenced until NBD_CLEAR_SOCK or the end of NBD_DO_IT,
+ * so this is safe against concurrent senders and receivers.
+ *
+ * FIXME: This code is duplicated from sys_shutdown, but there should be
+ * a more generic interface rather than calling socket ops directly here
+ */
+static void sock_shutdown(struct nbd_device *nbd)
 {
-	struct task_struct *task = (struct task_struct *)arg;
+	int i;
 
-	printk(KERN_WARNING "nbd: killing hung xmit (%s, pid: %d)\n",
-		task->comm, task->pid);
-	force_sig(SIGKILL, task);
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = &nbd->socks[i];
+
+		if (!nsock->sock || nsock->dead)
+			continue;
+		dev_warn(disk_to_dev(nbd->disk), "shutting down socket %d\n", i);
+		nsock->dead = 1;
+		kernel_sock_shutdown(nsock->sock, SHUT_RDWR);
+	}
 }
 
 /*
  *  Send or receive packet.
  */
-static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
-		int msg_flags)
+static int sock_xmit(struct nbd_device *nbd, int index, int send, void *buf,
+		int size, int msg_flags)
 {
-	struct socket *sock = nbd->sock;
+	struct socket *sock = nbd->socks[index].sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -175,6 +180,13 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 	current->flags |= PF_MEMALLOC;
 	do {
 		sock->sk->sk_allocation = GFP_NOIO | __GFP_MEMALLOC;
+		/*
+		 * Senders run from a workqueue, which cannot be killed, so a
+		 * hung send is bounded by the socket send timeout instead.
+		 */
+		if (send)
+			sock->sk->sk_sndtimeo = nbd->xmit_timeout ?:
+						MAX_SCHEDULE_TIMEOUT;
 		iov.iov_base = buf;
 		iov.iov_len = size;
 		msg.msg_name = NULL;
@@ -183,20 +195,9 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 		msg.msg_controllen = 0;
 		msg.msg_flags = msg_flags | MSG_NOSIGNAL;
 
-		if (send) {
-			struct timer_list ti;
-
-			if (nbd->xmit_timeout) {
-				init_timer(&ti);
-				ti.function = nbd_xmit_timeout;
-				ti.data = (unsigned long)current;
-				ti.expires = jiffies + nbd->xmit_timeout;
-				add_timer(&ti);
-			}
+		if (send)
 			result = kernel_sendmsg(sock, &msg, &iov, 1, size);
-			if (nbd->xmit_timeout)
-				del_timer_sync(&ti);
-		} else
+		else
 			result = kernel_recvmsg(sock, &msg, &iov, 1, size,
 						msg.msg_flags);
 
@@ -206,7 +207,14 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 				task_pid_nr(current), current->comm,
 				dequeue_signal_lock(current, &current->blocked, &info));
 			result = -EINTR;
-			sock_shutdown(nbd, !send);
+			sock_shutdown(nbd);
+			break;
+		}
+
+		if (send && result == -EAGAIN) {
+			dev_err(disk_to_dev(nbd->disk),
+				"Send timed out on connection %d\n", index);
+			sock_shutdown(nbd);
 			break;
 		}
 
@@ -225,28 +233,40 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *nbd, struct bio_vec *bvec,
-		int flags)
+static inline int sock_send_bvec(struct nbd_device *nbd, int index,
+		struct bio_vec *bvec, int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 1, kaddr + bvec->bv_offset,
+	result = sock_xmit(nbd, index, 1, kaddr + bvec->bv_offset,
 			   bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *nbd, struct request *req)
+/* always call with the tx_lock of connection @index held */
+static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 {
-	int result, flags;
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+	int result, flags, more;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u32 handle;
+
+	/*
+	 * If another request is already waiting to go out on this socket,
+	 * send our last piece with MSG_MORE: that sender pushes the lot, and
+	 * back to back small requests share segments instead of each paying
+	 * for its own.  Only done with a TCP_TX_COALESCE window on the socket,
+	 * which bounds the wait should that sender give up instead.
+	 */
+	more = nbd->socks[index].tx_coalesce &&
+	       atomic_read(&nbd->socks[index].tx_waiters) ? MSG_MORE : 0;
 
 	request.magic = htonl(NBD_REQUEST_MAGIC);
-	request.type = htonl(nbd_cmd(req));
+	request.type = htonl(cmd->type);
 
-	if (nbd_cmd(req) == NBD_CMD_FLUSH) {
+	if (cmd->type == NBD_CMD_FLUSH) {
 		/* Other values are reserved for FLUSH requests.  */
 		request.from = 0;
 		request.len = 0;
@@ -254,22 +274,24 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 		request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 		request.len = htonl(size);
 	}
-	memcpy(request.handle, &req, sizeof(req));
+	handle = ((u32)cmd->index << NBD_HANDLE_QUEUE_SHIFT) | req->tag;
+	memset(request.handle, 0, sizeof(request.handle));
+	memcpy(request.handle, &handle, sizeof(handle));
 
 	dprintk(DBG_TX, "%s: request %p: sending control (%s@%llu,%uB)\n",
 			nbd->disk->disk_name, req,
-			nbdcmd_to_ascii(nbd_cmd(req)),
+			nbdcmd_to_ascii(cmd->type),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(nbd, 1, &request, sizeof(request),
-			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
+	result = sock_xmit(nbd, index, 1, &request, sizeof(request),
+			(cmd->type == NBD_CMD_WRITE) ? MSG_MORE : more);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
 			"Send control failed (result %d)\n", result);
 		goto error_out;
 	}
 
-	if (nbd_cmd(req) == NBD_CMD_WRITE) {
+	if (cmd->type == NBD_CMD_WRITE) {
 		struct req_iterator iter;
 		struct bio_vec bvec;
 		/*
@@ -277,12 +299,12 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 		 * whether to set MSG_MORE or not...
 		 */
 		rq_for_each_segment(bvec, req, iter) {
-			flags = 0;
+			flags = more;
 			if (!rq_iter_last(bvec, iter))
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					nbd->disk->disk_name, req, bvec.bv_len);
-			result = sock_send_bvec(nbd, &bvec, flags);
+			result = sock_send_bvec(nbd, index, &bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk),
 					"Send data failed (result %d)\n",
@@ -297,54 +319,50 @@ error_out:
 	return -EIO;
 }
 
-static struct request *nbd_find_request(struct nbd_device *nbd,
-					struct request *xreq)
+static struct nbd_cmd *nbd_find_cmd(struct nbd_device *nbd, u32 handle)
 {
-	struct request *req, *tmp;
-	int err;
-
-	err = wait_event_interruptible(nbd->active_wq, nbd->active_req != xreq);
-	if (unlikely(err))
-		goto out;
-
-	spin_lock(&nbd->queue_lock);
-	list_for_each_entry_safe(req, tmp, &nbd->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&nbd->queue_lock);
-		return req;
-	}
-	spin_unlock(&nbd->queue_lock);
+	unsigned int index = handle >> NBD_HANDLE_QUEUE_SHIFT;
+	unsigned int tag = handle & NBD_HANDLE_TAG_MASK;
+	struct request *req;
+	struct nbd_cmd *cmd;
 
-	err = -ENOENT;
+	if (index >= nbd->tag_set.nr_hw_queues ||
+	    tag >= nbd->tag_set.queue_depth)
+		return ERR_PTR(-ENOENT);
 
-out:
-	return ERR_PTR(err);
+	req = blk_mq_tag_to_rq(nbd->tag_set.tags[index], tag);
+	cmd = blk_mq_rq_to_pdu(req);
+	if (!test_bit(NBD_CMDF_INFLIGHT, &cmd->flags))
+		return ERR_PTR(-ENOENT);
+	return cmd;
 }
 
-static inline int sock_recv_bvec(struct nbd_device *nbd, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_device *nbd, int index,
+		struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 0, kaddr + bvec->bv_offset, bvec->bv_len,
-			MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, kaddr + bvec->bv_offset,
+			bvec->bv_len, MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *nbd)
+static struct nbd_cmd *nbd_read_stat(struct nbd_device *nbd, int index)
 {
 	int result;
 	struct nbd_reply reply;
+	struct nbd_cmd *cmd;
 	struct request *req;
+	u32 handle;
 
 	reply.magic = 0;
-	result = sock_xmit(nbd, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
-		dev_err(disk_to_dev(nbd->disk),
-			"Receive control failed (result %d)\n", result);
+		if (!nbd->disconnect)
+			dev_err(disk_to_dev(nbd->disk),
+				"Receive control failed (result %d)\n", result);
 		goto harderror;
 	}
 
@@ -355,44 +373,42 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		goto harderror;
 	}
 
-	req = nbd_find_request(nbd, *(struct request **)reply.handle);
-	if (IS_ERR(req)) {
-		result = PTR_ERR(req);
-		if (result != -ENOENT)
-			goto harderror;
-
-		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%p)\n",
-			reply.handle);
+	memcpy(&handle, reply.handle, sizeof(handle));
+	cmd = nbd_find_cmd(nbd, handle);
+	if (IS_ERR(cmd)) {
+		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%08x)\n",
+			handle);
 		result = -EBADR;
 		goto harderror;
 	}
+	req = blk_mq_rq_from_pdu(cmd);
 
 	if (ntohl(reply.error)) {
 		dev_err(disk_to_dev(nbd->disk), "Other side returned error (%d)\n",
 			ntohl(reply.error));
 		req->errors++;
-		return req;
+		return cmd;
 	}
 
 	dprintk(DBG_RX, "%s: request %p: got reply\n",
 			nbd->disk->disk_name, req);
-	if (nbd_cmd(req) == NBD_CMD_READ) {
+	if (cmd->type == NBD_CMD_READ) {
 		struct req_iterator iter;
 		struct bio_vec bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(nbd, &bvec);
+			result = sock_recv_bvec(nbd, index, &bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk), "Receive data failed (result %d)\n",
 					result);
 				req->errors++;
-				return req;
+				return cmd;
 			}
 			dprintk(DBG_RX, "%s: request %p: got %d bytes data\n",
 				nbd->disk->disk_name, req, bvec.bv_len);
 		}
 	}
-	return req;
+	return cmd;
 harderror:
 	nbd->harderror = result;
 	return NULL;
@@ -412,77 +428,168 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
+static void nbd_recv_loop(struct nbd_device *nbd, int index)
+{
+	struct nbd_cmd *cmd;
+
+	while ((cmd = nbd_read_stat(nbd, index)) != NULL) {
+		if (test_and_clear_bit(NBD_CMDF_INFLIGHT, &cmd->flags))
+			nbd_end_request(blk_mq_rq_from_pdu(cmd));
+	}
+
+	/* one broken connection takes the others down with it */
+	sock_shutdown(nbd);
+}
+
+struct nbd_recv_args {
+	struct nbd_device *nbd;
+	int index;
+};
+
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_recv_args *args = data;
+	struct nbd_device *nbd = args->nbd;
+
+	set_user_nice(current, MIN_NICE);
+	nbd_recv_loop(nbd, args->index);
+
+	if (atomic_dec_and_test(&nbd->recv_threads))
+		wake_up(&nbd->recv_wq);
+	return 0;
+}
+
+/*
+ * Connection 0 is served by the caller of NBD_DO_IT, the others by a
+ * kernel thread each.  Returns once every connection has gone down.
+ */
 static int nbd_do_it(struct nbd_device *nbd)
 {
-	struct request *req;
-	int ret;
+	struct nbd_recv_args *args;
+	int i, ret;
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	sk_set_memalloc(nbd->sock->sk);
+	args = kcalloc(nbd->num_connections, sizeof(*args), GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
+
+	for (i = 0; i < nbd->num_connections; i++)
+		sk_set_memalloc(nbd->socks[i].sock->sk);
+
 	nbd->pid = task_pid_nr(current);
 	ret = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
 	if (ret) {
 		dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
 		nbd->pid = 0;
+		kfree(args);
 		return ret;
 	}
 
-	while ((req = nbd_read_stat(nbd)) != NULL)
-		nbd_end_request(req);
+	atomic_set(&nbd->recv_threads, 0);
+	for (i = 1; i < nbd->num_connections; i++) {
+		struct task_struct *thread;
+
+		args[i].nbd = nbd;
+		args[i].index = i;
+		atomic_inc(&nbd->recv_threads);
+		thread = kthread_run(nbd_recv_thread, &args[i], "%s-recv%d",
+				     nbd->disk->disk_name, i);
+		if (IS_ERR(thread)) {
+			atomic_dec(&nbd->recv_threads);
+			sock_shutdown(nbd);
+			break;
+		}
+	}
+
+	nbd_recv_loop(nbd, 0);
+	wait_event(nbd->recv_wq, !atomic_read(&nbd->recv_threads));
 
 	device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
 	nbd->pid = 0;
+	kfree(args);
 	return 0;
 }
 
+static void nbd_clear_cmds(void *data, unsigned long *free_tags)
+{
+	struct blk_mq_hw_ctx *hctx = data;
+	unsigned int tag = 0;
+
+	do {
+		struct request *req;
+		struct nbd_cmd *cmd;
+
+		tag = find_next_zero_bit(free_tags, hctx->tags->nr_tags, tag);
+		if (tag >= hctx->tags->nr_tags)
+			break;
+
+		req = blk_mq_tag_to_rq(hctx->tags, tag++);
+		cmd = blk_mq_rq_to_pdu(req);
+		if (req->q != hctx->queue ||
+		    !test_and_clear_bit(NBD_CMDF_INFLIGHT, &cmd->flags))
+			continue;
+		req->errors++;
+		nbd_end_request(req);
+	} while (1);
+}
+
 static void nbd_clear_que(struct nbd_device *nbd)
 {
-	struct request *req;
+	struct blk_mq_hw_ctx *hctx;
+	int i;
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
 	/*
-	 * Because we have set nbd->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * All sockets have been cleared under their tx_lock, so every
+	 * sender has either finished or will fail the request itself.  All
+	 * that is left are requests sent before the connections went down.
 	 */
-	BUG_ON(nbd->sock);
-	BUG_ON(nbd->active_req);
+	for (i = 0; i < nbd->num_connections; i++)
+		BUG_ON(nbd->socks[i].sock);
 
-	while (!list_empty(&nbd->queue_head)) {
-		req = list_entry(nbd->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(req);
-	}
+	queue_for_each_hw_ctx(nbd->disk->queue, hctx, i)
+		blk_mq_tag_busy_iter(hctx->tags, nbd_clear_cmds, hctx);
+}
 
-	while (!list_empty(&nbd->waiting_queue)) {
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(req);
+static void nbd_clear_sock(struct nbd_device *nbd)
+{
+	int i;
+
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = &nbd->socks[i];
+		struct socket *sock;
+
+		mutex_lock(&nsock->tx_lock);
+		sock = nsock->sock;
+		nsock->sock = NULL;
+		nsock->dead = 0;
+		mutex_unlock(&nsock->tx_lock);
+		if (sock)
+			sockfd_put(sock);
 	}
+	nbd_clear_que(nbd);
+	nbd->num_connections = 0;
 }
 
-
-static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
+static void nbd_handle_cmd(struct nbd_cmd *cmd)
 {
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+	struct nbd_device *nbd = cmd->nbd;
+	struct nbd_sock *nsock;
+	int index, num_connections;
+
 	if (req->cmd_type != REQ_TYPE_FS)
 		goto error_out;
 
-	nbd_cmd(req) = NBD_CMD_READ;
+	cmd->type = NBD_CMD_READ;
 	if (rq_data_dir(req) == WRITE) {
 		if ((req->cmd_flags & REQ_DISCARD)) {
 			WARN_ON(!(nbd->flags & NBD_FLAG_SEND_TRIM));
-			nbd_cmd(req) = NBD_CMD_TRIM;
+			cmd->type = NBD_CMD_TRIM;
 		} else
-			nbd_cmd(req) = NBD_CMD_WRITE;
+			cmd->type = NBD_CMD_WRITE;
 		if (nbd->flags & NBD_FLAG_READ_ONLY) {
 			dev_err(disk_to_dev(nbd->disk),
 				"Write on read-only\n");
@@ -492,34 +599,41 @@ static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
 
 	if (req->cmd_flags & REQ_FLUSH) {
 		BUG_ON(unlikely(blk_rq_sectors(req)));
-		nbd_cmd(req) = NBD_CMD_FLUSH;
+		cmd->type = NBD_CMD_FLUSH;
 	}
 
 	req->errors = 0;
 
-	mutex_lock(&nbd->tx_lock);
-	if (unlikely(!nbd->sock)) {
-		mutex_unlock(&nbd->tx_lock);
+	num_connections = ACCESS_ONCE(nbd->num_connections);
+	if (unlikely(!num_connections)) {
+		dev_err(disk_to_dev(nbd->disk),
+			"Attempted send on closed socket\n");
+		goto error_out;
+	}
+	smp_rmb();	/* pairs with NBD_SET_SOCK */
+	index = cmd->index % num_connections;
+	nsock = &nbd->socks[index];
+
+	atomic_inc(&nsock->tx_waiters);
+	mutex_lock(&nsock->tx_lock);
+	atomic_dec(&nsock->tx_waiters);
+	if (unlikely(!nsock->sock || nsock->dead)) {
+		mutex_unlock(&nsock->tx_lock);
 		dev_err(disk_to_dev(nbd->disk),
 			"Attempted send on closed socket\n");
 		goto error_out;
 	}
 
-	nbd->active_req = req;
-
-	if (nbd_send_req(nbd, req) != 0) {
+	/* the reply can beat us back, so mark the request before sending */
+	set_bit(NBD_CMDF_INFLIGHT, &cmd->flags);
+	if (nbd_send_cmd(nbd, cmd, index) != 0) {
 		dev_err(disk_to_dev(nbd->disk), "Request send failed\n");
-		req->errors++;
-		nbd_end_request(req);
-	} else {
-		spin_lock(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->queue_head);
-		spin_unlock(&nbd->queue_lock);
+		if (test_and_clear_bit(NBD_CMDF_INFLIGHT, &cmd->flags)) {
+			req->errors++;
+			nbd_end_request(req);
+		}
 	}
-
-	nbd->active_req = NULL;
-	mutex_unlock(&nbd->tx_lock);
-	wake_up_all(&nbd->active_wq);
+	mutex_unlock(&nsock->tx_lock);
 
 	return;
 
@@ -528,127 +642,125 @@ error_out:
 	nbd_end_request(req);
 }
 
-static int nbd_thread(void *data)
+static void nbd_cmd_work(struct work_struct *work)
 {
-	struct nbd_device *nbd = data;
-	struct request *req;
-
-	set_user_nice(current, MIN_NICE);
-	while (!kthread_should_stop() || !list_empty(&nbd->waiting_queue)) {
-		/* wait for something to do */
-		wait_event_interruptible(nbd->waiting_wq,
-					 kthread_should_stop() ||
-					 !list_empty(&nbd->waiting_queue));
-
-		/* extract request */
-		if (list_empty(&nbd->waiting_queue))
-			continue;
-
-		spin_lock_irq(&nbd->queue_lock);
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		spin_unlock_irq(&nbd->queue_lock);
-
-		/* handle request */
-		nbd_handle_req(nbd, req);
-	}
-	return 0;
+	nbd_handle_cmd(container_of(work, struct nbd_cmd, work));
 }
 
 /*
+ * ->queue_rq() may be called with preemption disabled, so sending, which
+ * sleeps on the socket, is punted to nbd_wq.  Works for different
+ * connections run in parallel.
+ *
  * We always wait for result of write, for now. It would be nice to make it optional
  * in future
  * if ((rq_data_dir(req) == WRITE) && (nbd->flags & NBD_WRITE_NOCHK))
  *   { printk( "Warning: Ignoring result!\n"); nbd_end_request( req ); }
  */
-
-static void do_nbd_request(struct request_queue *q)
-		__releases(q->queue_lock) __acquires(q->queue_lock)
+static int nbd_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
 {
-	struct request *req;
-	
-	while ((req = blk_fetch_request(q)) != NULL) {
-		struct nbd_device *nbd;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
 
-		spin_unlock_irq(q->queue_lock);
+	dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
+			req->rq_disk->disk_name, req, req->cmd_type);
 
-		dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
-				req->rq_disk->disk_name, req, req->cmd_type);
+	BUG_ON(cmd->nbd->magic != NBD_MAGIC);
 
-		nbd = req->rq_disk->private_data;
+	/* the flush request gets a copy of another request's pdu */
+	INIT_WORK(&cmd->work, nbd_cmd_work);
+	cmd->index = hctx->queue_num;
+	queue_work(nbd_wq, &cmd->work);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
 
-		BUG_ON(nbd->magic != NBD_MAGIC);
+static int nbd_init_request(void *data, struct request *req,
+			    unsigned int hctx_idx, unsigned int rq_idx,
+			    unsigned int numa_node)
+{
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
 
-		if (unlikely(!nbd->sock)) {
-			dev_err(disk_to_dev(nbd->disk),
-				"Attempted send on closed socket\n");
-			req->errors++;
-			nbd_end_request(req);
-			spin_lock_irq(q->queue_lock);
-			continue;
-		}
+	cmd->nbd = data;
+	cmd->flags = 0;
+	return 0;
+}
 
-		spin_lock_irq(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->waiting_queue);
-		spin_unlock_irq(&nbd->queue_lock);
+static struct blk_mq_ops nbd_mq_ops = {
+	.queue_rq	= nbd_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.complete	= nbd_complete_rq,
+	.init_request	= nbd_init_request,
+};
 
-		wake_up(&nbd->waiting_wq);
+static void nbd_send_disconnect(struct nbd_device *nbd)
+{
+	struct nbd_request request = {
+		.magic	= htonl(NBD_REQUEST_MAGIC),
+		.type	= htonl(NBD_CMD_DISC),
+	};
+	int i;
 
-		spin_lock_irq(q->queue_lock);
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = &nbd->socks[i];
+
+		mutex_lock(&nsock->tx_lock);
+		if (nsock->sock && !nsock->dead)
+			sock_xmit(nbd, i, 1, &request, sizeof(request), 0);
+		mutex_unlock(&nsock->tx_lock);
 	}
 }
 
-/* Must be called with tx_lock held */
+/* Must be called with config_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		       unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
 	case NBD_DISCONNECT: {
-		struct request sreq;
-
 		dev_info(disk_to_dev(nbd->disk), "NBD_DISCONNECT\n");
-		if (!nbd->sock)
+		if (!nbd->num_connections)
 			return -EINVAL;
 
-		mutex_unlock(&nbd->tx_lock);
+		mutex_unlock(&nbd->config_lock);
 		fsync_bdev(bdev);
-		mutex_lock(&nbd->tx_lock);
-		blk_rq_init(NULL, &sreq);
-		sreq.cmd_type = REQ_TYPE_SPECIAL;
-		nbd_cmd(&sreq) = NBD_CMD_DISC;
+		mutex_lock(&nbd->config_lock);
 
 		/* Check again after getting mutex back.  */
-		if (!nbd->sock)
+		if (!nbd->num_connections)
 			return -EINVAL;
 
 		nbd->disconnect = 1;
 
-		nbd_send_req(nbd, &sreq);
+		nbd_send_disconnect(nbd);
 		return 0;
 	}
  
-	case NBD_CLEAR_SOCK: {
-		struct socket *sock = nbd->sock;
-		nbd->sock = NULL;
-		nbd_clear_que(nbd);
-		BUG_ON(!list_empty(&nbd->queue_head));
-		BUG_ON(!list_empty(&nbd->waiting_queue));
+	case NBD_CLEAR_SOCK:
+		if (nbd->pid)
+			sock_shutdown(nbd);
+		else
+			nbd_clear_sock(nbd);
 		kill_bdev(bdev);
-		if (sock)
-			sockfd_put(sock);
 		return 0;
-	}
 
 	case NBD_SET_SOCK: {
 		struct socket *sock;
 		int err;
-		if (nbd->sock)
+		if (nbd->pid ||
+		    nbd->num_connections >= nbd->tag_set.nr_hw_queues)
 			return -EBUSY;
 		sock = sockfd_lookup(arg, &err);
 		if (sock) {
-			nbd->sock = sock;
+			struct nbd_sock *nsock = &nbd->socks[nbd->num_connections];
+
+			nsock->sock = sock;
+			nsock->dead = 0;
+			nsock->tx_coalesce = tx_coalesce_us &&
+				sock->sk->sk_protocol == IPPROTO_TCP &&
+				!kernel_setsockopt(sock, SOL_TCP,
+					TCP_TX_COALESCE, (char *)&tx_coalesce_us,
+					sizeof(tx_coalesce_us));
+			smp_wmb();	/* pairs with nbd_handle_cmd() */
+			nbd->num_connections++;
 			if (max_part > 0)
 				bdev->bd_invalidated = 1;
 			nbd->disconnect = 0; /* we're connected now */
@@ -688,16 +800,20 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct socket *sock;
 		int error;
 
 		if (nbd->pid)
 			return -EBUSY;
-		if (!nbd->sock)
+		if (!nbd->num_connections)
 			return -EINVAL;
+		if (nbd->num_connections > 1 &&
+		    !(nbd->flags & NBD_FLAG_CAN_MULTI_CONN)) {
+			dev_err(disk_to_dev(nbd->disk),
+				"server does not support multiple connections per device\n");
+			return -EINVAL;
+		}
 
-		mutex_unlock(&nbd->tx_lock);
+		mutex_unlock(&nbd->config_lock);
 
 		if (nbd->flags & NBD_FLAG_READ_ONLY)
 			set_device_ro(bdev, true);
@@ -709,29 +825,17 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		else
 			blk_queue_flush(nbd->disk->queue, 0);
 
-		thread = kthread_create(nbd_thread, nbd, "%s",
-					nbd->disk->disk_name);
-		if (IS_ERR(thread)) {
-			mutex_lock(&nbd->tx_lock);
-			return PTR_ERR(thread);
-		}
-		wake_up_process(thread);
 		error = nbd_do_it(nbd);
-		kthread_stop(thread);
 
-		mutex_lock(&nbd->tx_lock);
+		mutex_lock(&nbd->config_lock);
 		if (error)
 			return error;
-		sock_shutdown(nbd, 0);
-		sock = nbd->sock;
-		nbd->sock = NULL;
-		nbd_clear_que(nbd);
+		sock_shutdown(nbd);
+		nbd_clear_sock(nbd);
 		dev_warn(disk_to_dev(nbd->disk), "queue cleared\n");
 		kill_bdev(bdev);
 		queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, nbd->disk->queue);
 		set_device_ro(bdev, false);
-		if (sock)
-			sockfd_put(sock);
 		nbd->flags = 0;
 		nbd->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
@@ -752,9 +856,9 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 
 	case NBD_PRINT_DEBUG:
 		dev_info(disk_to_dev(nbd->disk),
-			"next = %p, prev = %p, head = %p\n",
-			nbd->queue_head.next, nbd->queue_head.prev,
-			&nbd->queue_head);
+			"connections = %d, hw queues = %u, pid = %d\n",
+			nbd->num_connections, nbd->tag_set.nr_hw_queues,
+			nbd->pid);
 		return 0;
 	}
 	return -ENOTTY;
@@ -775,9 +879,9 @@ static int nbd_ioctl(struct block_device *bdev, fmode_t mode,
 	dprintk(DBG_IOCTL, "%s: nbd_ioctl cmd=%s(0x%x) arg=%lu\n",
 		nbd->disk->disk_name, ioctl_cmd_to_ascii(cmd), cmd, arg);
 
-	mutex_lock(&nbd->tx_lock);
+	mutex_lock(&nbd->config_lock);
 	error = __nbd_ioctl(bdev, nbd, cmd, arg);
-	mutex_unlock(&nbd->tx_lock);
+	mutex_unlock(&nbd->config_lock);
 
 	return error;
 }
@@ -806,6 +910,12 @@ static int __init nbd_init(void)
 		return -EINVAL;
 	}
 
+	if (!max_connections ||
+	    max_connections > 1U << (32 - NBD_HANDLE_QUEUE_SHIFT)) {
+		printk(KERN_ERR "nbd: max_connections out of range\n");
+		return -EINVAL;
+	}
+
 	nbd_dev = kcalloc(nbds_max, sizeof(*nbd_dev), GFP_KERNEL);
 	if (!nbd_dev)
 		return -ENOMEM;
@@ -831,18 +941,51 @@ static int __init nbd_init(void)
 	if (nbds_max > 1UL << (MINORBITS - part_shift))
 		return -EINVAL;
 
+	nbd_wq = alloc_workqueue("nbd", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!nbd_wq)
+		goto out_free;
+
 	for (i = 0; i < nbds_max; i++) {
+		struct nbd_device *nbd = &nbd_dev[i];
 		struct gendisk *disk = alloc_disk(1 << part_shift);
+
+		err = -ENOMEM;
 		if (!disk)
 			goto out;
-		nbd_dev[i].disk = disk;
+		nbd->disk = disk;
+
+		nbd->socks = kcalloc(max_connections, sizeof(*nbd->socks),
+				     GFP_KERNEL);
+		if (!nbd->socks) {
+			put_disk(disk);
+			goto out;
+		}
+
+		nbd->tag_set.ops = &nbd_mq_ops;
+		nbd->tag_set.nr_hw_queues = max_connections;
+		nbd->tag_set.queue_depth = 128;
+		nbd->tag_set.numa_node = NUMA_NO_NODE;
+		nbd->tag_set.cmd_size = sizeof(struct nbd_cmd);
+		nbd->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+		nbd->tag_set.driver_data = nbd;
+
+		err = blk_mq_alloc_tag_set(&nbd->tag_set);
+		if (err) {
+			kfree(nbd->socks);
+			put_disk(disk);
+			goto out;
+		}
+
 		/*
 		 * The new linux 2.5 block layer implementation requires
 		 * every gendisk to have its very own request_queue struct.
 		 * These structs are big so we dynamically allocate them.
 		 */
-		disk->queue = blk_init_queue(do_nbd_request, &nbd_lock);
-		if (!disk->queue) {
+		disk->queue = blk_mq_init_queue(&nbd->tag_set);
+		if (IS_ERR(disk->queue)) {
+			err = PTR_ERR(disk->queue);
+			blk_mq_free_tag_set(&nbd->tag_set);
+			kfree(nbd->socks);
 			put_disk(disk);
 			goto out;
 		}
@@ -867,13 +1010,13 @@ static int __init nbd_init(void)
 
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
+		int j;
+
 		nbd_dev[i].magic = NBD_MAGIC;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
-		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
+		for (j = 0; j < max_connections; j++)
+			mutex_init(&nbd_dev[i].socks[j].tx_lock);
+		mutex_init(&nbd_dev[i].config_lock);
+		init_waitqueue_head(&nbd_dev[i].recv_wq);
 		nbd_dev[i].blksize = 1024;
 		nbd_dev[i].bytesize = 0;
 		disk->major = NBD_MAJOR;
@@ -889,8 +1032,12 @@ static int __init nbd_init(void)
 out:
 	while (i--) {
 		blk_cleanup_queue(nbd_dev[i].disk->queue);
+		blk_mq_free_tag_set(&nbd_dev[i].tag_set);
+		kfree(nbd_dev[i].socks);
 		put_disk(nbd_dev[i].disk);
 	}
+	destroy_workqueue(nbd_wq);
+out_free:
 	kfree(nbd_dev);
 	return err;
 }
@@ -904,9 +1051,12 @@ static void __exit nbd_cleanup(void)
 		if (disk) {
 			del_gendisk(disk);
 			blk_cleanup_queue(disk->queue);
+			blk_mq_free_tag_set(&nbd_dev[i].tag_set);
+			kfree(nbd_dev[i].socks);
 			put_disk(disk);
 		}
 	}
+	destroy_workqueue(nbd_wq);
 	unregister_blkdev(NBD_MAJOR, "nbd");
 	kfree(nbd_dev);
 	printk(KERN_INFO "nbd: unregistered device at major %d\n", NBD_MAJOR);
@@ -922,6 +1072,10 @@ module_param(nbds_max, int, 0444);
 MODULE_PARM_DESC(nbds_max, "number of network block devices to initialize (default: 16)");
 module_param(max_part, int, 0444);
 MODULE_PARM_DESC(max_part, "number of partitions per device (default: 0)");
+module_param(max_connections, uint, 0444);
+MODULE_PARM_DESC(max_connections, "number of connections, and hardware queues, per device (default: 4)");
+module_param(tx_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(tx_coalesce_us, "TCP_TX_COALESCE window set on new connections, in usecs, 0 for off (default: 0)");
 #ifndef NDEBUG
 module_param(debugflags, int, 0644);
 MODULE_PARM_DESC(debugflags, "flags for controlling debug output");
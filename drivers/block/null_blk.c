@@ -108,6 +108,10 @@ static int hw_queue_depth = 64;
 module_param(hw_queue_depth, int, S_IRUGO);
 MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue. Default: 64");
 
+static int oob_size;
+module_param(oob_size, int, S_IRUGO);
+MODULE_PARM_DESC(oob_size, "Per-sector out-of-band bytes reported to vsl. Default: 0");
+
 static bool use_per_node_hctx = false;
 module_param(use_per_node_hctx, bool, S_IRUGO);
 MODULE_PARM_DESC(use_per_node_hctx, "Use per-node allocation for hardware context queues. Default: false");
@@ -335,7 +339,7 @@ static struct vsl_id_chnl null_vsl_id_chnl(struct vsl_dev *dev, int chnl_num)
 	ic.gran_read = bs;
 	ic.gran_write = bs;
 	ic.gran_erase = bs;
-	ic.oob_size = 0;
+	ic.oob_size = oob_size;
 	ic.t_r = ic.t_sqr = completion_nsec;
 	ic.t_w = ic.t_sqw = completion_nsec;
 	ic.t_e = completion_nsec;
@@ -663,6 +667,11 @@ static int __init null_init(void)
 		bs = PAGE_SIZE;
 	}
 
+	if (oob_size < 0 || oob_size > bs) {
+		pr_warn("null_blk: invalid oob size, disabling it\n");
+		oob_size = 0;
+	}
+
 	if (queue_mode |= (NULL_Q_MQ|NULL_Q_VSL) && use_per_node_hctx) {
 		if (submit_queues < nr_online_nodes) {
 			pr_warn("null_blk: submit_queues param is set to %u.",
@@ -26,6 +26,7 @@
 #include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/hdreg.h>
+#include <linux/highmem.h>
 #include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
@@ -42,6 +43,7 @@
 #include <linux/ptrace.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/timer.h>
 #include <linux/types.h>
 #include <scsi/sg.h>
 #include <asm-generic/io-64-nonatomic-lo-hi.h>
@@ -52,6 +54,17 @@
 #define ADMIN_TIMEOUT	(60 * HZ)
 #define IOD_TIMEOUT	(4 * NVME_IO_TIMEOUT)
 
+/*
+ * Each IO queue keeps iods, with room for a few segments and a short PRP
+ * list, for the bios it submits.  Bigger I/Os, or more of them than there
+ * are slots, get their iod from kmalloc and their PRP lists from the pools.
+ */
+#define NVME_IOD_SLOTS		256
+#define NVME_IOD_SLOT_SEGS	8
+#define NVME_IOD_SLOT_PRPS	(256 / 8)
+#define NVME_IOD_SLOT_SIZE	(sizeof(struct nvme_iod) + sizeof(__le64 *) + \
+			NVME_IOD_SLOT_SEGS * sizeof(struct scatterlist))
+
 unsigned char io_timeout = 30;
 module_param(io_timeout, byte, 0644);
 MODULE_PARM_DESC(io_timeout, "timeout in seconds for I/O");
@@ -62,11 +75,23 @@ module_param(nvme_major, int, 0);
 static int use_threaded_interrupts;
 module_param(use_threaded_interrupts, int, 0);
 
+static unsigned int sgl_threshold = 32 * 1024;
+module_param(sgl_threshold, uint, 0644);
+MODULE_PARM_DESC(sgl_threshold,
+	"smallest multi-segment I/O, in bytes, sent with SGLs (0 = never)");
+
+static bool use_cmb_sqes = true;
+module_param(use_cmb_sqes, bool, 0444);
+MODULE_PARM_DESC(use_cmb_sqes,
+	"place I/O submission queues in the controller memory buffer");
+
+static unsigned int cmb_write_max = 4096;
+module_param(cmb_write_max, uint, 0644);
+MODULE_PARM_DESC(cmb_write_max,
+	"largest write, in bytes, copied into the controller memory buffer (0 = never)");
+
 static DEFINE_SPINLOCK(dev_list_lock);
-static LIST_HEAD(dev_list);
-static struct task_struct *nvme_thread;
 static struct workqueue_struct *nvme_workq;
-static wait_queue_head_t nvme_kthread_wait;
 
 static void nvme_reset_failed_dev(struct work_struct *ws);
 
@@ -89,13 +114,23 @@ struct nvme_queue {
 	char irqname[24];	/* nvme4294967295-65535\0 */
 	spinlock_t q_lock;
 	struct nvme_command *sq_cmds;
+	struct nvme_command __iomem *sq_cmds_io;	/* SQ in the CMB, if any */
 	volatile struct nvme_completion *cqes;
 	dma_addr_t sq_dma_addr;
+	dma_addr_t sq_cmb_dma;
 	dma_addr_t cq_dma_addr;
+	void __iomem *cmb_data;		/* Page-sized write data slots */
+	dma_addr_t cmb_data_dma;
+	unsigned long cmb_map;
+	unsigned cmb_slots;
 	wait_queue_head_t sq_full;
-	wait_queue_t sq_cong_wait;
+	struct timer_list timer;	/* Timeouts, congestion retry */
 	struct bio_list sq_cong;
 	struct list_head iod_bio;
+	void *iods;
+	__le64 *iod_prps;
+	dma_addr_t iod_prps_dma;
+	DECLARE_BITMAP(iod_map, NVME_IOD_SLOTS);
 	u32 __iomem *q_db;
 	u16 q_depth;
 	u16 cq_vector;
@@ -116,6 +151,7 @@ struct nvme_queue {
  */
 static inline void _nvme_check_size(void)
 {
+	BUILD_BUG_ON(sizeof(struct nvme_sgl_desc) != 16);
 	BUILD_BUG_ON(sizeof(struct nvme_rw_command) != 64);
 	BUILD_BUG_ON(sizeof(struct nvme_create_cq) != 64);
 	BUILD_BUG_ON(sizeof(struct nvme_create_sq) != 64);
@@ -150,6 +186,32 @@ static unsigned nvme_queue_extra(int depth)
 	return DIV_ROUND_UP(depth, 8) + (depth * sizeof(struct nvme_cmd_info));
 }
 
+/*
+ * Make sure the queue timer fires no later than @expires.  Racing callers
+ * without the q_lock may leave it a little late; the timer itself re-arms
+ * for the earliest outstanding deadline, so nothing is missed for long.
+ */
+static void nvme_queue_timer(struct nvme_queue *nvmeq, unsigned long expires)
+{
+	if (timer_pending(&nvmeq->timer) &&
+			!time_before(expires, nvmeq->timer.expires))
+		return;
+	mod_timer(&nvmeq->timer, expires);
+}
+
+/*
+ * Congested I/O is resubmitted when a completion frees a command id.  With
+ * nothing outstanding (an allocation failed) nothing will complete, so let
+ * the queue timer retry it.
+ */
+static void nvme_cong_timer(struct nvme_queue *nvmeq)
+{
+	int depth = nvmeq->q_depth - 1;
+
+	if (find_first_bit(nvmeq->cmdid_data, depth) >= depth)
+		nvme_queue_timer(nvmeq, jiffies + HZ / 10);
+}
+
 /**
  * alloc_cmdid() - Allocate a Command ID
  * @nvmeq: The queue that will be used for this command
@@ -182,6 +244,7 @@ static int alloc_cmdid(struct nvme_queue *nvmeq, void *ctx,
 	info[cmdid].ctx = ctx;
 	info[cmdid].timeout = jiffies + timeout;
 	info[cmdid].aborted = 0;
+	nvme_queue_timer(nvmeq, info[cmdid].timeout);
 	return cmdid;
 }
 
@@ -304,6 +367,35 @@ static void unlock_nvmeq(struct nvme_queue *nvmeq) __releases(RCU)
 	rcu_read_unlock();
 }
 
+static void nvme_ring_sq(struct nvme_queue *nvmeq, u16 tail)
+{
+	struct nvme_dev *dev = nvmeq->dev;
+
+	writel(tail, nvmeq->q_db);
+	if (dev->ops->sq_doorbell)
+		dev->ops->sq_doorbell(dev, nvmeq->qid);
+}
+
+/*
+ * Called with the q_lock held.  An SQ in the controller memory buffer is
+ * mapped write-combining; the wmb() pushes the entry out before the
+ * doorbell write.
+ */
+static void nvme_queue_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
+{
+	u16 tail = nvmeq->sq_tail;
+
+	if (nvmeq->sq_cmds_io) {
+		memcpy_toio(&nvmeq->sq_cmds_io[tail], cmd, sizeof(*cmd));
+		wmb();
+	} else
+		memcpy(&nvmeq->sq_cmds[tail], cmd, sizeof(*cmd));
+	if (++tail == nvmeq->q_depth)
+		tail = 0;
+	nvme_ring_sq(nvmeq, tail);
+	nvmeq->sq_tail = tail;
+}
+
 /**
  * nvme_submit_cmd() - Copy a command into a queue and ring the doorbell
  * @nvmeq: The queue to use
@@ -314,18 +406,12 @@ static void unlock_nvmeq(struct nvme_queue *nvmeq) __releases(RCU)
 static int nvme_submit_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
 {
 	unsigned long flags;
-	u16 tail;
 	spin_lock_irqsave(&nvmeq->q_lock, flags);
 	if (nvmeq->q_suspended) {
 		spin_unlock_irqrestore(&nvmeq->q_lock, flags);
 		return -EBUSY;
 	}
-	tail = nvmeq->sq_tail;
-	memcpy(&nvmeq->sq_cmds[tail], cmd, sizeof(*cmd));
-	if (++tail == nvmeq->q_depth)
-		tail = 0;
-	writel(tail, nvmeq->q_db);
-	nvmeq->sq_tail = tail;
+	nvme_queue_cmd(nvmeq, cmd);
 	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
 
 	return 0;
@@ -347,11 +433,19 @@ static int nvme_npages(unsigned size)
 	return DIV_ROUND_UP(8 * nprps, PAGE_SIZE - 8);
 }
 
+/* Pages needed if the segments are described with SGLs instead */
+static int nvme_sgl_npages(unsigned nseg)
+{
+	unsigned per_page = PAGE_SIZE / sizeof(struct nvme_sgl_desc);
+	return DIV_ROUND_UP(nseg, per_page - 1);
+}
+
 static struct nvme_iod *
 nvme_alloc_iod(unsigned nseg, unsigned nbytes, gfp_t gfp)
 {
+	int npages = max(nvme_npages(nbytes), nvme_sgl_npages(nseg));
 	struct nvme_iod *iod = kmalloc(sizeof(struct nvme_iod) +
-				sizeof(__le64 *) * nvme_npages(nbytes) +
+				sizeof(__le64 *) * npages +
 				sizeof(struct scatterlist) * nseg, gfp);
 
 	if (iod) {
@@ -361,14 +455,97 @@ nvme_alloc_iod(unsigned nseg, unsigned nbytes, gfp_t gfp)
 		iod->nents = 0;
 		iod->first_dma = 0ULL;
 		iod->start_time = jiffies;
+		iod->nvmeq = NULL;
+		iod->prp_inline = NULL;
+		iod->sgl.length = 0;
+		iod->cmb_slot = -1;
 	}
 
 	return iod;
 }
 
+static struct nvme_iod *nvme_iod_slot(struct nvme_queue *nvmeq, int slot)
+{
+	return nvmeq->iods + slot * NVME_IOD_SLOT_SIZE;
+}
+
+/*
+ * Called with local interrupts disabled and the q_lock held.  Takes a
+ * preallocated iod if the bio fits in one.
+ */
+static struct nvme_iod *nvme_alloc_bio_iod(struct nvme_queue *nvmeq,
+					struct bio *bio, unsigned nseg)
+{
+	unsigned nbytes = bio->bi_iter.bi_size;
+	struct nvme_iod *iod;
+	int slot;
+
+	if (!nvmeq->iods || nseg > NVME_IOD_SLOT_SEGS ||
+	    (!(bio->bi_rw & REQ_DISCARD) &&
+	     nbytes > NVME_IOD_SLOT_PRPS * PAGE_SIZE))
+		return nvme_alloc_iod(nseg, nbytes, GFP_ATOMIC);
+
+	do {
+		slot = find_first_zero_bit(nvmeq->iod_map, NVME_IOD_SLOTS);
+		if (slot >= NVME_IOD_SLOTS)
+			return nvme_alloc_iod(nseg, nbytes, GFP_ATOMIC);
+	} while (test_and_set_bit(slot, nvmeq->iod_map));
+
+	iod = nvme_iod_slot(nvmeq, slot);
+	iod->npages = -1;
+	iod->length = nbytes;
+	iod->nents = 0;
+	iod->first_dma = 0ULL;
+	iod->start_time = jiffies;
+	iod->sgl.length = 0;
+	iod->cmb_slot = -1;
+	return iod;
+}
+
+static void nvme_alloc_iod_slots(struct nvme_queue *nvmeq)
+{
+	size_t prp_size = NVME_IOD_SLOT_PRPS * sizeof(__le64);
+	int i;
+
+	nvmeq->iod_prps = dma_alloc_coherent(nvmeq->q_dmadev,
+					NVME_IOD_SLOTS * prp_size,
+					&nvmeq->iod_prps_dma, GFP_KERNEL);
+	if (!nvmeq->iod_prps)
+		return;
+	nvmeq->iods = kcalloc(NVME_IOD_SLOTS, NVME_IOD_SLOT_SIZE, GFP_KERNEL);
+	if (!nvmeq->iods) {
+		dma_free_coherent(nvmeq->q_dmadev, NVME_IOD_SLOTS * prp_size,
+					nvmeq->iod_prps, nvmeq->iod_prps_dma);
+		nvmeq->iod_prps = NULL;
+		return;
+	}
+
+	for (i = 0; i < NVME_IOD_SLOTS; i++) {
+		struct nvme_iod *iod = nvme_iod_slot(nvmeq, i);
+
+		iod->offset = offsetof(struct nvme_iod,
+					sg[NVME_IOD_SLOT_SEGS]);
+		iod->nvmeq = nvmeq;
+		iod->prp_inline = nvmeq->iod_prps + i * NVME_IOD_SLOT_PRPS;
+		iod->prp_inline_dma = nvmeq->iod_prps_dma + i * prp_size;
+	}
+}
+
+static void nvme_free_iod_slots(struct nvme_queue *nvmeq)
+{
+	if (!nvmeq->iods)
+		return;
+	dma_free_coherent(nvmeq->q_dmadev,
+			NVME_IOD_SLOTS * NVME_IOD_SLOT_PRPS * sizeof(__le64),
+			nvmeq->iod_prps, nvmeq->iod_prps_dma);
+	kfree(nvmeq->iods);
+}
+
 void nvme_free_iod(struct nvme_dev *dev, struct nvme_iod *iod)
 {
 	const int last_prp = PAGE_SIZE / 8 - 1;
+	/* SGL pages chain through the address of their last descriptor */
+	int next = iod->sgl.length ? last_prp - 1 : last_prp;
 	int i;
 	__le64 **list = iod_list(iod);
 	dma_addr_t prp_dma = iod->first_dma;
@@ -377,11 +554,15 @@ void nvme_free_iod(struct nvme_dev *dev, struct nvme_iod *iod)
 		dma_pool_free(dev->prp_small_pool, list[0], prp_dma);
 	for (i = 0; i < iod->npages; i++) {
 		__le64 *prp_list = list[i];
-		dma_addr_t next_prp_dma = le64_to_cpu(prp_list[last_prp]);
+		dma_addr_t next_prp_dma = le64_to_cpu(prp_list[next]);
 		dma_pool_free(dev->prp_page_pool, prp_list, prp_dma);
 		prp_dma = next_prp_dma;
 	}
-	kfree(iod);
+	if (iod->nvmeq)
+		clear_bit(((void *)iod - iod->nvmeq->iods) / NVME_IOD_SLOT_SIZE,
+							iod->nvmeq->iod_map);
+	else
+		kfree(iod);
 }
 
 static void nvme_start_io_acct(struct bio *bio)
@@ -389,7 +570,7 @@ static void nvme_start_io_acct(struct bio *bio)
 	struct gendisk *disk = bio->bi_bdev->bd_disk;
 	const int rw = bio_data_dir(bio);
 	int cpu = part_stat_lock();
-	part_round_stats(cpu, &disk->part0);
+	part_update_io_ticks(cpu, &disk->part0, false);
 	part_stat_inc(cpu, &disk->part0, ios[rw]);
 	part_stat_add(cpu, &disk->part0, sectors[rw], bio_sectors(bio));
 	part_inc_in_flight(&disk->part0, rw);
@@ -403,11 +584,42 @@ static void nvme_end_io_acct(struct bio *bio, unsigned long start_time)
 	unsigned long duration = jiffies - start_time;
 	int cpu = part_stat_lock();
 	part_stat_add(cpu, &disk->part0, ticks[rw], duration);
-	part_round_stats(cpu, &disk->part0);
+	part_stat_add(cpu, &disk->part0, time_in_queue, duration);
+	part_update_io_ticks(cpu, &disk->part0, true);
 	part_dec_in_flight(&disk->part0, rw);
 	part_stat_unlock();
 }
 
+/*
+ * Called with the q_lock held.  Small writes also get a slot in the queue's
+ * share of the controller memory buffer, so the controller doesn't have to
+ * fetch the data across the bus.  The host mapping is kept as well: the
+ * slot may be gone by the time a retry is submitted after a reset.
+ */
+static void nvme_cmb_get_slot(struct nvme_queue *nvmeq, struct nvme_iod *iod,
+							struct bio *bio)
+{
+	int slot;
+
+	if (!nvmeq->cmb_slots || bio_data_dir(bio) != WRITE ||
+	    bio_integrity(bio) ||
+	    bio->bi_iter.bi_size > min_t(unsigned, cmb_write_max, PAGE_SIZE))
+		return;
+
+	do {
+		slot = find_first_zero_bit(&nvmeq->cmb_map, nvmeq->cmb_slots);
+		if (slot >= nvmeq->cmb_slots)
+			return;
+	} while (test_and_set_bit(slot, &nvmeq->cmb_map));
+	iod->cmb_slot = slot;
+}
+
+static void nvme_cmb_put_slot(struct nvme_queue *nvmeq, struct nvme_iod *iod)
+{
+	if (iod->cmb_slot >= 0)
+		clear_bit(iod->cmb_slot, &nvmeq->cmb_map);
+}
+
 static void bio_completion(struct nvme_queue *nvmeq, void *ctx,
 						struct nvme_completion *cqe)
 {
@@ -419,11 +631,7 @@ static void bio_completion(struct nvme_queue *nvmeq, void *ctx,
 		if (!(status & NVME_SC_DNR ||
 				bio->bi_rw & REQ_FAILFAST_MASK) &&
 				(jiffies - iod->start_time) < IOD_TIMEOUT) {
-			if (!waitqueue_active(&nvmeq->sq_full))
-				add_wait_queue(&nvmeq->sq_full,
-							&nvmeq->sq_cong_wait);
 			list_add_tail(&iod->node, &nvmeq->iod_bio);
-			wake_up(&nvmeq->sq_full);
 			return;
 		}
 	}
@@ -432,6 +640,10 @@ static void bio_completion(struct nvme_queue *nvmeq, void *ctx,
 			bio_data_dir(bio) ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
 		nvme_end_io_acct(bio, iod->start_time);
 	}
+	if (bio_integrity(bio))
+		dma_unmap_sg(nvmeq->q_dmadev, &iod->meta_sg, 1,
+			bio_data_dir(bio) ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+	nvme_cmb_put_slot(nvmeq, iod);
 	nvme_free_iod(nvmeq->dev, iod);
 	if (status)
 		bio_endio(bio, -EIO);
@@ -473,19 +685,26 @@ int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
 	}
 
 	nprps = DIV_ROUND_UP(length, PAGE_SIZE);
-	if (nprps <= (256 / 8)) {
-		pool = dev->prp_small_pool;
-		iod->npages = 0;
+	if (nprps <= NVME_IOD_SLOT_PRPS && iod->prp_inline) {
+		/* npages stays -1, there is nothing to give back */
+		pool = NULL;
+		prp_list = iod->prp_inline;
+		prp_dma = iod->prp_inline_dma;
 	} else {
-		pool = dev->prp_page_pool;
-		iod->npages = 1;
-	}
+		if (nprps <= (256 / 8)) {
+			pool = dev->prp_small_pool;
+			iod->npages = 0;
+		} else {
+			pool = dev->prp_page_pool;
+			iod->npages = 1;
+		}
 
-	prp_list = dma_pool_alloc(pool, gfp, &prp_dma);
-	if (!prp_list) {
-		iod->first_dma = dma_addr;
-		iod->npages = -1;
-		return (total_len - length) + PAGE_SIZE;
+		prp_list = dma_pool_alloc(pool, gfp, &prp_dma);
+		if (!prp_list) {
+			iod->first_dma = dma_addr;
+			iod->npages = -1;
+			return (total_len - length) + PAGE_SIZE;
+		}
 	}
 	list[0] = prp_list;
 	iod->first_dma = prp_dma;
@@ -518,6 +737,100 @@ int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
 	return total_len;
 }
 
+static void nvme_sgl_set_data(struct nvme_sgl_desc *sge,
+						struct scatterlist *sg)
+{
+	sge->addr = cpu_to_le64(sg_dma_address(sg));
+	sge->length = cpu_to_le32(sg_dma_len(sg));
+	sge->type = NVME_SGL_FMT_DATA_DESC << 4;
+}
+
+static void nvme_sgl_set_seg(struct nvme_sgl_desc *sge, dma_addr_t dma_addr,
+								int entries)
+{
+	const int per_page = PAGE_SIZE / sizeof(struct nvme_sgl_desc);
+
+	sge->addr = cpu_to_le64(dma_addr);
+	if (entries <= per_page) {
+		sge->length = cpu_to_le32(entries * sizeof(*sge));
+		sge->type = NVME_SGL_FMT_LAST_SEG_DESC << 4;
+	} else {
+		sge->length = cpu_to_le32(PAGE_SIZE);
+		sge->type = NVME_SGL_FMT_SEG_DESC << 4;
+	}
+}
+
+/*
+ * Describe the mapped scatterlist with one SGL data block descriptor per
+ * DMA segment.  A list that doesn't fit in a page continues in the next,
+ * reached through a segment descriptor in the last slot.
+ */
+static int nvme_setup_sgls(struct nvme_dev *dev, struct nvme_iod *iod,
+						int total_len, gfp_t gfp)
+{
+	const int per_page = PAGE_SIZE / sizeof(struct nvme_sgl_desc);
+	int entries = iod->nents;
+	__le64 **list = iod_list(iod);
+	struct nvme_sgl_desc *sg_list;
+	struct scatterlist *sg;
+	struct dma_pool *pool;
+	dma_addr_t sgl_dma;
+	int i = 0, j;
+
+	if (entries == 1) {
+		nvme_sgl_set_data(&iod->sgl, iod->sg);
+		return total_len;
+	}
+
+	if (entries * sizeof(*sg_list) <= NVME_IOD_SLOT_PRPS * 8 &&
+							iod->prp_inline) {
+		pool = NULL;
+		sg_list = (struct nvme_sgl_desc *)iod->prp_inline;
+		sgl_dma = iod->prp_inline_dma;
+	} else {
+		if (entries * sizeof(*sg_list) <= 256) {
+			pool = dev->prp_small_pool;
+			iod->npages = 0;
+		} else {
+			pool = dev->prp_page_pool;
+			iod->npages = 1;
+		}
+
+		sg_list = dma_pool_alloc(pool, gfp, &sgl_dma);
+		if (!sg_list) {
+			iod->npages = -1;
+			return -ENOMEM;
+		}
+	}
+	list[0] = (__le64 *)sg_list;
+	iod->first_dma = sgl_dma;
+	nvme_sgl_set_seg(&iod->sgl, sgl_dma, entries);
+
+	for_each_sg(iod->sg, sg, entries, j) {
+		if (i == per_page) {
+			struct nvme_sgl_desc *link = &sg_list[i - 1];
+
+			sg_list = dma_pool_alloc(pool, gfp, &sgl_dma);
+			if (!sg_list)
+				return -ENOMEM;
+			list[iod->npages++] = (__le64 *)sg_list;
+			sg_list[0] = *link;
+			nvme_sgl_set_seg(link, sgl_dma, entries - j + 1);
+			i = 1;
+		}
+		nvme_sgl_set_data(&sg_list[i++], sg);
+	}
+
+	return total_len;
+}
+
+static bool nvme_use_sgls(struct nvme_dev *dev, struct bio *bio, int psegs)
+{
+	if (!(dev->sgls & NVME_CTRL_SGLS_SUPPORTED) || !sgl_threshold)
+		return false;
+	return psegs > 1 && bio->bi_iter.bi_size >= sgl_threshold;
+}
+
 static int nvme_split_and_submit(struct bio *bio, struct nvme_queue *nvmeq,
 				 int len)
 {
@@ -527,11 +840,8 @@ static int nvme_split_and_submit(struct bio *bio, struct nvme_queue *nvmeq,
 
 	bio_chain(split, bio);
 
-	if (!waitqueue_active(&nvmeq->sq_full))
-		add_wait_queue(&nvmeq->sq_full, &nvmeq->sq_cong_wait);
 	bio_list_add(&nvmeq->sq_cong, split);
 	bio_list_add(&nvmeq->sq_cong, bio);
-	wake_up(&nvmeq->sq_full);
 
 	return 0;
 }
@@ -540,8 +850,13 @@ static int nvme_split_and_submit(struct bio *bio, struct nvme_queue *nvmeq,
 #define BIOVEC_NOT_VIRT_MERGEABLE(vec1, vec2)	((vec2)->bv_offset || \
 			(((vec1)->bv_offset + (vec1)->bv_len) % PAGE_SIZE))
 
+/*
+ * With PRPs only the first segment may start, and only the last may end,
+ * inside a page; bios with other gaps are split.  SGLs have no such rule.
+ */
 static int nvme_map_bio(struct nvme_queue *nvmeq, struct nvme_iod *iod,
-		struct bio *bio, enum dma_data_direction dma_dir, int psegs)
+		struct bio *bio, enum dma_data_direction dma_dir, int psegs,
+		bool sgl)
 {
 	struct bio_vec bvec, bvprv;
 	struct bvec_iter iter;
@@ -559,7 +874,8 @@ static int nvme_map_bio(struct nvme_queue *nvmeq, struct nvme_iod *iod,
 		if (!first && BIOVEC_PHYS_MERGEABLE(&bvprv, &bvec)) {
 			sg->length += bvec.bv_len;
 		} else {
-			if (!first && BIOVEC_NOT_VIRT_MERGEABLE(&bvprv, &bvec))
+			if (!first && !sgl &&
+			    BIOVEC_NOT_VIRT_MERGEABLE(&bvprv, &bvec))
 				return nvme_split_and_submit(bio, nvmeq,
 							     length);
 
@@ -584,46 +900,59 @@ static int nvme_map_bio(struct nvme_queue *nvmeq, struct nvme_iod *iod,
 	return length;
 }
 
+/*
+ * The metadata buffer attached by bio_integrity_prep() or
+ * bio_integrity_meta_alloc() is physically contiguous, so a single
+ * metadata pointer covers it, also after the bio has been split.
+ */
+static int nvme_map_meta(struct nvme_queue *nvmeq, struct nvme_iod *iod,
+		struct bio *bio, enum dma_data_direction dma_dir)
+{
+	struct bio_integrity_payload *bip = bio->bi_integrity;
+	struct bio_vec bv = bvec_iter_bvec(bip->bip_vec, bip->bip_iter);
+
+	sg_init_table(&iod->meta_sg, 1);
+	sg_set_page(&iod->meta_sg, bv.bv_page, bip->bip_iter.bi_size,
+							bv.bv_offset);
+	if (dma_map_sg(nvmeq->q_dmadev, &iod->meta_sg, 1, dma_dir) == 0)
+		return -ENOMEM;
+	return 0;
+}
+
 static int nvme_submit_discard(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 		struct bio *bio, struct nvme_iod *iod, int cmdid)
 {
 	struct nvme_dsm_range *range =
 				(struct nvme_dsm_range *)iod_list(iod)[0];
-	struct nvme_command *cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
+	struct nvme_command cmnd;
 
 	range->cattr = cpu_to_le32(0);
 	range->nlb = cpu_to_le32(bio->bi_iter.bi_size >> ns->lba_shift);
 	range->slba = cpu_to_le64(nvme_block_nr(ns, bio->bi_iter.bi_sector));
 
-	memset(cmnd, 0, sizeof(*cmnd));
-	cmnd->dsm.opcode = nvme_cmd_dsm;
-	cmnd->dsm.command_id = cmdid;
-	cmnd->dsm.nsid = cpu_to_le32(ns->ns_id);
-	cmnd->dsm.prp1 = cpu_to_le64(iod->first_dma);
-	cmnd->dsm.nr = 0;
-	cmnd->dsm.attributes = cpu_to_le32(NVME_DSMGMT_AD);
-
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	memset(&cmnd, 0, sizeof(cmnd));
+	cmnd.dsm.opcode = nvme_cmd_dsm;
+	cmnd.dsm.command_id = cmdid;
+	cmnd.dsm.nsid = cpu_to_le32(ns->ns_id);
+	cmnd.dsm.prp1 = cpu_to_le64(iod->first_dma);
+	cmnd.dsm.nr = 0;
+	cmnd.dsm.attributes = cpu_to_le32(NVME_DSMGMT_AD);
 
+	nvme_queue_cmd(nvmeq, &cmnd);
 	return 0;
 }
 
 static int nvme_submit_flush(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 								int cmdid)
 {
-	struct nvme_command *cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
+	struct nvme_command cmnd;
 
-	memset(cmnd, 0, sizeof(*cmnd));
-	cmnd->common.opcode = nvme_cmd_flush;
-	cmnd->common.command_id = cmdid;
-	cmnd->common.nsid = cpu_to_le32(ns->ns_id);
-
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	memset(&cmnd, 0, sizeof(cmnd));
+	cmnd.common.opcode = nvme_cmd_flush;
+	cmnd.common.command_id = cmdid;
+	cmnd.common.nsid = cpu_to_le32(ns->ns_id);
 
+	nvme_queue_cmd(nvmeq, &cmnd);
 	return 0;
 }
 
@@ -637,11 +966,34 @@ int nvme_submit_flush_data(struct nvme_queue *nvmeq, struct nvme_ns *ns)
 	return nvme_submit_flush(nvmeq, ns, cmdid);
 }
 
+/* Copy the write data into its slot; done on every (re)submission */
+static bool nvme_cmb_copy(struct nvme_queue *nvmeq, struct nvme_iod *iod,
+							struct bio *bio)
+{
+	void __iomem *dst;
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	if (iod->cmb_slot < 0 || iod->cmb_slot >= nvmeq->cmb_slots)
+		return false;
+
+	dst = nvmeq->cmb_data + (iod->cmb_slot << PAGE_SHIFT);
+	bio_for_each_segment(bvec, bio, iter) {
+		void *src = kmap_atomic(bvec.bv_page);
+		memcpy_toio(dst, src + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(src);
+		dst += bvec.bv_len;
+	}
+	/* The SQ may be in host memory: drain the WC buffers here too */
+	wmb();
+	return true;
+}
+
 static int nvme_submit_iod(struct nvme_queue *nvmeq, struct nvme_iod *iod)
 {
 	struct bio *bio = iod->private;
 	struct nvme_ns *ns = bio->bi_bdev->bd_disk->private_data;
-	struct nvme_command *cmnd;
+	struct nvme_command cmnd;
 	int cmdid;
 	u16 control;
 	u32 dsmgmt;
@@ -665,24 +1017,31 @@ static int nvme_submit_iod(struct nvme_queue *nvmeq, struct nvme_iod *iod)
 	if (bio->bi_rw & REQ_RAHEAD)
 		dsmgmt |= NVME_RW_DSM_FREQ_PREFETCH;
 
-	cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
-	memset(cmnd, 0, sizeof(*cmnd));
-
-	cmnd->rw.opcode = bio_data_dir(bio) ? nvme_cmd_write : nvme_cmd_read;
-	cmnd->rw.command_id = cmdid;
-	cmnd->rw.nsid = cpu_to_le32(ns->ns_id);
-	cmnd->rw.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
-	cmnd->rw.prp2 = cpu_to_le64(iod->first_dma);
-	cmnd->rw.slba = cpu_to_le64(nvme_block_nr(ns, bio->bi_iter.bi_sector));
-	cmnd->rw.length =
+	memset(&cmnd, 0, sizeof(cmnd));
+
+	cmnd.rw.opcode = bio_data_dir(bio) ? nvme_cmd_write : nvme_cmd_read;
+	cmnd.rw.command_id = cmdid;
+	cmnd.rw.nsid = cpu_to_le32(ns->ns_id);
+	if (iod->sgl.length) {
+		cmnd.rw.flags = NVME_CMD_SGL_METABUF;
+		cmnd.rw.sgl = iod->sgl;
+	} else if (nvme_cmb_copy(nvmeq, iod, bio)) {
+		cmnd.rw.prp1 = cpu_to_le64(nvmeq->cmb_data_dma +
+					(iod->cmb_slot << PAGE_SHIFT));
+	} else {
+		cmnd.rw.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
+		cmnd.rw.prp2 = cpu_to_le64(iod->first_dma);
+	}
+	cmnd.rw.slba = cpu_to_le64(nvme_block_nr(ns, bio->bi_iter.bi_sector));
+	cmnd.rw.length =
 		cpu_to_le16((bio->bi_iter.bi_size >> ns->lba_shift) - 1);
-	cmnd->rw.control = cpu_to_le16(control);
-	cmnd->rw.dsmgmt = cpu_to_le32(dsmgmt);
-
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	cmnd.rw.control = cpu_to_le16(control);
+	cmnd.rw.dsmgmt = cpu_to_le32(dsmgmt);
+	if (bio_integrity(bio))
+		cmnd.rw.metadata =
+			cpu_to_le64(sg_dma_address(&iod->meta_sg));
 
+	nvme_queue_cmd(nvmeq, &cmnd);
 	return 0;
 }
 
@@ -702,12 +1061,15 @@ static int nvme_submit_bio_queue(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 			return result;
 	}
 
-	iod = nvme_alloc_iod(psegs, bio->bi_iter.bi_size, GFP_ATOMIC);
+	iod = nvme_alloc_bio_iod(nvmeq, bio, psegs);
 	if (!iod)
 		return -ENOMEM;
 
 	iod->private = bio;
-	if (bio->bi_rw & REQ_DISCARD) {
+	if ((bio->bi_rw & REQ_DISCARD) && iod->prp_inline) {
+		iod_list(iod)[0] = iod->prp_inline;
+		iod->first_dma = iod->prp_inline_dma;
+	} else if (bio->bi_rw & REQ_DISCARD) {
 		void *range;
 		/*
 		 * We reuse the small pool to allocate the 16-byte range here
@@ -724,22 +1086,33 @@ static int nvme_submit_bio_queue(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 		iod_list(iod)[0] = (__le64 *)range;
 		iod->npages = 0;
 	} else if (psegs) {
+		bool sgl = nvme_use_sgls(nvmeq->dev, bio, psegs);
+
 		result = nvme_map_bio(nvmeq, iod, bio,
 			bio_data_dir(bio) ? DMA_TO_DEVICE : DMA_FROM_DEVICE,
-			psegs);
+			psegs, sgl);
 		if (result <= 0)
 			goto free_iod;
-		if (nvme_setup_prps(nvmeq->dev, iod, result, GFP_ATOMIC) !=
-								result) {
+		if (sgl ? nvme_setup_sgls(nvmeq->dev, iod, result, GFP_ATOMIC)
+				!= result :
+			  nvme_setup_prps(nvmeq->dev, iod, result, GFP_ATOMIC)
+				!= result) {
 			result = -ENOMEM;
 			goto free_iod;
 		}
+		if (bio_integrity(bio)) {
+			result = nvme_map_meta(nvmeq, iod, bio,
+				bio_data_dir(bio) ? DMA_TO_DEVICE :
+						    DMA_FROM_DEVICE);
+			if (result)
+				goto free_iod;
+		}
+		nvme_cmb_get_slot(nvmeq, iod, bio);
 		nvme_start_io_acct(bio);
 	}
 	if (unlikely(nvme_submit_iod(nvmeq, iod))) {
-		if (!waitqueue_active(&nvmeq->sq_full))
-			add_wait_queue(&nvmeq->sq_full, &nvmeq->sq_cong_wait);
 		list_add_tail(&iod->node, &nvmeq->iod_bio);
+		nvme_cong_timer(nvmeq);
 	}
 	return 0;
 
@@ -748,9 +1121,75 @@ static int nvme_submit_bio_queue(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 	return result;
 }
 
+static void nvme_resubmit_iods(struct nvme_queue *nvmeq)
+{
+	struct nvme_iod *iod, *next;
+
+	list_for_each_entry_safe(iod, next, &nvmeq->iod_bio, node) {
+		if (unlikely(nvme_submit_iod(nvmeq, iod))) {
+			nvme_cong_timer(nvmeq);
+			break;
+		}
+		list_del(&iod->node);
+	}
+}
+
+static void nvme_resubmit_bios(struct nvme_queue *nvmeq)
+{
+	while (bio_list_peek(&nvmeq->sq_cong)) {
+		struct bio *bio = bio_list_pop(&nvmeq->sq_cong);
+		struct nvme_ns *ns = bio->bi_bdev->bd_disk->private_data;
+
+		if (nvme_submit_bio_queue(nvmeq, ns, bio)) {
+			bio_list_add_head(&nvmeq->sq_cong, bio);
+			nvme_cong_timer(nvmeq);
+			break;
+		}
+	}
+}
+
+/*
+ * Called with the q_lock held once completions have freed command ids, and
+ * from the queue timer.
+ */
+static void nvme_resubmit_cong(struct nvme_queue *nvmeq)
+{
+	if (nvmeq->q_suspended)
+		return;
+	nvme_resubmit_bios(nvmeq);
+	nvme_resubmit_iods(nvmeq);
+}
+
+/*
+ * Hand the controller to the reset work unless a reset or removal is
+ * already queued.  Returns true if this call queued it.
+ */
+static bool nvme_schedule_reset(struct nvme_dev *dev)
+{
+	if (work_busy(&dev->reset_work))
+		return false;
+	dev->reset_workfn = nvme_reset_failed_dev;
+	queue_work(nvme_workq, &dev->reset_work);
+	return true;
+}
+
+/*
+ * The controller status is only read after an error completion or a
+ * timeout; a healthy controller never pays for the MMIO read.
+ */
+static bool nvme_check_fatal(struct nvme_dev *dev)
+{
+	if (!(readl(&dev->bar->csts) & NVME_CSTS_CFS))
+		return false;
+	if (nvme_schedule_reset(dev))
+		dev_warn(dev->dev, "Failed status, reset controller\n");
+	return true;
+}
+
 static int nvme_process_cq(struct nvme_queue *nvmeq)
 {
 	u16 head, phase;
+	bool error = false;
 
 	head = nvmeq->cq_head;
 	phase = nvmeq->cq_phase;
@@ -767,6 +1206,8 @@ static int nvme_process_cq(struct nvme_queue *nvmeq)
 			phase = !phase;
 		}
 
+		if (unlikely(le16_to_cpu(cqe.status) >> 1))
+			error = true;
 		ctx = free_cmdid(nvmeq, cqe.command_id, &fn);
 		fn(nvmeq, ctx, &cqe);
 	}
@@ -785,15 +1226,27 @@ static int nvme_process_cq(struct nvme_queue *nvmeq)
 	nvmeq->cq_phase = phase;
 
 	nvmeq->cqe_seen = 1;
+
+	if (unlikely(error) && nvmeq->dev->initialized)
+		nvme_check_fatal(nvmeq->dev);
+	if (!bio_list_empty(&nvmeq->sq_cong) || !list_empty(&nvmeq->iod_bio))
+		nvme_resubmit_cong(nvmeq);
 	return 1;
 }
 
 static void nvme_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct nvme_ns *ns = q->queuedata;
-	struct nvme_queue *nvmeq = get_nvmeq(ns->dev);
+	struct nvme_queue *nvmeq;
 	int result = -EBUSY;
 
+	/* bio based, so the metadata buffer has to be attached here */
+	if (bio_integrity_enabled(bio) && bio_integrity_prep(bio)) {
+		bio_endio(bio, -EIO);
+		return;
+	}
+
+	nvmeq = get_nvmeq(ns->dev);
 	if (!nvmeq) {
 		put_nvmeq(NULL);
 		bio_endio(bio, -EIO);
@@ -801,12 +1254,15 @@ static void nvme_make_request(struct request_queue *q, struct bio *bio)
 	}
 
 	spin_lock_irq(&nvmeq->q_lock);
-	if (!nvmeq->q_suspended && bio_list_empty(&nvmeq->sq_cong))
+	if (!nvmeq->q_suspended && bio_list_empty(&nvmeq->sq_cong)) {
 		result = nvme_submit_bio_queue(nvmeq, ns, bio);
+		/* A split leaves both halves on sq_cong */
+		if (!result && !bio_list_empty(&nvmeq->sq_cong))
+			nvme_resubmit_bios(nvmeq);
+	}
 	if (unlikely(result)) {
-		if (!waitqueue_active(&nvmeq->sq_full))
-			add_wait_queue(&nvmeq->sq_full, &nvmeq->sq_cong_wait);
 		bio_list_add(&nvmeq->sq_cong, bio);
+		nvme_cong_timer(nvmeq);
 	}
 
 	nvme_process_cq(nvmeq);
@@ -989,7 +1445,8 @@ static int adapter_alloc_sq(struct nvme_dev *dev, u16 qid,
 
 	memset(&c, 0, sizeof(c));
 	c.create_sq.opcode = nvme_admin_create_sq;
-	c.create_sq.prp1 = cpu_to_le64(nvmeq->sq_dma_addr);
+	c.create_sq.prp1 = cpu_to_le64(nvmeq->sq_cmds_io ? nvmeq->sq_cmb_dma :
+							   nvmeq->sq_dma_addr);
 	c.create_sq.sqid = cpu_to_le16(qid);
 	c.create_sq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
 	c.create_sq.sq_flags = cpu_to_le16(flags);
@@ -1069,15 +1526,13 @@ static void nvme_abort_cmd(int cmdid, struct nvme_queue *nvmeq)
 	struct nvme_cmd_info *info = nvme_cmd_info(nvmeq);
 	struct nvme_queue *adminq;
 
+	if (nvme_check_fatal(dev))
+		return;
 	if (!nvmeq->qid || info[cmdid].aborted) {
-		if (work_busy(&dev->reset_work))
-			return;
-		list_del_init(&dev->node);
-		dev_warn(&dev->pci_dev->dev,
-			"I/O %d QID %d timeout, reset controller\n", cmdid,
-								nvmeq->qid);
-		dev->reset_workfn = nvme_reset_failed_dev;
-		queue_work(nvme_workq, &dev->reset_work);
+		if (nvme_schedule_reset(dev))
+			dev_warn(dev->dev,
+				"I/O %d QID %d timeout, reset controller\n",
+							cmdid, nvmeq->qid);
 		return;
 	}
 
@@ -1139,10 +1594,46 @@ static void nvme_cancel_ios(struct nvme_queue *nvmeq, bool timeout)
 	}
 }
 
+/*
+ * Per-queue timer, armed by alloc_cmdid() for the earliest command deadline
+ * and by nvme_cong_timer().  Also reaps completions whose interrupt was lost.
+ */
+static void nvme_queue_timeout(unsigned long data)
+{
+	struct nvme_queue *nvmeq = (struct nvme_queue *)data;
+	struct nvme_cmd_info *info = nvme_cmd_info(nvmeq);
+	int depth = nvmeq->q_depth - 1;
+	unsigned long now = jiffies;
+	int cmdid;
+
+	spin_lock_irq(&nvmeq->q_lock);
+	if (nvmeq->q_suspended)
+		goto unlock;
+	nvme_process_cq(nvmeq);
+	rcu_read_lock();
+	nvme_cancel_ios(nvmeq, true);
+	rcu_read_unlock();
+	nvme_resubmit_cong(nvmeq);
+
+	/*
+	 * Commands already aborted or waiting on a reset keep a deadline in
+	 * the past; look at those again in a second, as nvme_kthread did.
+	 */
+	for_each_set_bit(cmdid, nvmeq->cmdid_data, depth) {
+		if (info[cmdid].ctx == CMD_CTX_CANCELLED)
+			continue;
+		nvme_queue_timer(nvmeq, time_after(info[cmdid].timeout, now) ?
+					info[cmdid].timeout : now + HZ);
+	}
+ unlock:
+	spin_unlock_irq(&nvmeq->q_lock);
+}
+
 static void nvme_free_queue(struct rcu_head *r)
 {
 	struct nvme_queue *nvmeq = container_of(r, struct nvme_queue, r_head);
 
+	del_timer_sync(&nvmeq->timer);
 	spin_lock_irq(&nvmeq->q_lock);
 	while (bio_list_peek(&nvmeq->sq_cong)) {
 		struct bio *bio = bio_list_pop(&nvmeq->sq_cong);
@@ -1161,6 +1652,7 @@ static void nvme_free_queue(struct rcu_head *r)
 	}
 	spin_unlock_irq(&nvmeq->q_lock);
 
+	nvme_free_iod_slots(nvmeq);
 	dma_free_coherent(nvmeq->q_dmadev, CQ_SIZE(nvmeq->q_depth),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
 	dma_free_coherent(nvmeq->q_dmadev, SQ_SIZE(nvmeq->q_depth),
@@ -1190,7 +1682,7 @@ static void nvme_free_queues(struct nvme_dev *dev, int lowest)
  */
 static int nvme_suspend_queue(struct nvme_queue *nvmeq)
 {
-	int vector = nvmeq->dev->entry[nvmeq->cq_vector].vector;
+	struct nvme_dev *dev = nvmeq->dev;
 
 	spin_lock_irq(&nvmeq->q_lock);
 	if (nvmeq->q_suspended) {
@@ -1201,8 +1693,7 @@ static int nvme_suspend_queue(struct nvme_queue *nvmeq)
 	nvmeq->dev->online_queues--;
 	spin_unlock_irq(&nvmeq->q_lock);
 
-	irq_set_affinity_hint(vector, NULL);
-	free_irq(vector, nvmeq);
+	dev->ops->free_irq(dev, nvmeq->cq_vector, nvmeq);
 
 	return 0;
 }
@@ -1236,7 +1727,7 @@ static void nvme_disable_queue(struct nvme_dev *dev, int qid)
 static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 							int depth, int vector)
 {
-	struct device *dmadev = &dev->pci_dev->dev;
+	struct device *dmadev = dev->dev;
 	unsigned extra = nvme_queue_extra(depth);
 	struct nvme_queue *nvmeq = kzalloc(sizeof(*nvmeq) + extra, GFP_KERNEL);
 	if (!nvmeq)
@@ -1264,7 +1755,7 @@ static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
 	init_waitqueue_head(&nvmeq->sq_full);
-	init_waitqueue_entry(&nvmeq->sq_cong_wait, nvme_thread);
+	setup_timer(&nvmeq->timer, nvme_queue_timeout, (unsigned long)nvmeq);
 	bio_list_init(&nvmeq->sq_cong);
 	INIT_LIST_HEAD(&nvmeq->iod_bio);
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
@@ -1272,6 +1763,8 @@ static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 	nvmeq->cq_vector = vector;
 	nvmeq->qid = qid;
 	nvmeq->q_suspended = 1;
+	if (qid)
+		nvme_alloc_iod_slots(nvmeq);
 	dev->queue_count++;
 	rcu_assign_pointer(dev->queues[qid], nvmeq);
 
@@ -1292,11 +1785,10 @@ static int queue_request_irq(struct nvme_dev *dev, struct nvme_queue *nvmeq,
 							const char *name)
 {
 	if (use_threaded_interrupts)
-		return request_threaded_irq(dev->entry[nvmeq->cq_vector].vector,
-					nvme_irq_check, nvme_irq, IRQF_SHARED,
+		return dev->ops->request_irq(dev, nvmeq->cq_vector,
+					nvme_irq_check, nvme_irq, name, nvmeq);
+	return dev->ops->request_irq(dev, nvmeq->cq_vector, nvme_irq, NULL,
 					name, nvmeq);
-	return request_irq(dev->entry[nvmeq->cq_vector].vector, nvme_irq,
-				IRQF_SHARED, name, nvmeq);
 }
 
 static void nvme_init_queue(struct nvme_queue *nvmeq, u16 qid)
@@ -1313,6 +1805,37 @@ static void nvme_init_queue(struct nvme_queue *nvmeq, u16 qid)
 	nvme_cancel_ios(nvmeq, false);
 	nvmeq->q_suspended = 0;
 	dev->online_queues++;
+	if (!bio_list_empty(&nvmeq->sq_cong) || !list_empty(&nvmeq->iod_bio))
+		mod_timer(&nvmeq->timer, jiffies);
+}
+
+/*
+ * Each IO queue owns an equal share of the controller memory buffer: its
+ * SQ first, if SQs are placed there, then page-sized write data slots.
+ */
+static void nvme_cmb_queue(struct nvme_queue *nvmeq, u16 qid)
+{
+	struct nvme_dev *dev = nvmeq->dev;
+	u32 sq_stride = dev->cmb_sq_stride;
+	u64 offset;
+
+	nvmeq->sq_cmds_io = NULL;
+	nvmeq->cmb_slots = 0;
+	if (!qid || qid > dev->cmb_queues)
+		return;
+
+	offset = (u64)(qid - 1) * dev->cmb_queue_size;
+
+	if (sq_stride && nvmeq->q_depth == dev->q_depth) {
+		nvmeq->sq_cmds_io = dev->cmb + offset;
+		nvmeq->sq_cmb_dma = dev->cmb_dma_addr + offset;
+	}
+	if (NVME_CMB_WDS(dev->cmbsz)) {
+		nvmeq->cmb_data = dev->cmb + offset + sq_stride;
+		nvmeq->cmb_data_dma = dev->cmb_dma_addr + offset + sq_stride;
+		nvmeq->cmb_slots = min_t(u32, (dev->cmb_queue_size - sq_stride)
+						>> PAGE_SHIFT, BITS_PER_LONG);
+	}
 }
 
 static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
@@ -1320,6 +1843,7 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
 	struct nvme_dev *dev = nvmeq->dev;
 	int result;
 
+	nvme_cmb_queue(nvmeq, qid);
 	result = adapter_alloc_cq(dev, qid, nvmeq);
 	if (result < 0)
 		return result;
@@ -1357,7 +1881,7 @@ static int nvme_wait_ready(struct nvme_dev *dev, u64 cap, bool enabled)
 		if (fatal_signal_pending(current))
 			return -EINTR;
 		if (time_after(jiffies, timeout)) {
-			dev_err(&dev->pci_dev->dev,
+			dev_err(dev->dev,
 				"Device not ready; aborting initialisation\n");
 			return -ENODEV;
 		}
@@ -1401,7 +1925,7 @@ static int nvme_shutdown_ctrl(struct nvme_dev *dev)
 		if (fatal_signal_pending(current))
 			return -EINTR;
 		if (time_after(jiffies, timeout)) {
-			dev_err(&dev->pci_dev->dev,
+			dev_err(dev->dev,
 				"Device shutdown incomplete; abort shutdown\n");
 			return -ENODEV;
 		}
@@ -1495,7 +2019,7 @@ struct nvme_iod *nvme_map_user_pages(struct nvme_dev *dev, int write,
 	iod->nents = count;
 
 	err = -ENOMEM;
-	nents = dma_map_sg(&dev->pci_dev->dev, sg, count,
+	nents = dma_map_sg(dev->dev, sg, count,
 				write ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
 	if (!nents)
 		goto free_iod;
@@ -1517,7 +2041,7 @@ void nvme_unmap_user_pages(struct nvme_dev *dev, int write,
 {
 	int i;
 
-	dma_unmap_sg(&dev->pci_dev->dev, iod->sg, iod->nents,
+	dma_unmap_sg(dev->dev, iod->sg, iod->nents,
 				write ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
 
 	for (i = 0; i < iod->nents; i++)
@@ -1577,7 +2101,7 @@ static int nvme_submit_io(struct nvme_ns *ns, struct nvme_user_io __user *uio)
 			goto unmap;
 		}
 
-		meta_mem = dma_alloc_coherent(&dev->pci_dev->dev, meta_len,
+		meta_mem = dma_alloc_coherent(dev->dev, meta_len,
 						&meta_dma_addr, GFP_KERNEL);
 		if (!meta_mem) {
 			status = -ENOMEM;
@@ -1623,7 +2147,7 @@ static int nvme_submit_io(struct nvme_ns *ns, struct nvme_user_io __user *uio)
 			}
 		}
 
-		dma_free_coherent(&dev->pci_dev->dev, meta_len, meta_mem,
+		dma_free_coherent(dev->dev, meta_len, meta_mem,
 								meta_dma_addr);
 	}
 
@@ -1712,7 +2236,7 @@ static int nvme_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd,
 	case SG_GET_VERSION_NUM:
 		return nvme_sg_get_version_num((void __user *)arg);
 	case SG_IO:
-		return nvme_sg_io(ns, (void __user *)arg);
+		return nvme_sg_io(ns, bdev, (void __user *)arg);
 	default:
 		return -ENOTTY;
 	}
@@ -1726,7 +2250,7 @@ static int nvme_compat_ioctl(struct block_device *bdev, fmode_t mode,
 
 	switch (cmd) {
 	case SG_IO:
-		return nvme_sg_io32(ns, arg);
+		return nvme_sg_io32(ns, bdev, arg);
 	}
 	return nvme_ioctl(bdev, mode, cmd, arg);
 }
@@ -1771,86 +2295,7 @@ static const struct block_device_operations nvme_fops = {
 	.getgeo		= nvme_getgeo,
 };
 
-static void nvme_resubmit_iods(struct nvme_queue *nvmeq)
-{
-	struct nvme_iod *iod, *next;
-
-	list_for_each_entry_safe(iod, next, &nvmeq->iod_bio, node) {
-		if (unlikely(nvme_submit_iod(nvmeq, iod)))
-			break;
-		list_del(&iod->node);
-		if (bio_list_empty(&nvmeq->sq_cong) &&
-						list_empty(&nvmeq->iod_bio))
-			remove_wait_queue(&nvmeq->sq_full,
-						&nvmeq->sq_cong_wait);
-	}
-}
-
-static void nvme_resubmit_bios(struct nvme_queue *nvmeq)
-{
-	while (bio_list_peek(&nvmeq->sq_cong)) {
-		struct bio *bio = bio_list_pop(&nvmeq->sq_cong);
-		struct nvme_ns *ns = bio->bi_bdev->bd_disk->private_data;
-
-		if (bio_list_empty(&nvmeq->sq_cong) &&
-						list_empty(&nvmeq->iod_bio))
-			remove_wait_queue(&nvmeq->sq_full,
-							&nvmeq->sq_cong_wait);
-		if (nvme_submit_bio_queue(nvmeq, ns, bio)) {
-			if (!waitqueue_active(&nvmeq->sq_full))
-				add_wait_queue(&nvmeq->sq_full,
-							&nvmeq->sq_cong_wait);
-			bio_list_add_head(&nvmeq->sq_cong, bio);
-			break;
-		}
-	}
-}
-
-static int nvme_kthread(void *data)
-{
-	struct nvme_dev *dev, *next;
-
-	while (!kthread_should_stop()) {
-		set_current_state(TASK_INTERRUPTIBLE);
-		spin_lock(&dev_list_lock);
-		list_for_each_entry_safe(dev, next, &dev_list, node) {
-			int i;
-			if (readl(&dev->bar->csts) & NVME_CSTS_CFS &&
-							dev->initialized) {
-				if (work_busy(&dev->reset_work))
-					continue;
-				list_del_init(&dev->node);
-				dev_warn(&dev->pci_dev->dev,
-					"Failed status, reset controller\n");
-				dev->reset_workfn = nvme_reset_failed_dev;
-				queue_work(nvme_workq, &dev->reset_work);
-				continue;
-			}
-			rcu_read_lock();
-			for (i = 0; i < dev->queue_count; i++) {
-				struct nvme_queue *nvmeq =
-						rcu_dereference(dev->queues[i]);
-				if (!nvmeq)
-					continue;
-				spin_lock_irq(&nvmeq->q_lock);
-				if (nvmeq->q_suspended)
-					goto unlock;
-				nvme_process_cq(nvmeq);
-				nvme_cancel_ios(nvmeq, true);
-				nvme_resubmit_bios(nvmeq);
-				nvme_resubmit_iods(nvmeq);
- unlock:
-				spin_unlock_irq(&nvmeq->q_lock);
-			}
-			rcu_read_unlock();
-		}
-		spin_unlock(&dev_list_lock);
-		schedule_timeout(round_jiffies_relative(HZ));
-	}
-	return 0;
-}
-
-static void nvme_config_discard(struct nvme_ns *ns)
+static void nvme_config_discard(struct nvme_ns *ns)
 {
 	u32 logical_block_size = queue_logical_block_size(ns->queue);
 	ns->queue->limits.discard_zeroes_data = 0;
@@ -1888,19 +2333,21 @@ static struct nvme_ns *nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid,
 		goto out_free_queue;
 	ns->ns_id = nsid;
 	ns->disk = disk;
-	lbaf = id->flbas & 0xf;
+	lbaf = id->flbas & NVME_NS_FLBAS_LBA_MASK;
 	ns->lba_shift = id->lbaf[lbaf].ds;
 	ns->ms = le16_to_cpu(id->lbaf[lbaf].ms);
 	blk_queue_logical_block_size(ns->queue, 1 << ns->lba_shift);
 	if (dev->max_hw_sectors)
 		blk_queue_max_hw_sectors(ns->queue, dev->max_hw_sectors);
+	if (ns->ms && !(id->flbas & NVME_NS_FLBAS_META_EXT))
+		blk_queue_max_integrity_segments(ns->queue, 1);
 
 	disk->major = nvme_major;
 	disk->first_minor = 0;
 	disk->fops = &nvme_fops;
 	disk->private_data = ns;
 	disk->queue = ns->queue;
-	disk->driverfs_dev = &dev->pci_dev->dev;
+	disk->driverfs_dev = dev->dev;
 	disk->flags = GENHD_FL_EXT_DEVT;
 	sprintf(disk->disk_name, "nvme%dn%d", dev->instance, nsid);
 	set_capacity(disk, le64_to_cpup(&id->nsze) << (ns->lba_shift - 9));
@@ -1917,6 +2364,27 @@ static struct nvme_ns *nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid,
 	return NULL;
 }
 
+/*
+ * Namespaces formatted with a separate metadata buffer get an opaque
+ * integrity profile, so that every IO carries a buffer for it and
+ * stacking drivers can fill it in through bio_integrity_meta_alloc().
+ */
+static void nvme_register_meta(struct nvme_ns *ns)
+{
+	struct blk_integrity meta = {
+		.name		= "NVME-META",
+		.tuple_size	= ns->ms,
+		.flags		= INTEGRITY_FLAG_META,
+	};
+
+	if (!ns->ms || !queue_max_integrity_segments(ns->queue))
+		return;
+
+	if (blk_integrity_register(ns->disk, &meta))
+		dev_warn(ns->dev->dev,
+			"failed to register metadata for nsid %d\n", ns->ns_id);
+}
+
 static int nvme_find_closest_node(int node)
 {
 	int n, val, min_val = INT_MAX, best_node = node;
@@ -2036,7 +2504,8 @@ static void nvme_assign_io_queues(struct nvme_dev *dev)
 			"nvme%d qid:%d mis-matched queue-to-cpu assignment\n",
 			dev->instance, i);
 
-		irq_set_affinity_hint(dev->entry[nvmeq->cq_vector].vector,
+		if (dev->ops->set_irq_affinity)
+			dev->ops->set_irq_affinity(dev, nvmeq->cq_vector,
 							nvmeq->cpu_mask);
 		cpumask_andnot(unassigned_cpus, unassigned_cpus,
 						nvmeq->cpu_mask);
@@ -2085,11 +2554,30 @@ static int nvme_cpu_notify(struct notifier_block *self,
 	return NOTIFY_OK;
 }
 
+/* Split the controller memory buffer evenly between the IO queues */
+static void nvme_cmb_layout(struct nvme_dev *dev, unsigned nr_io_queues)
+{
+	u32 sq_stride = roundup(SQ_SIZE(dev->q_depth), PAGE_SIZE);
+	u64 share;
+
+	dev->cmb_queues = 0;
+	if (!dev->cmb || !nr_io_queues)
+		return;
+
+	share = div_u64(dev->cmb_size, nr_io_queues) & PAGE_MASK;
+	dev->cmb_queue_size = min_t(u64, share, U32_MAX & PAGE_MASK);
+	dev->cmb_sq_stride = 0;
+	if (use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz) &&
+					dev->cmb_queue_size >= sq_stride)
+		dev->cmb_sq_stride = sq_stride;
+	if (dev->cmb_sq_stride || NVME_CMB_WDS(dev->cmbsz))
+		dev->cmb_queues = nr_io_queues;
+}
+
 static int nvme_setup_io_queues(struct nvme_dev *dev)
 {
 	struct nvme_queue *adminq = raw_nvmeq(dev, 0);
-	struct pci_dev *pdev = dev->pci_dev;
-	int result, i, vecs, nr_io_queues, size;
+	int result, vecs, nr_io_queues;
 
 	nr_io_queues = num_possible_cpus();
 	result = set_queue_count(dev, nr_io_queues);
@@ -2098,36 +2586,17 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	if (result < nr_io_queues)
 		nr_io_queues = result;
 
-	size = db_bar_size(dev, nr_io_queues);
-	if (size > 8192) {
-		iounmap(dev->bar);
-		do {
-			dev->bar = ioremap(pci_resource_start(pdev, 0), size);
-			if (dev->bar)
-				break;
-			if (!--nr_io_queues)
-				return -ENOMEM;
-			size = db_bar_size(dev, nr_io_queues);
-		} while (1);
-		dev->dbs = ((void __iomem *)dev->bar) + 4096;
-		adminq->q_db = dev->dbs;
-	}
-
 	/* Deregister the admin queue's interrupt */
-	free_irq(dev->entry[0].vector, adminq);
+	dev->ops->free_irq(dev, 0, adminq);
 
-	for (i = 0; i < nr_io_queues; i++)
-		dev->entry[i].entry = i;
-	vecs = pci_enable_msix_range(pdev, dev->entry, 1, nr_io_queues);
+	vecs = dev->ops->setup_vectors(dev, nr_io_queues);
 	if (vecs < 0) {
-		vecs = pci_enable_msi_range(pdev, 1, min(nr_io_queues, 32));
-		if (vecs < 0) {
-			vecs = 1;
-		} else {
-			for (i = 0; i < vecs; i++)
-				dev->entry[i].vector = i + pdev->irq;
-		}
+		result = vecs;
+		adminq->q_suspended = 1;
+		goto free_queues;
 	}
+	dev->dbs = ((void __iomem *)dev->bar) + 4096;
+	adminq->q_db = dev->dbs;
 
 	/*
 	 * Should investigate if there's a performance win from allocating
@@ -2137,6 +2606,7 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	 */
 	nr_io_queues = vecs;
 	dev->max_qid = nr_io_queues;
+	nvme_cmb_layout(dev, nr_io_queues);
 
 	result = queue_request_irq(dev, adminq, adminq->irqname);
 	if (result) {
@@ -2178,7 +2648,7 @@ static int nvme_dev_add(struct nvme_dev *dev)
 	dma_addr_t dma_addr;
 	int shift = NVME_CAP_MPSMIN(readq(&dev->bar->cap)) + 12;
 
-	mem = dma_alloc_coherent(&pdev->dev, 8192, &dma_addr, GFP_KERNEL);
+	mem = dma_alloc_coherent(dev->dev, 8192, &dma_addr, GFP_KERNEL);
 	if (!mem)
 		return -ENOMEM;
 
@@ -2190,6 +2660,8 @@ static int nvme_dev_add(struct nvme_dev *dev)
 
 	ctrl = mem;
 	nn = le32_to_cpup(&ctrl->nn);
+	dev->vendor = le16_to_cpup(&ctrl->vid);
+	dev->sgls = le32_to_cpup(&ctrl->sgls);
 	dev->oncs = le16_to_cpup(&ctrl->oncs);
 	dev->abort_limit = ctrl->acl + 1;
 	memcpy(dev->serial, ctrl->sn, sizeof(ctrl->sn));
@@ -2197,7 +2669,7 @@ static int nvme_dev_add(struct nvme_dev *dev)
 	memcpy(dev->firmware_rev, ctrl->fr, sizeof(ctrl->fr));
 	if (ctrl->mdts)
 		dev->max_hw_sectors = 1 << (ctrl->mdts + shift - 9);
-	if ((pdev->vendor == PCI_VENDOR_ID_INTEL) &&
+	if (pdev && (pdev->vendor == PCI_VENDOR_ID_INTEL) &&
 			(pdev->device == 0x0953) && ctrl->vs[3])
 		dev->stripe_size = 1 << (ctrl->vs[3] + shift);
 
@@ -2219,73 +2691,74 @@ static int nvme_dev_add(struct nvme_dev *dev)
 		if (ns)
 			list_add_tail(&ns->list, &dev->namespaces);
 	}
-	list_for_each_entry(ns, &dev->namespaces, list)
+	list_for_each_entry(ns, &dev->namespaces, list) {
 		add_disk(ns->disk);
+		nvme_register_meta(ns);
+	}
 	res = 0;
 
  out:
-	dma_free_coherent(&dev->pci_dev->dev, 8192, mem, dma_addr);
+	dma_free_coherent(dev->dev, 8192, mem, dma_addr);
 	return res;
 }
 
+static void nvme_map_cmb(struct nvme_dev *dev)
+{
+	u64 szu, size, offset;
+	u32 cmbloc;
+
+	dev->cmbsz = readl(&dev->bar->cmbsz);
+	if (!dev->ops->map_cmb ||
+	    !((use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz)) ||
+	      NVME_CMB_WDS(dev->cmbsz)))
+		return;
+
+	szu = 1ULL << (12 + 4 * NVME_CMB_SZU(dev->cmbsz));
+	size = szu * NVME_CMB_SZ(dev->cmbsz);
+	cmbloc = readl(&dev->bar->cmbloc);
+	offset = szu * NVME_CMB_OFST(cmbloc);
+
+	dev->cmb = dev->ops->map_cmb(dev, NVME_CMB_BIR(cmbloc), offset, &size,
+							&dev->cmb_dma_addr);
+	if (!dev->cmb)
+		return;
+	dev->cmb_size = size;
+	dev_info(dev->dev, "controller memory buffer: %lluKiB%s%s\n",
+			size >> 10,
+			NVME_CMB_SQS(dev->cmbsz) ? ", SQs" : "",
+			NVME_CMB_WDS(dev->cmbsz) ? ", write data" : "");
+}
+
 static int nvme_dev_map(struct nvme_dev *dev)
 {
 	u64 cap;
-	int bars, result = -ENOMEM;
-	struct pci_dev *pdev = dev->pci_dev;
+	int result;
 
-	if (pci_enable_device_mem(pdev))
+	result = dev->ops->map(dev);
+	if (result)
 		return result;
 
-	dev->entry[0].vector = pdev->irq;
-	pci_set_master(pdev);
-	bars = pci_select_bars(pdev, IORESOURCE_MEM);
-	if (pci_request_selected_regions(pdev, bars, "nvme"))
-		goto disable_pci;
-
-	if (dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64)) &&
-	    dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)))
-		goto disable;
-
-	dev->bar = ioremap(pci_resource_start(pdev, 0), 8192);
-	if (!dev->bar)
-		goto disable;
 	if (readl(&dev->bar->csts) == -1) {
-		result = -ENODEV;
-		goto unmap;
+		dev->ops->unmap(dev);
+		return -ENODEV;
 	}
 	cap = readq(&dev->bar->cap);
 	dev->q_depth = min_t(int, NVME_CAP_MQES(cap) + 1, NVME_Q_DEPTH);
 	dev->db_stride = 1 << NVME_CAP_STRIDE(cap);
 	dev->dbs = ((void __iomem *)dev->bar) + 4096;
+	nvme_map_cmb(dev);
 
 	return 0;
-
- unmap:
-	iounmap(dev->bar);
-	dev->bar = NULL;
- disable:
-	pci_release_regions(pdev);
- disable_pci:
-	pci_disable_device(pdev);
-	return result;
 }
 
 static void nvme_dev_unmap(struct nvme_dev *dev)
 {
-	if (dev->pci_dev->msi_enabled)
-		pci_disable_msi(dev->pci_dev);
-	else if (dev->pci_dev->msix_enabled)
-		pci_disable_msix(dev->pci_dev);
-
-	if (dev->bar) {
-		iounmap(dev->bar);
-		dev->bar = NULL;
-		pci_release_regions(dev->pci_dev);
+	if (dev->cmb) {
+		dev->ops->unmap_cmb(dev, dev->cmb);
+		dev->cmb = NULL;
+		dev->cmb_queues = 0;
 	}
-
-	if (pci_is_enabled(dev->pci_dev))
-		pci_disable_device(dev->pci_dev);
+	dev->ops->unmap(dev);
 }
 
 struct nvme_delq_ctx {
@@ -2401,7 +2874,7 @@ static void nvme_disable_io_queues(struct nvme_dev *dev)
 					&worker, "nvme%d", dev->instance);
 
 	if (IS_ERR(kworker_task)) {
-		dev_err(&dev->pci_dev->dev,
+		dev_err(dev->dev,
 			"Failed to create queue del task\n");
 		for (i = dev->queue_count - 1; i > 0; i--)
 			nvme_disable_queue(dev, i);
@@ -2425,26 +2898,6 @@ static void nvme_disable_io_queues(struct nvme_dev *dev)
 	kthread_stop(kworker_task);
 }
 
-/*
-* Remove the node from the device list and check
-* for whether or not we need to stop the nvme_thread.
-*/
-static void nvme_dev_list_remove(struct nvme_dev *dev)
-{
-	struct task_struct *tmp = NULL;
-
-	spin_lock(&dev_list_lock);
-	list_del_init(&dev->node);
-	if (list_empty(&dev_list) && !IS_ERR_OR_NULL(nvme_thread)) {
-		tmp = nvme_thread;
-		nvme_thread = NULL;
-	}
-	spin_unlock(&dev_list_lock);
-
-	if (tmp)
-		kthread_stop(tmp);
-}
-
 static void nvme_dev_shutdown(struct nvme_dev *dev)
 {
 	int i;
@@ -2452,8 +2905,6 @@ static void nvme_dev_shutdown(struct nvme_dev *dev)
 	dev->initialized = 0;
 	unregister_hotcpu_notifier(&dev->nb);
 
-	nvme_dev_list_remove(dev);
-
 	if (!dev->bar || (dev->bar && readl(&dev->bar->csts) == -1)) {
 		for (i = dev->queue_count - 1; i >= 0; i--) {
 			struct nvme_queue *nvmeq = raw_nvmeq(dev, i);
@@ -2473,8 +2924,11 @@ static void nvme_dev_remove(struct nvme_dev *dev)
 	struct nvme_ns *ns;
 
 	list_for_each_entry(ns, &dev->namespaces, list) {
-		if (ns->disk->flags & GENHD_FL_UP)
+		if (ns->disk->flags & GENHD_FL_UP) {
+			if (blk_get_integrity(ns->disk))
+				blk_integrity_unregister(ns->disk);
 			del_gendisk(ns->disk);
+		}
 		if (!blk_queue_dying(ns->queue))
 			blk_cleanup_queue(ns->queue);
 	}
@@ -2482,7 +2936,7 @@ static void nvme_dev_remove(struct nvme_dev *dev)
 
 static int nvme_setup_prp_pools(struct nvme_dev *dev)
 {
-	struct device *dmadev = &dev->pci_dev->dev;
+	struct device *dmadev = dev->dev;
 	dev->prp_page_pool = dma_pool_create("prp list page", dmadev,
 						PAGE_SIZE, PAGE_SIZE, 0);
 	if (!dev->prp_page_pool)
@@ -2593,7 +3047,6 @@ static const struct file_operations nvme_dev_fops = {
 static int nvme_dev_start(struct nvme_dev *dev)
 {
 	int result;
-	bool start_thread = false;
 
 	result = nvme_dev_map(dev);
 	if (result)
@@ -2603,25 +3056,6 @@ static int nvme_dev_start(struct nvme_dev *dev)
 	if (result)
 		goto unmap;
 
-	spin_lock(&dev_list_lock);
-	if (list_empty(&dev_list) && IS_ERR_OR_NULL(nvme_thread)) {
-		start_thread = true;
-		nvme_thread = NULL;
-	}
-	list_add(&dev->node, &dev_list);
-	spin_unlock(&dev_list_lock);
-
-	if (start_thread) {
-		nvme_thread = kthread_run(nvme_kthread, NULL, "nvme");
-		wake_up(&nvme_kthread_wait);
-	} else
-		wait_event_killable(nvme_kthread_wait, nvme_thread);
-
-	if (IS_ERR_OR_NULL(nvme_thread)) {
-		result = nvme_thread ? PTR_ERR(nvme_thread) : -EINTR;
-		goto disable;
-	}
-
 	result = nvme_setup_io_queues(dev);
 	if (result && result != -EBUSY)
 		goto disable;
@@ -2630,7 +3064,6 @@ static int nvme_dev_start(struct nvme_dev *dev)
 
  disable:
 	nvme_disable_queue(dev, 0);
-	nvme_dev_list_remove(dev);
  unmap:
 	nvme_dev_unmap(dev);
 	return result;
@@ -2639,10 +3072,9 @@ static int nvme_dev_start(struct nvme_dev *dev)
 static int nvme_remove_dead_ctrl(void *arg)
 {
 	struct nvme_dev *dev = (struct nvme_dev *)arg;
-	struct pci_dev *pdev = dev->pci_dev;
 
-	if (pci_get_drvdata(pdev))
-		pci_stop_and_remove_bus_device(pdev);
+	if (dev->ops->remove_dead)
+		dev->ops->remove_dead(dev);
 	kref_put(&dev->kref, nvme_free_dev);
 	return 0;
 }
@@ -2676,11 +3108,11 @@ static void nvme_dev_reset(struct nvme_dev *dev)
 {
 	nvme_dev_shutdown(dev);
 	if (nvme_dev_resume(dev)) {
-		dev_err(&dev->pci_dev->dev, "Device failed to resume\n");
+		dev_err(dev->dev, "Device failed to resume\n");
 		kref_get(&dev->kref);
 		if (IS_ERR(kthread_run(nvme_remove_dead_ctrl, dev, "nvme%d",
 							dev->instance))) {
-			dev_err(&dev->pci_dev->dev,
+			dev_err(dev->dev,
 				"Failed to start controller remove task\n");
 			kref_put(&dev->kref, nvme_free_dev);
 		}
@@ -2699,31 +3131,57 @@ static void nvme_reset_workfn(struct work_struct *work)
 	dev->reset_workfn(work);
 }
 
-static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
+/**
+ * nvme_alloc_ctrl - allocate an nvme_dev for a transport to probe
+ * @dev: the device DMA is done for, and parent of the nvme nodes
+ * @ops: how to reach the controller
+ *
+ * Hand the result to nvme_probe_ctrl(), which frees it on failure.
+ */
+struct nvme_dev *nvme_alloc_ctrl(struct device *dev,
+				const struct nvme_transport_ops *ops)
 {
-	int result = -ENOMEM;
-	struct nvme_dev *dev;
+	struct nvme_dev *ndev;
 
-	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
-	if (!dev)
-		return -ENOMEM;
-	dev->entry = kcalloc(num_possible_cpus(), sizeof(*dev->entry),
+	ndev = kzalloc(sizeof(*ndev), GFP_KERNEL);
+	if (!ndev)
+		return NULL;
+	ndev->entry = kcalloc(num_possible_cpus(), sizeof(*ndev->entry),
 								GFP_KERNEL);
-	if (!dev->entry)
+	if (!ndev->entry)
 		goto free;
-	dev->queues = kcalloc(num_possible_cpus() + 1, sizeof(void *),
+	ndev->queues = kcalloc(num_possible_cpus() + 1, sizeof(void *),
 								GFP_KERNEL);
-	if (!dev->queues)
+	if (!ndev->queues)
 		goto free;
-	dev->io_queue = alloc_percpu(unsigned short);
-	if (!dev->io_queue)
+	ndev->io_queue = alloc_percpu(unsigned short);
+	if (!ndev->io_queue)
 		goto free;
 
-	INIT_LIST_HEAD(&dev->namespaces);
-	dev->reset_workfn = nvme_reset_failed_dev;
-	INIT_WORK(&dev->reset_work, nvme_reset_workfn);
-	dev->pci_dev = pdev;
-	pci_set_drvdata(pdev, dev);
+	INIT_LIST_HEAD(&ndev->namespaces);
+	ndev->reset_workfn = nvme_reset_failed_dev;
+	INIT_WORK(&ndev->reset_work, nvme_reset_workfn);
+	ndev->dev = dev;
+	ndev->ops = ops;
+	return ndev;
+
+ free:
+	free_percpu(ndev->io_queue);
+	kfree(ndev->queues);
+	kfree(ndev->entry);
+	kfree(ndev);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(nvme_alloc_ctrl);
+
+/**
+ * nvme_probe_ctrl - bring up a controller and add its namespaces
+ * @dev: from nvme_alloc_ctrl(), freed if this fails
+ */
+int nvme_probe_ctrl(struct nvme_dev *dev)
+{
+	int result;
+
 	result = nvme_set_instance(dev);
 	if (result)
 		goto free;
@@ -2747,7 +3205,7 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
  create_cdev:
 	scnprintf(dev->name, sizeof(dev->name), "nvme%d", dev->instance);
 	dev->miscdev.minor = MISC_DYNAMIC_MINOR;
-	dev->miscdev.parent = &pdev->dev;
+	dev->miscdev.parent = dev->dev;
 	dev->miscdev.name = dev->name;
 	dev->miscdev.fops = &nvme_dev_fops;
 	result = misc_register(&dev->miscdev);
@@ -2774,6 +3232,179 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	kfree(dev);
 	return result;
 }
+EXPORT_SYMBOL_GPL(nvme_probe_ctrl);
+
+/**
+ * nvme_remove_ctrl - tear down a controller added by nvme_probe_ctrl()
+ * @dev: dropped; freed once the last opener goes away
+ */
+void nvme_remove_ctrl(struct nvme_dev *dev)
+{
+	flush_work(&dev->reset_work);
+	misc_deregister(&dev->miscdev);
+	nvme_dev_remove(dev);
+	nvme_dev_shutdown(dev);
+	nvme_free_queues(dev, 0);
+	rcu_barrier();
+	nvme_release_instance(dev);
+	nvme_release_prp_pools(dev);
+	kref_put(&dev->kref, nvme_free_dev);
+}
+EXPORT_SYMBOL_GPL(nvme_remove_ctrl);
+
+static int nvme_pci_map(struct nvme_dev *dev)
+{
+	int bars, result = -ENOMEM;
+	struct pci_dev *pdev = dev->pci_dev;
+
+	if (pci_enable_device_mem(pdev))
+		return result;
+
+	dev->entry[0].vector = pdev->irq;
+	pci_set_master(pdev);
+	bars = pci_select_bars(pdev, IORESOURCE_MEM);
+	if (pci_request_selected_regions(pdev, bars, "nvme"))
+		goto disable_pci;
+
+	if (dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64)) &&
+	    dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32)))
+		goto disable;
+
+	dev->bar = ioremap(pci_resource_start(pdev, 0), 8192);
+	if (!dev->bar)
+		goto disable;
+
+	return 0;
+
+ disable:
+	pci_release_regions(pdev);
+ disable_pci:
+	pci_disable_device(pdev);
+	return result;
+}
+
+static void __iomem *nvme_pci_map_cmb(struct nvme_dev *dev, int bir,
+			u64 offset, u64 *size, dma_addr_t *dma_addr)
+{
+	struct pci_dev *pdev = dev->pci_dev;
+	u64 bar_size = pci_resource_len(pdev, bir);
+	void __iomem *cmb;
+
+	if (offset >= bar_size)
+		return NULL;
+	*size = min(*size, bar_size - offset);
+	cmb = ioremap_wc(pci_resource_start(pdev, bir) + offset, *size);
+	if (cmb)
+		*dma_addr = pci_bus_address(pdev, bir) + offset;
+	return cmb;
+}
+
+static void nvme_pci_unmap_cmb(struct nvme_dev *dev, void __iomem *cmb)
+{
+	iounmap(cmb);
+}
+
+static void nvme_pci_unmap(struct nvme_dev *dev)
+{
+	if (dev->pci_dev->msi_enabled)
+		pci_disable_msi(dev->pci_dev);
+	else if (dev->pci_dev->msix_enabled)
+		pci_disable_msix(dev->pci_dev);
+
+	if (dev->bar) {
+		iounmap(dev->bar);
+		dev->bar = NULL;
+		pci_release_regions(dev->pci_dev);
+	}
+
+	if (pci_is_enabled(dev->pci_dev))
+		pci_disable_device(dev->pci_dev);
+}
+
+static int nvme_pci_setup_vectors(struct nvme_dev *dev, int nr_io_queues)
+{
+	struct pci_dev *pdev = dev->pci_dev;
+	int i, vecs, size;
+
+	size = db_bar_size(dev, nr_io_queues);
+	if (size > 8192) {
+		iounmap(dev->bar);
+		do {
+			dev->bar = ioremap(pci_resource_start(pdev, 0), size);
+			if (dev->bar)
+				break;
+			if (!--nr_io_queues)
+				return -ENOMEM;
+			size = db_bar_size(dev, nr_io_queues);
+		} while (1);
+	}
+
+	for (i = 0; i < nr_io_queues; i++)
+		dev->entry[i].entry = i;
+	vecs = pci_enable_msix_range(pdev, dev->entry, 1, nr_io_queues);
+	if (vecs < 0) {
+		vecs = pci_enable_msi_range(pdev, 1, min(nr_io_queues, 32));
+		if (vecs < 0) {
+			vecs = 1;
+		} else {
+			for (i = 0; i < vecs; i++)
+				dev->entry[i].vector = i + pdev->irq;
+		}
+	}
+	return vecs;
+}
+
+static int nvme_pci_request_irq(struct nvme_dev *dev, int vector,
+			irq_handler_t handler, irq_handler_t thread_fn,
+			const char *name, void *data)
+{
+	return request_threaded_irq(dev->entry[vector].vector, handler,
+					thread_fn, IRQF_SHARED, name, data);
+}
+
+static void nvme_pci_free_irq(struct nvme_dev *dev, int vector, void *data)
+{
+	irq_set_affinity_hint(dev->entry[vector].vector, NULL);
+	free_irq(dev->entry[vector].vector, data);
+}
+
+static void nvme_pci_set_irq_affinity(struct nvme_dev *dev, int vector,
+					const struct cpumask *mask)
+{
+	irq_set_affinity_hint(dev->entry[vector].vector, mask);
+}
+
+static void nvme_pci_remove_dead(struct nvme_dev *dev)
+{
+	struct pci_dev *pdev = dev->pci_dev;
+
+	if (pci_get_drvdata(pdev))
+		pci_stop_and_remove_bus_device(pdev);
+}
+
+static const struct nvme_transport_ops nvme_pci_ops = {
+	.map			= nvme_pci_map,
+	.unmap			= nvme_pci_unmap,
+	.setup_vectors		= nvme_pci_setup_vectors,
+	.request_irq		= nvme_pci_request_irq,
+	.free_irq		= nvme_pci_free_irq,
+	.set_irq_affinity	= nvme_pci_set_irq_affinity,
+	.remove_dead		= nvme_pci_remove_dead,
+	.map_cmb		= nvme_pci_map_cmb,
+	.unmap_cmb		= nvme_pci_unmap_cmb,
+};
+
+static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
+{
+	struct nvme_dev *dev;
+
+	dev = nvme_alloc_ctrl(&pdev->dev, &nvme_pci_ops);
+	if (!dev)
+		return -ENOMEM;
+	dev->pci_dev = pdev;
+	pci_set_drvdata(pdev, dev);
+	return nvme_probe_ctrl(dev);
+}
 
 static void nvme_reset_notify(struct pci_dev *pdev, bool prepare)
 {
@@ -2795,20 +3426,8 @@ static void nvme_remove(struct pci_dev *pdev)
 {
 	struct nvme_dev *dev = pci_get_drvdata(pdev);
 
-	spin_lock(&dev_list_lock);
-	list_del_init(&dev->node);
-	spin_unlock(&dev_list_lock);
-
 	pci_set_drvdata(pdev, NULL);
-	flush_work(&dev->reset_work);
-	misc_deregister(&dev->miscdev);
-	nvme_dev_remove(dev);
-	nvme_dev_shutdown(dev);
-	nvme_free_queues(dev, 0);
-	rcu_barrier();
-	nvme_release_instance(dev);
-	nvme_release_prp_pools(dev);
-	kref_put(&dev->kref, nvme_free_dev);
+	nvme_remove_ctrl(dev);
 }
 
 /* These functions are yet to be implemented */
@@ -2877,8 +3496,6 @@ static int __init nvme_init(void)
 {
 	int result;
 
-	init_waitqueue_head(&nvme_kthread_wait);
-
 	nvme_workq = create_singlethread_workqueue("nvme");
 	if (!nvme_workq)
 		return -ENOMEM;
@@ -2906,7 +3523,6 @@ static void __exit nvme_exit(void)
 	pci_unregister_driver(&nvme_driver);
 	unregister_blkdev(nvme_major, "nvme");
 	destroy_workqueue(nvme_workq);
-	BUG_ON(nvme_thread && !IS_ERR(nvme_thread));
 }
 
 MODULE_AUTHOR("Matthew Wilcox <willy@linux.intel.com>");
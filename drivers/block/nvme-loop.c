@@ -0,0 +1,1000 @@
+/*
+ * NVM Express loopback controller
+ *
+ * A software NVMe controller driven by nvme-core like any other: commands
+ * are fetched from submission queues in host memory and completed on
+ * completion queues, followed by an interrupt.  A kernel thread plays the
+ * device, serving one namespace from RAM or from another block device.
+ *
+ * The controller reads and writes host memory by physical address, so DMA
+ * addresses must not be translated by an IOMMU.  With cmb_kb set it also
+ * offers a controller memory buffer, which is just more kernel memory, for
+ * trying out SQ and write data placement without the hardware.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/nvme.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
+#include <linux/fs.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+static char *backing;
+module_param(backing, charp, 0444);
+MODULE_PARM_DESC(backing, "block device to serve (default: RAM)");
+
+static unsigned long ram_mb = 256;
+module_param(ram_mb, ulong, 0444);
+MODULE_PARM_DESC(ram_mb, "size of the RAM namespace in MiB");
+
+static unsigned int nr_io_queues;
+module_param(nr_io_queues, uint, 0444);
+MODULE_PARM_DESC(nr_io_queues, "IO queues offered (default: one per CPU)");
+
+static unsigned int cmb_kb;
+module_param(cmb_kb, uint, 0444);
+MODULE_PARM_DESC(cmb_kb, "controller memory buffer size in KiB (max 4096)");
+
+#define NVME_LOOP_Q_DEPTH	1024
+#define NVME_LOOP_LBA_SHIFT	9
+#define NVME_LOOP_BATCH		32	/* commands fetched per SQ per pass */
+
+struct nvme_loop_sq {
+	struct nvme_command *cmds;
+	u16 size;
+	u16 head;
+	u16 cqid;
+	bool valid;
+};
+
+struct nvme_loop_cq {
+	struct nvme_completion *cqes;
+	u16 size;
+	u16 tail;
+	u16 vector;
+	u16 reserved;		/* fetched commands not yet completed */
+	u8 phase;
+	bool irq_enabled;
+	bool irq_pending;
+	bool valid;
+};
+
+struct nvme_loop_vector {
+	irq_handler_t handler;
+	irq_handler_t thread_fn;
+	void *data;
+};
+
+/* A command handed to the backing device, completed by the thread */
+struct nvme_loop_cmd {
+	struct llist_node node;
+	struct nvme_loop_ctrl *ctrl;
+	atomic_t pending;
+	u16 sqid;
+	u16 command_id;
+	u16 status;
+};
+
+struct nvme_loop_ctrl {
+	struct device *dev;
+	struct nvme_dev *ndev;
+	struct task_struct *thread;
+	wait_queue_head_t wait;
+	unsigned long kicked;
+	atomic_t inflight;
+	struct llist_head done;
+
+	/* register page, then a SQ tail and CQ head doorbell per queue */
+	void *regs;
+	struct nvme_bar *bar;
+	u32 *dbs;
+	void *cmb;
+	size_t cmb_size;
+	unsigned nr_queues;
+	struct nvme_loop_sq *sqs;
+	struct nvme_loop_cq *cqs;
+	spinlock_t vec_lock;
+	struct nvme_loop_vector *vecs;
+
+	struct block_device *bdev;
+	void *ram;
+	u64 nr_lbas;
+};
+
+static struct nvme_loop_ctrl *nvme_loop;
+
+static void nvme_loop_kick(struct nvme_loop_ctrl *ctrl)
+{
+	set_bit(0, &ctrl->kicked);
+	wake_up(&ctrl->wait);
+}
+
+static void *nvme_loop_host_addr(u64 addr)
+{
+	return phys_to_virt(addr);
+}
+
+typedef void (*nvme_loop_seg_fn)(struct page *page, unsigned offset,
+						unsigned len, void *data);
+
+/*
+ * Walk the host pages described by a command's PRP entries, in the layout
+ * nvme_setup_prps() builds: PRP1 may start mid-page, PRP2 is the second
+ * page or a list of pages whose last entry chains to the next list.
+ */
+static void nvme_loop_for_each_prp(u64 prp1, u64 prp2, unsigned len,
+					nvme_loop_seg_fn fn, void *data)
+{
+	unsigned offset = offset_in_page(prp1);
+	unsigned seg = min_t(unsigned, len, PAGE_SIZE - offset);
+	__le64 *list;
+	int i;
+
+	fn(pfn_to_page(prp1 >> PAGE_SHIFT), offset, seg, data);
+	len -= seg;
+	if (!len)
+		return;
+
+	if (len <= PAGE_SIZE) {
+		fn(pfn_to_page(prp2 >> PAGE_SHIFT), 0, len, data);
+		return;
+	}
+
+	list = nvme_loop_host_addr(prp2);
+	for (i = 0; len; i++) {
+		u64 addr;
+
+		if (i == PAGE_SIZE / 8 - 1 && len > PAGE_SIZE) {
+			list = nvme_loop_host_addr(le64_to_cpu(list[i]));
+			i = 0;
+		}
+		addr = le64_to_cpu(list[i]);
+		seg = min_t(unsigned, len, PAGE_SIZE);
+		fn(pfn_to_page(addr >> PAGE_SHIFT), 0, seg, data);
+		len -= seg;
+	}
+}
+
+struct nvme_loop_copy {
+	void *buf;
+	bool to_host;
+};
+
+static void nvme_loop_copy_seg(struct page *page, unsigned offset,
+						unsigned len, void *data)
+{
+	struct nvme_loop_copy *copy = data;
+	void *host = page_address(page) + offset;
+
+	if (copy->to_host)
+		memcpy(host, copy->buf, len);
+	else
+		memcpy(copy->buf, host, len);
+	copy->buf += len;
+}
+
+static void nvme_loop_copy_to_host(struct nvme_command *cmd, void *buf,
+								unsigned len)
+{
+	struct nvme_loop_copy copy = { .buf = buf, .to_host = true };
+
+	nvme_loop_for_each_prp(le64_to_cpu(cmd->common.prp1),
+			le64_to_cpu(cmd->common.prp2), len,
+			nvme_loop_copy_seg, &copy);
+}
+
+static bool nvme_loop_cq_has_room(struct nvme_loop_ctrl *ctrl, u16 cqid)
+{
+	struct nvme_loop_cq *cq = &ctrl->cqs[cqid];
+	u16 head = ACCESS_ONCE(ctrl->dbs[cqid * 2 + 1]);
+	u16 used = (cq->tail + cq->size - head) % cq->size;
+
+	return used + cq->reserved < cq->size - 1;
+}
+
+static void nvme_loop_post(struct nvme_loop_ctrl *ctrl, u16 sqid,
+				u16 command_id, u16 status, u32 result)
+{
+	struct nvme_loop_sq *sq = &ctrl->sqs[sqid];
+	struct nvme_loop_cq *cq = &ctrl->cqs[sq->cqid];
+	struct nvme_completion *cqe = &cq->cqes[cq->tail];
+
+	cqe->result = cpu_to_le32(result);
+	cqe->sq_head = cpu_to_le16(sq->head);
+	cqe->sq_id = cpu_to_le16(sqid);
+	cqe->command_id = command_id;
+	/* the host looks at the phase bit before the rest of the entry */
+	smp_wmb();
+	cqe->status = cpu_to_le16(status << 1 | cq->phase);
+
+	if (++cq->tail == cq->size) {
+		cq->tail = 0;
+		cq->phase = !cq->phase;
+	}
+	cq->reserved--;
+	cq->irq_pending = cq->irq_enabled;
+}
+
+static void nvme_loop_raise_irqs(struct nvme_loop_ctrl *ctrl)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < ctrl->nr_queues; i++) {
+		struct nvme_loop_cq *cq = &ctrl->cqs[i];
+		struct nvme_loop_vector *vec;
+
+		if (!cq->irq_pending)
+			continue;
+		cq->irq_pending = false;
+
+		vec = &ctrl->vecs[cq->vector];
+		spin_lock_irqsave(&ctrl->vec_lock, flags);
+		if (vec->handler &&
+		    vec->handler(cq->vector, vec->data) == IRQ_WAKE_THREAD &&
+		    vec->thread_fn)
+			vec->thread_fn(cq->vector, vec->data);
+		spin_unlock_irqrestore(&ctrl->vec_lock, flags);
+	}
+}
+
+static bool nvme_loop_reap(struct nvme_loop_ctrl *ctrl)
+{
+	struct llist_node *node = llist_del_all(&ctrl->done);
+	bool reaped = node != NULL;
+
+	node = llist_reverse_order(node);
+	while (node) {
+		struct nvme_loop_cmd *cmd;
+
+		cmd = llist_entry(node, struct nvme_loop_cmd, node);
+		node = node->next;
+		nvme_loop_post(ctrl, cmd->sqid, cmd->command_id, cmd->status,
+									0);
+		kfree(cmd);
+	}
+	return reaped;
+}
+
+/* Wait for the backing device to finish everything it was given */
+static void nvme_loop_quiesce(struct nvme_loop_ctrl *ctrl)
+{
+	while (atomic_read(&ctrl->inflight))
+		wait_event_timeout(ctrl->wait, !atomic_read(&ctrl->inflight),
+									1);
+	nvme_loop_reap(ctrl);
+}
+
+static void nvme_loop_put_cmd(struct nvme_loop_cmd *cmd)
+{
+	struct nvme_loop_ctrl *ctrl = cmd->ctrl;
+
+	if (!atomic_dec_and_test(&cmd->pending))
+		return;
+	llist_add(&cmd->node, &ctrl->done);
+	nvme_loop_kick(ctrl);
+	/* last touch of ctrl, nvme_loop_quiesce() may return after this */
+	smp_mb__before_atomic();
+	atomic_dec(&ctrl->inflight);
+}
+
+static void nvme_loop_end_io(struct bio *bio, int error)
+{
+	struct nvme_loop_cmd *cmd = bio->bi_private;
+
+	if (error)
+		cmd->status = (bio->bi_rw & REQ_WRITE) ? NVME_SC_WRITE_FAULT :
+							NVME_SC_READ_ERROR;
+	bio_put(bio);
+	nvme_loop_put_cmd(cmd);
+}
+
+static struct nvme_loop_cmd *nvme_loop_alloc_cmd(struct nvme_loop_ctrl *ctrl,
+					u16 sqid, struct nvme_command *c)
+{
+	struct nvme_loop_cmd *cmd = kmalloc(sizeof(*cmd), GFP_NOIO);
+
+	if (!cmd)
+		return NULL;
+	cmd->ctrl = ctrl;
+	atomic_set(&cmd->pending, 1);
+	cmd->sqid = sqid;
+	cmd->command_id = c->common.command_id;
+	cmd->status = NVME_SC_SUCCESS;
+	atomic_inc(&ctrl->inflight);
+	return cmd;
+}
+
+static struct bio *nvme_loop_bio(struct nvme_loop_cmd *cmd, sector_t sector,
+								int nr_vecs)
+{
+	struct bio *bio = bio_alloc(GFP_NOIO, nr_vecs);
+
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_bdev = cmd->ctrl->bdev;
+	bio->bi_end_io = nvme_loop_end_io;
+	bio->bi_private = cmd;
+	return bio;
+}
+
+static void nvme_loop_submit_bio(struct nvme_loop_cmd *cmd, int rw,
+							struct bio *bio)
+{
+	atomic_inc(&cmd->pending);
+	submit_bio(rw, bio);
+}
+
+struct nvme_loop_bio_iter {
+	struct nvme_loop_cmd *cmd;
+	struct bio *bio;
+	sector_t sector;
+	int rw;
+};
+
+static void nvme_loop_bio_seg(struct page *page, unsigned offset,
+						unsigned len, void *data)
+{
+	struct nvme_loop_bio_iter *iter = data;
+
+	while (!iter->bio || !bio_add_page(iter->bio, page, len, offset)) {
+		if (iter->bio)
+			nvme_loop_submit_bio(iter->cmd, iter->rw, iter->bio);
+		iter->bio = nvme_loop_bio(iter->cmd, iter->sector,
+								BIO_MAX_PAGES);
+	}
+	iter->sector += len >> 9;
+}
+
+static int nvme_loop_rw(struct nvme_loop_ctrl *ctrl, u16 sqid,
+						struct nvme_command *c)
+{
+	struct nvme_rw_command *rw = &c->rw;
+	u64 slba = le64_to_cpu(rw->slba);
+	u32 nlb = le16_to_cpu(rw->length) + 1;
+	unsigned len = nlb << NVME_LOOP_LBA_SHIFT;
+	bool write = rw->opcode == nvme_cmd_write;
+	struct nvme_loop_bio_iter iter;
+
+	if (slba >= ctrl->nr_lbas || nlb > ctrl->nr_lbas - slba)
+		return NVME_SC_LBA_RANGE | NVME_SC_DNR;
+
+	if (ctrl->ram) {
+		struct nvme_loop_copy copy = {
+			.buf = ctrl->ram + (slba << NVME_LOOP_LBA_SHIFT),
+			.to_host = !write,
+		};
+
+		nvme_loop_for_each_prp(le64_to_cpu(rw->prp1),
+				le64_to_cpu(rw->prp2), len,
+				nvme_loop_copy_seg, &copy);
+		return NVME_SC_SUCCESS;
+	}
+
+	iter.cmd = nvme_loop_alloc_cmd(ctrl, sqid, c);
+	if (!iter.cmd)
+		return NVME_SC_INTERNAL;
+	iter.bio = NULL;
+	iter.sector = slba << (NVME_LOOP_LBA_SHIFT - 9);
+	iter.rw = write ? WRITE : READ;
+	if (le16_to_cpu(rw->control) & NVME_RW_FUA)
+		iter.rw |= REQ_FUA;
+
+	nvme_loop_for_each_prp(le64_to_cpu(rw->prp1), le64_to_cpu(rw->prp2),
+				len, nvme_loop_bio_seg, &iter);
+	nvme_loop_submit_bio(iter.cmd, iter.rw, iter.bio);
+	nvme_loop_put_cmd(iter.cmd);
+	return -EINPROGRESS;
+}
+
+static int nvme_loop_flush(struct nvme_loop_ctrl *ctrl, u16 sqid,
+						struct nvme_command *c)
+{
+	struct nvme_loop_cmd *cmd;
+
+	if (ctrl->ram)
+		return NVME_SC_SUCCESS;
+
+	cmd = nvme_loop_alloc_cmd(ctrl, sqid, c);
+	if (!cmd)
+		return NVME_SC_INTERNAL;
+	nvme_loop_submit_bio(cmd, WRITE_FLUSH, nvme_loop_bio(cmd, 0, 0));
+	nvme_loop_put_cmd(cmd);
+	return -EINPROGRESS;
+}
+
+static void nvme_loop_io_cmd(struct nvme_loop_ctrl *ctrl, u16 sqid,
+						struct nvme_command *c)
+{
+	int status;
+
+	if (le32_to_cpu(c->common.nsid) != 1) {
+		status = NVME_SC_INVALID_NS | NVME_SC_DNR;
+		goto post;
+	}
+
+	switch (c->common.opcode) {
+	case nvme_cmd_read:
+	case nvme_cmd_write:
+		status = nvme_loop_rw(ctrl, sqid, c);
+		break;
+	case nvme_cmd_flush:
+		status = nvme_loop_flush(ctrl, sqid, c);
+		break;
+	default:
+		status = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+		break;
+	}
+	if (status == -EINPROGRESS)
+		return;
+ post:
+	nvme_loop_post(ctrl, sqid, c->common.command_id, status, 0);
+}
+
+static void nvme_loop_fill(char *field, size_t size, const char *s)
+{
+	memset(field, ' ', size);
+	memcpy(field, s, min(size, strlen(s)));
+}
+
+static int nvme_loop_identify(struct nvme_loop_ctrl *ctrl,
+						struct nvme_command *c)
+{
+	void *mem = kzalloc(4096, GFP_NOIO);
+	int status = NVME_SC_SUCCESS;
+
+	if (!mem)
+		return NVME_SC_INTERNAL;
+
+	if (le32_to_cpu(c->identify.cns) == 1) {
+		struct nvme_id_ctrl *id = mem;
+
+		nvme_loop_fill(id->sn, sizeof(id->sn), dev_name(ctrl->dev));
+		nvme_loop_fill(id->mn, sizeof(id->mn), "Linux NVMe loopback");
+		nvme_loop_fill(id->fr, sizeof(id->fr), "1.0");
+		id->mdts = 8;
+		id->acl = 3;
+		id->sqes = 0x66;
+		id->cqes = 0x44;
+		id->nn = cpu_to_le32(1);
+		id->vwc = ctrl->bdev ? 1 : 0;
+	} else if (!le32_to_cpu(c->identify.cns) &&
+		   le32_to_cpu(c->identify.nsid) == 1) {
+		struct nvme_id_ns *id = mem;
+
+		id->nsze = cpu_to_le64(ctrl->nr_lbas);
+		id->ncap = cpu_to_le64(ctrl->nr_lbas);
+		id->nuse = cpu_to_le64(ctrl->nr_lbas);
+		id->lbaf[0].ds = NVME_LOOP_LBA_SHIFT;
+	} else {
+		status = NVME_SC_INVALID_NS | NVME_SC_DNR;
+	}
+
+	if (status == NVME_SC_SUCCESS)
+		nvme_loop_copy_to_host(c, mem, 4096);
+	kfree(mem);
+	return status;
+}
+
+static int nvme_loop_features(struct nvme_loop_ctrl *ctrl,
+					struct nvme_command *c, u32 *result)
+{
+	switch (le32_to_cpu(c->features.fid)) {
+	case NVME_FEAT_NUM_QUEUES:
+		/* report what we have, the host takes the smaller count */
+		*result = (ctrl->nr_queues - 2) | (ctrl->nr_queues - 2) << 16;
+		return NVME_SC_SUCCESS;
+	case NVME_FEAT_VOLATILE_WC:
+		if (c->common.opcode == nvme_admin_get_features)
+			*result = ctrl->bdev ? 1 : 0;
+		return NVME_SC_SUCCESS;
+	default:
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	}
+}
+
+static int nvme_loop_create_cq(struct nvme_loop_ctrl *ctrl,
+						struct nvme_create_cq *c)
+{
+	u16 qid = le16_to_cpu(c->cqid);
+	u16 size = le16_to_cpu(c->qsize) + 1;
+	u16 flags = le16_to_cpu(c->cq_flags);
+	u16 vector = le16_to_cpu(c->irq_vector);
+	struct nvme_loop_cq *cq;
+
+	if (!qid || qid >= ctrl->nr_queues || ctrl->cqs[qid].valid)
+		return NVME_SC_QID_INVALID | NVME_SC_DNR;
+	if (size < 2 || size > NVME_LOOP_Q_DEPTH)
+		return NVME_SC_QUEUE_SIZE | NVME_SC_DNR;
+	if (!(flags & NVME_QUEUE_PHYS_CONTIG))
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+	if (vector >= ctrl->nr_queues)
+		return NVME_SC_INVALID_VECTOR | NVME_SC_DNR;
+
+	cq = &ctrl->cqs[qid];
+	cq->cqes = nvme_loop_host_addr(le64_to_cpu(c->prp1));
+	cq->size = size;
+	cq->tail = 0;
+	cq->vector = vector;
+	cq->reserved = 0;
+	cq->phase = 1;
+	cq->irq_enabled = flags & NVME_CQ_IRQ_ENABLED;
+	cq->irq_pending = false;
+	ctrl->dbs[qid * 2 + 1] = 0;
+	cq->valid = true;
+	return NVME_SC_SUCCESS;
+}
+
+static int nvme_loop_create_sq(struct nvme_loop_ctrl *ctrl,
+						struct nvme_create_sq *c)
+{
+	u16 qid = le16_to_cpu(c->sqid);
+	u16 size = le16_to_cpu(c->qsize) + 1;
+	u16 cqid = le16_to_cpu(c->cqid);
+	struct nvme_loop_sq *sq;
+
+	if (!qid || qid >= ctrl->nr_queues || ctrl->sqs[qid].valid)
+		return NVME_SC_QID_INVALID | NVME_SC_DNR;
+	if (!cqid || cqid >= ctrl->nr_queues || !ctrl->cqs[cqid].valid)
+		return NVME_SC_CQ_INVALID | NVME_SC_DNR;
+	if (size < 2 || size > NVME_LOOP_Q_DEPTH)
+		return NVME_SC_QUEUE_SIZE | NVME_SC_DNR;
+	if (!(le16_to_cpu(c->sq_flags) & NVME_QUEUE_PHYS_CONTIG))
+		return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+
+	sq = &ctrl->sqs[qid];
+	sq->cmds = nvme_loop_host_addr(le64_to_cpu(c->prp1));
+	sq->size = size;
+	sq->head = 0;
+	sq->cqid = cqid;
+	ctrl->dbs[qid * 2] = 0;
+	sq->valid = true;
+	return NVME_SC_SUCCESS;
+}
+
+static int nvme_loop_delete_sq(struct nvme_loop_ctrl *ctrl,
+						struct nvme_command *c)
+{
+	u16 qid = le16_to_cpu(c->delete_queue.qid);
+
+	if (!qid || qid >= ctrl->nr_queues || !ctrl->sqs[qid].valid)
+		return NVME_SC_QID_INVALID | NVME_SC_DNR;
+
+	/* commands from this queue complete before the deletion does */
+	nvme_loop_quiesce(ctrl);
+	ctrl->sqs[qid].valid = false;
+	return NVME_SC_SUCCESS;
+}
+
+static int nvme_loop_delete_cq(struct nvme_loop_ctrl *ctrl,
+						struct nvme_command *c)
+{
+	u16 qid = le16_to_cpu(c->delete_queue.qid);
+	int i;
+
+	if (!qid || qid >= ctrl->nr_queues || !ctrl->cqs[qid].valid)
+		return NVME_SC_QID_INVALID | NVME_SC_DNR;
+	for (i = 1; i < ctrl->nr_queues; i++)
+		if (ctrl->sqs[i].valid && ctrl->sqs[i].cqid == qid)
+			return NVME_SC_INVALID_FIELD | NVME_SC_DNR;
+
+	ctrl->cqs[qid].valid = false;
+	return NVME_SC_SUCCESS;
+}
+
+static void nvme_loop_admin_cmd(struct nvme_loop_ctrl *ctrl,
+						struct nvme_command *c)
+{
+	u32 result = 0;
+	int status;
+
+	switch (c->common.opcode) {
+	case nvme_admin_identify:
+		status = nvme_loop_identify(ctrl, c);
+		break;
+	case nvme_admin_get_features:
+	case nvme_admin_set_features:
+		status = nvme_loop_features(ctrl, c, &result);
+		break;
+	case nvme_admin_create_cq:
+		status = nvme_loop_create_cq(ctrl, &c->create_cq);
+		break;
+	case nvme_admin_create_sq:
+		status = nvme_loop_create_sq(ctrl, &c->create_sq);
+		break;
+	case nvme_admin_delete_sq:
+		status = nvme_loop_delete_sq(ctrl, c);
+		break;
+	case nvme_admin_delete_cq:
+		status = nvme_loop_delete_cq(ctrl, c);
+		break;
+	case nvme_admin_abort_cmd:
+		/* commands run to completion; report this one as not aborted */
+		result = 1;
+		status = NVME_SC_SUCCESS;
+		break;
+	default:
+		status = NVME_SC_INVALID_OPCODE | NVME_SC_DNR;
+		break;
+	}
+	nvme_loop_post(ctrl, 0, c->common.command_id, status, result);
+}
+
+/* Returns true if any command was fetched */
+static bool nvme_loop_poll_sqs(struct nvme_loop_ctrl *ctrl)
+{
+	bool busy = false;
+	int qid;
+
+	for (qid = 0; qid < ctrl->nr_queues; qid++) {
+		struct nvme_loop_sq *sq = &ctrl->sqs[qid];
+		struct nvme_command cmd;
+		u16 tail;
+		int n;
+
+		if (!sq->valid)
+			continue;
+		tail = ACCESS_ONCE(ctrl->dbs[qid * 2]);
+		if (tail >= sq->size) {
+			ctrl->bar->csts |= NVME_CSTS_CFS;
+			return false;
+		}
+		/* read the entries after the doorbell that published them */
+		smp_rmb();
+
+		for (n = 0; n < NVME_LOOP_BATCH && sq->head != tail; n++) {
+			if (!nvme_loop_cq_has_room(ctrl, sq->cqid))
+				break;
+			cmd = sq->cmds[sq->head];
+			if (++sq->head == sq->size)
+				sq->head = 0;
+			ctrl->cqs[sq->cqid].reserved++;
+			if (qid)
+				nvme_loop_io_cmd(ctrl, qid, &cmd);
+			else
+				nvme_loop_admin_cmd(ctrl, &cmd);
+			busy = true;
+		}
+	}
+	return busy;
+}
+
+static void nvme_loop_disable(struct nvme_loop_ctrl *ctrl)
+{
+	int i;
+
+	nvme_loop_quiesce(ctrl);
+	nvme_loop_raise_irqs(ctrl);
+	for (i = 0; i < ctrl->nr_queues; i++) {
+		ctrl->sqs[i].valid = false;
+		ctrl->cqs[i].valid = false;
+	}
+	memset(ctrl->dbs, 0, ctrl->nr_queues * 8);
+}
+
+static int nvme_loop_enable(struct nvme_loop_ctrl *ctrl, u32 cc)
+{
+	struct nvme_bar *bar = ctrl->bar;
+	struct nvme_loop_sq *sq = &ctrl->sqs[0];
+	struct nvme_loop_cq *cq = &ctrl->cqs[0];
+
+	if (((cc >> NVME_CC_MPS_SHIFT) & 0xf) != PAGE_SHIFT - 12)
+		return -EINVAL;
+
+	memset(ctrl->dbs, 0, ctrl->nr_queues * 8);
+	sq->cmds = nvme_loop_host_addr(bar->asq);
+	sq->size = (bar->aqa & 0xfff) + 1;
+	sq->head = 0;
+	sq->cqid = 0;
+	sq->valid = true;
+
+	cq->cqes = nvme_loop_host_addr(bar->acq);
+	cq->size = ((bar->aqa >> 16) & 0xfff) + 1;
+	cq->tail = 0;
+	cq->vector = 0;
+	cq->reserved = 0;
+	cq->phase = 1;
+	cq->irq_enabled = true;
+	cq->irq_pending = false;
+	cq->valid = true;
+	return 0;
+}
+
+/* React to the host's writes to CC, as a controller would */
+static void nvme_loop_check_cc(struct nvme_loop_ctrl *ctrl)
+{
+	struct nvme_bar *bar = ctrl->bar;
+	u32 cc = ACCESS_ONCE(bar->cc);
+	u32 csts = bar->csts;
+
+	if (!(cc & NVME_CC_ENABLE)) {
+		if (csts & NVME_CSTS_RDY)
+			nvme_loop_disable(ctrl);
+		bar->csts = 0;
+		return;
+	}
+
+	if (cc & NVME_CC_SHN_MASK) {
+		if ((csts & NVME_CSTS_SHST_MASK) != NVME_CSTS_SHST_CMPLT) {
+			nvme_loop_disable(ctrl);
+			bar->csts = (csts & ~NVME_CSTS_SHST_MASK) |
+							NVME_CSTS_SHST_CMPLT;
+		}
+		return;
+	}
+
+	if (!(csts & (NVME_CSTS_RDY | NVME_CSTS_CFS)))
+		bar->csts = nvme_loop_enable(ctrl, cc) ? NVME_CSTS_CFS :
+								NVME_CSTS_RDY;
+}
+
+static int nvme_loop_thread(void *data)
+{
+	struct nvme_loop_ctrl *ctrl = data;
+
+	while (!kthread_should_stop()) {
+		bool busy;
+
+		clear_bit(0, &ctrl->kicked);
+		nvme_loop_check_cc(ctrl);
+		busy = nvme_loop_reap(ctrl);
+		if (ctrl->bar->csts == NVME_CSTS_RDY)
+			busy |= nvme_loop_poll_sqs(ctrl);
+		nvme_loop_raise_irqs(ctrl);
+
+		if (busy)
+			cond_resched();
+		else
+			wait_event_interruptible_timeout(ctrl->wait,
+					test_bit(0, &ctrl->kicked) ||
+					kthread_should_stop(), HZ / 10);
+	}
+	nvme_loop_quiesce(ctrl);
+	return 0;
+}
+
+static struct nvme_loop_ctrl *to_loop_ctrl(struct nvme_dev *dev)
+{
+	return dev_get_drvdata(dev->dev);
+}
+
+static int nvme_loop_map(struct nvme_dev *dev)
+{
+	dev->bar = (struct nvme_bar __force __iomem *)to_loop_ctrl(dev)->bar;
+	return 0;
+}
+
+static void nvme_loop_unmap(struct nvme_dev *dev)
+{
+	dev->bar = NULL;
+}
+
+static void __iomem *nvme_loop_map_cmb(struct nvme_dev *dev, int bir,
+			u64 offset, u64 *size, dma_addr_t *dma_addr)
+{
+	struct nvme_loop_ctrl *ctrl = to_loop_ctrl(dev);
+
+	if (!ctrl->cmb || bir || offset)
+		return NULL;
+	*size = min_t(u64, *size, ctrl->cmb_size);
+	*dma_addr = virt_to_phys(ctrl->cmb);
+	return (void __force __iomem *)ctrl->cmb;
+}
+
+static void nvme_loop_unmap_cmb(struct nvme_dev *dev, void __iomem *cmb)
+{
+}
+
+static int nvme_loop_setup_vectors(struct nvme_dev *dev, int nr_io_queues)
+{
+	return min_t(int, nr_io_queues, to_loop_ctrl(dev)->nr_queues - 1);
+}
+
+static int nvme_loop_request_irq(struct nvme_dev *dev, int vector,
+			irq_handler_t handler, irq_handler_t thread_fn,
+			const char *name, void *data)
+{
+	struct nvme_loop_ctrl *ctrl = to_loop_ctrl(dev);
+	struct nvme_loop_vector *vec;
+	unsigned long flags;
+
+	if (vector >= ctrl->nr_queues)
+		return -EINVAL;
+	vec = &ctrl->vecs[vector];
+	spin_lock_irqsave(&ctrl->vec_lock, flags);
+	vec->handler = handler;
+	vec->thread_fn = thread_fn;
+	vec->data = data;
+	spin_unlock_irqrestore(&ctrl->vec_lock, flags);
+	return 0;
+}
+
+static void nvme_loop_free_irq(struct nvme_dev *dev, int vector, void *data)
+{
+	struct nvme_loop_ctrl *ctrl = to_loop_ctrl(dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctrl->vec_lock, flags);
+	memset(&ctrl->vecs[vector], 0, sizeof(ctrl->vecs[vector]));
+	spin_unlock_irqrestore(&ctrl->vec_lock, flags);
+}
+
+static void nvme_loop_sq_doorbell(struct nvme_dev *dev, u16 qid)
+{
+	nvme_loop_kick(to_loop_ctrl(dev));
+}
+
+static const struct nvme_transport_ops nvme_loop_ops = {
+	.map		= nvme_loop_map,
+	.unmap		= nvme_loop_unmap,
+	.setup_vectors	= nvme_loop_setup_vectors,
+	.request_irq	= nvme_loop_request_irq,
+	.free_irq	= nvme_loop_free_irq,
+	.sq_doorbell	= nvme_loop_sq_doorbell,
+	.map_cmb	= nvme_loop_map_cmb,
+	.unmap_cmb	= nvme_loop_unmap_cmb,
+};
+
+static int nvme_loop_init_backing(struct nvme_loop_ctrl *ctrl)
+{
+	if (backing) {
+		ctrl->bdev = blkdev_get_by_path(backing,
+				FMODE_READ | FMODE_WRITE | FMODE_EXCL, ctrl);
+		if (IS_ERR(ctrl->bdev)) {
+			pr_err("can't open %s\n", backing);
+			return PTR_ERR(ctrl->bdev);
+		}
+		ctrl->nr_lbas = i_size_read(ctrl->bdev->bd_inode) >>
+							NVME_LOOP_LBA_SHIFT;
+		return 0;
+	}
+
+	ctrl->ram = vzalloc(ram_mb << 20);
+	if (!ctrl->ram)
+		return -ENOMEM;
+	ctrl->nr_lbas = (ram_mb << 20) >> NVME_LOOP_LBA_SHIFT;
+	return 0;
+}
+
+static void nvme_loop_release_backing(struct nvme_loop_ctrl *ctrl)
+{
+	if (ctrl->bdev)
+		blkdev_put(ctrl->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(ctrl->ram);
+}
+
+static void nvme_loop_free(struct nvme_loop_ctrl *ctrl)
+{
+	if (ctrl->cmb)
+		free_pages_exact(ctrl->cmb, ctrl->cmb_size);
+	kfree(ctrl->vecs);
+	kfree(ctrl->cqs);
+	kfree(ctrl->sqs);
+	kfree(ctrl->regs);
+	kfree(ctrl);
+}
+
+static struct nvme_loop_ctrl *nvme_loop_alloc(void)
+{
+	struct nvme_loop_ctrl *ctrl;
+	unsigned nr_queues;
+
+	nr_queues = min(nr_io_queues ?: num_possible_cpus(), 1024U) + 1;
+	ctrl = kzalloc(sizeof(*ctrl), GFP_KERNEL);
+	if (!ctrl)
+		return NULL;
+	ctrl->nr_queues = nr_queues;
+	ctrl->regs = kzalloc(max(8192U, 4096 + nr_queues * 8), GFP_KERNEL);
+	ctrl->sqs = kcalloc(nr_queues, sizeof(*ctrl->sqs), GFP_KERNEL);
+	ctrl->cqs = kcalloc(nr_queues, sizeof(*ctrl->cqs), GFP_KERNEL);
+	ctrl->vecs = kcalloc(nr_queues, sizeof(*ctrl->vecs), GFP_KERNEL);
+	if (!ctrl->regs || !ctrl->sqs || !ctrl->cqs || !ctrl->vecs) {
+		nvme_loop_free(ctrl);
+		return NULL;
+	}
+
+	ctrl->bar = ctrl->regs;
+	ctrl->dbs = ctrl->regs + 4096;
+	ctrl->bar->cap = (NVME_LOOP_Q_DEPTH - 1) | (10ULL << 24) | (1ULL << 37);
+	ctrl->bar->vs = NVME_VS(1, 0);
+
+	/* 4KiB size units at offset 0 of "BAR 0"; SQs and write data */
+	ctrl->cmb_size = (min(cmb_kb, 4096U) << 10) & ~0xfffUL;
+	if (ctrl->cmb_size) {
+		ctrl->cmb = alloc_pages_exact(ctrl->cmb_size,
+						GFP_KERNEL | __GFP_ZERO);
+		if (!ctrl->cmb) {
+			nvme_loop_free(ctrl);
+			return NULL;
+		}
+		ctrl->bar->cmbsz = ctrl->cmb_size | 0x10 | 0x1;
+	}
+	init_waitqueue_head(&ctrl->wait);
+	init_llist_head(&ctrl->done);
+	atomic_set(&ctrl->inflight, 0);
+	spin_lock_init(&ctrl->vec_lock);
+	return ctrl;
+}
+
+static int __init nvme_loop_init(void)
+{
+	struct nvme_loop_ctrl *ctrl;
+	int result;
+
+	ctrl = nvme_loop_alloc();
+	if (!ctrl)
+		return -ENOMEM;
+
+	result = nvme_loop_init_backing(ctrl);
+	if (result)
+		goto free;
+
+	ctrl->dev = root_device_register("nvme-loop");
+	if (IS_ERR(ctrl->dev)) {
+		result = PTR_ERR(ctrl->dev);
+		goto release;
+	}
+	ctrl->dev->coherent_dma_mask = DMA_BIT_MASK(64);
+	ctrl->dev->dma_mask = &ctrl->dev->coherent_dma_mask;
+	dev_set_drvdata(ctrl->dev, ctrl);
+
+	ctrl->thread = kthread_run(nvme_loop_thread, ctrl, "nvme-loop");
+	if (IS_ERR(ctrl->thread)) {
+		result = PTR_ERR(ctrl->thread);
+		goto unregister;
+	}
+
+	result = -ENOMEM;
+	ctrl->ndev = nvme_alloc_ctrl(ctrl->dev, &nvme_loop_ops);
+	if (!ctrl->ndev)
+		goto stop;
+	result = nvme_probe_ctrl(ctrl->ndev);
+	if (result)
+		goto stop;
+
+	nvme_loop = ctrl;
+	return 0;
+
+ stop:
+	kthread_stop(ctrl->thread);
+ unregister:
+	root_device_unregister(ctrl->dev);
+ release:
+	nvme_loop_release_backing(ctrl);
+ free:
+	nvme_loop_free(ctrl);
+	return result;
+}
+
+static void __exit nvme_loop_exit(void)
+{
+	struct nvme_loop_ctrl *ctrl = nvme_loop;
+
+	nvme_remove_ctrl(ctrl->ndev);
+	kthread_stop(ctrl->thread);
+	root_device_unregister(ctrl->dev);
+	nvme_loop_release_backing(ctrl);
+	nvme_loop_free(ctrl);
+}
+
+MODULE_LICENSE("GPL");
+module_init(nvme_loop_init);
+module_exit(nvme_loop_exit);
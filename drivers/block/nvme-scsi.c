@@ -687,7 +687,7 @@ static int nvme_trans_standard_inquiry_page(struct nvme_ns *ns,
 	u8 protect;
 	u8 cmdque = 0x01 << 1;
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 				&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -727,7 +727,7 @@ static int nvme_trans_standard_inquiry_page(struct nvme_ns *ns,
 	res = nvme_trans_copy_to_user(hdr, inq_response, xfer_len);
 
  out_free:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out_dma:
 	return res;
@@ -787,7 +787,7 @@ static int nvme_trans_device_id_page(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	int xfer_len;
 	__be32 tmp_id = cpu_to_be32(ns->ns_id);
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 					&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -824,8 +824,8 @@ static int nvme_trans_device_id_page(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	inq_response[9] = ieee[2];        /* IEEE ID */
 	inq_response[10] = ieee[1];       /* IEEE ID */
 	inq_response[11] = ieee[0];       /* IEEE ID| Vendor Specific ID... */
-	inq_response[12] = (dev->pci_dev->vendor & 0xFF00) >> 8;
-	inq_response[13] = (dev->pci_dev->vendor & 0x00FF);
+	inq_response[12] = (dev->vendor & 0xFF00) >> 8;
+	inq_response[13] = (dev->vendor & 0x00FF);
 	inq_response[14] = dev->serial[0];
 	inq_response[15] = dev->serial[1];
 	inq_response[16] = dev->model[0];
@@ -837,7 +837,7 @@ static int nvme_trans_device_id_page(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	res = nvme_trans_copy_to_user(hdr, inq_response, xfer_len);
 
  out_free:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out_dma:
 	return res;
@@ -869,7 +869,7 @@ static int nvme_trans_ext_inq_page(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		goto out_mem;
 	}
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 							&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -919,7 +919,7 @@ static int nvme_trans_ext_inq_page(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	res = nvme_trans_copy_to_user(hdr, inq_response, xfer_len);
 
  out_free:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out_dma:
 	kfree(inq_response);
@@ -1005,7 +1005,7 @@ static int nvme_trans_log_info_exceptions(struct nvme_ns *ns,
 		goto out_mem;
 	}
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev,
+	mem = dma_alloc_coherent(dev->dev,
 					sizeof(struct nvme_smart_log),
 					&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
@@ -1044,7 +1044,7 @@ static int nvme_trans_log_info_exceptions(struct nvme_ns *ns,
 	xfer_len = min(alloc_len, LOG_INFO_EXCP_PAGE_LENGTH);
 	res = nvme_trans_copy_to_user(hdr, log_response, xfer_len);
 
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_smart_log),
+	dma_free_coherent(dev->dev, sizeof(struct nvme_smart_log),
 			  mem, dma_addr);
  out_dma:
 	kfree(log_response);
@@ -1073,7 +1073,7 @@ static int nvme_trans_log_temperature(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		goto out_mem;
 	}
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev,
+	mem = dma_alloc_coherent(dev->dev,
 					sizeof(struct nvme_smart_log),
 					&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
@@ -1125,7 +1125,7 @@ static int nvme_trans_log_temperature(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	xfer_len = min(alloc_len, LOG_TEMP_PAGE_LENGTH);
 	res = nvme_trans_copy_to_user(hdr, log_response, xfer_len);
 
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_smart_log),
+	dma_free_coherent(dev->dev, sizeof(struct nvme_smart_log),
 			  mem, dma_addr);
  out_dma:
 	kfree(log_response);
@@ -1176,7 +1176,7 @@ static int nvme_trans_fill_blk_desc(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	else if (llbaa > 0 && len < MODE_PAGE_LLBAA_BLK_DES_LEN)
 		return SNTI_INTERNAL_ERROR;
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 							&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -1213,7 +1213,7 @@ static int nvme_trans_fill_blk_desc(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	}
 
  out_dma:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out:
 	return res;
@@ -1461,7 +1461,7 @@ static int nvme_trans_power_state(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	unsigned ps_desired = 0;
 
 	/* NVMe Controller Identify */
-	mem = dma_alloc_coherent(&dev->pci_dev->dev,
+	mem = dma_alloc_coherent(dev->dev,
 				sizeof(struct nvme_id_ctrl),
 				&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
@@ -1524,7 +1524,7 @@ static int nvme_trans_power_state(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	if (nvme_sc)
 		res = nvme_sc;
  out_dma:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ctrl), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ctrl), mem,
 			  dma_addr);
  out:
 	return res;
@@ -1788,7 +1788,7 @@ static int nvme_trans_fmt_set_blk_size_count(struct nvme_ns *ns,
 	 */
 
 	if (ns->mode_select_num_blocks == 0 || ns->mode_select_block_len == 0) {
-		mem = dma_alloc_coherent(&dev->pci_dev->dev,
+		mem = dma_alloc_coherent(dev->dev,
 			sizeof(struct nvme_id_ns), &dma_addr, GFP_KERNEL);
 		if (mem == NULL) {
 			res = -ENOMEM;
@@ -1813,7 +1813,7 @@ static int nvme_trans_fmt_set_blk_size_count(struct nvme_ns *ns,
 						(1 << (id_ns->lbaf[flbas].ds));
 		}
  out_dma:
-		dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+		dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns),
 				  mem, dma_addr);
 	}
  out:
@@ -1896,7 +1896,7 @@ static int nvme_trans_fmt_send_cmd(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	struct nvme_command c;
 
 	/* Loop thru LBAF's in id_ns to match reqd lbaf, put in cdw10 */
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 							&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -1947,7 +1947,7 @@ static int nvme_trans_fmt_send_cmd(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		res = nvme_sc;
 
  out_dma:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out:
 	return res;
@@ -2127,6 +2127,142 @@ static int nvme_trans_do_nvme_io(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	return res;
 }
 
+/*
+ * Fast path for READ(10/16), WRITE(10/16) and SYNCHRONIZE CACHE.  The user's
+ * pages are mapped straight into bios that go through nvme_make_request()
+ * on the caller's queue, all of them in flight at once, instead of one
+ * synchronous command per chunk.  Anything unusual is left to the generic
+ * translation, as is any I/O that fails: it is reissued there so the sense
+ * data reflects the NVMe status.
+ */
+#define NVME_TRANS_FAST_BIOS	16
+
+struct nvme_trans_fast_io {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+static void nvme_trans_fast_end_io(struct bio *bio, int error)
+{
+	struct nvme_trans_fast_io *fio = bio->bi_private;
+
+	if (error)
+		fio->error = error;
+	if (atomic_dec_and_test(&fio->pending))
+		complete(&fio->done);
+}
+
+static int nvme_trans_fast_rw(struct nvme_ns *ns, struct block_device *bdev,
+				struct sg_io_hdr *hdr,
+				struct nvme_trans_io_cdb *cdb_info, u8 is_write)
+{
+	struct request_queue *q = ns->queue;
+	struct bio *bios[NVME_TRANS_FAST_BIOS];
+	struct nvme_trans_fast_io fio;
+	unsigned long addr = (unsigned long)hdr->dxferp;
+	u64 len = (u64)cdb_info->xfer_len << ns->lba_shift;
+	sector_t sector = cdb_info->lba << (ns->lba_shift - 9);
+	unsigned max_bytes = queue_max_hw_sectors(q) << 9;
+	unsigned lba_mask = (1 << ns->lba_shift) - 1;
+	int rw = is_write ? WRITE : READ;
+	int i, nr;
+
+	if (cdb_info->fua)
+		rw |= REQ_FUA;
+
+	fio.error = 0;
+	while (len && !fio.error) {
+		atomic_set(&fio.pending, 1);
+		init_completion(&fio.done);
+
+		for (nr = 0; len && nr < NVME_TRANS_FAST_BIOS; nr++) {
+			struct bio *bio;
+			unsigned size;
+
+			bio = bio_map_user(q, bdev, addr,
+					min_t(u64, len, max_bytes), !is_write,
+					GFP_KERNEL);
+			if (IS_ERR(bio)) {
+				fio.error = PTR_ERR(bio);
+				break;
+			}
+			size = bio->bi_iter.bi_size;
+			if (!size || (size & lba_mask)) {
+				bio_unmap_user(bio);
+				fio.error = -EINVAL;
+				break;
+			}
+
+			bio->bi_iter.bi_sector = sector;
+			bio->bi_end_io = nvme_trans_fast_end_io;
+			bio->bi_private = &fio;
+			bios[nr] = bio;
+			addr += size;
+			sector += size >> 9;
+			len -= size;
+
+			atomic_inc(&fio.pending);
+			submit_bio(rw, bio);
+		}
+
+		if (!atomic_dec_and_test(&fio.pending))
+			wait_for_completion(&fio.done);
+		for (i = 0; i < nr; i++)
+			bio_unmap_user(bios[i]);
+	}
+	return fio.error;
+}
+
+/* Returns -EAGAIN if the command must go through the generic translation */
+static int nvme_trans_fast_path(struct nvme_ns *ns, struct block_device *bdev,
+					struct sg_io_hdr *hdr, u8 *cmd)
+{
+	struct request_queue *q = ns->queue;
+	struct nvme_trans_io_cdb cdb_info;
+	u64 nr_lbas;
+	u8 is_write = 0;
+
+	/* SG_IO addresses the whole namespace, even through a partition */
+	bdev = bdev->bd_contains;
+
+	switch (cmd[0]) {
+	case SYNCHRONIZE_CACHE:
+		if (!(q->flush_flags & REQ_FLUSH) ||
+		    blkdev_issue_flush(bdev, GFP_KERNEL, NULL))
+			return -EAGAIN;
+		return nvme_trans_status_code(hdr, NVME_SC_SUCCESS);
+	case WRITE_10:
+		is_write = 1;
+		/* fall through */
+	case READ_10:
+		nvme_trans_get_io_cdb10(cmd, &cdb_info);
+		break;
+	case WRITE_16:
+		is_write = 1;
+		/* fall through */
+	case READ_16:
+		nvme_trans_get_io_cdb16(cmd, &cdb_info);
+		break;
+	default:
+		return -EAGAIN;
+	}
+
+	if (hdr->iovec_count || ns->ms || !cdb_info.xfer_len)
+		return -EAGAIN;
+	if (hdr->dxfer_len != (u64)cdb_info.xfer_len << ns->lba_shift)
+		return -EAGAIN;
+	nr_lbas = get_capacity(ns->disk) >> (ns->lba_shift - 9);
+	if (cdb_info.lba >= nr_lbas || cdb_info.xfer_len > nr_lbas - cdb_info.lba)
+		return -EAGAIN;
+	/* Without flush support the block layer would drop REQ_FUA */
+	if (cdb_info.fua && !(q->flush_flags & REQ_FUA))
+		return -EAGAIN;
+
+	if (nvme_trans_fast_rw(ns, bdev, hdr, &cdb_info, is_write))
+		return -EAGAIN;
+	return nvme_trans_status_code(hdr, NVME_SC_SUCCESS);
+}
 
 /* SCSI Command Translation Functions */
 
@@ -2449,7 +2585,7 @@ static int nvme_trans_read_capacity(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		resp_size = READ_CAP_16_RESP_SIZE;
 	}
 
-	mem = dma_alloc_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns),
+	mem = dma_alloc_coherent(dev->dev, sizeof(struct nvme_id_ns),
 							&dma_addr, GFP_KERNEL);
 	if (mem == NULL) {
 		res = -ENOMEM;
@@ -2478,7 +2614,7 @@ static int nvme_trans_read_capacity(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 
 	kfree(response);
  out_dma:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ns), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ns), mem,
 			  dma_addr);
  out:
 	return res;
@@ -2512,7 +2648,7 @@ static int nvme_trans_report_luns(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		goto out;
 	} else {
 		/* NVMe Controller Identify */
-		mem = dma_alloc_coherent(&dev->pci_dev->dev,
+		mem = dma_alloc_coherent(dev->dev,
 					sizeof(struct nvme_id_ctrl),
 					&dma_addr, GFP_KERNEL);
 		if (mem == NULL) {
@@ -2564,7 +2700,7 @@ static int nvme_trans_report_luns(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 
 	kfree(response);
  out_dma:
-	dma_free_coherent(&dev->pci_dev->dev, sizeof(struct nvme_id_ctrl), mem,
+	dma_free_coherent(dev->dev, sizeof(struct nvme_id_ctrl), mem,
 			  dma_addr);
  out:
 	return res;
@@ -2878,7 +3014,7 @@ static int nvme_trans_unmap(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 		goto out;
 	}
 
-	range = dma_alloc_coherent(&dev->pci_dev->dev, ndesc * sizeof(*range),
+	range = dma_alloc_coherent(dev->dev, ndesc * sizeof(*range),
 							&dma_addr, GFP_KERNEL);
 	if (!range)
 		goto out;
@@ -2899,14 +3035,15 @@ static int nvme_trans_unmap(struct nvme_ns *ns, struct sg_io_hdr *hdr,
 	nvme_sc = nvme_submit_io_cmd(dev, &c, NULL);
 	res = nvme_trans_status_code(hdr, nvme_sc);
 
-	dma_free_coherent(&dev->pci_dev->dev, ndesc * sizeof(*range),
+	dma_free_coherent(dev->dev, ndesc * sizeof(*range),
 							range, dma_addr);
  out:
 	kfree(plist);
 	return res;
 }
 
-static int nvme_scsi_translate(struct nvme_ns *ns, struct sg_io_hdr *hdr)
+static int nvme_scsi_translate(struct nvme_ns *ns, struct block_device *bdev,
+						struct sg_io_hdr *hdr)
 {
 	u8 cmd[BLK_MAX_CDB];
 	int retcode;
@@ -2917,6 +3054,10 @@ static int nvme_scsi_translate(struct nvme_ns *ns, struct sg_io_hdr *hdr)
 	if (copy_from_user(cmd, hdr->cmdp, hdr->cmd_len))
 		return -EFAULT;
 
+	retcode = nvme_trans_fast_path(ns, bdev, hdr, cmd);
+	if (retcode != -EAGAIN)
+		return retcode;
+
 	opcode = cmd[0];
 
 	switch (opcode) {
@@ -2993,7 +3134,8 @@ static int nvme_scsi_translate(struct nvme_ns *ns, struct sg_io_hdr *hdr)
 	return retcode;
 }
 
-int nvme_sg_io(struct nvme_ns *ns, struct sg_io_hdr __user *u_hdr)
+int nvme_sg_io(struct nvme_ns *ns, struct block_device *bdev,
+					struct sg_io_hdr __user *u_hdr)
 {
 	struct sg_io_hdr hdr;
 	int retcode;
@@ -3007,7 +3149,7 @@ int nvme_sg_io(struct nvme_ns *ns, struct sg_io_hdr __user *u_hdr)
 	if (hdr.cmd_len > BLK_MAX_CDB)
 		return -EINVAL;
 
-	retcode = nvme_scsi_translate(ns, &hdr);
+	retcode = nvme_scsi_translate(ns, bdev, &hdr);
 	if (retcode < 0)
 		return retcode;
 	if (retcode > 0)
@@ -3071,7 +3213,8 @@ static int sg_build_iovec(sg_io_hdr_t __user *sgio, void __user *dxferp, u16 iov
 	return 0;
 }
 
-int nvme_sg_io32(struct nvme_ns *ns, unsigned long arg)
+int nvme_sg_io32(struct nvme_ns *ns, struct block_device *bdev,
+						unsigned long arg)
 {
 	sg_io_hdr32_t __user *sgio32 = (sg_io_hdr32_t __user *)arg;
 	sg_io_hdr_t __user *sgio;
@@ -3144,7 +3287,7 @@ int nvme_sg_io32(struct nvme_ns *ns, unsigned long arg)
 	if (put_user(compat_ptr(data), &sgio->usr_ptr))
 		return -EFAULT;
 
-	err = nvme_sg_io(ns, sgio);
+	err = nvme_sg_io(ns, bdev, sgio);
 	if (err >= 0) {
 		void __user *datap;
 
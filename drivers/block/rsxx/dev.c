@@ -118,7 +118,7 @@ static void disk_stats_start(struct rsxx_cardinfo *card, struct bio *bio)
 
 	cpu = part_stat_lock();
 
-	part_round_stats(cpu, part0);
+	part_update_io_ticks(cpu, part0, false);
 	part_inc_in_flight(part0, rw);
 
 	part_stat_unlock();
@@ -138,8 +138,9 @@ static void disk_stats_complete(struct rsxx_cardinfo *card,
 	part_stat_add(cpu, part0, sectors[rw], bio_sectors(bio));
 	part_stat_inc(cpu, part0, ios[rw]);
 	part_stat_add(cpu, part0, ticks[rw], duration);
+	part_stat_add(cpu, part0, time_in_queue, duration);
 
-	part_round_stats(cpu, part0);
+	part_update_io_ticks(cpu, part0, true);
 	part_dec_in_flight(part0, rw);
 
 	part_stat_unlock();
@@ -13,6 +13,8 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
@@ -43,6 +45,23 @@ struct zcomp_strm_multi {
 	wait_queue_head_t strm_wait;
 };
 
+/*
+ * per-cpu zcomp_strm backend
+ *
+ * Every possible CPU owns one stream, a writer uses the stream of the
+ * CPU it runs on. The stream mutex is only contended if a writer got
+ * preempted or migrated while compressing, so the stream can still be
+ * held across sleeping allocations in the caller.
+ */
+struct zcomp_strm_percpu_slot {
+	struct mutex strm_lock;
+	struct zcomp_strm *zstrm;
+};
+
+struct zcomp_strm_percpu {
+	struct zcomp_strm_percpu_slot __percpu *slots;
+};
+
 static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
@@ -158,6 +177,10 @@ static bool zcomp_strm_multi_set_max_streams(struct zcomp *comp, int num_strm)
 	struct zcomp_strm_multi *zs = comp->stream;
 	struct zcomp_strm *zstrm;
 
+	/* switching to per-cpu streams needs a device reset */
+	if (num_strm < 1)
+		return false;
+
 	spin_lock(&zs->strm_lock);
 	zs->max_strm = num_strm;
 	/*
@@ -267,6 +290,84 @@ static int zcomp_strm_single_create(struct zcomp *comp)
 	return 0;
 }
 
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	struct zcomp_strm_percpu_slot *slot;
+
+	slot = per_cpu_ptr(zs->slots, raw_smp_processor_id());
+	mutex_lock(&slot->strm_lock);
+	return slot->zstrm;
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	/* the stream remembers its slot, we may have migrated since find */
+	struct zcomp_strm_percpu_slot *slot = zstrm->slot;
+
+	mutex_unlock(&slot->strm_lock);
+}
+
+static bool zcomp_strm_percpu_set_max_streams(struct zcomp *comp,
+		int num_strm)
+{
+	/* the number of per-cpu streams is fixed by the number of CPUs */
+	return false;
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zcomp_strm_percpu_slot *slot =
+			per_cpu_ptr(zs->slots, cpu);
+
+		if (slot->zstrm)
+			zcomp_strm_free(comp, slot->zstrm);
+	}
+	free_percpu(zs->slots);
+	kfree(zs);
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs;
+	int cpu;
+
+	comp->destroy = zcomp_strm_percpu_destroy;
+	comp->strm_find = zcomp_strm_percpu_find;
+	comp->strm_release = zcomp_strm_percpu_release;
+	comp->set_max_streams = zcomp_strm_percpu_set_max_streams;
+	zs = kmalloc(sizeof(struct zcomp_strm_percpu), GFP_KERNEL);
+	if (!zs)
+		return -ENOMEM;
+
+	zs->slots = alloc_percpu(struct zcomp_strm_percpu_slot);
+	if (!zs->slots) {
+		kfree(zs);
+		return -ENOMEM;
+	}
+
+	comp->stream = zs;
+	for_each_possible_cpu(cpu) {
+		struct zcomp_strm_percpu_slot *slot =
+			per_cpu_ptr(zs->slots, cpu);
+
+		mutex_init(&slot->strm_lock);
+		slot->zstrm = zcomp_strm_alloc(comp);
+		if (!slot->zstrm) {
+			zcomp_strm_percpu_destroy(comp);
+			comp->stream = NULL;
+			return -ENOMEM;
+		}
+		slot->zstrm->slot = slot;
+	}
+	return 0;
+}
+
 /* show available compressors */
 ssize_t zcomp_available_show(const char *comp, char *buf)
 {
@@ -325,7 +426,9 @@ void zcomp_destroy(struct zcomp *comp)
  * allocate new zcomp and initialize it. return compressing
  * backend pointer or ERR_PTR if things went bad. ERR_PTR(-EINVAL)
  * if requested algorithm is not supported, ERR_PTR(-ENOMEM) in
- * case of allocation error.
+ * case of allocation error. max_strm == 0 selects one stream per
+ * CPU, 1 a single shared stream and anything above a pool of up to
+ * max_strm streams.
  */
 struct zcomp *zcomp_create(const char *compress, int max_strm)
 {
@@ -343,8 +446,10 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 	comp->backend = backend;
 	if (max_strm > 1)
 		zcomp_strm_multi_create(comp, max_strm);
-	else
+	else if (max_strm == 1)
 		zcomp_strm_single_create(comp);
+	else
+		zcomp_strm_percpu_create(comp);
 	if (!comp->stream) {
 		kfree(comp);
 		return ERR_PTR(-ENOMEM);
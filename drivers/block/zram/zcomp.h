@@ -23,6 +23,8 @@ struct zcomp_strm {
 	void *private;
 	/* used in multi stream backend, protected by backend strm_lock */
 	struct list_head list;
+	/* owning per-cpu slot, used in per-cpu stream backend */
+	void *slot;
 };
 
 /* static compression backend */
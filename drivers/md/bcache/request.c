@@ -604,8 +604,9 @@ static void bio_complete(struct search *s)
 		unsigned long duration = jiffies - s->start_time;
 
 		cpu = part_stat_lock();
-		part_round_stats(cpu, &s->d->disk->part0);
+		part_update_io_ticks(cpu, &s->d->disk->part0, true);
 		part_stat_add(cpu, &s->d->disk->part0, ticks[rw], duration);
+		part_stat_add(cpu, &s->d->disk->part0, time_in_queue, duration);
 		part_stat_unlock();
 
 		trace_bcache_request_end(s->d, s->orig_bio);
@@ -567,10 +567,10 @@ static void start_io_acct(struct dm_io *io)
 	io->start_time = jiffies;
 
 	cpu = part_stat_lock();
-	part_round_stats(cpu, &dm_disk(md)->part0);
+	part_update_io_ticks(cpu, &dm_disk(md)->part0, false);
+	part_inc_in_flight(&dm_disk(md)->part0, rw);
 	part_stat_unlock();
-	atomic_set(&dm_disk(md)->part0.in_flight[rw],
-		atomic_inc_return(&md->pending[rw]));
+	atomic_inc(&md->pending[rw]);
 
 	if (unlikely(dm_stats_used(&md->stats)))
 		dm_stats_account_io(&md->stats, bio->bi_rw, bio->bi_iter.bi_sector,
@@ -586,8 +586,10 @@ static void end_io_acct(struct dm_io *io)
 	int rw = bio_data_dir(bio);
 
 	cpu = part_stat_lock();
-	part_round_stats(cpu, &dm_disk(md)->part0);
+	part_update_io_ticks(cpu, &dm_disk(md)->part0, true);
 	part_stat_add(cpu, &dm_disk(md)->part0, ticks[rw], duration);
+	part_stat_add(cpu, &dm_disk(md)->part0, time_in_queue, duration);
+	part_dec_in_flight(&dm_disk(md)->part0, rw);
 	part_stat_unlock();
 
 	if (unlikely(dm_stats_used(&md->stats)))
@@ -599,7 +601,6 @@ static void end_io_acct(struct dm_io *io)
 	 * a flush.
 	 */
 	pending = atomic_dec_return(&md->pending[rw]);
-	atomic_set(&dm_disk(md)->part0.in_flight[rw], pending);
 	pending += atomic_read(&md->pending[rw^0x1]);
 
 	/* nudge anyone waiting on suspend queue */
@@ -49,6 +49,9 @@ module_param(gso, bool, 0444);
 /* Minimum alignment for mergeable packet buffers. */
 #define MERGEABLE_BUFFER_ALIGN max(L1_CACHE_BYTES, 256)
 
+/* Number of used up frag pages each receive queue keeps for recycling. */
+#define VIRTNET_PAGE_POOL_SIZE 64
+
 #define VIRTNET_DRIVER_VERSION "1.0.0"
 
 struct virtnet_stats {
@@ -89,6 +92,20 @@ struct receive_queue {
 	/* Page frag for packet buffer allocation. */
 	struct page_frag alloc_frag;
 
+	/* Used up alloc_frag pages, oldest first, waiting for their skbs
+	 * to be freed so they can be handed out again.  Only touched by
+	 * whoever refills the ring (NAPI, or refill_work with NAPI off).
+	 */
+	struct page *pool[VIRTNET_PAGE_POOL_SIZE];
+	unsigned int pool_head;
+	unsigned int pool_count;
+
+	/* Page pool statistics */
+	struct u64_stats_sync pool_syncp;
+	u64 pool_recycled;	/* refills served from the pool */
+	u64 pool_alloced;	/* refills that had to allocate */
+	u64 pool_released;	/* pages given back to the page allocator */
+
 	/* RX: fragments + linear part + virtio header */
 	struct scatterlist sg[MAX_SKB_FRAGS + 2];
 
@@ -216,6 +233,107 @@ static struct page *get_a_page(struct receive_queue *rq, gfp_t gfp_mask)
 	return p;
 }
 
+static void virtnet_pool_release(struct receive_queue *rq, struct page *page)
+{
+	put_page(page);
+	u64_stats_update_begin(&rq->pool_syncp);
+	rq->pool_released++;
+	u64_stats_update_end(&rq->pool_syncp);
+}
+
+/* Park a used up frag page, keeping the reference alloc_frag held on it. */
+static void virtnet_pool_put(struct receive_queue *rq, struct page *page)
+{
+	/* Don't hold on to emergency reserves or to remote memory */
+	if (unlikely(page->pfmemalloc || page_to_nid(page) != numa_mem_id())) {
+		virtnet_pool_release(rq, page);
+		return;
+	}
+
+	if (rq->pool_count == VIRTNET_PAGE_POOL_SIZE) {
+		virtnet_pool_release(rq, rq->pool[rq->pool_head]);
+		rq->pool_head = (rq->pool_head + 1) % VIRTNET_PAGE_POOL_SIZE;
+		rq->pool_count--;
+	}
+	rq->pool[(rq->pool_head + rq->pool_count) % VIRTNET_PAGE_POOL_SIZE] =
+		page;
+	rq->pool_count++;
+}
+
+/*
+ * Take the oldest parked page back if the skbs built on it are all gone,
+ * i.e. the pool holds the only reference left.  Pages are parked in the
+ * order they were used up, so if the oldest one is still busy the others
+ * most likely are too.
+ */
+static struct page *virtnet_pool_get(struct receive_queue *rq)
+{
+	struct page *page;
+
+	if (!rq->pool_count)
+		return NULL;
+
+	page = rq->pool[rq->pool_head];
+	if (page_count(page) != 1)
+		return NULL;
+
+	rq->pool_head = (rq->pool_head + 1) % VIRTNET_PAGE_POOL_SIZE;
+	rq->pool_count--;
+	return page;
+}
+
+static void virtnet_pool_drain(struct receive_queue *rq)
+{
+	while (rq->pool_count) {
+		put_page(rq->pool[rq->pool_head]);
+		rq->pool_head = (rq->pool_head + 1) % VIRTNET_PAGE_POOL_SIZE;
+		rq->pool_count--;
+	}
+}
+
+/*
+ * Like skb_page_frag_refill(), but a used up page is parked in the
+ * receive queue's pool instead of being put, and pages from the pool
+ * are preferred over fresh ones once the stack has freed them: they
+ * are likely still cache hot and cost no trip to the page allocator.
+ */
+static bool virtnet_page_frag_refill(struct receive_queue *rq,
+				     unsigned int sz, gfp_t gfp)
+{
+	struct page_frag *pfrag = &rq->alloc_frag;
+	struct page *page;
+
+	if (pfrag->page) {
+		if (page_count(pfrag->page) == 1) {
+			pfrag->offset = 0;
+			return true;
+		}
+		if (pfrag->offset + sz <= pfrag->size)
+			return true;
+		virtnet_pool_put(rq, pfrag->page);
+		pfrag->page = NULL;
+	}
+
+	page = virtnet_pool_get(rq);
+	if (page) {
+		pfrag->page = page;
+		pfrag->offset = 0;
+		pfrag->size = PAGE_SIZE << compound_order(page);
+		u64_stats_update_begin(&rq->pool_syncp);
+		rq->pool_recycled++;
+		u64_stats_update_end(&rq->pool_syncp);
+		return true;
+	}
+
+	if (unlikely(!skb_page_frag_refill(sz, pfrag, gfp)))
+		return false;
+
+	u64_stats_update_begin(&rq->pool_syncp);
+	rq->pool_alloced++;
+	u64_stats_update_end(&rq->pool_syncp);
+	return true;
+}
+
 static void skb_xmit_done(struct virtqueue *vq)
 {
 	struct virtnet_info *vi = vq->vdev->priv;
@@ -521,7 +639,7 @@ static void receive_buf(struct receive_queue *rq, void *buf, unsigned int len)
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
-	netif_receive_skb(skb);
+	napi_gro_receive(&rq->napi, skb);
 	return;
 
 frame_err:
@@ -619,7 +737,7 @@ static int add_recvbuf_mergeable(struct receive_queue *rq, gfp_t gfp)
 	unsigned int len, hole;
 
 	len = get_mergeable_buf_len(&rq->mrg_avg_pkt_len);
-	if (unlikely(!skb_page_frag_refill(len, alloc_frag, gfp)))
+	if (unlikely(!virtnet_page_frag_refill(rq, len, gfp)))
 		return -ENOMEM;
 
 	buf = (char *)page_address(alloc_frag->page) + alloc_frag->offset;
@@ -1314,12 +1432,71 @@ static void virtnet_get_channels(struct net_device *dev,
 	channels->other_count = 0;
 }
 
+static const char virtnet_pool_stat_names[][ETH_GSTRING_LEN] = {
+	"pool_recycled",
+	"pool_alloced",
+	"pool_released",
+};
+
+#define VIRTNET_POOL_STATS_LEN ARRAY_SIZE(virtnet_pool_stat_names)
+
+static int virtnet_get_sset_count(struct net_device *dev, int sset)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+
+	switch (sset) {
+	case ETH_SS_STATS:
+		return vi->max_queue_pairs * VIRTNET_POOL_STATS_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void virtnet_get_strings(struct net_device *dev, u32 stringset, u8 *data)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+	unsigned int i, j;
+
+	if (stringset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < vi->max_queue_pairs; i++) {
+		for (j = 0; j < VIRTNET_POOL_STATS_LEN; j++) {
+			snprintf(data, ETH_GSTRING_LEN, "rx_queue_%u_%s",
+				 i, virtnet_pool_stat_names[j]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+}
+
+static void virtnet_get_ethtool_stats(struct net_device *dev,
+				      struct ethtool_stats *stats, u64 *data)
+{
+	struct virtnet_info *vi = netdev_priv(dev);
+	unsigned int i, start;
+
+	for (i = 0; i < vi->max_queue_pairs; i++) {
+		struct receive_queue *rq = &vi->rq[i];
+
+		do {
+			start = u64_stats_fetch_begin_irq(&rq->pool_syncp);
+			data[0] = rq->pool_recycled;
+			data[1] = rq->pool_alloced;
+			data[2] = rq->pool_released;
+		} while (u64_stats_fetch_retry_irq(&rq->pool_syncp, start));
+		data += VIRTNET_POOL_STATS_LEN;
+	}
+}
+
 static const struct ethtool_ops virtnet_ethtool_ops = {
 	.get_drvinfo = virtnet_get_drvinfo,
 	.get_link = ethtool_op_get_link,
 	.get_ringparam = virtnet_get_ringparam,
 	.set_channels = virtnet_set_channels,
 	.get_channels = virtnet_get_channels,
+	.get_sset_count = virtnet_get_sset_count,
+	.get_strings = virtnet_get_strings,
+	.get_ethtool_stats = virtnet_get_ethtool_stats,
 };
 
 #define MIN_MTU 68
@@ -1418,9 +1595,11 @@ static void free_receive_bufs(struct virtnet_info *vi)
 static void free_receive_page_frags(struct virtnet_info *vi)
 {
 	int i;
-	for (i = 0; i < vi->max_queue_pairs; i++)
+	for (i = 0; i < vi->max_queue_pairs; i++) {
 		if (vi->rq[i].alloc_frag.page)
 			put_page(vi->rq[i].alloc_frag.page);
+		virtnet_pool_drain(&vi->rq[i]);
+	}
 }
 
 static void free_unused_bufs(struct virtnet_info *vi)
@@ -1555,6 +1734,7 @@ static int virtnet_alloc_queues(struct virtnet_info *vi)
 
 		sg_init_table(vi->rq[i].sg, ARRAY_SIZE(vi->rq[i].sg));
 		ewma_init(&vi->rq[i].mrg_avg_pkt_len, 1, RECEIVE_AVG_WEIGHT);
+		u64_stats_init(&vi->rq[i].pool_syncp);
 		sg_init_table(vi->sq[i].sg, ARRAY_SIZE(vi->sq[i].sg));
 	}
 
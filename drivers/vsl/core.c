@@ -505,6 +505,25 @@ finished:
 	return BLK_MQ_RQ_QUEUE_OK;
 }
 
+/*
+ * Store the logical address in the OOB area of every sector of the written
+ * page, so the mapping can be rebuilt from the media.  The area lives in the
+ * request pdu; the device driver picks it up with vsl_rq_oob() and sends it
+ * along with the data.
+ */
+static void vsl_set_oob_laddr(struct vsl_stor *s, struct request *rq,
+							sector_t l_addr)
+{
+	struct per_rq_data *pb = get_per_rq_data(s->dev, rq);
+	int i;
+
+	if (!pb->oob)
+		return;
+
+	for (i = 0; i < NR_PHY_IN_LOG; i++)
+		*(__le64 *)(pb->oob + i * s->oob_size) = cpu_to_le64(l_addr);
+}
+
 /* Assumes that l_addr is locked with vsl_lock_addr() */
 int __vsl_write_rq(struct vsl_stor *s,
 			struct request *rq, int is_gc,
@@ -524,6 +543,7 @@ int __vsl_write_rq(struct vsl_stor *s,
 	}
 
 	rq->__sector = p->addr * NR_PHY_IN_LOG;
+	vsl_set_oob_laddr(s, rq, l_addr);
 
 	vsl_submit_rq(s, rq, p, l_addr, sync, trans_map);
 
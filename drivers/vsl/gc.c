@@ -83,7 +83,7 @@ static void vsl_move_valid_pages(struct vsl_stor *s, struct vsl_block *block)
 
 		BUG_ON(src.addr >= s->nr_pages);
 
-		src_bio = bio_alloc(GFP_NOIO, 1);
+		src_bio = bio_alloc_cached(GFP_NOIO, 1, fs_bio_set);
 		if (!src_bio)
 			pr_err("vsl: failed to alloc gc bio request");
 		src_bio->bi_iter.bi_sector = src.addr * NR_PHY_IN_LOG;
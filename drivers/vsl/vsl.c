@@ -114,6 +114,7 @@ int vsl_init_request(void *data, struct request *rq, unsigned int hctx_idx,
 	struct per_rq_data *pdu = get_per_rq_data(dev, rq);
 
 	pdu->dev = dev->stor;
+	pdu->oob = dev->oob_size ? (void *)(pdu + 1) : NULL;
 
 	/* TODO: Allow underlying driver to hook in its own init_reques fn */
 	return 0;
@@ -133,6 +134,19 @@ void vsl_config_cmd_size(struct vsl_dev *dev, struct blk_mq_tag_set *tagset)
 {
 	dev->drv_cmd_size = tagset->cmd_size;
 	tagset->cmd_size += sizeof(struct per_rq_data);
+
+	/* room for the OOB area of a whole exposed page behind per_rq_data */
+	dev->oob_size = 0;
+	if (dev->ops->identify_channel)
+		dev->oob_size = dev->ops->identify_channel(dev, 0).oob_size;
+	if (dev->oob_size < sizeof(__le64))
+		dev->oob_size = 0;
+	tagset->cmd_size += dev->oob_size * NR_PHY_IN_LOG;
+}
+
+void *vsl_rq_oob(struct vsl_dev *dev, struct request *rq)
+{
+	return get_per_rq_data(dev, rq)->oob;
 }
 
 static int vsl_pool_init(struct vsl_stor *s, struct vsl_dev *dev)
@@ -408,6 +422,9 @@ int vsl_init(struct vsl_dev *dev)
 	s->config.t_write = TIMING_WRITE;
 	s->config.t_erase = TIMING_ERASE;
 
+	/* logical addresses ride along in the OOB area if there's room */
+	s->oob_size = dev->oob_size;
+
 	/* Constants */
 	s->nr_host_pages_in_blk = NR_HOST_PAGES_IN_FLASH_PAGE
 						* s->nr_pages_per_blk;
@@ -432,6 +449,12 @@ int vsl_init(struct vsl_dev *dev)
 		s->nr_pages_per_blk,
 		s->nr_aps,
 		s->nr_aps_per_pool);
+	/* pools work in parallel, each page keeps one busy for t_read/write */
+	blk_iocost_set_model(dev->q, READ, 0, 0,
+		div_u64((u64)s->config.t_read * NSEC_PER_USEC, s->nr_pools));
+	blk_iocost_set_model(dev->q, WRITE, 0, 0,
+		div_u64((u64)s->config.t_write * NSEC_PER_USEC, s->nr_pools));
+
 	pr_info("vsl: timings: %u/%u/%u",
 			s->config.t_read,
 			s->config.t_write,
@@ -324,6 +324,9 @@ struct vsl_stor {
 	unsigned int nr_host_pages_in_blk;
 	unsigned long nr_pages;
 
+	/* Per sector out-of-band bytes, as reported by the device */
+	unsigned int oob_size;
+
 	unsigned int next_collect_pool;
 
 	/* Write strategy variables. Move these into each for structure for each
@@ -362,6 +365,7 @@ struct per_rq_data {
 	struct timespec start_tv;
 
 	sector_t l_addr;
+	void *oob;
 
 	struct completion *event;
 	unsigned int sync;
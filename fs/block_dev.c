@@ -28,6 +28,8 @@
 #include <linux/log2.h>
 #include <linux/cleancache.h>
 #include <linux/aio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <asm/uaccess.h>
 #include "internal.h"
 
@@ -1610,6 +1612,153 @@ static ssize_t blkdev_aio_read(struct kiocb *iocb, const struct iovec *iov,
 	return generic_file_aio_read(iocb, iov, nr_segs, pos);
 }
 
+struct blkdev_splice_io {
+	atomic_t		pending;
+	int			error;
+	struct completion	done;
+};
+
+static bool blkdev_splice_done(void *data)
+{
+	struct blkdev_splice_io *io = data;
+
+	return completion_done(&io->done);
+}
+
+static void blkdev_splice_end_io(struct bio *bio, int error)
+{
+	struct blkdev_splice_io *io = bio->bi_private;
+
+	if (error)
+		io->error = error;
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+	bio_put(bio);
+}
+
+/*
+ * splice_read for a block device opened with O_DIRECT: read straight into
+ * private pages and hand those to the pipe, so an export path splicing
+ * on to a socket moves the data without a trip through the page cache.
+ * The pages carry no mapping, the IO has completed before they become
+ * visible, and whoever sits on the other side of the pipe (e.g. the
+ * socket via ->sendpage) holds its own reference for as long as it needs
+ * the data.  Reads must start on a logical block boundary and are
+ * truncated to whole logical blocks.
+ */
+static ssize_t blkdev_direct_splice_read(struct file *in, loff_t *ppos,
+					 struct pipe_inode_info *pipe,
+					 size_t len, unsigned int flags)
+{
+	struct block_device *bdev = I_BDEV(in->f_mapping->host);
+	unsigned int blkmask = bdev_logical_block_size(bdev) - 1;
+	loff_t size = i_size_read(bdev->bd_inode);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &default_pipe_buf_ops,
+		.spd_release = spd_release_page,
+	};
+	struct blkdev_splice_io io;
+	struct blk_plug plug;
+	struct bio *bio = NULL;
+	sector_t sector;
+	ssize_t ret;
+	int i;
+
+	if (*ppos >= size)
+		return 0;
+	if (*ppos & blkmask)
+		return -EINVAL;
+	len = min_t(loff_t, len, size - *ppos) & ~(size_t)blkmask;
+	if (!len)
+		return -EINVAL;
+
+	/* as for O_DIRECT reads, don't go around dirty page cache data */
+	ret = filemap_write_and_wait_range(in->f_mapping, *ppos,
+					   *ppos + len - 1);
+	if (ret)
+		return ret;
+
+	if (splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+
+	atomic_set(&io.pending, 1);
+	io.error = 0;
+	init_completion(&io.done);
+	sector = *ppos >> 9;
+
+	blk_start_plug(&plug);
+	while (len && spd.nr_pages < spd.nr_pages_max) {
+		unsigned int this_len = min_t(size_t, len, PAGE_SIZE);
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page)
+			break;
+
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = 0;
+		spd.partial[spd.nr_pages].len = this_len;
+		spd.nr_pages++;
+
+		if (bio && bio_add_page(bio, page, this_len, 0) == this_len)
+			goto next;
+		if (bio)
+			submit_bio(READ, bio);
+
+		bio = bio_alloc_cached(GFP_KERNEL,
+				       min_t(int, spd.nr_pages_max - spd.nr_pages + 1,
+					     BIO_MAX_PAGES), fs_bio_set);
+		bio->bi_bdev = bdev;
+		bio->bi_iter.bi_sector = sector;
+		bio->bi_end_io = blkdev_splice_end_io;
+		bio->bi_private = &io;
+		atomic_inc(&io.pending);
+		bio_add_page(bio, page, this_len, 0);
+next:
+		sector += this_len >> 9;
+		len -= this_len;
+	}
+	if (bio)
+		submit_bio(READ, bio);
+	blk_finish_plug(&plug);
+
+	if (!atomic_dec_and_test(&io.pending)) {
+		blk_busy_wait(bdev_get_queue(bdev), blkdev_splice_done, &io);
+		wait_for_completion_io(&io.done);
+	}
+
+	if (!spd.nr_pages) {
+		ret = -ENOMEM;
+	} else if (io.error) {
+		for (i = 0; i < spd.nr_pages; i++)
+			__free_page(spd.pages[i]);
+		ret = io.error;
+	} else {
+		ret = splice_to_pipe(pipe, &spd);
+		if (ret > 0) {
+			*ppos += ret;
+			file_accessed(in);
+		}
+	}
+
+	splice_shrink_spd(&spd);
+	return ret;
+}
+
+static ssize_t blkdev_splice_read(struct file *in, loff_t *ppos,
+				  struct pipe_inode_info *pipe, size_t len,
+				  unsigned int flags)
+{
+	if (in->f_flags & O_DIRECT)
+		return blkdev_direct_splice_read(in, ppos, pipe, len, flags);
+	return generic_file_splice_read(in, ppos, pipe, len, flags);
+}
+
 /*
  * Try to release a page associated with block device when the system
  * is under memory pressure.
@@ -1649,7 +1798,7 @@ const struct file_operations def_blk_fops = {
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= compat_blkdev_ioctl,
 #endif
-	.splice_read	= generic_file_splice_read,
+	.splice_read	= blkdev_splice_read,
 	.splice_write	= generic_file_splice_write,
 };
 
@@ -132,6 +132,8 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct request_queue *poll_q;	/* queue to busy poll while waiting */
+	bool poll_mixed;		/* bios went to more than one queue */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -370,9 +372,10 @@ dio_bio_alloc(struct dio *dio, struct dio_submit *sdio,
 
 	/*
 	 * bio_alloc() is guaranteed to return a bio when called with
-	 * __GFP_WAIT and we request a valid number of vectors.
+	 * __GFP_WAIT and we request a valid number of vectors.  Small
+	 * dios are common enough to be worth the per-cpu bio cache.
 	 */
-	bio = bio_alloc(GFP_KERNEL, nr_vecs);
+	bio = bio_alloc_cached(GFP_KERNEL, nr_vecs, fs_bio_set);
 
 	bio->bi_bdev = bdev;
 	bio->bi_iter.bi_sector = first_sector;
@@ -395,6 +398,7 @@ dio_bio_alloc(struct dio *dio, struct dio_submit *sdio,
 static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 {
 	struct bio *bio = sdio->bio;
+	struct request_queue *q = bdev_get_queue(bio->bi_bdev);
 	unsigned long flags;
 
 	bio->bi_private = dio;
@@ -406,6 +410,14 @@ static inline void dio_bio_submit(struct dio *dio, struct dio_submit *sdio)
 	if (dio->is_async && dio->rw == READ)
 		bio_set_pages_dirty(bio);
 
+	/* only a single queue is polled, don't guess which one to pick */
+	if (!dio->poll_q && !dio->poll_mixed) {
+		dio->poll_q = q;
+	} else if (dio->poll_q != q) {
+		dio->poll_q = NULL;
+		dio->poll_mixed = true;
+	}
+
 	if (sdio->submit_io)
 		sdio->submit_io(dio->rw, bio, dio->inode,
 			       sdio->logical_offset_in_bio);
@@ -426,6 +438,13 @@ static inline void dio_cleanup(struct dio *dio, struct dio_submit *sdio)
 		page_cache_release(dio_get_page(dio, sdio));
 }
 
+static bool dio_bio_ready(void *data)
+{
+	struct dio *dio = data;
+
+	return ACCESS_ONCE(dio->refcount) <= 1 || ACCESS_ONCE(dio->bio_list);
+}
+
 /*
  * Wait for the next BIO to complete.  Remove it and return it.  NULL is
  * returned once all BIOs have been completed.  This must only be called once
@@ -437,6 +456,10 @@ static struct bio *dio_await_one(struct dio *dio)
 	unsigned long flags;
 	struct bio *bio = NULL;
 
+	/* busy poll first if the queue allows it, sleep if that times out */
+	if (dio->poll_q)
+		blk_busy_wait(dio->poll_q, dio_bio_ready, dio);
+
 	spin_lock_irqsave(&dio->bio_lock, flags);
 
 	/*
@@ -332,10 +332,12 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 }
 
 extern struct bio_set *bioset_create(unsigned int, unsigned int);
+extern int bioset_enable_cache(struct bio_set *);
 extern void bioset_free(struct bio_set *);
 extern mempool_t *biovec_create_pool(int pool_entries);
 
 extern struct bio *bio_alloc_bioset(gfp_t, int, struct bio_set *);
+extern struct bio *bio_alloc_cached(gfp_t, int, struct bio_set *);
 extern void bio_put(struct bio *);
 
 extern void __bio_clone_fast(struct bio *, struct bio *);
@@ -628,6 +630,10 @@ struct bio_set {
 	struct bio_list		rescue_list;
 	struct work_struct	rescue_work;
 	struct workqueue_struct	*rescue_workqueue;
+
+	/* per-cpu free bios for bio_alloc_cached(), optional */
+	struct bio_alloc_cache __percpu *cache;
+	struct list_head	cache_node;
 };
 
 struct biovec_slab {
@@ -664,6 +670,7 @@ extern int bio_integrity_enabled(struct bio *bio);
 extern int bio_integrity_set_tag(struct bio *, void *, unsigned int);
 extern int bio_integrity_get_tag(struct bio *, void *, unsigned int);
 extern int bio_integrity_prep(struct bio *);
+extern void *bio_integrity_meta_alloc(struct bio *, gfp_t);
 extern void bio_integrity_endio(struct bio *, int);
 extern void bio_integrity_advance(struct bio *, unsigned int);
 extern void bio_integrity_trim(struct bio *, unsigned int, unsigned int);
@@ -699,6 +706,11 @@ static inline int bio_integrity_prep(struct bio *bio)
 	return 0;
 }
 
+static inline void *bio_integrity_meta_alloc(struct bio *bio, gfp_t gfp)
+{
+	return NULL;
+}
+
 static inline void bio_integrity_free(struct bio *bio)
 {
 	return;
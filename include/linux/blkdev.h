@@ -43,7 +43,7 @@ struct blkcg_gq;
  * Maximum number of blkcg policies allowed to be registered concurrently.
  * Defined here to simplify include dependency.
  */
-#define BLKCG_MAX_POLS		2
+#define BLKCG_MAX_POLS		3
 
 struct request;
 typedef void (rq_end_io_fn)(struct request *, int);
@@ -303,6 +303,8 @@ struct queue_limits {
 	unsigned char		raid_partial_stripes_expensive;
 };
 
+struct blk_flush_queue;
+
 struct request_queue {
 	/*
 	 * Together with queue_head for cacheline sharing
@@ -454,14 +456,11 @@ struct request_queue {
 	 */
 	unsigned int		flush_flags;
 	unsigned int		flush_not_queueable:1;
-	unsigned int		flush_queue_delayed:1;
-	unsigned int		flush_pending_idx:1;
-	unsigned int		flush_running_idx:1;
-	unsigned long		flush_pending_since;
-	struct list_head	flush_queue[2];
-	struct list_head	flush_data_in_flight;
-	struct request		*flush_rq;
-	spinlock_t		mq_flush_lock;
+	/* legacy queues only, blk-mq keeps one per hardware context */
+	struct blk_flush_queue	*fq;
+	/* write-back cache state shared by all flush queues */
+	unsigned long		flush_state;
+	atomic_t		flush_inflight;
 
 	struct list_head	requeue_list;
 	spinlock_t		requeue_lock;
@@ -480,12 +479,19 @@ struct request_queue {
 #ifdef CONFIG_BLK_DEV_THROTTLING
 	/* Throttle data */
 	struct throtl_data *td;
+#endif
+#ifdef CONFIG_BLK_CGROUP_IOCOST
+	/* Proportional share data */
+	struct ioc_data *iocd;
 #endif
 	struct rcu_head		rcu_head;
 	wait_queue_head_t	mq_freeze_wq;
 	struct percpu_counter	mq_usage_counter;
 	struct list_head	all_q_node;
 
+	/* blk-mq busy polling budget, see blk_busy_wait() */
+	unsigned int		poll_usec;
+
 	struct blk_mq_tag_set	*tag_set;
 	struct list_head	tag_set_list;
 };
@@ -1046,6 +1052,14 @@ extern void blk_queue_rq_timeout(struct request_queue *, unsigned int);
 extern void blk_queue_flush(struct request_queue *q, unsigned int flush);
 extern void blk_queue_flush_queueable(struct request_queue *q, bool queueable);
 extern struct backing_dev_info *blk_get_backing_dev_info(struct block_device *bdev);
+#ifdef CONFIG_BLK_CGROUP_IOCOST
+extern void blk_iocost_set_model(struct request_queue *q, int rw, u64 seq_cost,
+				 u64 rand_cost, u64 page_cost);
+#else
+static inline void blk_iocost_set_model(struct request_queue *q, int rw,
+					u64 seq_cost, u64 rand_cost,
+					u64 page_cost) { }
+#endif
 
 extern int blk_rq_map_sg(struct request_queue *, struct request *, struct scatterlist *);
 extern int blk_bio_map_sg(struct request_queue *q, struct bio *bio,
@@ -1160,6 +1174,10 @@ static inline struct request *blk_map_queue_find_tag(struct blk_queue_tag *bqt,
 	return bqt->tag_index[tag];
 }
 
+extern int blk_mq_poll(struct request_queue *q);
+extern bool blk_busy_wait(struct request_queue *q, bool (*done)(void *),
+			  void *arg);
+
 #define BLKDEV_DISCARD_SECURE  0x01    /* secure discard */
 
 extern int blkdev_issue_flush(struct block_device *, gfp_t, sector_t *);
@@ -1464,6 +1482,7 @@ static inline uint64_t rq_io_start_time_ns(struct request *req)
 
 #define INTEGRITY_FLAG_READ	2	/* verify data integrity on read */
 #define INTEGRITY_FLAG_WRITE	4	/* generate data integrity on write */
+#define INTEGRITY_FLAG_META	8	/* opaque metadata, always attached */
 
 struct blk_integrity_exchg {
 	void			*prot_buf;
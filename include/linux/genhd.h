@@ -64,6 +64,7 @@ enum {
 #include <linux/string.h>
 #include <linux/fs.h>
 #include <linux/workqueue.h>
+#include <asm/local.h>
 
 struct partition {
 	unsigned char boot_ind;		/* 0x80 - active */
@@ -85,6 +86,8 @@ struct disk_stats {
 	unsigned long ticks[2];
 	unsigned long io_ticks;
 	unsigned long time_in_queue;
+	/* may go negative when a request completes on another cpu */
+	local_t in_flight[2];
 };
 
 #define PARTITION_META_INFO_VOLNAMELTH	64
@@ -118,7 +121,6 @@ struct hd_struct {
 	int make_it_fail;
 #endif
 	unsigned long stamp;
-	atomic_t in_flight[2];
 #ifdef	CONFIG_SMP
 	struct disk_stats __percpu *dkstats;
 #else
@@ -310,6 +312,12 @@ extern struct hd_struct *disk_map_sector_rcu(struct gendisk *disk,
 #define __part_stat_add(cpu, part, field, addnd)			\
 	(per_cpu_ptr((part)->dkstats, (cpu))->field += (addnd))
 
+#define __part_stat_local_add(part, field, addnd)			\
+	local_add((addnd), &this_cpu_ptr((part)->dkstats)->field)
+
+#define part_stat_local_read_cpu(part, field, cpu)			\
+	local_read(&per_cpu_ptr((part)->dkstats, (cpu))->field)
+
 #define part_stat_read(part, field)					\
 ({									\
 	typeof((part)->dkstats->field) res = 0;				\
@@ -348,6 +356,12 @@ static inline void free_part_stats(struct hd_struct *part)
 #define __part_stat_add(cpu, part, field, addnd)				\
 	((part)->dkstats.field += addnd)
 
+#define __part_stat_local_add(part, field, addnd)			\
+	local_add((addnd), &(part)->dkstats.field)
+
+#define part_stat_local_read_cpu(part, field, cpu)			\
+	local_read(&(part)->dkstats.field)
+
 #define part_stat_read(part, field)	((part)->dkstats.field)
 
 static inline void part_stat_set_all(struct hd_struct *part, int value)
@@ -380,23 +394,42 @@ static inline void free_part_stats(struct hd_struct *part)
 #define part_stat_sub(cpu, gendiskp, field, subnd)			\
 	part_stat_add(cpu, gendiskp, field, -subnd)
 
+/*
+ * In-flight counts are kept per cpu so that starting and completing I/O
+ * only touches local cachelines.  Must be called between
+ * part_stat_lock() and part_stat_unlock().
+ */
 static inline void part_inc_in_flight(struct hd_struct *part, int rw)
 {
-	atomic_inc(&part->in_flight[rw]);
+	__part_stat_local_add(part, in_flight[rw], 1);
 	if (part->partno)
-		atomic_inc(&part_to_disk(part)->part0.in_flight[rw]);
+		__part_stat_local_add(&part_to_disk(part)->part0,
+				      in_flight[rw], 1);
 }
 
 static inline void part_dec_in_flight(struct hd_struct *part, int rw)
 {
-	atomic_dec(&part->in_flight[rw]);
+	__part_stat_local_add(part, in_flight[rw], -1);
 	if (part->partno)
-		atomic_dec(&part_to_disk(part)->part0.in_flight[rw]);
+		__part_stat_local_add(&part_to_disk(part)->part0,
+				      in_flight[rw], -1);
+}
+
+/* sums all cpus, not for the I/O path */
+static inline int part_in_flight_rw(struct hd_struct *part, int rw)
+{
+	int cpu, inflight = 0;
+
+	for_each_possible_cpu(cpu)
+		inflight += part_stat_local_read_cpu(part, in_flight[rw], cpu);
+
+	/* a racing read may see a completion before its start */
+	return max(inflight, 0);
 }
 
 static inline int part_in_flight(struct hd_struct *part)
 {
-	return atomic_read(&part->in_flight[0]) + atomic_read(&part->in_flight[1]);
+	return part_in_flight_rw(part, READ) + part_in_flight_rw(part, WRITE);
 }
 
 static inline struct partition_meta_info *alloc_part_info(struct gendisk *disk)
@@ -414,6 +447,7 @@ static inline void free_part_info(struct hd_struct *part)
 
 /* block/blk-core.c */
 extern void part_round_stats(int cpu, struct hd_struct *part);
+extern void part_update_io_ticks(int cpu, struct hd_struct *part, bool end);
 
 /* block/genhd.c */
 extern void add_disk(struct gendisk *disk);
@@ -17,24 +17,37 @@
 
 #include <linux/wait.h>
 #include <linux/mutex.h>
+#include <linux/blk-mq.h>
 #include <uapi/linux/nbd.h>
 
 struct request;
 
+/*
+ * One TCP connection to the server.  Each blk-mq hardware queue sends on
+ * connection (queue_num % num_connections), replies are read by a receive
+ * thread per connection.
+ */
+struct nbd_sock {
+	struct socket *sock;	/* If == NULL, connection is not usable	*/
+	struct mutex tx_lock;	/* Serializes senders on this socket	*/
+	atomic_t tx_waiters;	/* Senders queued up on tx_lock		*/
+	int dead;		/* Shut down after an error		*/
+	bool tx_coalesce;	/* TCP_TX_COALESCE window is set	*/
+};
+
 struct nbd_device {
 	int flags;
 	int harderror;		/* Code of hard error			*/
-	struct socket * sock;	/* If == NULL, device is not ready, yet	*/
+	struct nbd_sock *socks;	/* One per hardware queue at most	*/
+	int num_connections;
 	int magic;
 
-	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
-	wait_queue_head_t active_wq;
-	struct list_head waiting_queue;	/* Requests to be sent */
-	wait_queue_head_t waiting_wq;
+	struct blk_mq_tag_set tag_set;
+
+	atomic_t recv_threads;	/* Receive threads still running	*/
+	wait_queue_head_t recv_wq;
 
-	struct mutex tx_lock;
+	struct mutex config_lock;
 	struct gendisk *disk;
 	int blksize;
 	u64 bytesize;
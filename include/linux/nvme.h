@@ -21,6 +21,7 @@
 
 #include <uapi/linux/nvme.h>
 #include <linux/pci.h>
+#include <linux/interrupt.h>
 #include <linux/miscdevice.h>
 #include <linux/kref.h>
 
@@ -36,6 +37,8 @@ struct nvme_bar {
 	__u32			aqa;	/* Admin Queue Attributes */
 	__u64			asq;	/* Admin SQ Base Address */
 	__u64			acq;	/* Admin CQ Base Address */
+	__u32			cmbloc;	/* Controller Memory Buffer Location */
+	__u32			cmbsz;	/* Controller Memory Buffer Size */
 };
 
 #define NVME_CAP_MQES(cap)	((cap) & 0xffff)
@@ -43,6 +46,13 @@ struct nvme_bar {
 #define NVME_CAP_STRIDE(cap)	(((cap) >> 32) & 0xf)
 #define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
 
+#define NVME_CMB_BIR(cmbloc)	((cmbloc) & 0x7)
+#define NVME_CMB_OFST(cmbloc)	(((cmbloc) >> 12) & 0xfffff)
+#define NVME_CMB_SZ(cmbsz)	(((cmbsz) >> 12) & 0xfffff)
+#define NVME_CMB_SZU(cmbsz)	(((cmbsz) >> 8) & 0xf)
+#define NVME_CMB_WDS(cmbsz)	((cmbsz) & 0x10)
+#define NVME_CMB_SQS(cmbsz)	((cmbsz) & 0x1)
+
 enum {
 	NVME_CC_ENABLE		= 1 << 0,
 	NVME_CC_CSS_NVM		= 0 << 4,
@@ -69,15 +79,55 @@ enum {
 extern unsigned char io_timeout;
 #define NVME_IO_TIMEOUT	(io_timeout * HZ)
 
+struct nvme_dev;
+
+/*
+ * How nvme-core reaches a controller's registers and interrupts.  The PCI
+ * transport lives in nvme-core itself; others, such as nvme-loop, hand their
+ * controllers to nvme_probe_ctrl().  Interrupt vectors are numbered from 0,
+ * which is always the admin queue's.
+ */
+struct nvme_transport_ops {
+	/* make the register page and admin doorbells available at dev->bar */
+	int (*map)(struct nvme_dev *dev);
+	void (*unmap)(struct nvme_dev *dev);
+	/*
+	 * Called with the admin vector released.  Makes doorbells for
+	 * @nr_io_queues available and returns how many IO vectors were set up.
+	 */
+	int (*setup_vectors)(struct nvme_dev *dev, int nr_io_queues);
+	int (*request_irq)(struct nvme_dev *dev, int vector,
+			irq_handler_t handler, irq_handler_t thread_fn,
+			const char *name, void *data);
+	void (*free_irq)(struct nvme_dev *dev, int vector, void *data);
+	/* optional */
+	void (*set_irq_affinity)(struct nvme_dev *dev, int vector,
+			const struct cpumask *mask);
+	/* optional, called after a SQ tail doorbell write */
+	void (*sq_doorbell)(struct nvme_dev *dev, u16 qid);
+	/* optional, detach a controller that failed to come back from reset */
+	void (*remove_dead)(struct nvme_dev *dev);
+	/*
+	 * optional, map the controller memory buffer write-combined.  @size
+	 * may be trimmed to what the BAR holds; the address the controller
+	 * knows the buffer by is returned in @dma_addr.
+	 */
+	void __iomem *(*map_cmb)(struct nvme_dev *dev, int bir, u64 offset,
+				u64 *size, dma_addr_t *dma_addr);
+	void (*unmap_cmb)(struct nvme_dev *dev, void __iomem *cmb);
+};
+
 /*
- * Represents an NVM Express device.  Each nvme_dev is a PCI function.
+ * Represents an NVM Express device.  Each nvme_dev is a controller reached
+ * through a transport, usually a PCI function.
  */
 struct nvme_dev {
-	struct list_head node;
 	struct nvme_queue __rcu **queues;
 	unsigned short __percpu *io_queue;
 	u32 __iomem *dbs;
-	struct pci_dev *pci_dev;
+	struct device *dev;
+	const struct nvme_transport_ops *ops;
+	struct pci_dev *pci_dev;	/* NULL if not on PCI */
 	struct dma_pool *prp_page_pool;
 	struct dma_pool *prp_small_pool;
 	int instance;
@@ -89,6 +139,13 @@ struct nvme_dev {
 	u32 ctrl_config;
 	struct msix_entry *entry;
 	struct nvme_bar __iomem *bar;
+	void __iomem *cmb;		/* Controller memory buffer, if mapped */
+	dma_addr_t cmb_dma_addr;
+	u64 cmb_size;
+	u32 cmbsz;
+	u32 cmb_sq_stride;		/* Per-queue SQ space, 0 if SQs aren't in it */
+	u32 cmb_queue_size;		/* Per-queue share of the buffer */
+	unsigned cmb_queues;
 	struct list_head namespaces;
 	struct kref kref;
 	struct miscdevice miscdev;
@@ -101,6 +158,8 @@ struct nvme_dev {
 	char firmware_rev[8];
 	u32 max_hw_sectors;
 	u32 stripe_size;
+	u32 sgls;
+	u16 vendor;
 	u16 oncs;
 	u16 abort_limit;
 	u8 initialized;
@@ -137,7 +196,13 @@ struct nvme_iod {
 	int length;		/* Of data, in bytes */
 	unsigned long start_time;
 	dma_addr_t first_dma;
+	struct scatterlist meta_sg;	/* Metadata buffer, if any */
 	struct list_head node;
+	struct nvme_queue *nvmeq;	/* Owner, if preallocated */
+	__le64 *prp_inline;		/* Preallocated PRP list, if any */
+	dma_addr_t prp_inline_dma;
+	struct nvme_sgl_desc sgl;	/* Data pointer, if length is set */
+	int cmb_slot;			/* Write data copy in the CMB, or -1 */
 	struct scatterlist sg[0];
 };
 
@@ -153,6 +218,11 @@ static inline u64 nvme_block_nr(struct nvme_ns *ns, sector_t sector)
  */
 void nvme_free_iod(struct nvme_dev *dev, struct nvme_iod *iod);
 
+struct nvme_dev *nvme_alloc_ctrl(struct device *dev,
+				const struct nvme_transport_ops *ops);
+int nvme_probe_ctrl(struct nvme_dev *dev);
+void nvme_remove_ctrl(struct nvme_dev *dev);
+
 int nvme_setup_prps(struct nvme_dev *, struct nvme_iod *, int , gfp_t);
 struct nvme_iod *nvme_map_user_pages(struct nvme_dev *dev, int write,
 				unsigned long addr, unsigned length);
@@ -169,10 +239,13 @@ int nvme_get_features(struct nvme_dev *dev, unsigned fid, unsigned nsid,
 int nvme_set_features(struct nvme_dev *dev, unsigned fid, unsigned dword11,
 			dma_addr_t dma_addr, u32 *result);
 
+struct block_device;
 struct sg_io_hdr;
 
-int nvme_sg_io(struct nvme_ns *ns, struct sg_io_hdr __user *u_hdr);
-int nvme_sg_io32(struct nvme_ns *ns, unsigned long arg);
+int nvme_sg_io(struct nvme_ns *ns, struct block_device *bdev,
+					struct sg_io_hdr __user *u_hdr);
+int nvme_sg_io32(struct nvme_ns *ns, struct block_device *bdev,
+						unsigned long arg);
 int nvme_sg_get_version_num(int __user *ip);
 
 #endif /* _LINUX_NVME_H */
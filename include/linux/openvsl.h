@@ -104,6 +104,8 @@ struct vsl_dev {
 	struct vsl_dev_ops *ops;
 
 	unsigned int drv_cmd_size;
+	/* per sector OOB bytes carried in each request's pdu, 0 if none */
+	unsigned int oob_size;
 
 	void *driver_data;
 	void *stor;
@@ -120,6 +122,7 @@ void vsl_free(struct vsl_dev *);
 /* OpenVSL Requests */
 int vsl_queue_rq(struct blk_mq_hw_ctx *, struct request *);
 int vsl_init_hctx(struct blk_mq_hw_ctx *, void *, unsigned int);
+void *vsl_rq_oob(struct vsl_dev *, struct request *);
 int vsl_init_request(void *, struct request *, unsigned int, unsigned int,
 								unsigned int);
 void vsl_end_io(struct request *, int);
@@ -162,6 +162,10 @@ struct tcp_sock {
 	struct list_head tsq_node; /* anchor in tsq_tasklet.head list */
 	unsigned long	tsq_flags;
 
+	u32	tx_coalesce_us;	/* TCP_TX_COALESCE window, 0 when off */
+	u32	tx_coalesce_end; /* when the open window closes, in usecs */
+	struct list_head tx_coalesce_node; /* anchor in tx_coalesce_timer list */
+
 	/* Data for direct copy to user */
 	struct {
 		struct sk_buff_head	prequeue;
@@ -334,6 +338,8 @@ enum tsq_flags {
 	TCP_MTU_REDUCED_DEFERRED,  /* tcp_v{4|6}_err() could not call
 				    * tcp_v{4|6}_mtu_reduced()
 				    */
+	TCP_TX_COALESCE_HOLD,	   /* a TCP_TX_COALESCE window is open */
+	TCP_TX_COALESCE_QUEUED,	   /* queued to a tx_coalesce_timer */
 };
 
 static inline struct tcp_sock *tcp_sk(const struct sock *sk)
@@ -37,6 +37,11 @@ extern unsigned int sysctl_net_busy_poll __read_mostly;
 #define LL_FLUSH_FAILED		-1
 #define LL_FLUSH_BUSY		-2
 
+/* napi context last busy polled on this cpu, for napi_busy_poll_cpu() */
+DECLARE_PER_CPU(unsigned int, busy_poll_napi_id);
+
+extern int napi_busy_poll_cpu(void);
+
 static inline bool net_busy_loop_on(void)
 {
 	return sysctl_net_busy_poll;
@@ -96,6 +101,8 @@ static inline bool sk_busy_loop(struct sock *sk, int nonblock)
 	if (!ops->ndo_busy_poll)
 		goto out;
 
+	__this_cpu_write(busy_poll_napi_id, sk->sk_napi_id);
+
 	do {
 		rc = ops->ndo_busy_poll(napi);
 
@@ -165,5 +172,10 @@ static inline bool sk_busy_loop(struct sock *sk, int nonblock)
 	return false;
 }
 
+static inline int napi_busy_poll_cpu(void)
+{
+	return 0;
+}
+
 #endif /* CONFIG_NET_RX_BUSY_POLL */
 #endif /* _LINUX_NET_BUSY_POLL_H */
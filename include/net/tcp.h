@@ -556,6 +556,10 @@ void tcp_send_ack(struct sock *sk);
 void tcp_send_delayed_ack(struct sock *sk);
 void tcp_send_loss_probe(struct sock *sk);
 bool tcp_schedule_loss_probe(struct sock *sk);
+void tcp_tx_coalesce_arm(struct sock *sk);
+
+/* Longest TCP_TX_COALESCE window accepted, in usecs */
+#define TCP_TX_COALESCE_MAX_US	10000
 
 /* tcp_input.c */
 void tcp_cwnd_application_limited(struct sock *sk);
@@ -43,6 +43,8 @@ enum {
 #define NBD_FLAG_SEND_FLUSH   (1 << 2) /* can flush writeback cache */
 /* there is a gap here to match userspace */
 #define NBD_FLAG_SEND_TRIM    (1 << 5) /* send trim/discard */
+/* there is a gap here to match userspace */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8) /* server serves several connections */
 
 #define nbd_cmd(req) ((req)->cmd[0])
 
@@ -0,0 +1,97 @@
+/*
+ * Kernel module for measuring bio allocation and free costs.
+ *
+ * Times bio_alloc()/bio_put() and bio_alloc_cached()/bio_put() pairs for
+ * a few vec counts and reports the average in nsecs.  Loading fails if
+ * any allocation fails or returns a bio with too few vecs.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/bio.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+static unsigned int iterations = 1000000;
+module_param(iterations, uint, 0444);
+MODULE_PARM_DESC(iterations, "alloc/free pairs per measurement");
+
+/* bios kept allocated at once, mimics a submitter with IOs in flight */
+static unsigned int batch = 32;
+module_param(batch, uint, 0444);
+MODULE_PARM_DESC(batch, "bios allocated before freeing them");
+
+static int bench_bio_alloc(int nr_vecs, bool cached, u64 *ns)
+{
+	struct bio **bios;
+	unsigned int i, j;
+	ktime_t start;
+	int ret = 0;
+
+	bios = kcalloc(batch, sizeof(*bios), GFP_KERNEL);
+	if (!bios)
+		return -ENOMEM;
+
+	start = ktime_get();
+	for (i = 0; i < iterations && !ret; i += batch) {
+		for (j = 0; j < batch; j++) {
+			if (cached)
+				bios[j] = bio_alloc_cached(GFP_KERNEL, nr_vecs,
+							   fs_bio_set);
+			else
+				bios[j] = bio_alloc(GFP_KERNEL, nr_vecs);
+			if (!bios[j]) {
+				ret = -ENOMEM;
+				break;
+			}
+			if (bios[j]->bi_max_vecs < nr_vecs)
+				ret = -EINVAL;
+		}
+		while (j--)
+			bio_put(bios[j]);
+		cond_resched();
+	}
+	*ns = div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), i);
+
+	kfree(bios);
+	return ret;
+}
+
+static int __init test_bio_alloc_init(void)
+{
+	static const int nr_vecs[] = { 1, 4, 16, 256 };
+	u64 plain, cached;
+	int i, ret;
+
+	if (!iterations || !batch || batch > iterations)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(nr_vecs); i++) {
+		ret = bench_bio_alloc(nr_vecs[i], false, &plain);
+		if (!ret)
+			ret = bench_bio_alloc(nr_vecs[i], true, &cached);
+		if (ret) {
+			pr_err("nr_vecs=%3d failed: %d\n", nr_vecs[i], ret);
+			return ret;
+		}
+		pr_info("nr_vecs=%3d bio_alloc: %llu ns  bio_alloc_cached: %llu ns\n",
+			nr_vecs[i], plain, cached);
+	}
+
+	return 0;
+}
+
+static void __exit test_bio_alloc_exit(void)
+{
+}
+
+module_init(test_bio_alloc_init);
+module_exit(test_bio_alloc_exit);
+
+MODULE_LICENSE("GPL");
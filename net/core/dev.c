@@ -132,6 +132,7 @@
 #include <linux/hashtable.h>
 #include <linux/vmalloc.h>
 #include <linux/if_macvlan.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -4318,6 +4319,49 @@ void napi_hash_del(struct napi_struct *napi)
 }
 EXPORT_SYMBOL_GPL(napi_hash_del);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+DEFINE_PER_CPU(unsigned int, busy_poll_napi_id);
+
+/**
+ *	napi_busy_poll_cpu - poll the napi context last busy polled here
+ *
+ *	For busy pollers waiting on something other than a socket, block
+ *	IO say, so that they reap packets for this CPU's last socket busy
+ *	poller within the same budget.  Returns the number of packets.
+ */
+int napi_busy_poll_cpu(void)
+{
+	const struct net_device_ops *ops;
+	struct napi_struct *napi;
+	unsigned int napi_id;
+	int rc = 0;
+
+	rcu_read_lock_bh();
+	napi_id = __this_cpu_read(busy_poll_napi_id);
+	if (!napi_id)
+		goto out;
+
+	napi = napi_by_id(napi_id);
+	if (!napi)
+		goto out;
+
+	ops = napi->dev->netdev_ops;
+	if (!ops->ndo_busy_poll)
+		goto out;
+
+	rc = ops->ndo_busy_poll(napi);
+	if (rc > 0)
+		NET_ADD_STATS_BH(dev_net(napi->dev),
+				 LINUX_MIB_BUSYPOLLRXPACKETS, rc);
+	else
+		rc = 0;
+out:
+	rcu_read_unlock_bh();
+	return rc;
+}
+EXPORT_SYMBOL(napi_busy_poll_cpu);
+#endif
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
@@ -655,7 +655,17 @@ static void tcp_push(struct sock *sk, int flags, int mss_now,
 
 	tcp_mark_urg(tp, flags);
 
-	if (tcp_should_autocork(sk, skb, size_goal)) {
+	/* TCP_TX_COALESCE: a send announcing more to come gives following
+	 * writes a chance to fill the segment, tcp_write_xmit() holds it
+	 * back until the window closes.  One that doesn't closes it now.
+	 */
+	if (tp->tx_coalesce_us && !(flags & MSG_MORE) &&
+	    test_bit(TCP_TX_COALESCE_HOLD, &tp->tsq_flags))
+		clear_bit(TCP_TX_COALESCE_HOLD, &tp->tsq_flags);
+
+	if (tp->tx_coalesce_us && (flags & MSG_MORE) && skb->len < size_goal)
+		tcp_tx_coalesce_arm(sk);
+	else if (tcp_should_autocork(sk, skb, size_goal)) {
 
 		/* avoid atomic op if TSQ_THROTTLED bit is already set */
 		if (!test_bit(TSQ_THROTTLED, &tp->tsq_flags)) {
@@ -2698,6 +2708,12 @@ static int do_tcp_setsockopt(struct sock *sk, int level,
 		tp->notsent_lowat = val;
 		sk->sk_write_space(sk);
 		break;
+	case TCP_TX_COALESCE:
+		if (val < 0 || val > TCP_TX_COALESCE_MAX_US)
+			err = -EINVAL;
+		else
+			tp->tx_coalesce_us = val;
+		break;
 	default:
 		err = -ENOPROTOOPT;
 		break;
@@ -2922,6 +2938,9 @@ static int do_tcp_getsockopt(struct sock *sk, int level,
 	case TCP_NOTSENT_LOWAT:
 		val = tp->notsent_lowat;
 		break;
+	case TCP_TX_COALESCE:
+		val = tp->tx_coalesce_us;
+		break;
 	default:
 		return -ENOPROTOOPT;
 	}
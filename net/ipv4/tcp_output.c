@@ -753,6 +753,133 @@ static void tcp_tasklet_func(unsigned long data)
 	}
 }
 
+/*
+ * TCP_TX_COALESCE: a send with MSG_MORE which leaves a partial segment at
+ * the tail of the write queue opens a window of tp->tx_coalesce_us, during
+ * which tcp_write_xmit() holds that segment back so that following small
+ * writes (RPC headers and payloads, say) join it and leave as one full
+ * sized skb.  A send without MSG_MORE closes the window again.
+ *
+ * Windows are timed per cpu rather than per socket, like TSQ: sockets with
+ * an open window are queued to the local cpu, whose hrtimer pushes out
+ * what is still held back once their window closed.
+ */
+struct tx_coalesce_timer {
+	struct tasklet_hrtimer	timer;
+	struct list_head	head; /* queue of tcp sockets */
+};
+static DEFINE_PER_CPU(struct tx_coalesce_timer, tx_coalesce_timer);
+
+/* Window ends are kept in usecs, compared wrap safe */
+static u32 tcp_tx_coalesce_now(void)
+{
+	return (u32)ktime_to_us(ktime_get());
+}
+
+/* Make sure the timer of @txc fires within @us. Called with irqs off. */
+static void tcp_tx_coalesce_schedule(struct tx_coalesce_timer *txc, u32 us)
+{
+	ktime_t expires = ktime_add_us(ktime_get(), us);
+
+	if (hrtimer_is_queued(&txc->timer.timer) &&
+	    ktime_compare(hrtimer_get_expires(&txc->timer.timer), expires) <= 0)
+		return;
+
+	tasklet_hrtimer_start(&txc->timer, expires, HRTIMER_MODE_ABS_PINNED);
+}
+
+static enum hrtimer_restart tcp_tx_coalesce_timer_fn(struct hrtimer *timer)
+{
+	struct tx_coalesce_timer *txc = container_of(timer,
+					struct tx_coalesce_timer, timer.timer);
+	u32 now = tcp_tx_coalesce_now();
+	s32 left, next = S32_MAX;
+	struct tcp_sock *tp, *tmp;
+	unsigned long flags;
+	struct sock *sk;
+	LIST_HEAD(list);
+
+	local_irq_save(flags);
+	list_splice_init(&txc->head, &list);
+	local_irq_restore(flags);
+
+	list_for_each_entry_safe(tp, tmp, &list, tx_coalesce_node) {
+		left = (s32)(ACCESS_ONCE(tp->tx_coalesce_end) - now);
+		if (left > 0) {
+			next = min(next, left);
+			continue;
+		}
+		list_del(&tp->tx_coalesce_node);
+		clear_bit(TCP_TX_COALESCE_HOLD, &tp->tsq_flags);
+
+		sk = (struct sock *)tp;
+		bh_lock_sock(sk);
+
+		if (!sock_owned_by_user(sk)) {
+			tcp_tsq_handler(sk);
+		} else {
+			/* defer the work to tcp_release_cb() */
+			set_bit(TCP_TSQ_DEFERRED, &tp->tsq_flags);
+		}
+		bh_unlock_sock(sk);
+
+		smp_mb__before_clear_bit();
+		clear_bit(TCP_TX_COALESCE_QUEUED, &tp->tsq_flags);
+		sock_put(sk);
+	}
+
+	/* windows which are still open, reopened after a push say */
+	if (!list_empty(&list)) {
+		local_irq_save(flags);
+		list_splice(&list, &txc->head);
+		tcp_tx_coalesce_schedule(txc, next);
+		local_irq_restore(flags);
+	}
+	return HRTIMER_NORESTART;
+}
+
+/* Open a coalescing window unless one is open already. */
+void tcp_tx_coalesce_arm(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct tx_coalesce_timer *txc;
+	unsigned long flags;
+
+	if (test_and_set_bit(TCP_TX_COALESCE_HOLD, &tp->tsq_flags))
+		return;
+
+	ACCESS_ONCE(tp->tx_coalesce_end) = tcp_tx_coalesce_now() +
+					   tp->tx_coalesce_us;
+
+	/* still queued for an earlier window, that timer picks it up */
+	if (test_and_set_bit(TCP_TX_COALESCE_QUEUED, &tp->tsq_flags))
+		return;
+
+	/* The queue keeps a reference, released by the timer */
+	sock_hold(sk);
+
+	local_irq_save(flags);
+	txc = &__get_cpu_var(tx_coalesce_timer);
+	list_add(&tp->tx_coalesce_node, &txc->head);
+	tcp_tx_coalesce_schedule(txc, tp->tx_coalesce_us);
+	local_irq_restore(flags);
+}
+
+/* Should the partial tail segment @skb wait for the window to close? */
+static bool tcp_tx_coalesce_defer(const struct sock *sk,
+				  const struct sk_buff *skb,
+				  unsigned int mss_now)
+{
+	const struct tcp_sock *tp = tcp_sk(sk);
+
+	return tp->tx_coalesce_us &&
+	       test_bit(TCP_TX_COALESCE_HOLD, &tp->tsq_flags) &&
+	       tcp_skb_is_last(sk, skb) &&
+	       !tcp_urg_mode(tp) &&
+	       !(TCP_SKB_CB(skb)->tcp_flags & TCPHDR_FIN) &&
+	       skb->len < max_t(u32, tp->xmit_size_goal_segs, 1) * mss_now;
+}
+
 #define TCP_DEFERRED_ALL ((1UL << TCP_TSQ_DEFERRED) |		\
 			  (1UL << TCP_WRITE_TIMER_DEFERRED) |	\
 			  (1UL << TCP_DELACK_TIMER_DEFERRED) |	\
@@ -813,10 +940,16 @@ void __init tcp_tasklet_init(void)
 	for_each_possible_cpu(i) {
 		struct tsq_tasklet *tsq = &per_cpu(tsq_tasklet, i);
 
+		struct tx_coalesce_timer *txc = &per_cpu(tx_coalesce_timer, i);
+
 		INIT_LIST_HEAD(&tsq->head);
 		tasklet_init(&tsq->tasklet,
 			     tcp_tasklet_func,
 			     (unsigned long)tsq);
+
+		INIT_LIST_HEAD(&txc->head);
+		tasklet_hrtimer_init(&txc->timer, tcp_tx_coalesce_timer_fn,
+				     CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	}
 }
 
@@ -1902,6 +2035,9 @@ static bool tcp_write_xmit(struct sock *sk, unsigned int mss_now, int nonagle,
 		if (unlikely(!tcp_snd_wnd_test(tp, skb, mss_now)))
 			break;
 
+		if (push_one != 2 && tcp_tx_coalesce_defer(sk, skb, mss_now))
+			break;
+
 		if (tso_segs == 1) {
 			if (unlikely(!tcp_nagle_test(tp, skb, mss_now,
 						     (tcp_skb_is_last(sk, skb) ?
@@ -66,6 +66,9 @@ static unsigned int xprt_max_resvport = RPC_DEF_MAX_RESVPORT;
 #define XS_TCP_LINGER_TO	(15U * HZ)
 static unsigned int xs_tcp_fin_timeout __read_mostly = XS_TCP_LINGER_TO;
 
+/* TCP_TX_COALESCE window for new TCP transports, in usecs, 0 for off */
+static unsigned int xprt_tcp_tx_coalesce_us;
+
 /*
  * We can register our own files under /proc/sys/sunrpc by
  * calling register_sysctl_table() again.  The files in that
@@ -443,9 +446,10 @@ static int xs_send_pagedata(struct socket *sock, struct xdr_buf *xdr, unsigned i
  * @xdr: buffer containing this request
  * @base: starting position in the buffer
  * @zerocopy: true if it is safe to use sendpage()
+ * @more: more data will follow this buffer, send it all with MSG_MORE
  *
  */
-static int xs_sendpages(struct socket *sock, struct sockaddr *addr, int addrlen, struct xdr_buf *xdr, unsigned int base, bool zerocopy)
+static int xs_sendpages(struct socket *sock, struct sockaddr *addr, int addrlen, struct xdr_buf *xdr, unsigned int base, bool zerocopy, int more)
 {
 	unsigned int remainder = xdr->len - base;
 	int err, sent = 0;
@@ -462,7 +466,7 @@ static int xs_sendpages(struct socket *sock, struct sockaddr *addr, int addrlen,
 	if (base < xdr->head[0].iov_len || addr != NULL) {
 		unsigned int len = xdr->head[0].iov_len - base;
 		remainder -= len;
-		err = xs_send_kvec(sock, addr, addrlen, &xdr->head[0], base, remainder != 0);
+		err = xs_send_kvec(sock, addr, addrlen, &xdr->head[0], base, remainder != 0 || more);
 		if (remainder == 0 || err != len)
 			goto out;
 		sent += err;
@@ -473,7 +477,7 @@ static int xs_sendpages(struct socket *sock, struct sockaddr *addr, int addrlen,
 	if (base < xdr->page_len) {
 		unsigned int len = xdr->page_len - base;
 		remainder -= len;
-		err = xs_send_pagedata(sock, xdr, base, remainder != 0, zerocopy);
+		err = xs_send_pagedata(sock, xdr, base, remainder != 0 || more, zerocopy);
 		if (remainder == 0 || err != len)
 			goto out;
 		sent += err;
@@ -483,7 +487,7 @@ static int xs_sendpages(struct socket *sock, struct sockaddr *addr, int addrlen,
 
 	if (base >= xdr->tail[0].iov_len)
 		return sent;
-	err = xs_send_kvec(sock, NULL, 0, &xdr->tail[0], base, 0);
+	err = xs_send_kvec(sock, NULL, 0, &xdr->tail[0], base, more);
 out:
 	if (sent == 0)
 		return err;
@@ -580,7 +584,7 @@ static int xs_local_send_request(struct rpc_task *task)
 			req->rq_svec->iov_base, req->rq_svec->iov_len);
 
 	status = xs_sendpages(transport->sock, NULL, 0,
-						xdr, req->rq_bytes_sent, true);
+						xdr, req->rq_bytes_sent, true, 0);
 	dprintk("RPC:       %s(%u) = %d\n",
 			__func__, xdr->len - req->rq_bytes_sent, status);
 	if (likely(status >= 0)) {
@@ -636,7 +640,7 @@ static int xs_udp_send_request(struct rpc_task *task)
 	status = xs_sendpages(transport->sock,
 			      xs_addr(xprt),
 			      xprt->addrlen, xdr,
-			      req->rq_bytes_sent, true);
+			      req->rq_bytes_sent, true, 0);
 
 	dprintk("RPC:       xs_udp_send_request(%u) = %d\n",
 			xdr->len - req->rq_bytes_sent, status);
@@ -710,10 +714,17 @@ static int xs_tcp_send_request(struct rpc_task *task)
 	struct sock_xprt *transport = container_of(xprt, struct sock_xprt, xprt);
 	struct xdr_buf *xdr = &req->rq_snd_buf;
 	bool zerocopy = true;
-	int status;
+	int status, more;
 
 	xs_encode_stream_record_marker(&req->rq_snd_buf);
 
+	/* With TCP_TX_COALESCE on, a record followed by more queued
+	 * requests can go out with MSG_MORE: the coalescing window bounds
+	 * how long it waits should those requests not be sent after all.
+	 */
+	more = tcp_sk(transport->inet)->tx_coalesce_us &&
+	       ACCESS_ONCE(xprt->sending.qlen);
+
 	xs_pktdump("packet data:",
 				req->rq_svec->iov_base,
 				req->rq_svec->iov_len);
@@ -730,7 +741,7 @@ static int xs_tcp_send_request(struct rpc_task *task)
 	while (1) {
 		status = xs_sendpages(transport->sock,
 					NULL, 0, xdr, req->rq_bytes_sent,
-					zerocopy);
+					zerocopy, more);
 
 		dprintk("RPC:       xs_tcp_send_request(%u) = %d\n",
 				xdr->len - req->rq_bytes_sent, status);
@@ -2166,6 +2177,11 @@ static int xs_tcp_finish_connecting(struct rpc_xprt *xprt, struct socket *sock)
 		kernel_setsockopt(sock, SOL_TCP, TCP_KEEPCNT,
 				(char *)&keepcnt, sizeof(keepcnt));
 
+		if (xprt_tcp_tx_coalesce_us)
+			kernel_setsockopt(sock, SOL_TCP, TCP_TX_COALESCE,
+					(char *)&xprt_tcp_tx_coalesce_us,
+					sizeof(xprt_tcp_tx_coalesce_us));
+
 		write_lock_bh(&sk->sk_callback_lock);
 
 		xs_save_old_callbacks(transport, sk);
@@ -3125,4 +3141,5 @@ module_param_named(tcp_max_slot_table_entries, xprt_max_tcp_slot_table_entries,
 		   max_slot_table_size, 0644);
 module_param_named(udp_slot_table_entries, xprt_udp_slot_table_entries,
 		   slot_table_size, 0644);
+module_param_named(tcp_tx_coalesce_us, xprt_tcp_tx_coalesce_us, uint, 0644);
 
@@ -0,0 +1,679 @@
+/*
+ * block.c
+ *
+ * block: random and sequential read/write benchmark for block devices
+ *
+ * Drives a block device from a number of threads, either with one
+ * pread()/pwrite() at a time per thread (sync) or with a queue of Linux
+ * native AIO requests per thread (async), and reports IOPS, bandwidth and
+ * completion latency percentiles.  With --stages, the block tracepoints
+ * are sampled during the run to split latency into time spent queued in
+ * the block layer (insert to issue) and time spent in the driver and
+ * device (issue to complete).
+ *
+ * The reference target is null_blk, e.g.:
+ *
+ *   modprobe null_blk queue_mode=2      (blk-mq)
+ *   modprobe null_blk queue_mode=3      (VSL)
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/aio_abi.h>
+
+static const char	*device		= "/dev/nullb0";
+static const char	*op_str		= "randread";
+static const char	*bs_str		= "4k";
+static const char	*size_str;
+static unsigned int	nthreads	= 1;
+static unsigned int	iodepth		= 32;
+static unsigned int	nsecs		= 5;
+static bool		buffered;
+static bool		force;
+static bool		stages;
+
+static const struct option options[] = {
+	OPT_STRING('d', "device",     &device,   "dev",   "Block device to benchmark (default: /dev/nullb0)"),
+	OPT_STRING('o', "op",         &op_str,   "op",    "read, write, randread or randwrite (default: randread)"),
+	OPT_STRING('b', "block-size", &bs_str,   "size",  "Size of each IO, e.g. 4k, 128k (default: 4k)"),
+	OPT_STRING('s', "size",       &size_str, "size",  "Only use the first <size> bytes of the device"),
+	OPT_UINTEGER('t', "threads",  &nthreads,          "Number of submitting threads (default: 1)"),
+	OPT_UINTEGER('q', "iodepth",  &iodepth,           "IOs in flight per thread, async only (default: 32)"),
+	OPT_UINTEGER('r', "runtime",  &nsecs,             "Runtime in seconds (default: 5)"),
+	OPT_BOOLEAN('B', "buffered",  &buffered,          "Go through the page cache instead of O_DIRECT"),
+	OPT_BOOLEAN('F', "force",     &force,             "Allow writes to devices other than null_blk"),
+	OPT_BOOLEAN('S', "stages",    &stages,            "Sample per-stage latencies from block tracepoints"),
+	OPT_END()
+};
+
+static const char * const bench_block_sync_usage[] = {
+	"perf bench block sync <options>",
+	NULL
+};
+
+static const char * const bench_block_async_usage[] = {
+	"perf bench block async <options>",
+	NULL
+};
+
+/*
+ * Log-linear latency histogram: 16 linear buckets per power of two,
+ * which keeps every percentile within ~6% of the real value.
+ */
+#define LAT_SUB_BITS	4
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	(64 * LAT_SUB)
+
+struct lat_hist {
+	u64 buckets[LAT_BUCKETS];
+	u64 nr;
+	u64 sum;
+	u64 min;
+	u64 max;
+};
+
+static unsigned int lat_bucket(u64 ns)
+{
+	unsigned int msb, shift;
+
+	if (ns < LAT_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	shift = msb - LAT_SUB_BITS;
+	return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+static u64 lat_bucket_val(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < LAT_SUB)
+		return idx;
+
+	shift = idx / LAT_SUB - 1;
+	return (u64)(LAT_SUB + idx % LAT_SUB) << shift;
+}
+
+static void lat_add(struct lat_hist *h, u64 ns)
+{
+	h->buckets[lat_bucket(ns)]++;
+	h->sum += ns;
+	if (!h->nr || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+	h->nr++;
+}
+
+static void lat_merge(struct lat_hist *to, struct lat_hist *from)
+{
+	unsigned int i;
+
+	if (!from->nr)
+		return;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	if (!to->nr || from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->sum += from->sum;
+	to->nr += from->nr;
+}
+
+static u64 lat_percentile(struct lat_hist *h, double pct)
+{
+	u64 want = (u64)(h->nr * pct / 100.0);
+	u64 seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want)
+			return lat_bucket_val(i);
+	}
+	return h->max;
+}
+
+static void lat_print(const char *name, struct lat_hist *h)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+	unsigned int i;
+
+	if (!h->nr) {
+		printf(" %-10s no samples\n", name);
+		return;
+	}
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		printf("%s", name);
+		for (i = 0; i < ARRAY_SIZE(pcts); i++)
+			printf(" %.3f", lat_percentile(h, pcts[i]) / 1e3);
+		printf(" %.3f\n", h->max / 1e3);
+		return;
+	}
+
+	printf(" %-10s (usec) min %.2f, avg %.2f, max %.2f\n", name,
+	       h->min / 1e3, (double)h->sum / h->nr / 1e3, h->max / 1e3);
+	printf("            ");
+	for (i = 0; i < ARRAY_SIZE(pcts); i++)
+		printf(" p%g=%.2f", pcts[i], lat_percentile(h, pcts[i]) / 1e3);
+	printf("\n");
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+enum {
+	OP_READ,
+	OP_WRITE,
+	OP_RANDREAD,
+	OP_RANDWRITE,
+};
+
+static int op;
+static u64 bs, dev_size;
+static volatile bool done;
+
+struct worker {
+	pthread_t	thread;
+	unsigned int	id;
+	int		fd;
+	u64		seed;
+	u64		next;		/* sequential position */
+	u64		start, end;	/* sequential region */
+	u64		ios;
+	struct lat_hist	lat;
+};
+
+static bool op_is_write(void)
+{
+	return op == OP_WRITE || op == OP_RANDWRITE;
+}
+
+static u64 next_offset(struct worker *w)
+{
+	u64 off;
+
+	if (op == OP_RANDREAD || op == OP_RANDWRITE) {
+		/* xorshift64* */
+		w->seed ^= w->seed >> 12;
+		w->seed ^= w->seed << 25;
+		w->seed ^= w->seed >> 27;
+		return ((w->seed * 2685821657736338717ULL) % (dev_size / bs)) * bs;
+	}
+
+	off = w->next;
+	w->next += bs;
+	if (w->next + bs > w->end)
+		w->next = w->start;
+	return off;
+}
+
+static void *alloc_buf(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, len))
+		err(EXIT_FAILURE, "posix_memalign");
+	memset(buf, 0xa5, len);
+	return buf;
+}
+
+static void *sync_worker(void *arg)
+{
+	struct worker *w = arg;
+	void *buf = alloc_buf(bs);
+
+	while (!done) {
+		u64 off = next_offset(w);
+		u64 start = now_ns();
+		ssize_t ret;
+
+		if (op_is_write())
+			ret = pwrite(w->fd, buf, bs, off);
+		else
+			ret = pread(w->fd, buf, bs, off);
+		if (ret != (ssize_t)bs)
+			err(EXIT_FAILURE, "IO at %llu", (unsigned long long)off);
+
+		lat_add(&w->lat, now_ns() - start);
+		w->ios++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void async_prep(struct worker *w, struct iocb *iocb)
+{
+	iocb->aio_offset = next_offset(w);
+	iocb->aio_data = now_ns();
+}
+
+static void *async_worker(void *arg)
+{
+	struct worker *w = arg;
+	aio_context_t ctx = 0;
+	struct iocb *iocbs, **batch;
+	struct io_event *events;
+	char *buf = alloc_buf(bs * iodepth);
+	unsigned int i, inflight;
+
+	iocbs = zalloc(iodepth * sizeof(*iocbs));
+	batch = zalloc(iodepth * sizeof(*batch));
+	events = zalloc(iodepth * sizeof(*events));
+	if (!iocbs || !batch || !events)
+		err(EXIT_FAILURE, "zalloc");
+
+	if (syscall(SYS_io_setup, iodepth, &ctx))
+		err(EXIT_FAILURE, "io_setup");
+
+	for (i = 0; i < iodepth; i++) {
+		struct iocb *iocb = &iocbs[i];
+
+		iocb->aio_fildes = w->fd;
+		iocb->aio_lio_opcode = op_is_write() ? IOCB_CMD_PWRITE :
+						       IOCB_CMD_PREAD;
+		iocb->aio_buf = (unsigned long)(buf + i * bs);
+		iocb->aio_nbytes = bs;
+		async_prep(w, iocb);
+		batch[i] = iocb;
+	}
+	if (syscall(SYS_io_submit, ctx, iodepth, batch) != iodepth)
+		err(EXIT_FAILURE, "io_submit");
+	inflight = iodepth;
+
+	while (inflight) {
+		long nr, nr_batch = 0;
+
+		nr = syscall(SYS_io_getevents, ctx, 1, iodepth, events, NULL);
+		if (nr < 0)
+			err(EXIT_FAILURE, "io_getevents");
+
+		for (i = 0; i < nr; i++) {
+			struct iocb *iocb = (void *)(unsigned long)events[i].obj;
+			u64 now = now_ns();
+
+			if (events[i].res != (s64)bs)
+				errx(EXIT_FAILURE, "IO at %llu failed: %lld",
+				     (unsigned long long)iocb->aio_offset,
+				     (long long)events[i].res);
+
+			lat_add(&w->lat, now - iocb->aio_data);
+			w->ios++;
+			inflight--;
+
+			if (done)
+				continue;
+			async_prep(w, iocb);
+			batch[nr_batch++] = iocb;
+		}
+
+		if (nr_batch) {
+			if (syscall(SYS_io_submit, ctx, nr_batch, batch) != nr_batch)
+				err(EXIT_FAILURE, "io_submit");
+			inflight += nr_batch;
+		}
+	}
+
+	syscall(SYS_io_destroy, ctx);
+	free(events);
+	free(batch);
+	free(iocbs);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Per-stage sampling.  The block_rq_insert, block_rq_issue and
+ * block_rq_complete events of the device are read from trace_pipe while
+ * the benchmark runs and matched up by start sector.
+ */
+#define STAGE_SLOTS	65536
+
+struct stage_slot {
+	u64	sector;
+	double	insert;
+	double	issue;
+};
+
+static const char * const stage_events[] = {
+	"block_rq_insert", "block_rq_issue", "block_rq_complete",
+};
+
+static char tracing_dir[PATH_MAX];
+static struct stage_slot *stage_table;
+static struct lat_hist i2d_lat, d2c_lat;
+static pthread_t stage_thread;
+static int trace_fd = -1;
+
+static int tracing_write(const char *file, const char *val)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	scnprintf(path, sizeof(path), "%s/%s", tracing_dir, file);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val)) == (ssize_t)strlen(val) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static void stage_events_enable(const char *filter, const char *enable)
+{
+	char file[PATH_MAX];
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(stage_events); i++) {
+		scnprintf(file, sizeof(file), "events/block/%s/filter",
+			  stage_events[i]);
+		tracing_write(file, filter);
+		scnprintf(file, sizeof(file), "events/block/%s/enable",
+			  stage_events[i]);
+		if (tracing_write(file, enable) && *enable == '1')
+			warnx("cannot enable %s, no per-stage latencies",
+			      stage_events[i]);
+	}
+}
+
+static struct stage_slot *stage_slot(u64 sector)
+{
+	return &stage_table[(sector * 0x9e3779b97f4a7c15ULL) >> 48];
+}
+
+/*
+ * Lines look like:
+ *   <comm>-<pid> [cpu] flags <secs>: block_rq_issue: 251,0 R 4096 () 8 + 8 [comm]
+ */
+static void stage_parse(char *line)
+{
+	char *ev, *p, *plus;
+	double ts;
+	u64 sector;
+	struct stage_slot *slot;
+
+	ev = strstr(line, ": block_rq_");
+	if (!ev)
+		return;
+	*ev = '\0';
+	p = strrchr(line, ' ');
+	ts = strtod(p ? p + 1 : line, NULL);
+	ev += 2;
+
+	plus = strstr(ev, " + ");
+	if (!plus)
+		return;
+	*plus = '\0';
+	p = strrchr(ev, ' ');
+	if (!p)
+		return;
+	sector = strtoull(p + 1, NULL, 10);
+	slot = stage_slot(sector);
+
+	if (!strncmp(ev, "block_rq_insert:", 16)) {
+		slot->sector = sector;
+		slot->insert = ts;
+		slot->issue = 0;
+	} else if (!strncmp(ev, "block_rq_issue:", 15)) {
+		if (slot->sector != sector) {
+			slot->sector = sector;
+			slot->insert = 0;
+		}
+		slot->issue = ts;
+		if (slot->insert)
+			lat_add(&i2d_lat, (ts - slot->insert) * 1e9);
+	} else if (!strncmp(ev, "block_rq_complete:", 18)) {
+		if (slot->sector == sector && slot->issue)
+			lat_add(&d2c_lat, (ts - slot->issue) * 1e9);
+		slot->insert = 0;
+		slot->issue = 0;
+	}
+}
+
+static void *stage_reader(void *arg __maybe_unused)
+{
+	char buf[65536], *line, *nl;
+	size_t len = 0;
+	ssize_t ret;
+
+	while ((ret = read(trace_fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += ret;
+		buf[len] = '\0';
+		for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+			*nl = '\0';
+			stage_parse(line);
+		}
+		len = buf + len - line;
+		memmove(buf, line, len);
+		if (len == sizeof(buf) - 1)
+			len = 0;	/* runaway line, drop it */
+	}
+	return NULL;
+}
+
+static int stages_start(dev_t rdev)
+{
+	char filter[64], path[PATH_MAX];
+	char *p;
+
+	strncpy(tracing_dir, tracing_events_path, sizeof(tracing_dir) - 1);
+	p = strrchr(tracing_dir, '/');
+	if (p)
+		*p = '\0';
+
+	stage_table = zalloc(STAGE_SLOTS * sizeof(*stage_table));
+	if (!stage_table)
+		return -1;
+
+	/* the kernel's dev_t, which is what the events carry */
+	scnprintf(filter, sizeof(filter), "dev == %u",
+		  (major(rdev) << 20) | minor(rdev));
+	stage_events_enable(filter, "1");
+	tracing_write("trace", "");
+
+	scnprintf(path, sizeof(path), "%s/trace_pipe", tracing_dir);
+	trace_fd = open(path, O_RDONLY);
+	if (trace_fd < 0) {
+		warn("%s", path);
+		stage_events_enable("0", "0");
+		return -1;
+	}
+	if (pthread_create(&stage_thread, NULL, stage_reader, NULL))
+		err(EXIT_FAILURE, "pthread_create");
+	return 0;
+}
+
+static void stages_stop(void)
+{
+	stage_events_enable("0", "0");
+	/* trace_pipe blocks while empty, so cancel the reader */
+	pthread_cancel(stage_thread);
+	pthread_join(stage_thread, NULL);
+	close(trace_fd);
+	free(stage_table);
+}
+
+static const char *op_names[] = {
+	[OP_READ]	= "read",
+	[OP_WRITE]	= "write",
+	[OP_RANDREAD]	= "randread",
+	[OP_RANDWRITE]	= "randwrite",
+};
+
+static int bench_block(int argc, const char **argv,
+		       const char * const *usage, bool async)
+{
+	struct worker *workers;
+	struct lat_hist *lat;
+	struct stat st;
+	u64 start, elapsed, ios = 0;
+	unsigned int i;
+	int flags, fd;
+
+	argc = parse_options(argc, argv, options, usage, 0);
+	if (argc) {
+		usage_with_options(usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	for (op = 0; op < (int)ARRAY_SIZE(op_names); op++)
+		if (!strcmp(op_str, op_names[op]))
+			break;
+	if (op == ARRAY_SIZE(op_names)) {
+		fprintf(stderr, "Unknown op: %s\n", op_str);
+		usage_with_options(usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	bs = perf_atoll(bs_str);
+	if ((s64)bs <= 0 || (!buffered && bs % 512)) {
+		fprintf(stderr, "Invalid block size: %s\n", bs_str);
+		exit(EXIT_FAILURE);
+	}
+	if (!nthreads || (async && !iodepth)) {
+		fprintf(stderr, "threads and iodepth must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (op_is_write() && !force && strncmp(device, "/dev/nullb", 10)) {
+		fprintf(stderr, "Refusing to write to %s, use --force\n", device);
+		exit(EXIT_FAILURE);
+	}
+
+	flags = (op_is_write() ? O_RDWR : O_RDONLY) | (buffered ? 0 : O_DIRECT);
+	fd = open(device, flags);
+	if (fd < 0) {
+		if (!strncmp(device, "/dev/nullb", 10))
+			fprintf(stderr, "%s missing, try: modprobe null_blk "
+				"(queue_mode=3 for VSL)\n", device);
+		err(EXIT_FAILURE, "%s", device);
+	}
+	if (fstat(fd, &st) || !S_ISBLK(st.st_mode))
+		errx(EXIT_FAILURE, "%s is not a block device", device);
+	if (ioctl(fd, BLKGETSIZE64, &dev_size))
+		err(EXIT_FAILURE, "BLKGETSIZE64");
+	close(fd);
+
+	if (size_str) {
+		u64 size = perf_atoll(size_str);
+
+		if ((s64)size > 0 && size < dev_size)
+			dev_size = size;
+	}
+	if (dev_size < bs * nthreads)
+		errx(EXIT_FAILURE, "%s is too small", device);
+
+	workers = zalloc(nthreads * sizeof(*workers));
+	lat = zalloc(sizeof(*lat));
+	if (!workers || !lat)
+		err(EXIT_FAILURE, "zalloc");
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# %s: %s %s, bs=%llu, %u thread(s)", device,
+		       async ? "async" : "sync", op_str,
+		       (unsigned long long)bs, nthreads);
+		if (async)
+			printf(", iodepth=%u", iodepth);
+		printf(", %us\n", nsecs);
+	}
+
+	if (stages && stages_start(st.st_rdev))
+		stages = false;
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		u64 region = dev_size / nthreads / bs * bs;
+
+		w->id = i;
+		w->seed = (0x9e3779b97f4a7c15ULL * (i + 1) ^ start) | 1;
+		w->start = w->next = region * i;
+		w->end = w->start + region;
+		w->fd = open(device, flags);
+		if (w->fd < 0)
+			err(EXIT_FAILURE, "%s", device);
+		if (pthread_create(&w->thread, NULL,
+				   async ? async_worker : sync_worker, w))
+			err(EXIT_FAILURE, "pthread_create");
+	}
+
+	sleep(nsecs);
+	done = true;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
+		ios += workers[i].ios;
+		lat_merge(lat, &workers[i].lat);
+	}
+	elapsed = now_ns() - start;
+
+	if (stages)
+		stages_stop();
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf(" %14.0f IOPS\n", ios * 1e9 / elapsed);
+		printf(" %14.2f MB/sec\n", ios * bs * 1e9 / elapsed / (1 << 20));
+		lat_print("completion", lat);
+		if (stages) {
+			lat_print("I2D", &i2d_lat);
+			lat_print("D2C", &d2c_lat);
+		}
+		break;
+	case BENCH_FORMAT_SIMPLE:
+		printf("%.0f %.2f\n", ios * 1e9 / elapsed,
+		       ios * bs * 1e9 / elapsed / (1 << 20));
+		lat_print("completion", lat);
+		if (stages) {
+			lat_print("I2D", &i2d_lat);
+			lat_print("D2C", &d2c_lat);
+		}
+		break;
+	default:
+		/* reaching this means there's some disaster: */
+		die("unknown format: %d\n", bench_format);
+		break;
+	}
+
+	free(lat);
+	free(workers);
+	return 0;
+}
+
+int bench_block_sync(int argc, const char **argv,
+		     const char *prefix __maybe_unused)
+{
+	return bench_block(argc, argv, bench_block_sync_usage, false);
+}
+
+int bench_block_async(int argc, const char **argv,
+		      const char *prefix __maybe_unused)
+{
+	return bench_block(argc, argv, bench_block_async_usage, true);
+}
@@ -13,6 +13,7 @@
  *  mem   ... memory access performance
  *  numa  ... NUMA scheduling and MM performance
  *  futex ... Futex performance
+ *  block ... Block device I/O performance
  */
 #include "perf.h"
 #include "util/util.h"
@@ -63,6 +64,13 @@ static struct bench futex_benchmarks[] = {
 	{ NULL,		NULL,						NULL			}
 };
 
+static struct bench block_benchmarks[] = {
+	{ "sync",	"Benchmark for pread()/pwrite() on a block device",	bench_block_sync	},
+	{ "async",	"Benchmark for queued AIO on a block device",		bench_block_async	},
+	{ "all",	"Test all block benchmarks",			NULL			},
+	{ NULL,		NULL,						NULL			}
+};
+
 struct collection {
 	const char	*name;
 	const char	*summary;
@@ -76,6 +84,7 @@ static struct collection collections[] = {
 	{ "numa",	"NUMA scheduling and MM benchmarks",		numa_benchmarks		},
 #endif
 	{"futex",       "Futex stressing benchmarks",                   futex_benchmarks        },
+	{ "block",	"Block device I/O benchmarks",			block_benchmarks	},
 	{ "all",	"All benchmarks",				NULL			},
 	{ NULL,		NULL,						NULL			}
 };
@@ -0,0 +1,930 @@
+#include "builtin.h"
+#include "perf.h"
+
+#include "util/evlist.h"
+#include "util/evsel.h"
+#include "util/util.h"
+#include "util/cache.h"
+#include "util/symbol.h"
+#include "util/thread.h"
+#include "util/header.h"
+#include "util/session.h"
+#include "util/tool.h"
+
+#include "util/parse-options.h"
+#include "util/trace-event.h"
+#include "util/data.h"
+
+#include "util/debug.h"
+
+#include <linux/rbtree.h>
+#include <linux/string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+ * Request life cycle, in blktrace terms:
+ *
+ *   Q  block_bio_queue	bio handed to the block layer
+ *   G  block_getrq	request allocated (S, block_sleeprq, if it had to wait)
+ *   I  block_rq_insert	request queued in the scheduler / software queue
+ *   D  block_rq_issue	request handed to the driver
+ *   C  block_rq_complete	request completed
+ *
+ * Requests are tracked by device and start sector from the first event
+ * seen to the completion, and every stage is accounted to the device,
+ * process or cgroup that queued the IO.  A front merge moves the request
+ * to the sector of the merged bio.
+ */
+enum {
+	MARK_Q,
+	MARK_G,
+	MARK_I,
+	MARK_D,
+	NR_MARKS,
+};
+
+enum {
+	STAGE_Q2G,
+	STAGE_G2I,
+	STAGE_I2D,
+	STAGE_D2C,
+	STAGE_Q2C,
+	NR_STAGES,
+};
+
+static const char * const stage_names[NR_STAGES] = {
+	"Q2G", "G2I", "I2D", "D2C", "Q2C",
+};
+
+enum group_by {
+	BY_DEV,
+	BY_PID,
+	BY_COMM,
+	BY_CGROUP,
+};
+
+static const char	*group_str = "dev";
+static enum group_by	group_by;
+static int		top_lines = 10;
+static unsigned int	interval;
+static bool		print_hist;
+
+/* log2 buckets of usecs, the last one takes everything above */
+#define LAT_BUCKETS	24
+
+struct stage_stat {
+	u64	nr;
+	u64	sum;
+	u64	max;
+	u64	hist[LAT_BUCKETS];
+};
+
+struct lat_group {
+	struct rb_node		node;
+	u64			key;
+	char			name[64];
+	u64			sleeps;
+	struct stage_stat	stages[NR_STAGES];
+};
+
+struct blk_rq {
+	struct rb_node		node;
+	u64			dev;
+	u64			sector;
+	u32			nr_sector;
+	pid_t			pid;
+	struct thread		*thread;
+	u64			mark[NR_MARKS];
+	bool			slept;
+	struct ip_callchain	*callchain;
+};
+
+struct slow_rq {
+	u64			lat;
+	u64			dev;
+	u64			sector;
+	u32			nr_sector;
+	pid_t			pid;
+	struct thread		*thread;
+	u64			stage[NR_STAGES];
+	struct ip_callchain	*callchain;
+};
+
+struct pid_cgroup {
+	struct rb_node		node;
+	pid_t			pid;
+	char			path[64];
+};
+
+static struct rb_root	root_groups;
+static struct rb_root	root_rqs;
+static struct rb_root	root_cgroups;
+static struct slow_rq	*slow_rqs;
+static int		nr_slow;
+static u64		nr_unmatched;
+static u64		next_print;
+
+#define dev_major(dev)	((unsigned int)((dev) >> 20))
+#define dev_minor(dev)	((unsigned int)((dev) & ((1U << 20) - 1)))
+
+/* link where @dev/@sector is or would go, *node is set if it's there */
+static struct rb_node **rq_slot(u64 dev, u64 sector, struct rb_node **parent)
+{
+	struct rb_node **node = &root_rqs.rb_node;
+	struct blk_rq *rq;
+
+	*parent = NULL;
+	while (*node) {
+		*parent = *node;
+		rq = rb_entry(*node, struct blk_rq, node);
+
+		if (dev != rq->dev)
+			node = dev < rq->dev ? &(*node)->rb_left : &(*node)->rb_right;
+		else if (sector != rq->sector)
+			node = sector < rq->sector ? &(*node)->rb_left : &(*node)->rb_right;
+		else
+			break;
+	}
+	return node;
+}
+
+static struct blk_rq *rq_find(u64 dev, u64 sector, bool create)
+{
+	struct rb_node **node, *parent;
+	struct blk_rq *rq;
+
+	node = rq_slot(dev, sector, &parent);
+	if (*node)
+		return rb_entry(*node, struct blk_rq, node);
+
+	if (!create)
+		return NULL;
+
+	rq = zalloc(sizeof(*rq));
+	if (!rq) {
+		pr_err("%s: zalloc failed\n", __func__);
+		return NULL;
+	}
+	rq->dev = dev;
+	rq->sector = sector;
+	rq->pid = -1;
+
+	rb_link_node(&rq->node, parent, node);
+	rb_insert_color(&rq->node, &root_rqs);
+	return rq;
+}
+
+static void rq_free(struct blk_rq *rq)
+{
+	rb_erase(&rq->node, &root_rqs);
+	free(rq->callchain);
+	free(rq);
+}
+
+static const char *pid_cgroup(pid_t pid)
+{
+	struct rb_node **node = &root_cgroups.rb_node;
+	struct rb_node *parent = NULL;
+	struct pid_cgroup *cg;
+	char path[PATH_MAX], line[BUFSIZ];
+	FILE *fp;
+
+	while (*node) {
+		parent = *node;
+		cg = rb_entry(*node, struct pid_cgroup, node);
+
+		if (pid < cg->pid)
+			node = &(*node)->rb_left;
+		else if (pid > cg->pid)
+			node = &(*node)->rb_right;
+		else
+			return cg->path;
+	}
+
+	cg = zalloc(sizeof(*cg));
+	if (!cg)
+		return "?";
+	cg->pid = pid;
+	strcpy(cg->path, "?");
+
+	/* only works while the task is alive, i.e. live or right after record */
+	scnprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			char *p = strstr(line, ":blkio:");
+
+			if (!p)
+				continue;
+			p += strlen(":blkio:");
+			p[strcspn(p, "\n")] = '\0';
+			strncpy(cg->path, p, sizeof(cg->path) - 1);
+			break;
+		}
+		fclose(fp);
+	}
+
+	rb_link_node(&cg->node, parent, node);
+	rb_insert_color(&cg->node, &root_cgroups);
+	return cg->path;
+}
+
+static struct lat_group *group_find(struct blk_rq *rq)
+{
+	struct rb_node **node = &root_groups.rb_node;
+	struct rb_node *parent = NULL;
+	struct lat_group *grp;
+	char name[64];
+	u64 key = 0;
+
+	switch (group_by) {
+	case BY_DEV:
+		key = rq->dev;
+		scnprintf(name, sizeof(name), "%u:%u", dev_major(rq->dev),
+			  dev_minor(rq->dev));
+		break;
+	case BY_PID:
+		key = rq->pid;
+		scnprintf(name, sizeof(name), "%s:%d",
+			  rq->thread ? thread__comm_str(rq->thread) : "?",
+			  rq->pid);
+		break;
+	case BY_COMM:
+		scnprintf(name, sizeof(name), "%s",
+			  rq->thread ? thread__comm_str(rq->thread) : "?");
+		break;
+	case BY_CGROUP:
+		scnprintf(name, sizeof(name), "%s",
+			  rq->pid > 0 ? pid_cgroup(rq->pid) : "?");
+		break;
+	}
+
+	while (*node) {
+		int cmp;
+
+		parent = *node;
+		grp = rb_entry(*node, struct lat_group, node);
+
+		if (key != grp->key)
+			cmp = key < grp->key ? -1 : 1;
+		else
+			cmp = strcmp(name, grp->name);
+
+		if (cmp < 0)
+			node = &(*node)->rb_left;
+		else if (cmp > 0)
+			node = &(*node)->rb_right;
+		else
+			return grp;
+	}
+
+	grp = zalloc(sizeof(*grp));
+	if (!grp) {
+		pr_err("%s: zalloc failed\n", __func__);
+		return NULL;
+	}
+	grp->key = key;
+	strcpy(grp->name, name);
+
+	rb_link_node(&grp->node, parent, node);
+	rb_insert_color(&grp->node, &root_groups);
+	return grp;
+}
+
+static void stage_add(struct stage_stat *st, u64 ns)
+{
+	u64 usecs = ns / NSEC_PER_USEC;
+	int bucket = 0;
+
+	while (usecs && bucket < LAT_BUCKETS - 1) {
+		usecs >>= 1;
+		bucket++;
+	}
+
+	st->hist[bucket]++;
+	st->nr++;
+	st->sum += ns;
+	if (ns > st->max)
+		st->max = ns;
+}
+
+static void slow_rq_add(struct blk_rq *rq, u64 lat, u64 *stage)
+{
+	struct slow_rq *slot;
+	int i;
+
+	if (!top_lines)
+		return;
+
+	if (nr_slow < top_lines) {
+		slot = &slow_rqs[nr_slow++];
+	} else {
+		/* replace the fastest of the slow ones */
+		slot = &slow_rqs[0];
+		for (i = 1; i < nr_slow; i++)
+			if (slow_rqs[i].lat < slot->lat)
+				slot = &slow_rqs[i];
+		if (lat <= slot->lat)
+			return;
+		free(slot->callchain);
+	}
+
+	slot->lat = lat;
+	slot->dev = rq->dev;
+	slot->sector = rq->sector;
+	slot->nr_sector = rq->nr_sector;
+	slot->pid = rq->pid;
+	slot->thread = rq->thread;
+	memcpy(slot->stage, stage, sizeof(slot->stage));
+	slot->callchain = rq->callchain;
+	rq->callchain = NULL;
+}
+
+static struct blk_rq *rq_mark(struct perf_evsel *evsel,
+			      struct perf_sample *sample,
+			      struct machine *machine, int mark)
+{
+	u64 dev = perf_evsel__intval(evsel, sample, "dev");
+	u64 sector = perf_evsel__intval(evsel, sample, "sector");
+	struct blk_rq *rq;
+
+	rq = rq_find(dev, sector, true);
+	if (!rq)
+		return NULL;
+
+	/* a new bio at this sector starts over */
+	if (mark == MARK_Q && rq->mark[MARK_Q]) {
+		memset(rq->mark, 0, sizeof(rq->mark));
+		rq->slept = false;
+		zfree(&rq->callchain);
+		rq->pid = -1;
+	}
+
+	rq->mark[mark] = sample->time;
+	rq->nr_sector = perf_evsel__intval(evsel, sample, "nr_sector");
+
+	/* the submitter is whoever we see first in process context */
+	if (rq->pid < 0 && mark <= MARK_G && sample->pid > 0) {
+		rq->pid = sample->tid;
+		rq->thread = machine__findnew_thread(machine, sample->pid,
+						     sample->tid);
+	}
+
+	if (!rq->callchain && sample->callchain && mark <= MARK_G) {
+		size_t sz = (sample->callchain->nr + 1) * sizeof(u64);
+
+		rq->callchain = memdup(sample->callchain, sz);
+	}
+	return rq;
+}
+
+static int process_queue_event(struct perf_evsel *evsel,
+			       struct perf_sample *sample,
+			       struct machine *machine)
+{
+	return rq_mark(evsel, sample, machine, MARK_Q) ? 0 : -1;
+}
+
+static int process_getrq_event(struct perf_evsel *evsel,
+			       struct perf_sample *sample,
+			       struct machine *machine)
+{
+	return rq_mark(evsel, sample, machine, MARK_G) ? 0 : -1;
+}
+
+static int process_sleeprq_event(struct perf_evsel *evsel,
+				 struct perf_sample *sample,
+				 struct machine *machine __maybe_unused)
+{
+	struct blk_rq *rq;
+
+	rq = rq_find(perf_evsel__intval(evsel, sample, "dev"),
+		     perf_evsel__intval(evsel, sample, "sector"), true);
+	if (!rq)
+		return -1;
+	rq->slept = true;
+	return 0;
+}
+
+static int process_insert_event(struct perf_evsel *evsel,
+				struct perf_sample *sample,
+				struct machine *machine)
+{
+	return rq_mark(evsel, sample, machine, MARK_I) ? 0 : -1;
+}
+
+static int process_issue_event(struct perf_evsel *evsel,
+			       struct perf_sample *sample,
+			       struct machine *machine)
+{
+	return rq_mark(evsel, sample, machine, MARK_D) ? 0 : -1;
+}
+
+/* the bio joined an existing request and won't complete on its own */
+static int process_merge_event(struct perf_evsel *evsel,
+			       struct perf_sample *sample,
+			       struct machine *machine __maybe_unused)
+{
+	struct blk_rq *rq;
+
+	rq = rq_find(perf_evsel__intval(evsel, sample, "dev"),
+		     perf_evsel__intval(evsel, sample, "sector"), false);
+	if (rq && !rq->mark[MARK_G] && !rq->mark[MARK_I])
+		rq_free(rq);
+	return 0;
+}
+
+/* the request now starts at the bio's sector, complete will report that */
+static int process_frontmerge_event(struct perf_evsel *evsel,
+				    struct perf_sample *sample,
+				    struct machine *machine)
+{
+	u64 dev = perf_evsel__intval(evsel, sample, "dev");
+	u64 sector = perf_evsel__intval(evsel, sample, "sector");
+	u32 nr_sector = perf_evsel__intval(evsel, sample, "nr_sector");
+	struct rb_node **node, *parent;
+	struct blk_rq *rq, *stale;
+
+	process_merge_event(evsel, sample, machine);
+
+	rq = rq_find(dev, sector + nr_sector, false);
+	if (!rq)
+		return 0;
+
+	rb_erase(&rq->node, &root_rqs);
+	stale = rq_find(dev, sector, false);
+	if (stale)
+		rq_free(stale);
+	node = rq_slot(dev, sector, &parent);
+
+	rq->sector = sector;
+	rq->nr_sector += nr_sector;
+	rb_link_node(&rq->node, parent, node);
+	rb_insert_color(&rq->node, &root_rqs);
+	return 0;
+}
+
+static int process_complete_event(struct perf_evsel *evsel,
+				  struct perf_sample *sample,
+				  struct machine *machine __maybe_unused)
+{
+	u64 stage[NR_STAGES] = { 0, };
+	u64 first = 0, *mark;
+	struct lat_group *grp;
+	struct blk_rq *rq;
+	int i;
+
+	rq = rq_find(perf_evsel__intval(evsel, sample, "dev"),
+		     perf_evsel__intval(evsel, sample, "sector"), false);
+	if (!rq) {
+		nr_unmatched++;
+		return 0;
+	}
+
+	grp = group_find(rq);
+	if (!grp)
+		return -1;
+
+	/*
+	 * A stage is only accounted when both of its ends were seen, e.g.
+	 * blk-mq requests issued directly have no I, so no G2I nor I2D.
+	 */
+	mark = rq->mark;
+	if (mark[MARK_Q] && mark[MARK_G] && mark[MARK_G] >= mark[MARK_Q])
+		stage[STAGE_Q2G] = mark[MARK_G] - mark[MARK_Q];
+	if (mark[MARK_G] && mark[MARK_I] && mark[MARK_I] >= mark[MARK_G])
+		stage[STAGE_G2I] = mark[MARK_I] - mark[MARK_G];
+	if (mark[MARK_I] && mark[MARK_D] && mark[MARK_D] >= mark[MARK_I])
+		stage[STAGE_I2D] = mark[MARK_D] - mark[MARK_I];
+	if (mark[MARK_D] && sample->time >= mark[MARK_D])
+		stage[STAGE_D2C] = sample->time - mark[MARK_D];
+
+	for (i = 0; i < NR_MARKS && !first; i++)
+		first = mark[i];
+	if (first && sample->time >= first)
+		stage[STAGE_Q2C] = sample->time - first;
+
+	if (mark[MARK_Q] && mark[MARK_G])
+		stage_add(&grp->stages[STAGE_Q2G], stage[STAGE_Q2G]);
+	if (mark[MARK_G] && mark[MARK_I])
+		stage_add(&grp->stages[STAGE_G2I], stage[STAGE_G2I]);
+	if (mark[MARK_I] && mark[MARK_D])
+		stage_add(&grp->stages[STAGE_I2D], stage[STAGE_I2D]);
+	if (mark[MARK_D])
+		stage_add(&grp->stages[STAGE_D2C], stage[STAGE_D2C]);
+	if (first)
+		stage_add(&grp->stages[STAGE_Q2C], stage[STAGE_Q2C]);
+	if (rq->slept)
+		grp->sleeps++;
+
+	slow_rq_add(rq, stage[STAGE_Q2C], stage);
+	rq_free(rq);
+	return 0;
+}
+
+static void print_stage(const char *name, struct stage_stat *st)
+{
+	u64 max_count = 0;
+	int i, last = 0;
+
+	printf("   %-4s %10" PRIu64 " %12.2f %12.2f\n", name, st->nr,
+	       (double)st->sum / st->nr / NSEC_PER_USEC,
+	       (double)st->max / NSEC_PER_USEC);
+
+	if (!print_hist)
+		return;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		if (st->hist[i])
+			last = i;
+		if (st->hist[i] > max_count)
+			max_count = st->hist[i];
+	}
+
+	for (i = 0; i <= last; i++) {
+		int bar = st->hist[i] * 40 / max_count;
+
+		if (i == LAT_BUCKETS - 1)
+			printf("        %8lu+     us | ", 1UL << (i - 1));
+		else
+			printf("        %8lu -> %-8lu | ",
+			       i ? 1UL << (i - 1) : 0, (1UL << i) - 1);
+		printf("%-40.*s | %" PRIu64 "\n", bar,
+		       "########################################", st->hist[i]);
+	}
+}
+
+static void print_callchain(struct machine *machine, struct slow_rq *srq)
+{
+	u8 cpumode = PERF_RECORD_MISC_KERNEL;
+	u64 i;
+
+	if (!srq->callchain)
+		return;
+
+	for (i = 0; i < srq->callchain->nr; i++) {
+		u64 ip = srq->callchain->ips[i];
+		struct addr_location al;
+
+		if (ip >= PERF_CONTEXT_MAX) {
+			if (ip == PERF_CONTEXT_USER)
+				cpumode = PERF_RECORD_MISC_USER;
+			else if (ip == PERF_CONTEXT_KERNEL)
+				cpumode = PERF_RECORD_MISC_KERNEL;
+			continue;
+		}
+
+		al.sym = NULL;
+		if (srq->thread)
+			thread__find_addr_location(srq->thread, machine,
+						   cpumode, MAP__FUNCTION,
+						   ip, &al);
+		if (al.sym)
+			printf("\t%16" PRIx64 " %s\n", ip, al.sym->name);
+		else
+			printf("\t%16" PRIx64 " [unknown]\n", ip);
+	}
+}
+
+static int slow_rq_cmp(const void *a, const void *b)
+{
+	const struct slow_rq *l = a, *r = b;
+
+	if (l->lat != r->lat)
+		return l->lat < r->lat ? 1 : -1;
+	return 0;
+}
+
+static void print_result(struct perf_session *session)
+{
+	struct machine *machine = &session->machines.host;
+	struct rb_node *next;
+	int i, j;
+
+	for (next = rb_first(&root_groups); next; next = rb_next(next)) {
+		struct lat_group *grp = rb_entry(next, struct lat_group, node);
+
+		printf("%.80s\n", graph_dotted_line);
+		printf(" %s %s", group_str, grp->name);
+		if (grp->sleeps)
+			printf("  (%" PRIu64 " waited for a request)", grp->sleeps);
+		printf("\n%.80s\n", graph_dotted_line);
+		printf("   %-4s %10s %12s %12s\n", "", "count", "avg(us)", "max(us)");
+
+		for (i = 0; i < NR_STAGES; i++) {
+			if (grp->stages[i].nr)
+				print_stage(stage_names[i], &grp->stages[i]);
+		}
+	}
+
+	if (nr_slow) {
+		qsort(slow_rqs, nr_slow, sizeof(*slow_rqs), slow_rq_cmp);
+
+		printf("\n%.80s\n", graph_dotted_line);
+		printf(" %d slowest requests\n", nr_slow);
+		printf("%.80s\n", graph_dotted_line);
+
+		for (i = 0; i < nr_slow; i++) {
+			struct slow_rq *srq = &slow_rqs[i];
+
+			printf(" %u:%u %" PRIu64 "+%u %s:%d  Q2C %.2f us  (",
+			       dev_major(srq->dev), dev_minor(srq->dev),
+			       srq->sector, srq->nr_sector,
+			       srq->thread ? thread__comm_str(srq->thread) : "?",
+			       srq->pid, (double)srq->lat / NSEC_PER_USEC);
+			for (j = 0; j < STAGE_Q2C; j++)
+				printf("%s%s %.2f", j ? ", " : "", stage_names[j],
+				       (double)srq->stage[j] / NSEC_PER_USEC);
+			printf(")\n");
+			print_callchain(machine, srq);
+		}
+	}
+
+	if (nr_unmatched)
+		printf("\n%" PRIu64 " completions without a matching submission\n",
+		       nr_unmatched);
+}
+
+static void reset_result(void)
+{
+	struct rb_node *node;
+	int i;
+
+	while ((node = rb_first(&root_groups))) {
+		rb_erase(node, &root_groups);
+		free(rb_entry(node, struct lat_group, node));
+	}
+
+	for (i = 0; i < nr_slow; i++)
+		free(slow_rqs[i].callchain);
+	nr_slow = 0;
+	nr_unmatched = 0;
+}
+
+typedef int (*tracepoint_handler)(struct perf_evsel *evsel,
+				  struct perf_sample *sample,
+				  struct machine *machine);
+
+static struct perf_session *block_session;
+
+static int process_sample_event(struct perf_tool *tool __maybe_unused,
+				union perf_event *event,
+				struct perf_sample *sample,
+				struct perf_evsel *evsel,
+				struct machine *machine)
+{
+	struct thread *thread = machine__findnew_thread(machine, sample->pid,
+							sample->tid);
+
+	if (thread == NULL) {
+		pr_debug("problem processing %d event, skipping it.\n",
+			 event->header.type);
+		return -1;
+	}
+
+	/* live mode: dump and restart the statistics every interval */
+	if (interval && sample->time >= next_print) {
+		if (next_print) {
+			print_result(block_session);
+			reset_result();
+			printf("\n");
+			fflush(stdout);
+		}
+		next_print = sample->time + interval * NSEC_PER_SEC;
+	}
+
+	if (evsel->handler != NULL) {
+		tracepoint_handler f = evsel->handler;
+		return f(evsel, sample, machine);
+	}
+
+	return 0;
+}
+
+static const struct perf_evsel_str_handler block_tracepoints[] = {
+	{ "block:block_bio_queue",	process_queue_event, },
+	{ "block:block_getrq",		process_getrq_event, },
+	{ "block:block_sleeprq",	process_sleeprq_event, },
+	{ "block:block_rq_insert",	process_insert_event, },
+	{ "block:block_rq_issue",	process_issue_event, },
+	{ "block:block_rq_complete",	process_complete_event, },
+	{ "block:block_bio_backmerge",	process_merge_event, },
+	{ "block:block_bio_frontmerge",	process_frontmerge_event, },
+};
+
+/* in pipe mode the tracepoints only get their names with the tracing data */
+static int process_tracing_data(struct perf_tool *tool,
+				union perf_event *event,
+				struct perf_session *session)
+{
+	int err = perf_event__process_tracing_data(tool, event, session);
+
+	if (err < 0)
+		return err;
+
+	if (perf_session__set_tracepoints_handlers(session, block_tracepoints)) {
+		pr_err("Initializing perf session tracepoint handlers failed\n");
+		return -1;
+	}
+	return err;
+}
+
+static struct perf_tool perf_block = {
+	.sample		 = process_sample_event,
+	.comm		 = perf_event__process_comm,
+	.mmap		 = perf_event__process_mmap,
+	.mmap2		 = perf_event__process_mmap2,
+	.fork		 = perf_event__process_fork,
+	.exit		 = perf_event__process_exit,
+	.attr		 = perf_event__process_attr,
+	.tracing_data	 = process_tracing_data,
+	.build_id	 = perf_event__process_build_id,
+	.ordered_samples = true,
+};
+
+static int __cmd_report(bool live)
+{
+	int err = -EINVAL;
+	struct perf_session *session;
+	struct perf_data_file file = {
+		.path = live ? "-" : input_name,
+		.mode = PERF_DATA_MODE_READ,
+	};
+
+	slow_rqs = zalloc((top_lines ?: 1) * sizeof(*slow_rqs));
+	if (!slow_rqs)
+		return -ENOMEM;
+
+	session = perf_session__new(&file, false, &perf_block);
+	if (session == NULL) {
+		free(slow_rqs);
+		return -ENOMEM;
+	}
+	block_session = session;
+
+	if (perf_session__create_kernel_maps(session) < 0)
+		goto out_delete;
+
+	if (!live) {
+		if (!perf_session__has_traces(session, "block record"))
+			goto out_delete;
+
+		if (perf_session__set_tracepoints_handlers(session,
+							   block_tracepoints)) {
+			pr_err("Initializing perf session tracepoint handlers failed\n");
+			goto out_delete;
+		}
+		setup_pager();
+	}
+
+	err = perf_session__process_events(session, &perf_block);
+	if (err != 0)
+		goto out_delete;
+	print_result(session);
+out_delete:
+	reset_result();
+	free(slow_rqs);
+	perf_session__delete(session);
+	return err;
+}
+
+static int __cmd_record(int argc, const char **argv, bool live)
+{
+	const char * const record_args[] = {
+	"record", "-a", "-R", "-c", "1",
+	"-e", "block:block_bio_queue",
+	"-e", "block:block_getrq",
+	"-e", "block:block_sleeprq",
+	"-e", "block:block_rq_insert",
+	"-e", "block:block_rq_issue",
+	"-e", "block:block_rq_complete",
+	"-e", "block:block_bio_backmerge",
+	"-e", "block:block_bio_frontmerge",
+	};
+	unsigned int rec_argc, i, j;
+	const char **rec_argv;
+
+	rec_argc = ARRAY_SIZE(record_args) + argc - 1 + (live ? 2 : 0);
+	rec_argv = calloc(rec_argc + 1, sizeof(char *));
+
+	if (rec_argv == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(record_args); i++)
+		rec_argv[i] = strdup(record_args[i]);
+
+	if (live) {
+		rec_argv[i++] = "-o";
+		rec_argv[i++] = "-";
+	}
+
+	for (j = 1; j < (unsigned int)argc; j++, i++)
+		rec_argv[i] = argv[j];
+
+	return cmd_record(i, rec_argv, NULL);
+}
+
+/*
+ * Live mode: 'perf record' streams into a pipe that is analysed as it
+ * comes in.  ^C stops the recorder, which ends the stream and prints the
+ * final report.
+ */
+static int __cmd_live(int argc, const char **argv)
+{
+	int fds[2], err;
+	pid_t child;
+
+	if (pipe(fds) < 0) {
+		pr_err("pipe: %s\n", strerror(errno));
+		return -1;
+	}
+
+	child = fork();
+	if (child < 0) {
+		pr_err("fork: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (!child) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[1]);
+		exit(__cmd_record(argc, argv, true) ? EXIT_FAILURE : 0);
+	}
+
+	close(fds[1]);
+	dup2(fds[0], STDIN_FILENO);
+	close(fds[0]);
+	signal(SIGINT, SIG_IGN);
+
+	err = __cmd_report(true);
+	waitpid(child, NULL, 0);
+	return err;
+}
+
+static int parse_group_opt(const struct option *opt __maybe_unused,
+			   const char *arg, int unset __maybe_unused)
+{
+	static const char * const names[] = {
+		[BY_DEV]	= "dev",
+		[BY_PID]	= "pid",
+		[BY_COMM]	= "comm",
+		[BY_CGROUP]	= "cgroup",
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (!strcmp(arg, names[i])) {
+			group_by = i;
+			group_str = names[i];
+			return 0;
+		}
+	}
+
+	error("Unknown --by key: '%s'", arg);
+	return -1;
+}
+
+int cmd_block(int argc, const char **argv, const char *prefix __maybe_unused)
+{
+	const struct option block_options[] = {
+	OPT_STRING('i', "input", &input_name, "file", "input file name"),
+	OPT_CALLBACK(0, "by", NULL, "key",
+		     "group latencies by: dev (default), pid, comm, cgroup",
+		     parse_group_opt),
+	OPT_INTEGER('n', "top", &top_lines,
+		    "show the n slowest requests, with stacks if recorded with -g"),
+	OPT_BOOLEAN('H', "hist", &print_hist, "print latency histograms"),
+	OPT_UINTEGER('I', "interval", &interval,
+		     "live: print and reset the statistics every n seconds"),
+	OPT_END()
+	};
+	const char *const block_subcommands[] = { "record", "report", "live", NULL };
+	const char *block_usage[] = {
+		NULL,
+		NULL
+	};
+	argc = parse_options_subcommand(argc, argv, block_options,
+					block_subcommands, block_usage, 0);
+
+	if (!argc)
+		usage_with_options(block_usage, block_options);
+
+	if (top_lines < 0)
+		top_lines = 0;
+
+	symbol__init();
+
+	if (!strncmp(argv[0], "rec", 3)) {
+		return __cmd_record(argc, argv, false);
+	} else if (!strncmp(argv[0], "rep", 3)) {
+		interval = 0;
+		return __cmd_report(false);
+	} else if (!strcmp(argv[0], "live")) {
+		return __cmd_live(argc, argv);
+	} else
+		usage_with_options(block_usage, block_options);
+
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Drive an nbd device over several TCP connections to an in-process
+ * server on 127.0.0.1 and check that what was written reads back.
+ *
+ * Needs root and the nbd module loaded with max_connections >= the
+ * number of connections used (default 4).
+ *
+ * Usage: nbd_loopback [device] [connections]
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+
+#define DEV_SIZE	(64 << 20)
+#define BLKSIZE		4096
+#define IO_SIZE		(64 << 10)
+#define NR_WORKERS	8
+#define IOS_PER_WORKER	256
+
+static char *dev_path = "/dev/nbd0";
+static int nr_conns = 4;
+static char *backing;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = read(fd, buf, len);
+
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* one server thread per connection, all sharing the backing store */
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	struct nbd_request req;
+	struct nbd_reply reply;
+
+	while (!read_full(fd, &req, sizeof(req))) {
+		uint32_t type = ntohl(req.type);
+		uint64_t from = be64toh(req.from);
+		uint32_t len = ntohl(req.len);
+
+		if (ntohl(req.magic) != NBD_REQUEST_MAGIC) {
+			fprintf(stderr, "server: bad request magic\n");
+			break;
+		}
+		if (type == NBD_CMD_DISC)
+			break;
+
+		reply.magic = htonl(NBD_REPLY_MAGIC);
+		reply.error = 0;
+		memcpy(reply.handle, req.handle, sizeof(reply.handle));
+
+		if ((type == NBD_CMD_READ || type == NBD_CMD_WRITE) &&
+		    (from > DEV_SIZE || len > DEV_SIZE - from)) {
+			fprintf(stderr, "server: request beyond device\n");
+			break;
+		}
+
+		switch (type) {
+		case NBD_CMD_WRITE:
+			if (read_full(fd, backing + from, len))
+				goto out;
+			/* fall through */
+		case NBD_CMD_FLUSH:
+		case NBD_CMD_TRIM:
+			if (write_full(fd, &reply, sizeof(reply)))
+				goto out;
+			break;
+		case NBD_CMD_READ:
+			if (write_full(fd, &reply, sizeof(reply)) ||
+			    write_full(fd, backing + from, len))
+				goto out;
+			break;
+		default:
+			fprintf(stderr, "server: unknown command %u\n", type);
+			goto out;
+		}
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *do_it_thread(void *arg)
+{
+	int fd = (long)arg;
+
+	if (ioctl(fd, NBD_DO_IT))
+		perror("NBD_DO_IT");
+	return NULL;
+}
+
+static void fill(char *buf, unsigned long off, int seed)
+{
+	unsigned long i;
+
+	for (i = 0; i < IO_SIZE; i += sizeof(unsigned long))
+		*(unsigned long *)(buf + i) = (off + i) ^ seed;
+}
+
+static int failed;
+
+static void *io_worker(void *arg)
+{
+	long id = (long)arg;
+	char *wbuf, *rbuf;
+	int fd, i;
+
+	fd = open(dev_path, O_RDWR | O_DIRECT);
+	if (fd < 0 || posix_memalign((void **)&wbuf, BLKSIZE, IO_SIZE) ||
+	    posix_memalign((void **)&rbuf, BLKSIZE, IO_SIZE)) {
+		perror("worker setup");
+		failed = 1;
+		return NULL;
+	}
+
+	/* workers own interleaved IO_SIZE chunks, so no write overlaps */
+	for (i = 0; i < IOS_PER_WORKER; i++) {
+		unsigned long chunk = (i * NR_WORKERS + id) %
+				      (DEV_SIZE / IO_SIZE);
+		unsigned long off = chunk * IO_SIZE;
+
+		fill(wbuf, off, id);
+		if (pwrite(fd, wbuf, IO_SIZE, off) != IO_SIZE ||
+		    pread(fd, rbuf, IO_SIZE, off) != IO_SIZE) {
+			perror("worker io");
+			failed = 1;
+			break;
+		}
+		if (memcmp(wbuf, rbuf, IO_SIZE)) {
+			fprintf(stderr, "data mismatch at %lu\n", off);
+			failed = 1;
+			break;
+		}
+	}
+	if (fsync(fd)) {
+		perror("fsync");
+		failed = 1;
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t servers[64], workers[NR_WORKERS], do_it;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addrlen = sizeof(addr);
+	int lfd, nbd, i, one = 1;
+
+	if (argc > 1)
+		dev_path = argv[1];
+	if (argc > 2)
+		nr_conns = atoi(argv[2]);
+	if (nr_conns < 1 || nr_conns > 64) {
+		fprintf(stderr, "connections must be between 1 and 64\n");
+		return 1;
+	}
+
+	backing = calloc(1, DEV_SIZE);
+	nbd = open(dev_path, O_RDWR);
+	if (!backing || nbd < 0) {
+		perror(dev_path);
+		return 1;
+	}
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, nr_conns) ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addrlen)) {
+		perror("listen");
+		return 1;
+	}
+
+	ioctl(nbd, NBD_CLEAR_SOCK);
+	if (ioctl(nbd, NBD_SET_BLKSIZE, BLKSIZE) ||
+	    ioctl(nbd, NBD_SET_SIZE_BLOCKS, DEV_SIZE / BLKSIZE) ||
+	    ioctl(nbd, NBD_SET_FLAGS, NBD_FLAG_HAS_FLAGS |
+		  NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_TRIM |
+		  NBD_FLAG_CAN_MULTI_CONN)) {
+		perror("nbd setup");
+		return 1;
+	}
+
+	for (i = 0; i < nr_conns; i++) {
+		int cfd = socket(AF_INET, SOCK_STREAM, 0);
+		int sfd;
+
+		if (cfd < 0 ||
+		    connect(cfd, (struct sockaddr *)&addr, sizeof(addr))) {
+			perror("connect");
+			return 1;
+		}
+		sfd = accept(lfd, NULL, NULL);
+		if (sfd < 0) {
+			perror("accept");
+			return 1;
+		}
+		setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		pthread_create(&servers[i], NULL, server_thread, (void *)(long)sfd);
+
+		if (ioctl(nbd, NBD_SET_SOCK, cfd)) {
+			perror("NBD_SET_SOCK (is max_connections large enough?)");
+			return 1;
+		}
+	}
+
+	pthread_create(&do_it, NULL, do_it_thread, (void *)(long)nbd);
+	/* give NBD_DO_IT a moment to start its receive threads */
+	usleep(100000);
+
+	for (i = 0; i < NR_WORKERS; i++)
+		pthread_create(&workers[i], NULL, io_worker, (void *)(long)i);
+	for (i = 0; i < NR_WORKERS; i++)
+		pthread_join(workers[i], NULL);
+
+	if (ioctl(nbd, NBD_DISCONNECT))
+		perror("NBD_DISCONNECT");
+	pthread_join(do_it, NULL);
+	for (i = 0; i < nr_conns; i++)
+		pthread_join(servers[i], NULL);
+	ioctl(nbd, NBD_CLEAR_SOCK);
+	close(nbd);
+
+	if (failed) {
+		printf("nbd_loopback: %d connections [FAIL]\n", nr_conns);
+		return 1;
+	}
+	printf("nbd_loopback: %d connections ok\n", nr_conns);
+	return 0;
+}